@@ -0,0 +1,330 @@
+/// affinity.cpp
+/// Placement spec parsing, the sysfs topology and the thread pinning.
+///
+/// Ref:
+///     sched_setaffinity(2), pthread_setschedparam(3), sched(7)
+///     https://www.kernel.org/doc/Documentation/ABI/stable/sysfs-devices-node
+
+#include "affinity.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static bool parseCpuList(const string& s, vector<int>& cpus);
+static bool readFileLine(const string& fn, string& line);
+
+//--------------------------------------------------
+ThreadPlacement::ThreadPlacement() : node(-1), fifoPriority(0)
+{
+}
+
+CpuTopology::CpuTopology() : cpus(0)
+{
+}
+
+//--------------------------------------------------
+bool AffinityConfig::parse(const string& spec, string& error)
+{
+    // placements is left empty on errors
+    placements.clear();
+    vector<ThreadPlacement> parsed;
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ';'))
+    {
+        if (item.empty())
+            continue;
+        ThreadPlacement p;
+        size_t eq = item.find('=');
+        if (eq == string::npos || eq == 0)
+        {
+            error = "expected role=cpus in '" + item + "'";
+            return false;
+        }
+        p.role = item.substr(0, eq);
+        string where = item.substr(eq + 1);
+        size_t colon = where.find(':');
+        if (colon != string::npos)
+        {
+            string sched = where.substr(colon + 1);
+            where = where.substr(0, colon);
+            char c;
+            if (sscanf(sched.c_str(), "fifo%d%c", &p.fifoPriority, &c) != 1 ||
+                p.fifoPriority < 1 || p.fifoPriority > 99)
+            {
+                error = "expected fifo<1-99> in '" + item + "'";
+                return false;
+            }
+        }
+        if (where.compare(0, 4, "node") == 0)
+        {
+            char c;
+            if (sscanf(where.c_str() + 4, "%d%c", &p.node, &c) != 1 || p.node < 0)
+            {
+                error = "invalid node in '" + item + "'";
+                return false;
+            }
+        }
+        else if (!parseCpuList(where, p.cpus))
+        {
+            error = "invalid CPU list in '" + item + "'";
+            return false;
+        }
+        for (size_t i = 0; i < parsed.size(); i++)
+            if (parsed[i].role == p.role)
+            {
+                error = "role " + p.role + " placed twice";
+                return false;
+            }
+        parsed.push_back(p);
+    }
+    placements = parsed;
+    return true;
+}
+
+const ThreadPlacement* AffinityConfig::find(const string& role) const
+{
+    for (size_t i = 0; i < placements.size(); i++)
+        if (placements[i].role == role)
+            return &placements[i];
+    return 0;
+}
+
+//--------------------------------------------------
+/// Parses a CPU list as the kernel writes it: 0-3,8,10-11
+static bool parseCpuList(const string& s, vector<int>& cpus)
+{
+    cpus.clear();
+    stringstream ss(s);
+    string range;
+    while (getline(ss, range, ','))
+    {
+        int first, last;
+        char c;
+        int n = sscanf(range.c_str(), "%d-%d%c", &first, &last, &c);
+        if (n == 1)
+            last = first;
+        else if (n != 2)
+            return false;
+        if (first < 0 || last < first || last >= 4096)
+            return false;
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return !cpus.empty();
+}
+
+std::string cpuListString(const vector<int>& cpus)
+{
+    ostringstream os;
+    for (size_t i = 0; i < cpus.size(); )
+    {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+            j++;
+        os << (i ? "," : "") << cpus[i];
+        if (j > i)
+            os << "-" << cpus[j];
+        i = j + 1;
+    }
+    return os.str();
+}
+
+static bool readFileLine(const string& fn, string& line)
+{
+    ifstream f(fn.c_str());
+    return f.is_open() && getline(f, line) && !line.empty();
+}
+
+//--------------------------------------------------
+void readTopology(CpuTopology& topology)
+{
+    topology = CpuTopology();
+    string line;
+    vector<int> online;
+    if (readFileLine("/sys/devices/system/cpu/online", line) && parseCpuList(line, online))
+        topology.cpus = online.back() + 1;
+    else
+        topology.cpus = getNumberOfCPUs();
+
+    // node ids may have holes(offline nodes): keep them as indices
+    vector<int> nodes;
+    if (readFileLine("/sys/devices/system/node/online", line) && parseCpuList(line, nodes))
+    {
+        topology.nodes.resize(nodes.back() + 1);
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            ostringstream fn;
+            fn << "/sys/devices/system/node/node" << nodes[i] << "/cpulist";
+            vector<int> cpus;
+            if (readFileLine(fn.str(), line) && parseCpuList(line, cpus))
+                topology.nodes[nodes[i]] = cpus;
+        }
+    }
+    if (topology.nodes.empty())
+    {
+        topology.nodes.resize(1);
+        for (int cpu = 0; cpu < topology.cpus; cpu++)
+            topology.nodes[0].push_back(cpu);
+    }
+
+    topology.maxFreqKHz.assign(topology.cpus, 0);
+    for (int cpu = 0; cpu < topology.cpus; cpu++)
+    {
+        ostringstream fn;
+        fn << "/sys/devices/system/cpu/cpu" << cpu << "/cpufreq/cpuinfo_max_freq";
+        if (readFileLine(fn.str(), line))
+            topology.maxFreqKHz[cpu] = atoi(line.c_str());
+    }
+}
+
+int nodeOfCpu(const CpuTopology& topology, int cpu)
+{
+    for (size_t node = 0; node < topology.nodes.size(); node++)
+        for (size_t i = 0; i < topology.nodes[node].size(); i++)
+            if (topology.nodes[node][i] == cpu)
+                return (int)node;
+    return -1;
+}
+
+void reportTopology(ostream& os, const CpuTopology& topology, const AffinityConfig& config)
+{
+    int nodes = 0;
+    for (size_t node = 0; node < topology.nodes.size(); node++)
+        nodes += !topology.nodes[node].empty();
+    os << "Topology: " << topology.cpus << " CPUs, " << nodes << " NUMA node(s)" << endl;
+    for (size_t node = 0; node < topology.nodes.size(); node++)
+        if (!topology.nodes[node].empty())
+            os << "    node" << node << ": CPUs " << cpuListString(topology.nodes[node]) << endl;
+
+    // cores of different maximum frequencies: big.LITTLE(or P/E cores), list them by frequency
+    vector<int> freqs;
+    for (size_t cpu = 0; cpu < topology.maxFreqKHz.size(); cpu++)
+        if (topology.maxFreqKHz[cpu] && std::find(freqs.begin(), freqs.end(), topology.maxFreqKHz[cpu]) == freqs.end())
+            freqs.push_back(topology.maxFreqKHz[cpu]);
+    if (freqs.size() > 1)
+    {
+        std::sort(freqs.begin(), freqs.end());
+        for (size_t i = 0; i < freqs.size(); i++)
+        {
+            vector<int> cpus;
+            for (size_t cpu = 0; cpu < topology.maxFreqKHz.size(); cpu++)
+                if (topology.maxFreqKHz[cpu] == freqs[i])
+                    cpus.push_back((int)cpu);
+            os << "    " << freqs[i]/1000 << " MHz cores: CPUs " << cpuListString(cpus) << endl;
+        }
+    }
+
+    for (size_t i = 0; i < config.placements.size(); i++)
+    {
+        const ThreadPlacement& p = config.placements[i];
+        os << "    " << p.role << " -> ";
+        if (p.node >= 0)
+            os << "node" << p.node;
+        else
+            os << "CPUs " << cpuListString(p.cpus);
+        if (p.fifoPriority)
+            os << ", SCHED_FIFO " << p.fifoPriority;
+        os << endl;
+    }
+}
+
+//--------------------------------------------------
+bool applyPlacement(const ThreadPlacement& p, const CpuTopology& topology, string& error)
+{
+#if defined(__linux__)
+    vector<int> cpus = p.cpus;
+    if (p.node >= 0)
+    {
+        if (p.node >= (int)topology.nodes.size() || topology.nodes[p.node].empty())
+        {
+            ostringstream os;
+            os << "no NUMA node " << p.node;
+            error = os.str();
+            return false;
+        }
+        cpus = topology.nodes[p.node];
+    }
+    if (!cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < cpus.size(); i++)
+            if (cpus[i] < CPU_SETSIZE)
+                CPU_SET(cpus[i], &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err)
+        {
+            error = string("cannot pin to CPUs ") + cpuListString(cpus) + ": " + strerror(err);
+            return false;
+        }
+    }
+    if (p.fifoPriority)
+    {
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = p.fifoPriority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err)
+        {
+            error = string("cannot set SCHED_FIFO: ") + strerror(err);
+            return false;
+        }
+    }
+    return true;
+#else
+    (void)p;
+    (void)topology;
+    error = "thread placement is not supported on this system";
+    return false;
+#endif
+}
+
+bool placeCurrentThread(const AffinityConfig& config, const string& role)
+{
+    const ThreadPlacement* p = config.find(role);
+    if (!p)
+        return true;
+
+    // the topology does not change while running: read it once
+    static CpuTopology topology;
+    #pragma omp critical(affinity)
+    if (!topology.cpus)
+        readTopology(topology);
+
+    string error;
+    bool ok = applyPlacement(*p, topology, error);
+    int cpu = currentCpu();
+    #pragma omp critical(affinity)
+    {
+        if (ok)
+            cout << "Thread " << role << " placed, on CPU " << cpu << " node " << nodeOfCpu(topology, cpu) << endl;
+        else
+            cout << "Thread " << role << ": " << error << endl;
+    }
+    return ok;
+}
+
+int currentCpu()
+{
+#if defined(__linux__)
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,77 @@
+/// affinity.hpp
+/// Placement of the capture, processing and writer threads: the CPUs or NUMA node a thread may
+/// run on, and optionally SCHED_FIFO real-time scheduling, so the scheduler does not migrate
+/// them(tail latency on big.LITTLE boards and multi-socket servers).
+///
+/// The placements are given at runtime as a spec of roles(the pipeline stages, the cameras...):
+///     capture=0-1:fifo50;match=node1;record=7
+/// role=<CPU list, e.g. 0-3,8 | nodeN>[:fifo<priority 1-99>], separated by ';'.
+///
+/// Memory is allocated where it is first written(first touch), so the buffers a pinned thread
+/// allocates itself land on its node: pin a thread before it allocates its buffers(the matchers
+/// and the pipeline stages allocate theirs with their first frame).
+/// Linux only; elsewhere the placement fails and the threads run where the system puts them.
+
+#ifndef AFFINITY_HPP
+#define AFFINITY_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct ThreadPlacement
+{
+    std::string role;
+    std::vector<int> cpus;      // empty: any
+    int node;                   // the NUMA node given instead of the CPUs, -1 if none
+    int fifoPriority;           // SCHED_FIFO priority, 0: normal scheduling
+
+    ThreadPlacement();
+};
+
+struct CpuTopology
+{
+    int cpus;                               // online CPUs
+    std::vector<std::vector<int> > nodes;   // CPUs of every NUMA node, one node without NUMA
+    std::vector<int> maxFreqKHz;            // of every CPU, 0 if unknown; tells big from LITTLE cores
+
+    CpuTopology();
+};
+
+class AffinityConfig
+{
+public:
+    std::vector<ThreadPlacement> placements;
+
+    /// Parses the spec(see above). Returns false and the reason in error if it is invalid.
+    bool parse(const std::string& spec, std::string& error);
+    bool empty() const { return placements.empty(); }
+
+    /// The placement of role, 0 if it has none.
+    const ThreadPlacement* find(const std::string& role) const;
+};
+
+/// Reads the CPUs, NUMA nodes and core frequencies(sysfs).
+void readTopology(CpuTopology& topology);
+
+/// Prints the topology and the placements, e.g. at startup.
+void reportTopology(std::ostream& os, const CpuTopology& topology, const AffinityConfig& config);
+
+/// Pins the calling thread and sets its scheduling. Node placements are resolved with topology.
+/// Returns false and the reason in error if the system refuses(e.g. SCHED_FIFO needs
+/// CAP_SYS_NICE), the thread then keeps its former placement.
+bool applyPlacement(const ThreadPlacement& p, const CpuTopology& topology, std::string& error);
+
+/// applyPlacement of role if the config has one, and prints the result. Returns false on errors.
+bool placeCurrentThread(const AffinityConfig& config, const std::string& role);
+
+/// CPU and NUMA node the calling thread runs on, -1 if unknown.
+int currentCpu();
+int nodeOfCpu(const CpuTopology& topology, int cpu);
+
+/// Formats a CPU list as 0-3,8.
+std::string cpuListString(const std::vector<int>& cpus);
+
+#endif
@@ -0,0 +1,579 @@
+/// batch_calib.cpp
+/// Calibration of a fleet of stereo rigs in one run: for every rig of a manifest, the mono
+/// calibrations of camera_calib and the stereo calibration and rectification of stereo_calib,
+/// scheduled across all the cores.
+///
+/// Input: a manifest(xml/yaml) listing the rigs:
+///            %YAML:1.0
+///            board_Width: 6              # defaults of the rigs, as camera_calib
+///            board_Height: 5
+///            square_Size: 30
+///            rigs:
+///               - { name: rig01, images: "fleet/rig01" }
+///               - { name: rig02, images: "fleet/rig02/stereo_calib.xml", board_Width: 9 }
+///        images: a directory of pairs(left01.jpg, right01.jpg, ...) or an image list as used by
+///        stereo_calib(left01, right01, left02, ...);
+/// Output: for every rig, in <output directory>/<name>(or its own "output"), the files of the
+///         tools: calib_result_l.xml, calib_result_r.xml and stereo_params.xml, so stereo_match
+///         -p <dir>/stereo_params.xml works as after stereo_calib; a summary of the RMS errors
+///         and timings of every rig, printed and saved to <output directory>/batch_summary.xml.
+///
+/// Scheduling: one work queue for all the rigs. The jobs are the corner detection of every
+/// pair, then the mono calibration of each camera, then the stereo calibration; a rig's next
+/// jobs are queued when its previous ones are done. Calibrations go to the front of the queue:
+/// they are the long serial part of a rig, and overlap with the detection of the other rigs.
+/// The largest rigs are queued first.
+///
+/// Ref:
+///     calibration.hpp, camera_calib.cpp, stereo_calib.cpp, calib_regression.cpp
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include "calibration.hpp"
+#include "image_cache.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>   // mkdir()
+#include <sys/types.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef _WIN32
+#include <direct.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+string manifestFn;
+string outputDir = "batch_results";
+int threads = 0;                // 0: all the cores
+int solver = SOLVER_OPENCV;
+// flags of camera_calib, and of stereo_calib with the results of camera_calib
+const int monoFlags = CV_CALIB_FIX_PRINCIPAL_POINT | CV_CALIB_ZERO_TANGENT_DIST | CV_CALIB_FIX_ASPECT_RATIO;
+const int stereoFlags = CV_CALIB_FIX_INTRINSIC;
+//--------------------------------------------------
+// Rigs and jobs
+//--------------------------------------------------
+struct Rig
+{
+    string name, images, output;
+    Size boardSize;
+    float squareSize;
+    vector<string> files[2];                    // left and right images of the pairs
+    vector<vector<Point2f> > corners[2];
+    vector<char> found[2];
+    vector<Size> sizes;                         // of the left image of every pair
+    int pendingJobs;                            // of the current step
+    CameraParams camera[2];
+    string monoError[2];                        // of the mono calibrations, empty if calibrated
+    StereoParams stereo;
+    double epipolar;
+    int goodPairs;
+    double detectMs, calibrateMs;               // summed over the jobs
+    int64 startTicks, endTicks;
+    string error;                               // empty if calibrated
+
+    Rig() : squareSize(0), pendingJobs(0), epipolar(0), goodPairs(0), detectMs(0), calibrateMs(0),
+            startTicks(0), endTicks(0) {}
+};
+
+enum JobKind
+{
+    JOB_DETECT = 0,     // corners of a pair
+    JOB_MONO = 1,       // calibration of a camera
+    JOB_STEREO = 2      // stereo calibration, rectification and the files
+};
+
+struct Job
+{
+    int kind;
+    int rig;
+    int index;          // pair or camera
+
+    Job(int k, int r, int i) : kind(k), rig(r), index(i) {}
+};
+
+// shared by the workers, under omp critical(jobs)
+vector<Rig> rigs;
+deque<Job> jobs;
+int running = 0;
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void usage();
+static bool argParsing(int argc, char** argv);
+static bool readManifest(const string& filename, vector<Rig>& rigs);
+static bool listPairs(Rig& rig);
+static bool makeDirs(const string& path);
+static void worker();
+static void runJob(const Job& job);
+static void jobDone(const Job& job);
+static void printSummary(double wallMs);
+static bool saveSummary(const string& filename, double wallMs);
+//--------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    traceFromEnv();
+    if (!argParsing(argc, argv))
+        return -1;
+    if (!readManifest(manifestFn, rigs))
+    {
+        cout << "Cannot read the rigs of the manifest " << manifestFn << endl;
+        return -1;
+    }
+
+    // the largest rigs first: the last rigs to finish are then the short ones
+    vector<pair<int, int> > order;
+    for (int r = 0; r < (int)rigs.size(); r++)
+    {
+        Rig& rig = rigs[r];
+        if (rig.output.empty())
+            rig.output = outputDir + "/" + rig.name;
+        if (!listPairs(rig))
+            rig.error = "cannot read the pairs of " + rig.images;
+        else if (!makeDirs(rig.output))
+            rig.error = "cannot create " + rig.output;
+        else
+            order.push_back(make_pair(-(int)rig.files[0].size(), r));
+    }
+    sort(order.begin(), order.end());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        Rig& rig = rigs[order[i].second];
+        const int n = (int)rig.files[0].size();
+        for (int k = 0; k < 2; k++)
+        {
+            rig.corners[k].resize(n);
+            rig.found[k].assign(n, 0);
+        }
+        rig.sizes.resize(n);
+        rig.pendingJobs = n;
+        for (int p = 0; p < n; p++)
+            jobs.push_back(Job(JOB_DETECT, order[i].second, p));
+    }
+    if (!makeDirs(outputDir))
+    {
+        cout << "Cannot create " << outputDir << endl;
+        return -1;
+    }
+
+#ifdef _OPENMP
+    if (threads > 0)
+        omp_set_num_threads(threads);
+    cout << "Calibrating " << order.size() << " rigs(" << jobs.size() << " pairs) on "
+         << omp_get_max_threads() << " threads..." << endl;
+#endif
+    const int64 start = getTickCount();
+    #pragma omp parallel
+    worker();
+    const double wallMs = (getTickCount() - start)*1000/getTickFrequency();
+
+    printSummary(wallMs);
+    const string summaryFn = outputDir + "/batch_summary.xml";
+    if (!saveSummary(summaryFn, wallMs))
+        cout << "Cannot write the summary to " << summaryFn << endl;
+    else
+        cout << "Summary written to " << summaryFn << endl;
+
+    int failed = 0;
+    for (size_t r = 0; r < rigs.size(); r++)
+        failed += !rigs[r].error.empty();
+    return failed ? 1 : 0;
+}
+
+void usage()
+{
+    cout << "Usage:" << endl
+         << "\t./batch_calib [options] <manifest XML/YML file>" << endl
+         << "\t<manifest>: the rigs, each with a name and its images(a directory of left01.jpg," << endl
+         << "\t            right01.jpg... or a stereo_calib image list), optionally its output" << endl
+         << "\t            directory and board_Width, board_Height, square_Size;" << endl
+         << "\t-o <dir>: output directory, a subdirectory per rig, default is 'batch_results';" << endl
+         << "\t-j <threads>: default is all the cores;" << endl
+         << "\t-solver opencv|sparse: calibrateCamera/stereoCalibrate(default) or the sparse solver." << endl;
+}
+
+bool argParsing(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-o" && hasValue)
+            outputDir = argv[++i];
+        else if (arg == "-j" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &threads) != 1 || threads < 1)
+            {
+                cout << "The number of threads must be positive!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-solver" && hasValue)
+        {
+            string s = argv[++i];
+            if (s == "opencv")
+                solver = SOLVER_OPENCV;
+            else if (s == "sparse")
+                solver = SOLVER_SPARSE;
+            else
+            {
+                cout << "Invalid solver " << s << endl;
+                return false;
+            }
+        }
+        else if (arg[0] == '-')
+        {
+            cout << "Invalid option " << arg << endl;
+            usage();
+            return false;
+        }
+        else
+            manifestFn = arg;
+    }
+
+    if (manifestFn.empty())
+    {
+        usage();
+        return false;
+    }
+    return true;
+}
+
+bool readManifest(const string& filename, vector<Rig>& rigs)
+{
+    rigs.clear();
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened())
+        return false;
+
+    const int boardWidth = fs["board_Width"].empty() ? 6 : (int)fs["board_Width"];
+    const int boardHeight = fs["board_Height"].empty() ? 5 : (int)fs["board_Height"];
+    const float squareSize = fs["square_Size"].empty() ? 30.f : (float)fs["square_Size"];
+    FileNode n = fs["rigs"];
+    if (n.type() != FileNode::SEQ)
+        return false;
+    for (FileNodeIterator it = n.begin(); it != n.end(); ++it)
+    {
+        const FileNode& r = *it;
+        Rig rig;
+        rig.name = (string)r["name"];
+        rig.images = (string)r["images"];
+        rig.output = (string)r["output"];
+        rig.boardSize = Size(r["board_Width"].empty() ? boardWidth : (int)r["board_Width"],
+                             r["board_Height"].empty() ? boardHeight : (int)r["board_Height"]);
+        rig.squareSize = r["square_Size"].empty() ? squareSize : (float)r["square_Size"];
+        if (rig.name.empty())
+        {
+            char buf[32];
+            sprintf(buf, "rig%02d", (int)rigs.size() + 1);
+            rig.name = buf;
+        }
+        rigs.push_back(rig);
+    }
+    return !rigs.empty();
+}
+
+static bool fileExists(const string& fn)
+{
+    ifstream f(fn.c_str());
+    return f.good();
+}
+
+// the pairs of an image list, or left01.jpg, right01.jpg, ... of a directory
+bool listPairs(Rig& rig)
+{
+    vector<string> list;
+    if (readStringList(rig.images, list))
+    {
+        if (list.size() % 2 != 0)
+            return false;
+        for (size_t i = 0; i < list.size(); i += 2)
+        {
+            rig.files[0].push_back(list[i]);
+            rig.files[1].push_back(list[i + 1]);
+        }
+    }
+    else
+    {
+        for (int i = 1; ; i++)
+        {
+            char fn[2][32];
+            sprintf(fn[0], "/left%02d.jpg", i);
+            sprintf(fn[1], "/right%02d.jpg", i);
+            if (!fileExists(rig.images + fn[0]) || !fileExists(rig.images + fn[1]))
+                break;
+            rig.files[0].push_back(rig.images + fn[0]);
+            rig.files[1].push_back(rig.images + fn[1]);
+        }
+    }
+    return !rig.files[0].empty();
+}
+
+// as mkdir -p
+bool makeDirs(const string& path)
+{
+    for (size_t i = 1; i <= path.size(); i++)
+    {
+        if (i < path.size() && path[i] != '/')
+            continue;
+        const string dir = path.substr(0, i);
+#ifdef _WIN32
+        int ret = _mkdir(dir.c_str());
+#else
+        int ret = mkdir(dir.c_str(), 0755);
+#endif
+        if (ret != 0 && errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+
+static double elapsedMs(int64 since)
+{
+    return (getTickCount() - since)*1000/getTickFrequency();
+}
+
+// a thread of the pool: takes jobs until none is queued or running
+void worker()
+{
+    traceThreadName("batch worker");
+    for (int spins = 0; ; )
+    {
+        bool got = false, finished = false;
+        Job job(0, 0, 0);
+        #pragma omp critical(jobs)
+        {
+            if (!jobs.empty())
+            {
+                job = jobs.front();
+                jobs.pop_front();
+                running++;
+                got = true;
+            }
+            else
+                finished = running == 0;
+        }
+        if (finished)
+            break;
+        if (!got)
+        {
+            // the last jobs of a rig are running: their next jobs come soon
+            if (++spins > 100)
+            {
+#ifdef _WIN32
+                Sleep(1);
+#else
+                usleep(1000);
+#endif
+            }
+            continue;
+        }
+        spins = 0;
+        runJob(job);
+        jobDone(job);
+    }
+}
+
+void runJob(const Job& job)
+{
+    Rig& rig = rigs[job.rig];
+    const int64 t = getTickCount();
+    if (job.kind == JOB_DETECT)
+    {
+        TRACE_SCOPE("detect pair");
+        // corners are found on gray images: decode to gray directly
+        for (int k = 0; k < 2; k++)
+        {
+            Mat img = loadImage(rig.files[k][job.index], CV_LOAD_IMAGE_GRAYSCALE);
+            if (k == 0)
+                rig.sizes[job.index] = img.size();
+            rig.found[k][job.index] = !img.empty() && img.size() == rig.sizes[job.index] &&
+                                      findBoardCorners(img, rig.boardSize, rig.corners[k][job.index]);
+        }
+        const double ms = elapsedMs(t);
+        #pragma omp critical(jobs)
+        {
+            if (!rig.startTicks)
+                rig.startTicks = t;
+            rig.detectMs += ms;
+        }
+        return;
+    }
+
+    TRACE_SCOPE(job.kind == JOB_MONO ? "calibrate camera" : "calibrate pair");
+    const Size imageSize = rig.stereo.imageSize;
+    vector<Point3f> board;
+    calcBoardCornerPositions(rig.boardSize, rig.squareSize, board);
+    if (job.kind == JOB_MONO)
+    {
+        // every view of the camera, as camera_calib
+        const int k = job.index;
+        vector<vector<Point2f> > points;
+        for (size_t i = 0; i < rig.found[k].size(); i++)
+            if (rig.found[k][i])
+                points.push_back(rig.corners[k][i]);
+        vector<vector<Point3f> > objectPoints(points.size(), board);
+        const string fn = rig.output + (k ? "/calib_result_r.xml" : "/calib_result_l.xml");
+        if (!calibrateSingleCamera(objectPoints, points, imageSize, monoFlags, solver, rig.camera[k]))
+            rig.monoError[k] = string("the calibration of the ") + (k ? "right" : "left") + " camera failed";
+        else if (!saveCameraParams(fn, rig.camera[k], rig.boardSize, rig.squareSize))
+            rig.monoError[k] = "cannot write " + fn;
+    }
+    else
+    {
+        // the pairs where both cameras found the board, intrinsics of the mono calibrations
+        vector<vector<Point2f> > points[2];
+        for (size_t i = 0; i < rig.found[0].size(); i++)
+            if (rig.found[0][i] && rig.found[1][i])
+                for (int k = 0; k < 2; k++)
+                    points[k].push_back(rig.corners[k][i]);
+        vector<vector<Point3f> > objectPoints(points[0].size(), board);
+        for (int k = 0; k < 2; k++)
+        {
+            rig.stereo.cameraMatrix[k] = rig.camera[k].cameraMatrix.clone();
+            rig.stereo.distCoeffs[k] = rig.camera[k].distCoeffs.clone();
+        }
+        if (!calibrateStereoPair(objectPoints, points[0], points[1], imageSize, stereoFlags, solver, rig.stereo))
+            rig.error = "the stereo calibration failed";
+        else
+        {
+            rig.epipolar = epipolarError(points[0], points[1], rig.stereo);
+            rectifyStereoPair(rig.stereo);
+            if (!saveStereoParams(rig.output + "/stereo_params.xml", rig.stereo))
+                rig.error = "cannot write " + rig.output + "/stereo_params.xml";
+        }
+    }
+    const double ms = elapsedMs(t);
+    #pragma omp critical(jobs)
+    rig.calibrateMs += ms;
+}
+
+// queues the next step of the rig when the job was the last of its step
+void jobDone(const Job& job)
+{
+    #pragma omp critical(jobs)
+    {
+        running--;
+        Rig& rig = rigs[job.rig];
+        if (--rig.pendingJobs == 0)
+        {
+            if (job.kind == JOB_DETECT)
+            {
+                // the size of the first pair read, the pairs of another size are left out as in stereo_calib
+                const int n = (int)rig.sizes.size();
+                for (int i = 0; i < n && rig.stereo.imageSize == Size(); i++)
+                    rig.stereo.imageSize = rig.sizes[i];
+                for (int i = 0; i < n; i++)
+                {
+                    if (rig.sizes[i] != rig.stereo.imageSize)
+                        rig.found[0][i] = rig.found[1][i] = 0;
+                    rig.goodPairs += rig.found[0][i] && rig.found[1][i];
+                }
+                if (rig.goodPairs < 2)
+                    rig.error = "the board is found in less than 2 pairs";
+                else
+                {
+                    rig.pendingJobs = 2;
+                    jobs.push_front(Job(JOB_MONO, job.rig, 1));
+                    jobs.push_front(Job(JOB_MONO, job.rig, 0));
+                }
+            }
+            else if (job.kind == JOB_MONO)
+            {
+                rig.error = !rig.monoError[0].empty() ? rig.monoError[0] : rig.monoError[1];
+                if (rig.error.empty())
+                {
+                    rig.pendingJobs = 1;
+                    jobs.push_front(Job(JOB_STEREO, job.rig, 0));
+                }
+            }
+            if (rig.pendingJobs == 0)
+            {
+                rig.endTicks = getTickCount();
+                if (rig.error.empty())
+                    cout << "Rig " << rig.name << " calibrated, stereo RMS " << rig.stereo.rms << endl;
+                else
+                    cout << "Rig " << rig.name << ": " << rig.error << endl;
+            }
+        }
+    }
+}
+
+void printSummary(double wallMs)
+{
+    double jobMs = 0;
+    cout << format("%-16s %7s %9s %9s %10s %9s %10s %10s %10s  %s", "rig", "pairs", "rms_left", "rms_right",
+                   "rms_stereo", "epipolar", "detect_ms", "calib_ms", "wall_ms", "status") << endl;
+    for (size_t r = 0; r < rigs.size(); r++)
+    {
+        const Rig& rig = rigs[r];
+        const double rigWallMs = rig.endTicks ? (rig.endTicks - rig.startTicks)*1000/getTickFrequency() : 0;
+        cout << format("%-16s %3d/%-3d %9.4f %9.4f %10.4f %9.4f %10.1f %10.1f %10.1f  %s", rig.name.c_str(),
+                       rig.goodPairs, (int)rig.files[0].size(), rig.camera[0].rms, rig.camera[1].rms, rig.stereo.rms,
+                       rig.epipolar, rig.detectMs, rig.calibrateMs, rigWallMs,
+                       rig.error.empty() ? "ok" : rig.error.c_str()) << endl;
+        jobMs += rig.detectMs + rig.calibrateMs;
+    }
+    cout << format("Total %.1f s for %.1f s of jobs: %.1fx faster than one rig after the other.", wallMs/1000,
+                   jobMs/1000, wallMs > 0 ? jobMs/wallMs : 0.) << endl;
+}
+
+bool saveSummary(const string& filename, double wallMs)
+{
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened())
+        return false;
+
+    double jobMs = 0;
+    fs << "manifest" << manifestFn;
+    fs << "solver" << (solver == SOLVER_SPARSE ? "sparse" : "opencv");
+    fs << "rigs" << "[";
+    for (size_t r = 0; r < rigs.size(); r++)
+    {
+        const Rig& rig = rigs[r];
+        fs << "{"
+           << "name" << rig.name
+           << "status" << (rig.error.empty() ? "ok" : rig.error)
+           << "output" << rig.output
+           << "pairs" << (int)rig.files[0].size()
+           << "good_pairs" << rig.goodPairs
+           << "image_Width" << rig.stereo.imageSize.width
+           << "image_Height" << rig.stereo.imageSize.height
+           << "rms_left" << rig.camera[0].rms
+           << "rms_right" << rig.camera[1].rms
+           << "rms_stereo" << rig.stereo.rms
+           << "epipolar_error" << rig.epipolar
+           << "detect_ms" << rig.detectMs
+           << "calibrate_ms" << rig.calibrateMs
+           << "wall_ms" << (rig.endTicks ? (rig.endTicks - rig.startTicks)*1000/getTickFrequency() : 0.)
+           << "}";
+        jobMs += rig.detectMs + rig.calibrateMs;
+    }
+    fs << "]";
+#ifdef _OPENMP
+    fs << "threads" << (threads > 0 ? threads : omp_get_max_threads());
+#endif
+    fs << "wall_ms" << wallMs;
+    fs << "job_ms" << jobMs;
+    return true;
+}
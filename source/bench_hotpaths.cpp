@@ -0,0 +1,508 @@
+/// bench_hotpaths.cpp
+/// Microbenchmarks of the per-frame and calibration hot paths, on the stereo pairs of images/
+/// at their own resolution and stretched to larger ones(up to 4K).
+///
+/// Input: the directory of the pairs(left01.jpg, right01.jpg, ...), default is images/;
+/// Output: a table of the timings, and the same as JSON(-o, default bench_hotpaths.json).
+///         The benchmark names("remap/1920x1080") stay the same across versions, so the files
+///         of several versions or machines can be compared name by name.
+///
+/// Benchmarks, per resolution:
+///     findChessboardCorners    one image
+///     refineCorners            all the boards at once(corner_refine.hpp), 11x11 window
+///     mergeImages              two images resized into a 600 pixel wide canvas, as stereo_calib
+///     previewResize            two images scaled by 4/5 into the window, as binocular_capture
+///     initUndistortRectifyMap  the maps of both cameras(computeRectifyMaps)
+///     remap                    both grayscale images
+/// and once:
+///     computeReprojectionErrors  all the views of the left camera
+///
+/// Ref:
+///     calibration.hpp, stereo_calib.cpp, binocular_capture.cpp
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include "calibration.hpp"
+#include "corner_refine.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+string imageDir = "images";     // left01.jpg, right01.jpg, ...
+string outputFn = "bench_hotpaths.json";
+Size boardSize(6, 5);           // inner corners of the board of images/
+float squareSize = 30;
+double minSeconds = 0.5;        // each benchmark runs at least this long
+string filter;                  // only the benchmarks whose name contains it
+vector<Size> sizes;             // resolutions besides the one of the images
+
+const int SCHEMA_VERSION = 1;   // of the JSON file, incremented if the fields change
+//--------------------------------------------------
+// Benchmarks
+//--------------------------------------------------
+class Benchmark
+{
+public:
+    virtual ~Benchmark() {}
+    virtual void run(int iteration) = 0;
+};
+
+struct BenchResult
+{
+    string name;
+    string size;        // "640x480", empty if the benchmark does not depend on it
+    int iterations;
+    int items;          // images, boards or views per iteration
+    double minMs, medianMs, meanMs;
+};
+
+// findChessboardCorners on image iteration % n
+class DetectBench : public Benchmark
+{
+public:
+    const vector<Mat>& grays;
+    vector<Point2f> corners;
+
+    DetectBench(const vector<Mat>& g) : grays(g) {}
+    void run(int i) { findChessboardCorners(grays[i % grays.size()], boardSize, corners,
+                                            CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_NORMALIZE_IMAGE); }
+};
+
+// refineCorners of all the boards, from the corners of findChessboardCorners
+class RefineBench : public Benchmark
+{
+public:
+    const vector<Mat>& grays;
+    const vector<vector<Point2f> >& found;
+    vector<vector<Point2f> > corners;
+
+    RefineBench(const vector<Mat>& g, const vector<vector<Point2f> >& f) : grays(g), found(f) {}
+    void run(int)
+    {
+        corners = found;
+        refineCorners(grays, corners, Size(11, 11), Size(-1, -1),
+                      TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 30, 0.1));
+    }
+};
+
+// mergeImages of stereo_calib on pair iteration % n
+class MergeBench : public Benchmark
+{
+public:
+    const vector<Mat>& colors;     // left01, right01, left02, ...
+    Mat canvas;
+
+    MergeBench(const vector<Mat>& c) : colors(c) {}
+    void run(int i)
+    {
+        const int n = (int)colors.size()/2;
+        const Mat& imgL = colors[2*(i % n)];
+        const Mat& imgR = colors[2*(i % n) + 1];
+        double sf = 600./MAX(imgL.cols, imgL.rows);
+        int w = cvRound(imgL.cols*sf), h = cvRound(imgL.rows*sf);
+        canvas.create(h, w*2, CV_8UC3);
+        Mat canvasL = canvas(Rect(0, 0, w, h));
+        Mat canvasR = canvas(Rect(w, 0, w, h));
+        resize(imgL, canvasL, canvasL.size(), 0, 0, CV_INTER_LINEAR);
+        resize(imgR, canvasR, canvasR.size(), 0, 0, CV_INTER_LINEAR);
+    }
+};
+
+// the display of binocular_capture on pair iteration % n: both cameras scaled by 4/5 in parallel
+class PreviewBench : public Benchmark
+{
+public:
+    const vector<Mat>& colors;
+    Mat imageShow;
+
+    PreviewBench(const vector<Mat>& c) : colors(c) {}
+    void run(int i)
+    {
+        const int n = (int)colors.size()/2;
+        const int width = colors[0].cols*4/5, height = colors[0].rows*4/5;
+        imageShow.create(height, width*2, CV_8UC3);
+        #pragma omp parallel for
+        for (int k = 0; k < 2; k++)
+        {
+            Mat img_scaled;
+            resize(colors[2*(i % n) + k], img_scaled, Size(width, height));
+            img_scaled.copyTo(imageShow(Rect(k*width, 0, width, height)));
+        }
+    }
+};
+
+class MapBench : public Benchmark
+{
+public:
+    const StereoParams& params;
+    Mat map[2][2];
+
+    MapBench(const StereoParams& p) : params(p) {}
+    void run(int) { computeRectifyMaps(params, params.imageSize, map); }
+};
+
+// both images of pair iteration % n, as stereo_match
+class RemapBench : public Benchmark
+{
+public:
+    const vector<Mat>& grays;
+    const Mat (&map)[2][2];
+    Mat rect[2];
+
+    RemapBench(const vector<Mat>& g, const Mat (&m)[2][2]) : grays(g), map(m) {}
+    void run(int i)
+    {
+        const int n = (int)grays.size()/2;
+        for (int k = 0; k < 2; k++)
+            remap(grays[2*(i % n) + k], rect[k], map[k][0], map[k][1], INTER_LINEAR);
+    }
+};
+
+class ReprojectionBench : public Benchmark
+{
+public:
+    const vector<vector<Point3f> >& objectPoints;
+    const vector<vector<Point2f> >& imagePoints;
+    const CameraParams& params;
+    vector<float> perViewErrors;
+
+    ReprojectionBench(const vector<vector<Point3f> >& o, const vector<vector<Point2f> >& i, const CameraParams& p) :
+        objectPoints(o), imagePoints(i), params(p) {}
+    void run(int)
+    {
+        computeReprojectionErrors(objectPoints, imagePoints, params.rvecs, params.tvecs,
+                                  params.cameraMatrix, params.distCoeffs, perViewErrors);
+    }
+};
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void usage();
+static bool argParsing(int argc, char** argv);
+static bool loadPairs(vector<Mat>& colors);
+static void measure(const string& name, Size size, Benchmark& b, int minIterations, int items,
+                    vector<BenchResult>& results);
+static string sizeString(Size size);
+static bool writeJson(const string& filename, const vector<BenchResult>& results, int pairs);
+//--------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    traceFromEnv();
+    if (!argParsing(argc, argv))
+        return -1;
+
+    vector<Mat> colors0;
+    if (!loadPairs(colors0))
+    {
+        cout << "Cannot read the pairs left01.jpg, right01.jpg... of " << imageDir << ". Exiting." << endl;
+        return -1;
+    }
+    const Size imageSize = colors0[0].size();
+    const int npairs = (int)colors0.size()/2;
+    cout << npairs << " pairs of " << sizeString(imageSize) << " in " << imageDir << endl;
+
+    // calibration of the images, with the flags of camera_calib and stereo_calib and the solver of
+    // OpenCV; the starting point of the map benchmarks
+    vector<Mat> grays0(colors0.size());
+    vector<vector<Point2f> > imagePoints[2];
+    for (int i = 0; i < npairs; i++)
+    {
+        vector<Point2f> c[2];
+        for (int k = 0; k < 2; k++)
+            cvtColor(colors0[2*i + k], grays0[2*i + k], CV_BGR2GRAY);
+        if (findBoardCorners(grays0[2*i], boardSize, c[0]) && findBoardCorners(grays0[2*i + 1], boardSize, c[1]))
+            for (int k = 0; k < 2; k++)
+                imagePoints[k].push_back(c[k]);
+    }
+    if (imagePoints[0].size() < 3)
+    {
+        cout << "The board(" << sizeString(boardSize) << ") is found in " << imagePoints[0].size()
+             << " pairs only, set its size with -w -h. Exiting." << endl;
+        return -1;
+    }
+    vector<vector<Point3f> > objectPoints(1);
+    calcBoardCornerPositions(boardSize, squareSize, objectPoints[0]);
+    objectPoints.resize(imagePoints[0].size(), objectPoints[0]);
+
+    CameraParams camera;
+    StereoParams stereo;
+    if (!calibrateSingleCamera(objectPoints, imagePoints[0], imageSize,
+                               CV_CALIB_FIX_PRINCIPAL_POINT | CV_CALIB_ZERO_TANGENT_DIST | CV_CALIB_FIX_ASPECT_RATIO,
+                               SOLVER_OPENCV, camera)
+        || !calibrateStereoPair(objectPoints, imagePoints[0], imagePoints[1], imageSize,
+                                CV_CALIB_FIX_ASPECT_RATIO | CV_CALIB_ZERO_TANGENT_DIST, SOLVER_OPENCV, stereo))
+    {
+        cout << "The calibration of the pairs failed. Exiting." << endl;
+        return -1;
+    }
+    cout << "rms " << camera.rms << "(left camera), " << stereo.rms << "(pair)" << endl << endl;
+    rectifyStereoPair(stereo);  // scaled to every size(scaleStereoParams)
+
+    vector<BenchResult> results;
+    ReprojectionBench reprojection(objectPoints, imagePoints[0], camera);
+    measure("computeReprojectionErrors", Size(), reprojection, 1, (int)objectPoints.size(), results);
+
+    vector<Size> all(1, imageSize);
+    for (size_t s = 0; s < sizes.size(); s++)
+        if (find(all.begin(), all.end(), sizes[s]) == all.end())
+            all.push_back(sizes[s]);
+    for (size_t s = 0; s < all.size(); s++)
+    {
+        const Size size = all[s];
+        vector<Mat> colors(colors0.size()), grays(colors0.size());
+        for (size_t i = 0; i < colors0.size(); i++)
+        {
+            if (size == imageSize)
+                colors[i] = colors0[i];
+            else
+                resize(colors0[i], colors[i], size, 0, 0, INTER_CUBIC);
+            cvtColor(colors[i], grays[i], CV_BGR2GRAY);
+        }
+        vector<Mat> boards;
+        vector<vector<Point2f> > found;
+        for (size_t i = 0; i < grays.size(); i++)
+        {
+            vector<Point2f> c;
+            if (findChessboardCorners(grays[i], boardSize, c, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_NORMALIZE_IMAGE))
+            {
+                boards.push_back(grays[i]);
+                found.push_back(c);
+            }
+        }
+
+        DetectBench detect(grays);
+        measure("findChessboardCorners", size, detect, (int)grays.size(), 1, results);
+        if (!found.empty())
+        {
+            RefineBench refine(boards, found);
+            measure("refineCorners", size, refine, 1, (int)found.size(), results);
+        }
+        MergeBench merge(colors);
+        measure("mergeImages", size, merge, npairs, 2, results);
+        PreviewBench preview(colors);
+        measure("previewResize", size, preview, npairs, 2, results);
+
+        StereoParams scaled;
+        scaleStereoParams(stereo, size, scaled);
+        MapBench maps(scaled);
+        measure("initUndistortRectifyMap", size, maps, 1, 2, results);
+        RemapBench rect(grays, maps.map);
+        measure("remap", size, rect, npairs, 2, results);
+    }
+
+    if (!writeJson(outputFn, results, npairs))
+    {
+        cout << "Cannot write " << outputFn << endl;
+        return -1;
+    }
+    cout << endl << "Results written to " << outputFn << endl;
+    return 0;
+}
+
+void usage()
+{
+    cout << "Usage:" << endl
+         << "\t./bench_hotpaths [options] [image directory]" << endl
+         << "\t<image directory>: left01.jpg, right01.jpg, ..., default is 'images';" << endl
+         << "\t-o <file>: JSON results, default is 'bench_hotpaths.json';" << endl
+         << "\t-w <board_width> -h <board_height>: inner corners of the board, default is 6x5;" << endl
+         << "\t-s <width>x<height>: resolution to stretch the images to, may be repeated,"
+         << " default is 1280x720, 1920x1080 and 3840x2160;" << endl
+         << "\t-t <seconds>: minimum time of each benchmark, default is 0.5;" << endl
+         << "\t-f <text>: only the benchmarks whose name contains text." << endl;
+}
+
+bool argParsing(int argc, char** argv)
+{
+    bool sizesGiven = false;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-o" && hasValue)
+            outputFn = argv[++i];
+        else if (arg == "-w" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &boardSize.width) != 1 || boardSize.width < 2)
+            {
+                cout << "Invalid board width!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-h" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &boardSize.height) != 1 || boardSize.height < 2)
+            {
+                cout << "Invalid board height!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-s" && hasValue)
+        {
+            Size s;
+            if (sscanf(argv[++i], "%dx%d", &s.width, &s.height) != 2 || s.width < 64 || s.height < 64)
+            {
+                cout << "Invalid resolution " << argv[i] << endl;
+                return false;
+            }
+            sizes.push_back(s);
+            sizesGiven = true;
+        }
+        else if (arg == "-t" && hasValue)
+        {
+            if (sscanf(argv[++i], "%lf", &minSeconds) != 1 || minSeconds < 0)
+            {
+                cout << "Invalid time!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-f" && hasValue)
+            filter = argv[++i];
+        else if (arg[0] == '-')
+        {
+            cout << "Invalid option " << arg << endl;
+            usage();
+            return false;
+        }
+        else
+            imageDir = arg;
+    }
+
+    if (!sizesGiven)
+    {
+        sizes.push_back(Size(1280, 720));
+        sizes.push_back(Size(1920, 1080));
+        sizes.push_back(Size(3840, 2160));
+    }
+    return true;
+}
+
+// left01.jpg, right01.jpg, left02.jpg, ... until a pair is missing
+bool loadPairs(vector<Mat>& colors)
+{
+    for (int i = 1; ; i++)
+    {
+        char fn[2][32];
+        sprintf(fn[0], "/left%02d.jpg", i);
+        sprintf(fn[1], "/right%02d.jpg", i);
+        Mat img[2];
+        for (int k = 0; k < 2; k++)
+            img[k] = imread(imageDir + fn[k], CV_LOAD_IMAGE_COLOR);
+        if (img[0].empty() || img[1].empty() || img[0].size() != img[1].size()
+            || (!colors.empty() && img[0].size() != colors[0].size()))
+            break;
+        colors.push_back(img[0]);
+        colors.push_back(img[1]);
+    }
+    return !colors.empty();
+}
+
+// runs b for minSeconds and at least minIterations, after one iteration to warm up
+void measure(const string& name, Size size, Benchmark& b, int minIterations, int items,
+             vector<BenchResult>& results)
+{
+    BenchResult r;
+    r.name = size.area() ? name + "/" + sizeString(size) : name;
+    r.size = size.area() ? sizeString(size) : "";
+    if (!filter.empty() && r.name.find(filter) == string::npos)
+        return;
+
+    b.run(0);
+    vector<double> ms;
+    const int64 start = getTickCount();
+    const double freq = getTickFrequency();
+    for (int i = 0; (int)ms.size() < minIterations || (getTickCount() - start)/freq < minSeconds; i++)
+    {
+        const int64 t = getTickCount();
+        b.run(i);
+        ms.push_back((getTickCount() - t)*1000/freq);
+    }
+
+    r.iterations = (int)ms.size();
+    r.items = items;
+    r.meanMs = 0;
+    for (size_t i = 0; i < ms.size(); i++)
+        r.meanMs += ms[i];
+    r.meanMs /= ms.size();
+    r.minMs = *min_element(ms.begin(), ms.end());
+    nth_element(ms.begin(), ms.begin() + ms.size()/2, ms.end());
+    r.medianMs = ms[ms.size()/2];
+    results.push_back(r);
+    cout << format("%-40s %8d iterations  median %10.3f ms  min %10.3f ms  %10.3f ms/item",
+                   r.name.c_str(), r.iterations, r.medianMs, r.minMs, r.medianMs/items) << endl;
+}
+
+string sizeString(Size size)
+{
+    char buf[32];
+    sprintf(buf, "%dx%d", size.width, size.height);
+    return buf;
+}
+
+static string cpuName()
+{
+    ifstream f("/proc/cpuinfo");
+    string line;
+    while (getline(f, line))
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != string::npos)
+            return line.substr(line.find(':') + 2);
+    return "unknown";
+}
+
+bool writeJson(const string& filename, const vector<BenchResult>& results, int pairs)
+{
+    ofstream os(filename.c_str());
+    if (!os.is_open())
+        return false;
+#ifdef _OPENMP
+    const int threads = omp_get_max_threads();
+#else
+    const int threads = 1;
+#endif
+#if defined(__AVX2__)
+    const char* simd = "avx2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const char* simd = "neon";
+#else
+    const char* simd = "none";
+#endif
+    // the names are ours and the cpu name has no quotes: nothing to escape
+    os << "{\n"
+       << "  \"suite\": \"bench_hotpaths\",\n"
+       << "  \"schema\": " << SCHEMA_VERSION << ",\n"
+       << "  \"opencv\": \"" << CV_VERSION << "\",\n"
+       << "  \"cpu\": \"" << cpuName() << "\",\n"
+       << "  \"threads\": " << threads << ",\n"
+       << "  \"simd\": \"" << simd << "\",\n"
+       << "  \"pairs\": " << pairs << ",\n"
+       << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult& r = results[i];
+        os << (i ? ",\n" : "\n")
+           << format("    {\"name\": \"%s\", \"size\": \"%s\", \"iterations\": %d, \"items\": %d, "
+                     "\"median_ms\": %.4f, \"min_ms\": %.4f, \"mean_ms\": %.4f}",
+                     r.name.c_str(), r.size.c_str(), r.iterations, r.items, r.medianMs, r.minMs, r.meanMs);
+    }
+    os << "\n  ]\n}\n";
+    return !os.fail();
+}
@@ -5,6 +5,9 @@
 #include "opencv2/core/core.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
+#include "stereo_capture.hpp"
+#include "affinity.hpp"
+#include "trace.hpp"
 #include "omp.h"
 #include <iostream>
 #include <stdio.h>
@@ -28,8 +31,12 @@ const char* camera_name[2] = {"left", "right"};
 char dir_name[100] = "";        // default directory name for pictures and videos
 bool dir_created = false;
 bool video_file_created = false;
+AffinityConfig affinity;        // placement of the left/right camera threads, affinity.hpp
 
-static void argParsing(int argc, const char* argv[])
+static void usage(const char* argv[]);
+
+// return value: false if an argument is invalid and the program should exit
+static bool argParsing(int argc, const char* argv[])
 {
     for (int i = 1; i < argc; i++)
     {
@@ -55,7 +62,18 @@ static void argParsing(int argc, const char* argv[])
             i++;
             strcpy(dir_name, argv[i]);
         }
+        else if (!strcmp(argv[i], "-a") && i + 1 < argc)    // thread placement
+        {
+            string error;
+            if (!affinity.parse(argv[++i], error))
+            {
+                cout << "Invalid affinity: " << error << endl;
+                usage(argv);
+                return false;
+            }
+        }
     }
+    return true;
 }
 
 // TODO: display usage on the screen?
@@ -64,7 +82,9 @@ static void usage(const char* argv[])
     cout << "--------------------------------------------------" << endl;
     cout << "Optional arguments:" << endl;
     cout << "       -i: ID of left camera, default = 0;" << endl;
-    cout << "       -p: name of the directory to store the pics and videos." << endl;
+    cout << "       -p: name of the directory to store the pics and videos;" << endl;
+    cout << "       -a: pin the threads of each camera(grab, decode, write), e.g. 'left=2:fifo50;right=3'," << endl;
+    cout << "           <left|right>=<CPU list|nodeN>[:fifo<priority 1-99>]. 'left' is the main thread." << endl;
     cout << " e.g. " << argv[0] << " -i 1 -p folder" << endl;       // argv[0] already includes "./"!
     cout << "--------------------------------------------------" << endl;
     cout << "Usage:" << endl;
@@ -164,8 +184,12 @@ static void rmEmptyDir(const char* dir_name)
 
 int main(int argc, const char* argv[])
 {
+    // Trace to the file named by STEREO_TRACE, if set
+    traceFromEnv();
+
     // Parse input arguments
-    argParsing(argc, argv);
+    if (!argParsing(argc, argv))
+        return -1;
 
     // Display usage information
     usage(argv);
@@ -199,26 +223,32 @@ int main(int argc, const char* argv[])
         }
     }
 
-    VideoCapture cap[CAM_NUM];
+    StereoCapture stereo;
     VideoWriter  put[CAM_NUM];
     int i;
 
-    // Open the cameras
-    #pragma omp parallel for
-    for (i = 0; i < CAM_NUM; i++)
+    // Pin the threads of the per-camera loops: thread i of the team always takes camera i
+    // (static schedule), and the OpenMP pool keeps its threads between the loops
+    if (!affinity.empty())
     {
-        cap[i].open(i+camera_offset);
-        // Check if the file was opened properly
-        if (!cap[i].isOpened())
-        {
-            cout << "Capture could not be opened successfully, exiting." << endl;
-            return -1;
-        }
+        CpuTopology topology;
+        readTopology(topology);
+        reportTopology(cout, topology, affinity);
+        #pragma omp parallel for num_threads(CAM_NUM) schedule(static)
+        for (i = 0; i < CAM_NUM; i++)
+            placeCurrentThread(affinity, camera_name[i]);
+    }
+
+    // Open the cameras camera_offset and camera_offset+1 (in parallel)
+    if (!stereo.openCameras(camera_offset))
+    {
+        cout << "Capture could not be opened successfully, exiting." << endl;
+        return -1;
     }
 
     // Origin size of camera input
-    int origin_width = cap[0].get(CV_CAP_PROP_FRAME_WIDTH);
-    int origin_height = cap[0].get(CV_CAP_PROP_FRAME_HEIGHT);
+    int origin_width = stereo.frameSize().width;
+    int origin_height = stereo.frameSize().height;
     // If we put two video in a row directly, the window will be too wide for the screen.
     // So scale them by 4/5.
     int width = origin_width * 4 / 5;
@@ -228,7 +258,7 @@ int main(int argc, const char* argv[])
     int display_height = height;
 
     Mat imageShow(display_height, display_width, CV_8UC3);  // used for display
-    Mat img;                    // store input frames
+    Mat frame[CAM_NUM];         // store input frames
     Mat img_scaled;             // used for scaling the inputs
     // coordinates of top left corner of each camera input at different place of the display window
     int coord_left, coord_top;  
@@ -246,63 +276,67 @@ int main(int argc, const char* argv[])
             if (ret) return -1;     // Failed to make directory, exit
         }
 
+        // Both cameras are grabbed at once, then decoded
+        if (stereo.read(frame) != 1)
+            break;      // Either input channel finishes will stop both channels
+
+        //-------------------- Record videos --------------------
+        // Open/close the files here: a parallel loop cannot be left on failure
+        if (record && !video_file_created)
+        {
+            for (i = 0; i < CAM_NUM; i++)
+            {
+                char file_path[50];
+                sprintf(file_path, "%s/v_%s%02d.mpg", dir_name, camera_name[i], cnt_videos);
+                put[i].open(file_path, CV_FOURCC('M', 'P', 'E', 'G'), 30, Size(origin_width, origin_height));
+                if (!put[i].isOpened())
+                {
+                    cout << "File could not be opened for writing. Check permission. Exiting." << endl;
+                    rmEmptyDir(dir_name);
+                    return -1;
+                }
+                cout << "Start recording, video file is " << file_path << endl;
+            }
+            video_file_created = true;
+        }
+        else if (!record && video_file_created)    // A video has been finished
+        {
+            cout << "Stop recording." << endl;
+            video_file_created = false;
+        }
+        if (take_pics)
+            cnt_pics++;
+
         //----------------------------------------------------------------------
         // Use parallel loops. (private eliminates data competition)
-        #pragma omp parallel for private(img, img_scaled, coord_left, coord_top)
+        #pragma omp parallel for num_threads(CAM_NUM) schedule(static) private(img_scaled, coord_left, coord_top)
         for (i = 0; i < CAM_NUM; i++)
         {
-            cap[i+camera_offset] >> img;
-            if (img.empty())
-            {
-                runflag = false;    // Either input channel finishes will stop both channels
-                break;
-            }
+            const Mat& img = frame[i];
 
             //-------------------- Take pictures --------------------
             if (take_pics)
             {
-                if (i == 0) cnt_pics++;         // update picture index before left camera takes a picture
-                if (i == 1) take_pics = false;  // reset flag when right camera takes a picture
                 char file_path[50];
                 sprintf(file_path, "%s/%s%02d.jpg", dir_name, camera_name[i], cnt_pics);
+                TRACE_SCOPE("imwrite");
                 imwrite(file_path, img);
                 cout << "A picture has been written to " << file_path << "!" << endl;
             }
 
-            //-------------------- Record videos --------------------
+            // Write frame to file
             if (record)
             {
-                // Check if the video files have been created
-                if (!video_file_created)
-                {
-                    char file_path[50];
-                    sprintf(file_path, "%s/v_%s%02d.mpg", dir_name, camera_name[i], cnt_videos);
-                    put[i].open(file_path, CV_FOURCC('M', 'P', 'E', 'G'), 30, Size(origin_width, origin_height));
-                    if (!put[i].isOpened())
-                    {
-                        cout << "File could not be opened for writing. Check permission. Exiting." << endl;
-                        rmEmptyDir(dir_name);
-                        return -1;
-                    }
-                    if (i == 1) video_file_created = true;  // reset flag after video file for right camera is created
-                    cout << "Start recording, video file is " << file_path << endl;
-                }
-
-                // Write frame to file
+                TRACE_SCOPE("VideoWriter::write");
                 put[i] << img;
             }
-            else
-            {
-                if (video_file_created) // A video has been finished
-                {
-                    cout << "Stop recording." << endl;
-                    video_file_created = false;
-                }
-            }
             //--------------------------------------------------
 
             // Scale the input
-            resize(img, img_scaled, Size(width, height));
+            {
+                TRACE_SCOPE("resize");
+                resize(img, img_scaled, Size(width, height));
+            }
 
             // Solve for the coordinates of top left corner of the child window
             coord_left = i % 2 * width;
@@ -310,6 +344,7 @@ int main(int argc, const char* argv[])
             // Copy the scaled image into the child window
             img_scaled.copyTo(imageShow(Rect(coord_left, coord_top, width, height)));
         }
+        take_pics = false;
         //----------------------------------------------------------------------
         // Output text
         string msg_pics = format("Pictures taken: %d", cnt_pics);
@@ -0,0 +1,134 @@
+/// calib_convergence.cpp
+/// Convergence checks of a calibration while its views are collected.
+///
+/// The uncertainty of a pixel is the projection of its ray(fixed) through the intrinsics with
+/// their covariance C: J C J', J the 2x9 derivatives of the projection by the intrinsics
+/// (from projectPoints); its larger eigenvalue is the variance in the worst direction. It is
+/// taken at the pixels of a grid including the corners of the image, where the distortion and
+/// the focal length matter most.
+///
+/// Ref:
+///     Richardson et al., AprilCal: Assisted and repeatable camera calibration, 2013;
+///     opencv/modules/calib3d/src/calibration.cpp(stdDeviationsIntrinsics)
+
+#include "calib_convergence.hpp"
+#include "calib_solver.hpp"
+#include "trace.hpp"
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+using namespace cv;
+using namespace std;
+
+const int GRID_STEPS = 8;       // the grid has GRID_STEPS + 1 pixels per row and column
+
+ConvergenceParams::ConvergenceParams() :
+    tolerance(0.5), minViews(6), checkEvery(2), stableChecks(2)
+{
+}
+
+CalibConvergence::CalibConvergence(const ConvergenceParams& params) :
+    params(params)
+{
+    reset();
+}
+
+void CalibConvergence::reset()
+{
+    state.views = state.checks = state.stable = 0;
+    state.change = state.uncertainty = -1;
+    state.time = 0;
+    state.converged = false;
+    estimate = CameraParams();
+}
+
+bool CalibConvergence::update(const vector<vector<Point3f> >& objectPoints, const vector<vector<Point2f> >& imagePoints,
+                              Size imageSize, int flags, int solver)
+{
+    const int n = (int)imagePoints.size();
+    if (n < params.minViews || (state.checks > 0 && n < state.views + params.checkEvery))
+        return false;
+    TRACE_SCOPE("convergence check");
+    const int64 t = getTickCount();
+
+    // from the previous estimate: a few iterations when it is close already
+    CameraParams next = estimate;
+    const bool ok = calibrateSingleCamera(objectPoints, imagePoints, imageSize,
+                                          flags | (state.checks > 0 ? CV_CALIB_USE_INTRINSIC_GUESS : 0), solver, next);
+    state.change = state.uncertainty = -1;
+    if (ok)
+    {
+        Mat covariance;
+        if (intrinsicsCovariance(objectPoints, imagePoints, next.cameraMatrix, next.distCoeffs,
+                                 next.rvecs, next.tvecs, covariance, flags))
+            state.uncertainty = projectionUncertainty(next, covariance, imageSize);
+        if (state.checks > 0)
+            state.change = reprojectionDifference(estimate, next, imageSize);
+        estimate = next;
+    }
+
+    const bool below = state.change >= 0 && state.change <= params.tolerance &&
+                       state.uncertainty >= 0 && state.uncertainty <= params.tolerance;
+    state.stable = below ? state.stable + 1 : 0;
+    state.converged = state.stable >= params.stableChecks;
+    state.views = n;
+    state.checks++;
+    state.time = (getTickCount() - t)*1000/getTickFrequency();
+    return true;
+}
+
+// the pixels of the grid, and their rays(z = 1) through the intrinsics of params
+static void gridRays(const CameraParams& params, Size imageSize, vector<Point2f>& grid, vector<Point3f>& rays)
+{
+    grid.clear();
+    for (int y = 0; y <= GRID_STEPS; y++)
+        for (int x = 0; x <= GRID_STEPS; x++)
+            grid.push_back(Point2f(x*(imageSize.width - 1.f)/GRID_STEPS, y*(imageSize.height - 1.f)/GRID_STEPS));
+    vector<Point2f> normalized;
+    undistortPoints(grid, normalized, params.cameraMatrix, params.distCoeffs, Mat(), Mat());
+    rays.resize(grid.size());
+    for (size_t i = 0; i < grid.size(); i++)
+        rays[i] = Point3f(normalized[i].x, normalized[i].y, 1);
+}
+
+double reprojectionDifference(const CameraParams& from, const CameraParams& to, Size imageSize)
+{
+    vector<Point2f> grid, reprojected;
+    vector<Point3f> rays;
+    gridRays(from, imageSize, grid, rays);
+    const Mat zero = Mat::zeros(3, 1, CV_64F);
+    projectPoints(rays, zero, zero, to.cameraMatrix, to.distCoeffs, reprojected);
+    double d = 0;
+    for (size_t i = 0; i < grid.size(); i++)
+        d = max(d, (double)norm(reprojected[i] - grid[i]));
+    return d;
+}
+
+double projectionUncertainty(const CameraParams& params, const Mat& covariance, Size imageSize)
+{
+    vector<Point2f> grid, projected;
+    vector<Point3f> rays;
+    gridRays(params, imageSize, grid, rays);
+
+    // columns of the jacobian: rotation(3), translation(3), fx, fy, cx, cy, distortion coefficients,
+    // the order of the intrinsics of the covariance
+    Mat J;
+    const Mat zero = Mat::zeros(3, 1, CV_64F);
+    projectPoints(rays, zero, zero, params.cameraMatrix, params.distCoeffs, projected, J);
+    const int n = min(J.cols - 6, covariance.rows);
+    const Mat C = covariance(Range(0, n), Range(0, n));
+    double worst = 0;
+    for (size_t i = 0; i < grid.size(); i++)
+    {
+        const Mat Ji = J(Range(2*(int)i, 2*(int)i + 2), Range(6, 6 + n));
+        const Mat P = Ji*C*Ji.t();
+        // larger eigenvalue of the 2x2 covariance of the pixel
+        const double a = P.at<double>(0, 0), b = P.at<double>(0, 1), d = P.at<double>(1, 1);
+        worst = max(worst, (a + d)/2 + sqrt((a - d)*(a - d)/4 + b*b));
+    }
+    return sqrt(worst);
+}
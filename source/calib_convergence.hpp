@@ -0,0 +1,68 @@
+/// calib_convergence.hpp
+/// Stop collecting calibration views once the intrinsics are known well enough, instead of after
+/// a fixed number of views: every few new views the views so far are calibrated again(from the
+/// previous estimate), and two measures of the model are compared with a tolerance in pixels:
+///     change: how far the previous estimate moved, the largest distance between the pixels of a
+///             grid over the image and their rays reprojected by the new estimate;
+///     uncertainty: the standard deviation of the projection of these rays, from the covariance
+///             of the intrinsics(calib_solver.hpp).
+/// The collection has converged when both stay below the tolerance for a few checks in a row.
+/// Works the same for the views of an image list and for live frames.
+
+#ifndef CALIB_CONVERGENCE_HPP
+#define CALIB_CONVERGENCE_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include "calibration.hpp"
+
+#include <vector>
+
+struct ConvergenceParams
+{
+    double tolerance;       // pixels, for the change and the uncertainty
+    int minViews;           // views before the first check
+    int checkEvery;         // new views between checks
+    int stableChecks;       // checks in a row below the tolerance
+
+    ConvergenceParams();
+};
+
+struct ConvergenceState
+{
+    int views;              // calibrated by the last check
+    int checks;
+    int stable;             // checks in a row below the tolerance
+    double change;          // pixels, since the previous check(-1 at the first)
+    double uncertainty;     // pixels, -1 if the views do not determine the intrinsics
+    double time;            // ms spent on the last check
+    bool converged;
+};
+
+struct CalibConvergence
+{
+    ConvergenceParams params;
+    ConvergenceState state;
+    CameraParams estimate;  // of the last check
+
+    CalibConvergence(const ConvergenceParams& params = ConvergenceParams());
+
+    /// Forgets the checks and the estimate.
+    void reset();
+
+    /// Call after adding a view. Calibrates the views when a check is due, flags and solver as
+    /// calibrateSingleCamera. Returns true if it checked.
+    bool update(const std::vector<std::vector<cv::Point3f> >& objectPoints,
+                const std::vector<std::vector<cv::Point2f> >& imagePoints,
+                cv::Size imageSize, int flags, int solver);
+};
+
+/// Largest distance(pixels) between the pixels of a grid over the image and their rays, through
+/// the intrinsics from, reprojected through the intrinsics to.
+double reprojectionDifference(const CameraParams& from, const CameraParams& to, cv::Size imageSize);
+
+/// Largest standard deviation(pixels) of the projection of the rays of a grid of pixels over the
+/// image, covariance of the intrinsics as intrinsicsCovariance.
+double projectionUncertainty(const CameraParams& params, const cv::Mat& covariance, cv::Size imageSize);
+
+#endif
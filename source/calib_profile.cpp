@@ -0,0 +1,97 @@
+/// calib_profile.cpp
+/// Calibrations derived per image size.
+///
+/// Ref:
+///     opencv/modules/calib3d/src/calibration.cpp(stereoRectify: the layout of P1, P2 and Q)
+
+#include "calib_profile.hpp"
+
+#include <iostream>
+#include <stdio.h>
+
+using namespace cv;
+using namespace std;
+
+CalibProfile::CalibProfile()
+{
+}
+
+bool CalibProfile::load(const string& filename)
+{
+    StereoParams p;
+    if (!loadStereoParams(filename, p) || p.R1.empty() || p.R2.empty() || p.P1.empty() || p.P2.empty())
+        return false;
+    set(p);
+    return true;
+}
+
+void CalibProfile::set(const StereoParams& p)
+{
+    CV_Assert(!p.P1.empty() && !p.P2.empty() && "rectifyStereoPair first");
+    params = p;
+    derived.clear();
+}
+
+bool CalibProfile::empty() const
+{
+    return params.P1.empty();
+}
+
+const StereoParams& CalibProfile::calibrated() const
+{
+    return params;
+}
+
+CalibProfile::Derived& CalibProfile::find(Size size)
+{
+    CV_Assert(!empty() && "load or set first");
+    for (list<Derived>::iterator it = derived.begin(); it != derived.end(); it++)
+        if (it->size == size)
+            return *it;
+    Derived d;
+    d.size = size;
+    scaleStereoParams(params, size, d.params);
+    derived.push_back(d);
+    return derived.back();
+}
+
+const StereoParams& CalibProfile::at(Size size)
+{
+    return find(size).params;
+}
+
+void CalibProfile::rectifyMaps(Size size, Mat map[2][2])
+{
+    Derived& d = find(size);
+    if (d.map[0][0].empty())
+        computeRectifyMaps(d.params, size, d.map);
+    for (int k = 0; k < 2; k++)
+    {
+        map[k][0] = d.map[k][0];
+        map[k][1] = d.map[k][1];
+    }
+}
+
+bool CalibProfile::scaled(Size size) const
+{
+    return params.imageSize != Size() && params.imageSize != size;
+}
+
+bool CalibProfile::cropped(Size size) const
+{
+    bool crop = false;
+    if (scaled(size))
+        resolutionTransform(params.imageSize, size, &crop);
+    return crop;
+}
+
+void CalibProfile::report(Size size) const
+{
+    if (params.imageSize == Size())
+        cout << "The calibration does not record its image size, used as is for " << size.width << "x"
+             << size.height << " images." << endl;
+    else if (scaled(size))
+        cout << "Calibrated for " << params.imageSize.width << "x" << params.imageSize.height << " images, scaled to "
+             << size.width << "x" << size.height
+             << (cropped(size) ? "(another aspect ratio: taken as a centered crop of the sensor)" : "") << "." << endl;
+}
@@ -0,0 +1,61 @@
+/// calib_profile.hpp
+/// A stereo calibration stored once, at the size it was calibrated at(stereo_params.xml), and
+/// derived on demand for the sizes it is used at: capture modes of the cameras, or decimated
+/// frames for previews and matching. The calibration, rectification and maps of a size are
+/// computed the first time it is asked for(scaleStereoParams, computeRectifyMaps) and kept, so
+/// switching between sizes costs nothing after the first frame of each.
+///
+/// Not thread-safe: one profile per thread, or calls under a lock.
+
+#ifndef CALIB_PROFILE_HPP
+#define CALIB_PROFILE_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include "calibration.hpp"
+
+#include <list>
+#include <string>
+
+class CalibProfile
+{
+public:
+    CalibProfile();
+
+    /// Reads stereo_params.xml, which must hold the rectification. Forgets the derived sizes.
+    bool load(const std::string& filename);
+    /// A calibration of this program, rectified(rectifyStereoPair). Forgets the derived sizes.
+    void set(const StereoParams& params);
+    bool empty() const;
+
+    /// As calibrated; imageSize is Size() for files of older versions, then used at any size as is.
+    const StereoParams& calibrated() const;
+
+    /// The calibration and rectification for images of size.
+    const StereoParams& at(cv::Size size);
+    /// Rectification maps of both cameras for images of size(CV_16SC2), shared with the profile.
+    void rectifyMaps(cv::Size size, cv::Mat map[2][2]);
+
+    /// Whether images of size need scaling, and whether they are of another aspect ratio(taken
+    /// as a centered crop, see resolutionTransform).
+    bool scaled(cv::Size size) const;
+    bool cropped(cv::Size size) const;
+
+    /// Prints how the calibration is used for images of size, e.g. when a tool opens its input.
+    void report(cv::Size size) const;
+
+private:
+    struct Derived
+    {
+        cv::Size size;
+        StereoParams params;
+        cv::Mat map[2][2];      // empty until asked for
+    };
+
+    StereoParams params;
+    std::list<Derived> derived; // stable references, a few sizes
+
+    Derived& find(cv::Size size);
+};
+
+#endif
@@ -0,0 +1,507 @@
+/// calib_regression.cpp
+/// Non-interactive regression check of the calibration: runs the mono calibration of both
+/// cameras and the stereo calibration on the pairs of images/, as camera_calib and stereo_calib
+/// do, and compares the results and the time of every stage with the goldens.
+///
+/// Input: the directory of the pairs(left01.jpg, right01.jpg, ...), default is images/,
+///        and the goldens(-g, default <directory>/calib_golden.xml);
+/// Output: every check with its value, golden and tolerance; the exit code is 0 if all pass,
+///         1 if any fails(-1 on errors). -update writes the results of this run as the goldens.
+///
+/// Checks: RMS, mean and per-view reprojection errors; focal lengths(relative), principal
+/// points; distortion, as the largest difference of the undistorted positions of a grid of
+/// image points(the coefficients themselves are ill-conditioned: k3 may change a lot for the
+/// same correction); stereo RMS, epipolar error, rotation(degrees) and translation(relative).
+/// The time of a stage fails if it is more than the tolerance slower than its golden; the times
+/// depend on the machine, so they are only checked if the goldens hold some(-update on the
+/// machine that runs the check), and -notime skips them. -update -notime writes no times, as the
+/// goldens of images/.
+///
+/// Ref:
+///     calibration.hpp, camera_calib.cpp, stereo_calib.cpp
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include "calibration.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+using namespace cv;
+using namespace std;
+
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+string imageDir = "images";     // left01.jpg, right01.jpg, ...
+string goldenFn;                // default is imageDir/calib_golden.xml
+int solver = SOLVER_OPENCV;
+int runs = 3;                   // the times are the best of the runs
+bool update = false;            // write the goldens instead of checking them
+bool checkTime = true;
+const Size boardSize(6, 5);     // as camera_calib
+const float squareSize = 30;
+// flags of camera_calib, and of stereo_calib with the results of camera_calib
+const int monoFlags = CV_CALIB_FIX_PRINCIPAL_POINT | CV_CALIB_ZERO_TANGENT_DIST | CV_CALIB_FIX_ASPECT_RATIO;
+const int stereoFlags = CV_CALIB_FIX_INTRINSIC;
+
+const int STAGES = 7;
+const char* stageNames[STAGES] = {"load", "detect", "calibrate_left", "calibrate_right", "stereo_calibrate",
+                                  "rectify", "total"};
+//--------------------------------------------------
+// Goldens
+//--------------------------------------------------
+struct Tolerances
+{
+    double error;           // reprojection and epipolar errors, pixels
+    double focal;           // relative
+    double center;          // pixels
+    double distortion;      // pixels, on the undistortion grid
+    double rotation;        // degrees
+    double translation;     // relative
+    double time;            // relative slowdown
+    double timeFloorMs;     // slowdowns below are noise
+
+    Tolerances() :
+        error(0.01), focal(0.005), center(1), distortion(0.5), rotation(0.05), translation(0.01),
+        time(0.5), timeFloorMs(5)
+    {
+    }
+};
+
+struct CalibResult
+{
+    CameraParams camera[2];
+    StereoParams stereo;
+    double epipolar;
+    double stageMs[STAGES];
+    bool hasTimes;
+};
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void usage();
+static bool argParsing(int argc, char** argv);
+static bool runCalibration(CalibResult& r);
+static bool saveGoldens(const string& filename, const CalibResult& r, const Tolerances& tol);
+static bool loadGoldens(const string& filename, CalibResult& r, Tolerances& tol);
+static int checkGoldens(const CalibResult& r, const CalibResult& g, const Tolerances& tol);
+//--------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    traceFromEnv();
+    if (!argParsing(argc, argv))
+        return -1;
+
+    CalibResult result;
+    for (int i = 0; i < runs; i++)
+    {
+        CalibResult r;
+        if (!runCalibration(r))
+            return -1;
+        // the calibration is deterministic, only the times change
+        if (i == 0)
+            result = r;
+        for (int s = 0; s < STAGES; s++)
+            result.stageMs[s] = min(result.stageMs[s], r.stageMs[s]);
+    }
+    cout << "Stage times(best of " << runs << " runs):" << endl;
+    for (int s = 0; s < STAGES; s++)
+        cout << format("\t%-18s %9.2f ms", stageNames[s], result.stageMs[s]) << endl;
+
+    CalibResult golden;
+    Tolerances tol;
+    const bool hasGoldens = loadGoldens(goldenFn, golden, tol);
+    if (update)
+    {
+        // keeps the tolerances of the old goldens
+        if (!saveGoldens(goldenFn, result, tol))
+        {
+            cout << "Cannot write " << goldenFn << endl;
+            return -1;
+        }
+        cout << "Goldens written to " << goldenFn << endl;
+        return 0;
+    }
+    if (!hasGoldens)
+    {
+        cout << "Cannot read the goldens " << goldenFn << ", create them with -update." << endl;
+        return -1;
+    }
+
+    const int failures = checkGoldens(result, golden, tol);
+    if (failures)
+        cout << failures << " regressions against " << goldenFn << endl;
+    else
+        cout << "No regression against " << goldenFn << endl;
+    return failures ? 1 : 0;
+}
+
+void usage()
+{
+    cout << "Usage:" << endl
+         << "\t./calib_regression [options] [image directory]" << endl
+         << "\t<image directory>: left01.jpg, right01.jpg, ..., default is 'images';" << endl
+         << "\t-g <file>: goldens, default is '<image directory>/calib_golden.xml';" << endl
+         << "\t-update: write the results of this run as the goldens(the tolerances are kept);" << endl
+         << "\t-solver opencv|sparse: calibrateCamera/stereoCalibrate(default) or the sparse solver;" << endl
+         << "\t-r <runs>: the stage times are the best of the runs, default is 3;" << endl
+         << "\t-notime: do not check the stage times(with -update, do not write them)." << endl;
+}
+
+bool argParsing(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-g" && hasValue)
+            goldenFn = argv[++i];
+        else if (arg == "-update")
+            update = true;
+        else if (arg == "-solver" && hasValue)
+        {
+            string s = argv[++i];
+            if (s == "opencv")
+                solver = SOLVER_OPENCV;
+            else if (s == "sparse")
+                solver = SOLVER_SPARSE;
+            else
+            {
+                cout << "Invalid solver " << s << endl;
+                return false;
+            }
+        }
+        else if (arg == "-r" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &runs) != 1 || runs < 1)
+            {
+                cout << "The number of runs must be positive!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-notime")
+            checkTime = false;
+        else if (arg[0] == '-')
+        {
+            cout << "Invalid option " << arg << endl;
+            usage();
+            return false;
+        }
+        else
+            imageDir = arg;
+    }
+
+    if (goldenFn.empty())
+        goldenFn = imageDir + "/calib_golden.xml";
+    return true;
+}
+
+static double elapsedMs(int64& t)
+{
+    const int64 now = getTickCount();
+    const double ms = (now - t)*1000/getTickFrequency();
+    t = now;
+    return ms;
+}
+
+// the calibrations of camera_calib and stereo_calib on all the pairs of imageDir
+bool runCalibration(CalibResult& r)
+{
+    r.hasTimes = true;
+    const int64 start = getTickCount();
+    int64 t = start;
+
+    vector<Mat> images[2];
+    for (int i = 1; ; i++)
+    {
+        char fn[2][32];
+        sprintf(fn[0], "/left%02d.jpg", i);
+        sprintf(fn[1], "/right%02d.jpg", i);
+        Mat img[2];
+        for (int k = 0; k < 2; k++)
+            img[k] = imread(imageDir + fn[k], CV_LOAD_IMAGE_COLOR);
+        if (img[0].empty() || img[1].empty())
+            break;
+        for (int k = 0; k < 2; k++)
+            images[k].push_back(img[k]);
+    }
+    if (images[0].empty())
+    {
+        cout << "Cannot read the pairs left01.jpg, right01.jpg... of " << imageDir << endl;
+        return false;
+    }
+    const Size imageSize = images[0][0].size();
+    r.stageMs[0] = elapsedMs(t);
+
+    // corners of every camera, and of the pairs where both cameras found the board
+    const int n = (int)images[0].size();
+    vector<vector<Point2f> > corners[2];
+    vector<char> found[2];
+    for (int k = 0; k < 2; k++)
+    {
+        corners[k].resize(n);
+        found[k].resize(n);
+        for (int i = 0; i < n; i++)
+            found[k][i] = images[k][i].size() == imageSize && findBoardCorners(images[k][i], boardSize, corners[k][i]);
+    }
+    vector<vector<Point2f> > monoPoints[2], stereoPoints[2];
+    for (int i = 0; i < n; i++)
+    {
+        for (int k = 0; k < 2; k++)
+            if (found[k][i])
+                monoPoints[k].push_back(corners[k][i]);
+        if (found[0][i] && found[1][i])
+            for (int k = 0; k < 2; k++)
+                stereoPoints[k].push_back(corners[k][i]);
+    }
+    r.stageMs[1] = elapsedMs(t);
+    if (stereoPoints[0].size() < 2)
+    {
+        cout << "The board is found in " << stereoPoints[0].size() << " pairs only." << endl;
+        return false;
+    }
+
+    vector<Point3f> board;
+    calcBoardCornerPositions(boardSize, squareSize, board);
+    for (int k = 0; k < 2; k++)
+    {
+        vector<vector<Point3f> > objectPoints(monoPoints[k].size(), board);
+        if (!calibrateSingleCamera(objectPoints, monoPoints[k], imageSize, monoFlags, solver, r.camera[k]))
+        {
+            cout << "The calibration of the " << (k ? "right" : "left") << " camera failed." << endl;
+            return false;
+        }
+        r.stageMs[2 + k] = elapsedMs(t);
+    }
+
+    vector<vector<Point3f> > objectPoints(stereoPoints[0].size(), board);
+    for (int k = 0; k < 2; k++)
+    {
+        r.stereo.cameraMatrix[k] = r.camera[k].cameraMatrix.clone();
+        r.stereo.distCoeffs[k] = r.camera[k].distCoeffs.clone();
+    }
+    if (!calibrateStereoPair(objectPoints, stereoPoints[0], stereoPoints[1], imageSize, stereoFlags, solver, r.stereo))
+    {
+        cout << "The stereo calibration failed." << endl;
+        return false;
+    }
+    r.epipolar = epipolarError(stereoPoints[0], stereoPoints[1], r.stereo);
+    r.stageMs[4] = elapsedMs(t);
+
+    Mat map[2][2];
+    rectifyStereoPair(r.stereo);
+    computeRectifyMaps(r.stereo, imageSize, map);
+    r.stageMs[5] = elapsedMs(t);
+    r.stageMs[6] = (getTickCount() - start)*1000/getTickFrequency();
+    return true;
+}
+
+static void writeCamera(FileStorage& fs, const string& name, const CameraParams& c)
+{
+    fs << name << "{"
+       << "views" << (int)c.perViewErrors.size()
+       << "rms" << c.rms
+       << "avg_error" << c.avgError
+       << "per_view_errors" << c.perViewErrors
+       << "camera_matrix" << c.cameraMatrix
+       << "distortion_coefficients" << c.distCoeffs
+       << "}";
+}
+
+bool saveGoldens(const string& filename, const CalibResult& r, const Tolerances& tol)
+{
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened())
+        return false;
+
+    char buf[64];
+    time_t tm;
+    time(&tm);
+    strftime(buf, sizeof(buf), "%c", localtime(&tm));
+    fs << "calibration_time" << buf;
+    fs << "solver" << (solver == SOLVER_SPARSE ? "sparse" : "opencv");
+    fs << "image_Width" << r.stereo.imageSize.width;
+    fs << "image_Height" << r.stereo.imageSize.height;
+    fs << "tolerances" << "{"
+       << "error" << tol.error << "focal" << tol.focal << "center" << tol.center
+       << "distortion" << tol.distortion << "rotation" << tol.rotation << "translation" << tol.translation
+       << "time" << tol.time << "time_floor_ms" << tol.timeFloorMs
+       << "}";
+    writeCamera(fs, "left", r.camera[0]);
+    writeCamera(fs, "right", r.camera[1]);
+    fs << "stereo" << "{"
+       << "rms" << r.stereo.rms
+       << "epipolar_error" << r.epipolar
+       << "R" << r.stereo.R
+       << "T" << r.stereo.T
+       << "}";
+    if (checkTime)
+    {
+        fs << "times_ms" << "{";
+        for (int s = 0; s < STAGES; s++)
+            fs << stageNames[s] << r.stageMs[s];
+        fs << "}";
+    }
+    return true;
+}
+
+static void readCamera(const FileNode& node, CameraParams& c)
+{
+    node["rms"] >> c.rms;
+    node["avg_error"] >> c.avgError;
+    node["per_view_errors"] >> c.perViewErrors;
+    node["camera_matrix"] >> c.cameraMatrix;
+    node["distortion_coefficients"] >> c.distCoeffs;
+}
+
+bool loadGoldens(const string& filename, CalibResult& r, Tolerances& tol)
+{
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened())
+        return false;
+
+    FileNode t = fs["tolerances"];
+    if (!t.empty())
+    {
+        Tolerances d;
+        tol.error = t["error"].empty() ? d.error : (double)t["error"];
+        tol.focal = t["focal"].empty() ? d.focal : (double)t["focal"];
+        tol.center = t["center"].empty() ? d.center : (double)t["center"];
+        tol.distortion = t["distortion"].empty() ? d.distortion : (double)t["distortion"];
+        tol.rotation = t["rotation"].empty() ? d.rotation : (double)t["rotation"];
+        tol.translation = t["translation"].empty() ? d.translation : (double)t["translation"];
+        tol.time = t["time"].empty() ? d.time : (double)t["time"];
+        tol.timeFloorMs = t["time_floor_ms"].empty() ? d.timeFloorMs : (double)t["time_floor_ms"];
+    }
+    r.stereo.imageSize = Size((int)fs["image_Width"], (int)fs["image_Height"]);
+    readCamera(fs["left"], r.camera[0]);
+    readCamera(fs["right"], r.camera[1]);
+    FileNode s = fs["stereo"];
+    s["rms"] >> r.stereo.rms;
+    s["epipolar_error"] >> r.epipolar;
+    s["R"] >> r.stereo.R;
+    s["T"] >> r.stereo.T;
+
+    FileNode times = fs["times_ms"];
+    r.hasTimes = !times.empty();
+    for (int i = 0; i < STAGES; i++)
+        r.stageMs[i] = times[stageNames[i]].empty() ? 0 : (double)times[stageNames[i]];
+
+    return !r.camera[0].cameraMatrix.empty() && !r.camera[1].cameraMatrix.empty()
+        && !r.stereo.R.empty() && !r.stereo.T.empty();
+}
+
+// prints the check, returns 1 if it fails
+static int check(const string& name, double value, double golden, double diff, double tolerance)
+{
+    const bool ok = diff <= tolerance;
+    cout << format("%s %-34s %12.6g  golden %12.6g  diff %10.4g  tolerance %g",
+                   ok ? "PASS" : "FAIL", name.c_str(), value, golden, diff, tolerance) << endl;
+    return ok ? 0 : 1;
+}
+
+// largest distance between the undistorted positions of a grid of image points
+static double undistortionDifference(const CameraParams& a, const CameraParams& b, Size imageSize)
+{
+    vector<Point2f> grid, ua, ub;
+    for (int y = 0; y <= 8; y++)
+        for (int x = 0; x <= 8; x++)
+            grid.push_back(Point2f(x*(imageSize.width - 1)/8.f, y*(imageSize.height - 1)/8.f));
+    undistortPoints(grid, ua, a.cameraMatrix, a.distCoeffs, Mat(), a.cameraMatrix);
+    undistortPoints(grid, ub, b.cameraMatrix, b.distCoeffs, Mat(), b.cameraMatrix);
+    double d = 0;
+    for (size_t i = 0; i < grid.size(); i++)
+        d = max(d, (double)norm(ua[i] - ub[i]));
+    return d;
+}
+
+static int compareCamera(const string& name, const CameraParams& c, const CameraParams& g, Size imageSize,
+                         const Tolerances& tol)
+{
+    int failures = 0;
+    failures += check(name + ".rms", c.rms, g.rms, fabs(c.rms - g.rms), tol.error);
+    failures += check(name + ".avg_error", c.avgError, g.avgError, fabs(c.avgError - g.avgError), tol.error);
+    failures += check(name + ".views", (double)c.perViewErrors.size(), (double)g.perViewErrors.size(),
+                      fabs((double)c.perViewErrors.size() - g.perViewErrors.size()), 0);
+    if (c.perViewErrors.size() == g.perViewErrors.size())
+    {
+        // the worst view only, the others are listed if it fails
+        double worst = 0;
+        int worstView = 0;
+        for (size_t i = 0; i < c.perViewErrors.size(); i++)
+            if (fabs(c.perViewErrors[i] - g.perViewErrors[i]) > worst)
+            {
+                worst = fabs(c.perViewErrors[i] - g.perViewErrors[i]);
+                worstView = (int)i;
+            }
+        char buf[64];
+        sprintf(buf, ".per_view_errors[%d]", worstView);
+        if (check(name + buf, c.perViewErrors[worstView], g.perViewErrors[worstView], worst, tol.error))
+        {
+            failures++;
+            for (size_t i = 0; i < c.perViewErrors.size(); i++)
+                cout << "\tview " << i << ": " << c.perViewErrors[i] << ", golden " << g.perViewErrors[i] << endl;
+        }
+    }
+
+    const char* params[4] = {".fx", ".fy", ".cx", ".cy"};
+    for (int i = 0; i < 4; i++)
+    {
+        const int row = i % 2, col = i < 2 ? row : 2;
+        const double v = c.cameraMatrix.at<double>(row, col), gv = g.cameraMatrix.at<double>(row, col);
+        if (i < 2)
+            failures += check(name + params[i], v, gv, fabs(v - gv)/fabs(gv), tol.focal);
+        else
+            failures += check(name + params[i], v, gv, fabs(v - gv), tol.center);
+    }
+    failures += check(name + ".distortion", 0, 0, undistortionDifference(c, g, imageSize), tol.distortion);
+    return failures;
+}
+
+int checkGoldens(const CalibResult& r, const CalibResult& g, const Tolerances& tol)
+{
+    const Size imageSize = r.stereo.imageSize;
+    int failures = 0;
+    if (g.stereo.imageSize != imageSize)
+    {
+        cout << "FAIL the goldens are of " << g.stereo.imageSize.width << "x" << g.stereo.imageSize.height
+             << " images, not " << imageSize.width << "x" << imageSize.height << endl;
+        return 1;
+    }
+    failures += compareCamera("left", r.camera[0], g.camera[0], imageSize, tol);
+    failures += compareCamera("right", r.camera[1], g.camera[1], imageSize, tol);
+
+    const StereoParams& s = r.stereo;
+    const StereoParams& gs = g.stereo;
+    failures += check("stereo.rms", s.rms, gs.rms, fabs(s.rms - gs.rms), tol.error);
+    failures += check("stereo.epipolar_error", r.epipolar, g.epipolar, fabs(r.epipolar - g.epipolar), tol.error);
+    // angle of the rotation between R and the golden one
+    Mat dr;
+    Rodrigues(Mat(gs.R.t()*s.R), dr);
+    failures += check("stereo.rotation", 0, 0, norm(dr)*180/CV_PI, tol.rotation);
+    failures += check("stereo.translation", norm(s.T), norm(gs.T), norm(s.T, gs.T, NORM_L2)/norm(gs.T),
+                      tol.translation);
+
+    if (checkTime && g.hasTimes)
+        for (int i = 0; i < STAGES; i++)
+        {
+            // slowdowns of a few ms are noise
+            const double slower = r.stageMs[i] - g.stageMs[i];
+            const double diff = slower < tol.timeFloorMs ? 0 : slower/max(g.stageMs[i], 1e-3);
+            failures += check(string("time.") + stageNames[i], r.stageMs[i], g.stageMs[i], diff, tol.time);
+        }
+    else if (checkTime)
+        cout << "The goldens hold no stage times, run -update on this machine to check them." << endl;
+    return failures;
+}
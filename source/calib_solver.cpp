@@ -0,0 +1,843 @@
+/// calib_solver.cpp
+/// Block-sparse Levenberg-Marquardt for camera and stereo calibration.
+///
+/// Unknowns: the global block(free intrinsics of the cameras, and the rotation and translation of
+/// the right camera for stereo) and the pose of every view(of the left camera). A residual depends
+/// on the global block and on the pose of its view only, so the normal equations are
+///     [U  W] [dg]     [gg]
+///     [W' V] [dl] = - [gl],   V block diagonal with one 6x6 block per view,
+/// and are solved with the Schur complement S = U - W V^-1 W' of the global block:
+///     S dg = -gg + W V^-1 gl,     dl = -V^-1 (gl + W' dg).
+/// Both the Jacobians and the Schur complement are accumulated view by view, in parallel.
+///
+/// The camera model and the derivatives are those of projectPoints(k1, k2, p1, p2, k3). Rotations
+/// are updated multiplicatively, R <- Rodrigues(dw)*R.
+///
+/// Ref:
+///     Triggs et al., Bundle Adjustment - A Modern Synthesis, 2000;
+///     opencv/modules/calib3d/src/calibration.cpp
+
+#include "calib_solver.hpp"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+using namespace cv;
+using namespace std;
+
+const int POSE_PARAMS = 6;      // rotation and translation
+const int INTRINSICS = 9;       // fx, fy, cx, cy, k1, k2, p1, p2, k3
+const int MAX_GLOBALS = 2*INTRINSICS + POSE_PARAMS;
+
+//--------------------------------------------------
+// Small dense algebra
+//--------------------------------------------------
+// Rodrigues formula, R = exp([w]x)
+static void rotationMatrix(const double* w, double* R)
+{
+    const double th2 = w[0]*w[0] + w[1]*w[1] + w[2]*w[2], th = sqrt(th2);
+    const double s = th > 1e-12 ? sin(th)/th : 1, c = th > 1e-12 ? (1 - cos(th))/th2 : 0.5;
+    const double K[9] = {0, -w[2], w[1], w[2], 0, -w[0], -w[1], w[0], 0};
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            R[i*3 + j] = (i == j) + s*K[i*3 + j] + c*(w[i]*w[j] - (i == j)*th2);
+}
+
+// C = A*B, 3x3
+static void multiply3(const double* A, const double* B, double* C)
+{
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            C[i*3 + j] = A[i*3]*B[j] + A[i*3 + 1]*B[3 + j] + A[i*3 + 2]*B[6 + j];
+}
+
+// y = A*x, 3x3
+static void multiply3(const double* A, const double* x, double* y, int)
+{
+    for (int i = 0; i < 3; i++)
+        y[i] = A[i*3]*x[0] + A[i*3 + 1]*x[1] + A[i*3 + 2]*x[2];
+}
+
+static void invert3(const double* A, double* B)
+{
+    B[0] = A[4]*A[8] - A[5]*A[7];
+    B[1] = A[2]*A[7] - A[1]*A[8];
+    B[2] = A[1]*A[5] - A[2]*A[4];
+    B[3] = A[5]*A[6] - A[3]*A[8];
+    B[4] = A[0]*A[8] - A[2]*A[6];
+    B[5] = A[2]*A[3] - A[0]*A[5];
+    B[6] = A[3]*A[7] - A[4]*A[6];
+    B[7] = A[1]*A[6] - A[0]*A[7];
+    B[8] = A[0]*A[4] - A[1]*A[3];
+    const double det = A[0]*B[0] + A[1]*B[3] + A[2]*B[6];
+    for (int i = 0; i < 9; i++)
+        B[i] /= det;
+}
+
+// A = L*L', L in the lower triangle of A(n x n). False if A is not positive definite.
+static bool cholesky(double* A, int n)
+{
+    for (int j = 0; j < n; j++)
+    {
+        double d = A[j*n + j];
+        for (int k = 0; k < j; k++)
+            d -= A[j*n + k]*A[j*n + k];
+        if (!(d > 0))
+            return false;
+        d = sqrt(d);
+        A[j*n + j] = d;
+        for (int i = j + 1; i < n; i++)
+        {
+            double s = A[i*n + j];
+            for (int k = 0; k < j; k++)
+                s -= A[i*n + k]*A[j*n + k];
+            A[i*n + j] = s/d;
+        }
+    }
+    return true;
+}
+
+// solves L*L'*x = b in place
+static void choleskySolve(const double* L, int n, double* b)
+{
+    for (int i = 0; i < n; i++)
+    {
+        double s = b[i];
+        for (int k = 0; k < i; k++)
+            s -= L[i*n + k]*b[k];
+        b[i] = s/L[i*n + i];
+    }
+    for (int i = n - 1; i >= 0; i--)
+    {
+        double s = b[i];
+        for (int k = i + 1; k < n; k++)
+            s -= L[k*n + i]*b[k];
+        b[i] = s/L[i*n + i];
+    }
+}
+
+//--------------------------------------------------
+// Problem
+//--------------------------------------------------
+struct CalibParams
+{
+    double intrinsics[2][INTRINSICS];
+    double R[9], T[3];          // right camera relative to the left one
+    vector<double> poses;       // per view, rotation matrix(9) and translation(3) of the left camera
+};
+
+struct CalibProblem
+{
+    const vector<vector<Point3f> >* objectPoints;
+    const vector<vector<Point2f> >* imagePoints[2];
+    int cameras;
+    int views;
+    int points;                             // per camera, over all views
+    int freeIndex[2][INTRINSICS];           // column in the global block, -1 if fixed
+    bool tiedAspect[2];                     // fx = aspect*fy, the column of fy carries both
+    double aspect[2];
+    int stereoIndex;                        // first column of the rotation and translation of the right camera
+    int globals;                            // size of the global block
+};
+
+// normal equation terms of a view, and the scratch of the Schur complement
+struct ViewBlock
+{
+    double V[POSE_PARAMS*POSE_PARAMS];
+    double W[MAX_GLOBALS*POSE_PARAMS];      // row per global column
+    double g[POSE_PARAMS];
+    double Y[MAX_GLOBALS*POSE_PARAMS];      // V^-1 W', column per global column
+    double z[POSE_PARAMS];                  // V^-1 g
+};
+
+static void setupCamera(CalibProblem& pb, const CalibParams& prm, int c, int flags, int coeffs)
+{
+    bool fixed[INTRINSICS] = {false};
+    if (flags & CV_CALIB_FIX_INTRINSIC)
+        fill(fixed, fixed + INTRINSICS, true);
+    if (flags & CV_CALIB_FIX_FOCAL_LENGTH)
+        fixed[0] = fixed[1] = true;
+    if (flags & CV_CALIB_FIX_PRINCIPAL_POINT)
+        fixed[2] = fixed[3] = true;
+    if (flags & CV_CALIB_FIX_K1)
+        fixed[4] = true;
+    if (flags & CV_CALIB_FIX_K2)
+        fixed[5] = true;
+    if (flags & CV_CALIB_ZERO_TANGENT_DIST)
+        fixed[6] = fixed[7] = true;
+    if ((flags & CV_CALIB_FIX_K3) || coeffs < 5)
+        fixed[8] = true;
+
+    pb.tiedAspect[c] = (flags & CV_CALIB_FIX_ASPECT_RATIO) && !fixed[1];
+    pb.aspect[c] = prm.intrinsics[c][0]/prm.intrinsics[c][1];
+    if (pb.tiedAspect[c])
+        fixed[0] = true;
+    for (int m = 0; m < INTRINSICS; m++)
+        pb.freeIndex[c][m] = fixed[m] ? -1 : pb.globals++;
+}
+
+// Pixel of the camera point X with intrinsics k; with dpdX, its derivatives by X(2x3) and k(2x9).
+static void projectPoint(const double* k, const double* X, double* p, double* dpdX, double* dpdk)
+{
+    const double iz = 1/X[2], x = X[0]*iz, y = X[1]*iz;
+    const double r2 = x*x + y*y, r4 = r2*r2, r6 = r4*r2;
+    const double radial = 1 + k[4]*r2 + k[5]*r4 + k[8]*r6;
+    const double xd = x*radial + 2*k[6]*x*y + k[7]*(r2 + 2*x*x);
+    const double yd = y*radial + k[6]*(r2 + 2*y*y) + 2*k[7]*x*y;
+    p[0] = k[0]*xd + k[2];
+    p[1] = k[1]*yd + k[3];
+    if (!dpdX)
+        return;
+
+    const double dr = k[4] + 2*k[5]*r2 + 3*k[8]*r4;     // d radial/d r2
+    const double dxdx = radial + 2*x*x*dr + 2*k[6]*y + 6*k[7]*x;
+    const double dxdy = 2*x*y*dr + 2*k[6]*x + 2*k[7]*y; // = d yd/d x
+    const double dydy = radial + 2*y*y*dr + 6*k[6]*y + 2*k[7]*x;
+    dpdX[0] = k[0]*dxdx*iz;
+    dpdX[1] = k[0]*dxdy*iz;
+    dpdX[2] = -k[0]*(dxdx*x + dxdy*y)*iz;
+    dpdX[3] = k[1]*dxdy*iz;
+    dpdX[4] = k[1]*dydy*iz;
+    dpdX[5] = -k[1]*(dxdy*x + dydy*y)*iz;
+
+    const double du[INTRINSICS] = {xd, 0, 1, 0, k[0]*x*r2, k[0]*x*r4, k[0]*2*x*y, k[0]*(r2 + 2*x*x), k[0]*x*r6};
+    const double dv[INTRINSICS] = {0, yd, 0, 1, k[1]*y*r2, k[1]*y*r4, k[1]*(r2 + 2*y*y), k[1]*2*x*y, k[1]*y*r6};
+    memcpy(dpdk, du, sizeof(du));
+    memcpy(dpdk + INTRINSICS, dv, sizeof(dv));
+}
+
+// J(2x6) = dpdX(2x3)*[-[a]x | I], the derivatives by a rotation update(applied to a) and a translation;
+// a row of dpdX times -[a]x is a x(the row)
+static void poseJacobian(const double* dpdX, const double* a, double* J)
+{
+    for (int r = 0; r < 2; r++)
+    {
+        const double* d = dpdX + r*3;
+        J[r*6 + 0] = a[1]*d[2] - a[2]*d[1];
+        J[r*6 + 1] = a[2]*d[0] - a[0]*d[2];
+        J[r*6 + 2] = a[0]*d[1] - a[1]*d[0];
+        J[r*6 + 3] = d[0];
+        J[r*6 + 4] = d[1];
+        J[r*6 + 5] = d[2];
+    }
+}
+
+// Squared reprojection error of view i. With blk, also its normal equation terms; the terms of
+// the global block are added to U(globals x globals) and gg.
+static double viewTerms(const CalibProblem& pb, const CalibParams& prm, int i, ViewBlock* blk, double* U, double* gg)
+{
+    const vector<Point3f>& obj = (*pb.objectPoints)[i];
+    const double* Ri = &prm.poses[i*12];
+    const double* ti = Ri + 9;
+    const int G = pb.globals;
+    if (blk)
+        memset(blk, 0, sizeof(ViewBlock));
+
+    double err = 0;
+    for (size_t j = 0; j < obj.size(); j++)
+    {
+        const double X[3] = {obj[j].x, obj[j].y, obj[j].z};
+        double RX[3], Xc[2][3];
+        multiply3(Ri, X, RX, 0);
+        for (int k = 0; k < 3; k++)
+            Xc[0][k] = RX[k] + ti[k];
+        if (pb.cameras == 2)
+        {
+            multiply3(prm.R, Xc[0], Xc[1], 0);
+            for (int k = 0; k < 3; k++)
+                Xc[1][k] += prm.T[k];
+        }
+
+        for (int c = 0; c < pb.cameras; c++)
+        {
+            const Point2f& q = (*pb.imagePoints[c])[i][j];
+            double p[2], dpdX[6], dpdk[2*INTRINSICS];
+            projectPoint(prm.intrinsics[c], Xc[c], p, blk ? dpdX : NULL, dpdk);
+            const double e[2] = {p[0] - q.x, p[1] - q.y};
+            err += e[0]*e[0] + e[1]*e[1];
+            if (!blk)
+                continue;
+
+            // pose of the view; for the right camera, through R: d Xr = R*d Xl
+            double Jl[2*POSE_PARAMS];
+            if (c == 0)
+                poseJacobian(dpdX, RX, Jl);
+            else
+            {
+                double dpdXl[6];
+                for (int r = 0; r < 2; r++)
+                    for (int k = 0; k < 3; k++)
+                        dpdXl[r*3 + k] = dpdX[r*3]*prm.R[k] + dpdX[r*3 + 1]*prm.R[3 + k] + dpdX[r*3 + 2]*prm.R[6 + k];
+                poseJacobian(dpdXl, RX, Jl);
+            }
+
+            // global block, sparse: the intrinsics of this camera and R, T for the right one
+            int cols[INTRINSICS + POSE_PARAMS];
+            double Jg[2][INTRINSICS + POSE_PARAMS];
+            int nz = 0;
+            for (int m = 0; m < INTRINSICS; m++)
+            {
+                if (pb.freeIndex[c][m] < 0)
+                    continue;
+                cols[nz] = pb.freeIndex[c][m];
+                Jg[0][nz] = dpdk[m];
+                Jg[1][nz] = dpdk[INTRINSICS + m];
+                if (m == 1 && pb.tiedAspect[c])
+                {
+                    Jg[0][nz] += pb.aspect[c]*dpdk[0];
+                    Jg[1][nz] += pb.aspect[c]*dpdk[INTRINSICS];
+                }
+                nz++;
+            }
+            if (c == 1)
+            {
+                double RXl[3], Js[2*POSE_PARAMS];
+                multiply3(prm.R, Xc[0], RXl, 0);
+                poseJacobian(dpdX, RXl, Js);
+                for (int m = 0; m < POSE_PARAMS; m++, nz++)
+                {
+                    cols[nz] = pb.stereoIndex + m;
+                    Jg[0][nz] = Js[m];
+                    Jg[1][nz] = Js[POSE_PARAMS + m];
+                }
+            }
+
+            for (int a = 0; a < POSE_PARAMS; a++)
+            {
+                for (int b = 0; b < POSE_PARAMS; b++)
+                    blk->V[a*POSE_PARAMS + b] += Jl[a]*Jl[b] + Jl[POSE_PARAMS + a]*Jl[POSE_PARAMS + b];
+                blk->g[a] += Jl[a]*e[0] + Jl[POSE_PARAMS + a]*e[1];
+            }
+            for (int u = 0; u < nz; u++)
+            {
+                double* W = blk->W + cols[u]*POSE_PARAMS;
+                for (int a = 0; a < POSE_PARAMS; a++)
+                    W[a] += Jg[0][u]*Jl[a] + Jg[1][u]*Jl[POSE_PARAMS + a];
+                for (int v = 0; v < nz; v++)
+                    U[cols[u]*G + cols[v]] += Jg[0][u]*Jg[0][v] + Jg[1][u]*Jg[1][v];
+                gg[cols[u]] += Jg[0][u]*e[0] + Jg[1][u]*e[1];
+            }
+        }
+    }
+    return err;
+}
+
+static double totalError(const CalibProblem& pb, const CalibParams& prm)
+{
+    double err = 0;
+    #pragma omp parallel for reduction(+:err) schedule(static)
+    for (int i = 0; i < pb.views; i++)
+        err += viewTerms(pb, prm, i, NULL, NULL, NULL);
+    return err;
+}
+
+// Schur complement S = U - W V^-1 W' of the normal equations damped by 1 + lambda on the diagonal,
+// and b = -gg + W V^-1 gl; keeps V^-1 W' and V^-1 gl in the blocks. False if a damped V is singular.
+static bool schurComplement(const CalibProblem& pb, vector<ViewBlock>& blocks, const vector<double>& U,
+                            const vector<double>& gg, double lambda, vector<double>& S, vector<double>& b)
+{
+    const int G = pb.globals, n = pb.views;
+    S = U;
+    b.resize(G);
+    for (int k = 0; k < G; k++)
+    {
+        S[k*G + k] *= 1 + lambda;
+        b[k] = -gg[k];
+    }
+
+    // 1. Schur complement, view by view
+    bool ok = true;
+    #pragma omp parallel
+    {
+        vector<double> St(G*G + 1, 0.), bt(G + 1, 0.);
+        #pragma omp for schedule(static)
+        for (int i = 0; i < n; i++)
+        {
+            ViewBlock& blk = blocks[i];
+            double L[POSE_PARAMS*POSE_PARAMS];
+            memcpy(L, blk.V, sizeof(L));
+            for (int a = 0; a < POSE_PARAMS; a++)
+                L[a*POSE_PARAMS + a] *= 1 + lambda;
+            if (!cholesky(L, POSE_PARAMS))
+            {
+                #pragma omp atomic write
+                ok = false;
+                continue;
+            }
+            memcpy(blk.z, blk.g, sizeof(blk.z));
+            choleskySolve(L, POSE_PARAMS, blk.z);
+            for (int u = 0; u < G; u++)
+            {
+                double* y = blk.Y + u*POSE_PARAMS;
+                memcpy(y, blk.W + u*POSE_PARAMS, POSE_PARAMS*sizeof(double));
+                choleskySolve(L, POSE_PARAMS, y);
+            }
+            for (int u = 0; u < G; u++)
+            {
+                const double* w = blk.W + u*POSE_PARAMS;
+                for (int v = 0; v < G; v++)
+                {
+                    const double* y = blk.Y + v*POSE_PARAMS;
+                    double s = 0;
+                    for (int a = 0; a < POSE_PARAMS; a++)
+                        s += w[a]*y[a];
+                    St[u*G + v] += s;
+                }
+                double s = 0;
+                for (int a = 0; a < POSE_PARAMS; a++)
+                    s += w[a]*blk.z[a];
+                bt[u] += s;
+            }
+        }
+        #pragma omp critical
+        for (int k = 0; k < G*G; k++)
+            S[k] -= St[k];
+        #pragma omp critical
+        for (int k = 0; k < G; k++)
+            b[k] += bt[k];
+    }
+    return ok;
+}
+
+// Solves the normal equations damped by 1 + lambda on the diagonal, next = cur + step.
+// False if the damped system is not positive definite.
+static bool dampedStep(const CalibProblem& pb, vector<ViewBlock>& blocks, const vector<double>& U,
+                       const vector<double>& gg, double lambda, const CalibParams& cur, CalibParams& next,
+                       double& stepNorm)
+{
+    const int G = pb.globals, n = pb.views;
+    vector<double> S, b;
+    if (!schurComplement(pb, blocks, U, gg, lambda, S, b) || (G > 0 && !cholesky(&S[0], G)))
+        return false;
+
+    // 2. global step, then the step of every view
+    if (G > 0)
+        choleskySolve(&S[0], G, &b[0]);
+    const vector<double>& dg = b;
+    double sq = 0;
+    for (int k = 0; k < G; k++)
+        sq += dg[k]*dg[k];
+
+    next = cur;
+    for (int c = 0; c < pb.cameras; c++)
+    {
+        for (int m = 0; m < INTRINSICS; m++)
+        {
+            if (pb.freeIndex[c][m] >= 0)
+                next.intrinsics[c][m] += dg[pb.freeIndex[c][m]];
+        }
+        if (pb.tiedAspect[c])
+            next.intrinsics[c][0] = pb.aspect[c]*next.intrinsics[c][1];
+    }
+    if (pb.stereoIndex >= 0)
+    {
+        double dR[9];
+        rotationMatrix(&dg[pb.stereoIndex], dR);
+        multiply3(dR, cur.R, next.R);
+        for (int k = 0; k < 3; k++)
+            next.T[k] += dg[pb.stereoIndex + 3 + k];
+    }
+
+    #pragma omp parallel for reduction(+:sq) schedule(static)
+    for (int i = 0; i < n; i++)
+    {
+        const ViewBlock& blk = blocks[i];
+        double dl[POSE_PARAMS], dR[9];
+        for (int a = 0; a < POSE_PARAMS; a++)
+        {
+            double s = -blk.z[a];
+            for (int u = 0; u < G; u++)
+                s -= blk.Y[u*POSE_PARAMS + a]*dg[u];
+            dl[a] = s;
+            sq += s*s;
+        }
+        rotationMatrix(dl, dR);
+        multiply3(dR, &cur.poses[i*12], &next.poses[i*12]);
+        for (int k = 0; k < 3; k++)
+            next.poses[i*12 + 9 + k] += dl[3 + k];
+    }
+    stepNorm = sqrt(sq);
+    return true;
+}
+
+// norm of the parameters, to measure the relative change of a step
+static double paramNorm(const CalibProblem& pb, const CalibParams& prm)
+{
+    double sq = 0;
+    for (int c = 0; c < pb.cameras; c++)
+    {
+        for (int m = 0; m < INTRINSICS; m++)
+        {
+            if (pb.freeIndex[c][m] >= 0)
+                sq += prm.intrinsics[c][m]*prm.intrinsics[c][m];
+        }
+    }
+    if (pb.stereoIndex >= 0)
+        sq += 3 + prm.T[0]*prm.T[0] + prm.T[1]*prm.T[1] + prm.T[2]*prm.T[2];
+    for (int i = 0; i < pb.views; i++)
+    {
+        const double* t = &prm.poses[i*12 + 9];
+        sq += 3 + t[0]*t[0] + t[1]*t[1] + t[2]*t[2];
+    }
+    return sqrt(sq);
+}
+
+// normal equation terms of all the views at prm: the blocks of the views, U and gg of the global block
+static void normalEquations(const CalibProblem& pb, const CalibParams& prm, vector<ViewBlock>& blocks,
+                            vector<double>& U, vector<double>& gg)
+{
+    const int G = pb.globals;
+    blocks.resize(pb.views);
+    U.assign(G*G, 0.);
+    gg.assign(G, 0.);
+    #pragma omp parallel
+    {
+        vector<double> Ut(G*G + 1, 0.), gt(G + 1, 0.);
+        #pragma omp for schedule(static)
+        for (int i = 0; i < pb.views; i++)
+            viewTerms(pb, prm, i, &blocks[i], &Ut[0], &gt[0]);
+        #pragma omp critical
+        {
+            for (int k = 0; k < G*G; k++)
+                U[k] += Ut[k];
+            for (int k = 0; k < G; k++)
+                gg[k] += gt[k];
+        }
+    }
+}
+
+// Levenberg-Marquardt from prm. Returns the squared reprojection error.
+static double solveCalibration(const CalibProblem& pb, CalibParams& prm, const TermCriteria& criteria)
+{
+    const int maxIterations = criteria.type & TermCriteria::COUNT ? criteria.maxCount : 30;
+    const double epsilon = criteria.type & TermCriteria::EPS ? criteria.epsilon : DBL_EPSILON;
+    vector<ViewBlock> blocks;
+    vector<double> U, gg;
+    CalibParams next;
+
+    double err = totalError(pb, prm), lambda = 1e-3;
+    for (int it = 0; it < maxIterations; it++)
+    {
+        normalEquations(pb, prm, blocks, U, gg);
+
+        bool accepted = false;
+        double stepNorm = 0;
+        for (int tries = 0; tries < 10 && !accepted; tries++)
+        {
+            if (dampedStep(pb, blocks, U, gg, lambda, prm, next, stepNorm))
+            {
+                const double e = totalError(pb, next);
+                if (e < err)
+                {
+                    err = e;
+                    std::swap(prm.poses, next.poses);
+                    memcpy(prm.intrinsics, next.intrinsics, sizeof(prm.intrinsics));
+                    memcpy(prm.R, next.R, sizeof(prm.R));
+                    memcpy(prm.T, next.T, sizeof(prm.T));
+                    lambda = std::max(lambda/10, 1e-12);
+                    accepted = true;
+                    continue;
+                }
+            }
+            lambda *= 10;
+        }
+        if (!accepted || stepNorm < epsilon*paramNorm(pb, prm))
+            break;
+    }
+    return err;
+}
+
+//--------------------------------------------------
+// Initialization and results
+//--------------------------------------------------
+static void setIntrinsics(const Mat& cameraMatrix, const Mat& distCoeffs, int flags, double* k)
+{
+    Mat K, D;
+    cameraMatrix.convertTo(K, CV_64F);
+    k[0] = K.at<double>(0, 0);
+    k[1] = K.at<double>(1, 1);
+    k[2] = K.at<double>(0, 2);
+    k[3] = K.at<double>(1, 2);
+    fill(k + 4, k + INTRINSICS, 0.);
+    if (!distCoeffs.empty())
+    {
+        distCoeffs.reshape(1, (int)distCoeffs.total()).convertTo(D, CV_64F);
+        for (int m = 0; m < 5 && m < D.rows; m++)
+            k[4 + m] = D.at<double>(m);
+    }
+    if (flags & CV_CALIB_ZERO_TANGENT_DIST)
+        k[6] = k[7] = 0;
+}
+
+static void getIntrinsics(const double* k, int coeffs, Mat& cameraMatrix, Mat& distCoeffs)
+{
+    cameraMatrix = Mat::eye(3, 3, CV_64F);
+    cameraMatrix.at<double>(0, 0) = k[0];
+    cameraMatrix.at<double>(1, 1) = k[1];
+    cameraMatrix.at<double>(0, 2) = k[2];
+    cameraMatrix.at<double>(1, 2) = k[3];
+    distCoeffs.create(coeffs, 1, CV_64F);
+    for (int m = 0; m < coeffs; m++)
+        distCoeffs.at<double>(m) = k[4 + m];
+}
+
+static void cameraMatrixOf(const double* k, double* K)
+{
+    const double m[9] = {k[0], 0, k[2], 0, k[1], k[3], 0, 0, 1};
+    memcpy(K, m, sizeof(m));
+}
+
+static void poseFromVectors(const Mat& rvec, const Mat& tvec, double* pose)
+{
+    Mat R, t;
+    Rodrigues(rvec, R);
+    R.convertTo(R, CV_64F);
+    tvec.convertTo(t, CV_64F);
+    for (int k = 0; k < 9; k++)
+        pose[k] = R.at<double>(k/3, k%3);
+    for (int k = 0; k < 3; k++)
+        pose[9 + k] = t.at<double>(k);
+}
+
+static void initialPoses(const vector<vector<Point3f> >& objectPoints, const vector<vector<Point2f> >& imagePoints,
+                         const double* k, vector<double>& poses)
+{
+    const int n = (int)objectPoints.size();
+    Mat K, D;
+    getIntrinsics(k, 5, K, D);
+    poses.resize(n*12);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < n; i++)
+    {
+        Mat rvec, tvec;
+        solvePnP(objectPoints[i], imagePoints[i], K, D, rvec, tvec);
+        poseFromVectors(rvec, tvec, &poses[i*12]);
+    }
+}
+
+static int countPoints(const vector<vector<Point3f> >& objectPoints, const vector<vector<Point2f> >& imagePoints)
+{
+    CV_Assert(!objectPoints.empty() && objectPoints.size() == imagePoints.size());
+    int n = 0;
+    for (size_t i = 0; i < objectPoints.size(); i++)
+    {
+        CV_Assert(objectPoints[i].size() == imagePoints[i].size() && objectPoints[i].size() >= 4);
+        n += (int)objectPoints[i].size();
+    }
+    return n;
+}
+
+static void initProblem(CalibProblem& pb, const vector<vector<Point3f> >& objectPoints, int cameras)
+{
+    pb.objectPoints = &objectPoints;
+    pb.imagePoints[0] = pb.imagePoints[1] = NULL;
+    pb.cameras = cameras;
+    pb.views = (int)objectPoints.size();
+    pb.points = 0;
+    pb.stereoIndex = -1;
+    pb.globals = 0;
+}
+
+double calibrateCameraSparse(const vector<vector<Point3f> >& objectPoints, const vector<vector<Point2f> >& imagePoints,
+                             Size imageSize, Mat& cameraMatrix, Mat& distCoeffs,
+                             vector<Mat>& rvecs, vector<Mat>& tvecs, int flags, TermCriteria criteria)
+{
+    CV_Assert(!(flags & CV_CALIB_RATIONAL_MODEL));
+    const int coeffs = distCoeffs.total() == 4 ? 4 : 5;
+
+    CalibProblem pb;
+    initProblem(pb, objectPoints, 1);
+    pb.imagePoints[0] = &imagePoints;
+    pb.points = countPoints(objectPoints, imagePoints);
+
+    // as calibrateCamera: intrinsics from the homographies of the views unless guessed,
+    // then the pose of every view
+    CalibParams prm;
+    if (flags & CV_CALIB_USE_INTRINSIC_GUESS)
+        setIntrinsics(cameraMatrix, distCoeffs, flags, prm.intrinsics[0]);
+    else
+    {
+        double aspectRatio = 0;
+        if (flags & CV_CALIB_FIX_ASPECT_RATIO)
+        {
+            Mat K;
+            cameraMatrix.convertTo(K, CV_64F);
+            aspectRatio = K.at<double>(0, 0)/K.at<double>(1, 1);
+        }
+        setIntrinsics(initCameraMatrix2D(objectPoints, imagePoints, imageSize, aspectRatio), Mat(), flags,
+                      prm.intrinsics[0]);
+    }
+    setupCamera(pb, prm, 0, flags, coeffs);
+    initialPoses(objectPoints, imagePoints, prm.intrinsics[0], prm.poses);
+
+    const double err = solveCalibration(pb, prm, criteria);
+
+    getIntrinsics(prm.intrinsics[0], coeffs, cameraMatrix, distCoeffs);
+    rvecs.resize(pb.views);
+    tvecs.resize(pb.views);
+    for (int i = 0; i < pb.views; i++)
+    {
+        Mat R(3, 3, CV_64F, &prm.poses[i*12]);
+        Rodrigues(R, rvecs[i]);
+        Mat(3, 1, CV_64F, &prm.poses[i*12 + 9]).copyTo(tvecs[i]);
+    }
+    return sqrt(err/pb.points);
+}
+
+bool intrinsicsCovariance(const vector<vector<Point3f> >& objectPoints, const vector<vector<Point2f> >& imagePoints,
+                          const Mat& cameraMatrix, const Mat& distCoeffs,
+                          const vector<Mat>& rvecs, const vector<Mat>& tvecs, Mat& covariance, int flags)
+{
+    CV_Assert(rvecs.size() == objectPoints.size() && tvecs.size() == objectPoints.size());
+    const int coeffs = distCoeffs.total() == 4 ? 4 : 5;
+    covariance = Mat::zeros(INTRINSICS, INTRINSICS, CV_64F);
+
+    CalibProblem pb;
+    initProblem(pb, objectPoints, 1);
+    pb.imagePoints[0] = &imagePoints;
+    pb.points = countPoints(objectPoints, imagePoints);
+    CalibParams prm;
+    setIntrinsics(cameraMatrix, distCoeffs, flags, prm.intrinsics[0]);
+    setupCamera(pb, prm, 0, flags, coeffs);
+    prm.poses.resize(pb.views*12);
+    for (int i = 0; i < pb.views; i++)
+        poseFromVectors(rvecs[i], tvecs[i], &prm.poses[i*12]);
+
+    // sigma^2 S^-1, S the undamped Schur complement, column by column from its Cholesky factor
+    const int G = pb.globals, unknowns = G + POSE_PARAMS*pb.views;
+    if (G == 0)
+        return true;
+    if (2*pb.points <= unknowns)
+        return false;
+    vector<ViewBlock> blocks;
+    vector<double> U, gg, S, b;
+    normalEquations(pb, prm, blocks, U, gg);
+    if (!schurComplement(pb, blocks, U, gg, 0, S, b) || !cholesky(&S[0], G))
+        return false;
+    const double sigma2 = totalError(pb, prm)/(2*pb.points - unknowns);
+    vector<double> C(G*G, 0.);
+    for (int k = 0; k < G; k++)
+    {
+        double* col = &C[k*G];      // symmetric: the column is the row
+        col[k] = 1;
+        choleskySolve(&S[0], G, col);
+    }
+
+    // back to the intrinsics; fx = aspect*fy has the column of fy
+    int column[INTRINSICS];
+    double scale[INTRINSICS];
+    for (int m = 0; m < INTRINSICS; m++)
+    {
+        column[m] = pb.freeIndex[0][m];
+        scale[m] = 1;
+    }
+    if (pb.tiedAspect[0])
+    {
+        column[0] = pb.freeIndex[0][1];
+        scale[0] = pb.aspect[0];
+    }
+    for (int m = 0; m < INTRINSICS; m++)
+        for (int n = 0; n < INTRINSICS; n++)
+            if (column[m] >= 0 && column[n] >= 0)
+                covariance.at<double>(m, n) = sigma2*scale[m]*scale[n]*C[column[m]*G + column[n]];
+    return true;
+}
+
+double stereoCalibrateSparse(const vector<vector<Point3f> >& objectPoints,
+                             const vector<vector<Point2f> >& imagePoints1, const vector<vector<Point2f> >& imagePoints2,
+                             Mat& cameraMatrix1, Mat& distCoeffs1, Mat& cameraMatrix2, Mat& distCoeffs2,
+                             Size imageSize, Mat& R, Mat& T, Mat& E, Mat& F, TermCriteria criteria, int flags)
+{
+    CV_Assert(!(flags & CV_CALIB_RATIONAL_MODEL));
+    Mat* cameraMatrix[2] = {&cameraMatrix1, &cameraMatrix2};
+    Mat* distCoeffs[2] = {&distCoeffs1, &distCoeffs2};
+    const vector<vector<Point2f> >* imagePoints[2] = {&imagePoints1, &imagePoints2};
+
+    CalibProblem pb;
+    initProblem(pb, objectPoints, 2);
+    pb.points = countPoints(objectPoints, imagePoints1);
+    countPoints(objectPoints, imagePoints2);
+
+    // as stereoCalibrate: each camera is calibrated alone unless its intrinsics are given
+    CalibParams prm;
+    int coeffs[2];
+    for (int c = 0; c < 2; c++)
+    {
+        pb.imagePoints[c] = imagePoints[c];
+        if (!(flags & (CV_CALIB_FIX_INTRINSIC | CV_CALIB_USE_INTRINSIC_GUESS)))
+        {
+            vector<Mat> rvecs, tvecs;
+            calibrateCameraSparse(objectPoints, *imagePoints[c], imageSize, *cameraMatrix[c], *distCoeffs[c],
+                                  rvecs, tvecs, flags, criteria);
+        }
+        coeffs[c] = distCoeffs[c]->total() == 4 ? 4 : 5;
+        setIntrinsics(*cameraMatrix[c], *distCoeffs[c], flags, prm.intrinsics[c]);
+        setupCamera(pb, prm, c, flags, coeffs[c]);
+    }
+    pb.stereoIndex = pb.globals;
+    pb.globals += POSE_PARAMS;
+
+    // poses of the left camera, and the median of the relative poses of the views for R, T
+    vector<double> right;
+    initialPoses(objectPoints, imagePoints1, prm.intrinsics[0], prm.poses);
+    initialPoses(objectPoints, imagePoints2, prm.intrinsics[1], right);
+    vector<double> relative[6];
+    for (int i = 0; i < pb.views; i++)
+    {
+        const double* l = &prm.poses[i*12];
+        const double* r = &right[i*12];
+        double Rl[9], Rrel[9], t[3];
+        for (int a = 0; a < 3; a++)         // Rl = l'
+            for (int b = 0; b < 3; b++)
+                Rl[a*3 + b] = l[b*3 + a];
+        multiply3(r, Rl, Rrel);
+        multiply3(Rrel, l + 9, t, 0);
+        Mat om;
+        Rodrigues(Mat(3, 3, CV_64F, Rrel), om);
+        for (int k = 0; k < 3; k++)
+        {
+            relative[k].push_back(om.at<double>(k));
+            relative[3 + k].push_back(r[9 + k] - t[k]);
+        }
+    }
+    double om[3];
+    for (int k = 0; k < 6; k++)
+    {
+        vector<double>& v = relative[k];
+        nth_element(v.begin(), v.begin() + v.size()/2, v.end());
+        (k < 3 ? om[k] : prm.T[k - 3]) = v[v.size()/2];
+    }
+    rotationMatrix(om, prm.R);
+
+    const double err = solveCalibration(pb, prm, criteria);
+
+    for (int c = 0; c < 2; c++)
+        getIntrinsics(prm.intrinsics[c], coeffs[c], *cameraMatrix[c], *distCoeffs[c]);
+    Mat(3, 3, CV_64F, prm.R).copyTo(R);
+    Mat(3, 1, CV_64F, prm.T).copyTo(T);
+
+    // E = [T]x R, F = K2^-T E K1^-1 scaled to F(2, 2) = 1
+    const double Tx[9] = {0, -prm.T[2], prm.T[1], prm.T[2], 0, -prm.T[0], -prm.T[1], prm.T[0], 0};
+    double e[9], K1[9], K2[9], iK1[9], iK2[9], iK2t[9], tmp[9], f[9];
+    multiply3(Tx, prm.R, e);
+    cameraMatrixOf(prm.intrinsics[0], K1);
+    cameraMatrixOf(prm.intrinsics[1], K2);
+    invert3(K1, iK1);
+    invert3(K2, iK2);
+    for (int a = 0; a < 3; a++)
+        for (int b = 0; b < 3; b++)
+            iK2t[a*3 + b] = iK2[b*3 + a];
+    multiply3(iK2t, e, tmp);
+    multiply3(tmp, iK1, f);
+    if (fabs(f[8]) > 0)
+    {
+        for (int k = 0; k < 9; k++)
+            f[k] /= f[8];
+    }
+    Mat(3, 3, CV_64F, e).copyTo(E);
+    Mat(3, 3, CV_64F, f).copyTo(F);
+
+    // per point and camera, as stereoCalibrate
+    return sqrt(err/(2*pb.points));
+}
@@ -0,0 +1,50 @@
+/// calib_solver.hpp
+/// Camera and stereo calibration for large sets of views, as drop-in replacements of
+/// calibrateCamera and stereoCalibrate(same arguments, model and flags).
+///
+/// The Levenberg-Marquardt normal equations are solved with the Schur complement over the
+/// 6x6 pose blocks of the views, so time and memory grow linearly with the number of views,
+/// and the Jacobians of the views are evaluated in parallel(OpenMP).
+///
+/// Supported flags: CV_CALIB_USE_INTRINSIC_GUESS, CV_CALIB_FIX_INTRINSIC, CV_CALIB_FIX_ASPECT_RATIO,
+/// CV_CALIB_FIX_PRINCIPAL_POINT, CV_CALIB_FIX_FOCAL_LENGTH, CV_CALIB_ZERO_TANGENT_DIST and
+/// CV_CALIB_FIX_K1..3. The rational model(8 coefficients) is not supported.
+
+#ifndef CALIB_SOLVER_HPP
+#define CALIB_SOLVER_HPP
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include <float.h>
+#include <vector>
+
+/// As calibrateCamera: returns the RMS reprojection error.
+double calibrateCameraSparse(const std::vector<std::vector<cv::Point3f> >& objectPoints,
+                             const std::vector<std::vector<cv::Point2f> >& imagePoints,
+                             cv::Size imageSize, cv::Mat& cameraMatrix, cv::Mat& distCoeffs,
+                             std::vector<cv::Mat>& rvecs, std::vector<cv::Mat>& tvecs, int flags = 0,
+                             cv::TermCriteria criteria = cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 30, DBL_EPSILON));
+
+/// Covariance(9x9) of the intrinsics fx, fy, cx, cy, k1, k2, p1, p2, k3 estimated by a calibration
+/// of one camera with these flags: the normal equations at the solution, the poses of the views
+/// eliminated, inverted and scaled by the variance of the residuals. The square roots of its
+/// diagonal are stdDeviationsIntrinsics of calibrateCamera in OpenCV >= 3. Fixed intrinsics have
+/// 0. False if the views do not determine the intrinsics.
+bool intrinsicsCovariance(const std::vector<std::vector<cv::Point3f> >& objectPoints,
+                          const std::vector<std::vector<cv::Point2f> >& imagePoints,
+                          const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs,
+                          const std::vector<cv::Mat>& rvecs, const std::vector<cv::Mat>& tvecs,
+                          cv::Mat& covariance, int flags = 0);
+
+/// As stereoCalibrate: returns the RMS reprojection error of both cameras.
+double stereoCalibrateSparse(const std::vector<std::vector<cv::Point3f> >& objectPoints,
+                             const std::vector<std::vector<cv::Point2f> >& imagePoints1,
+                             const std::vector<std::vector<cv::Point2f> >& imagePoints2,
+                             cv::Mat& cameraMatrix1, cv::Mat& distCoeffs1,
+                             cv::Mat& cameraMatrix2, cv::Mat& distCoeffs2,
+                             cv::Size imageSize, cv::Mat& R, cv::Mat& T, cv::Mat& E, cv::Mat& F,
+                             cv::TermCriteria criteria = cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 30, 1e-6),
+                             int flags = CV_CALIB_FIX_INTRINSIC);
+
+#endif
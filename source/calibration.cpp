@@ -0,0 +1,431 @@
+/// calibration.cpp
+/// Calibration, rectification and calibration files, shared by the tools.
+///
+/// Ref:
+///     opencv/sample/cpp/calib3d/camera_calibration/camera_calibration.cpp;
+///     opencv/samples/cpp/stereo_calib.cpp;
+///     <Learning OpenCV> Ch12
+
+#include "calibration.hpp"
+#include "calib_solver.hpp"
+#include "corner_refine.hpp"
+#include "trace.hpp"
+
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+using namespace cv;
+using namespace std;
+
+CameraParams::CameraParams() :
+    flags(0), rms(0), avgError(0)
+{
+}
+
+StereoParams::StereoParams() :
+    rms(0)
+{
+}
+
+bool readStringList(const string& filename, vector<string>& l)
+{
+    l.clear();
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened())
+        return false;
+    FileNode n = fs.getFirstTopLevelNode();
+    if (n.type() != FileNode::SEQ)
+        return false;
+    FileNodeIterator it = n.begin(), it_end = n.end();
+    for ( ; it != it_end; it++)
+        l.push_back((string)*it);
+    return true;
+}
+
+// calculate the coordinates of board corners in world coord system
+void calcBoardCornerPositions(Size boardSize, float squareSize, vector<Point3f>& corners)
+{
+    corners.clear();
+    for (int i = 0; i < boardSize.height; i++)
+        for (int j = 0; j < boardSize.width; j++)
+            corners.push_back(Point3f(i*squareSize, j*squareSize, 0));
+}
+
+bool findBoardCorners(const Mat& image, Size boardSize, vector<Point2f>& corners)
+{
+    bool found;
+    {
+        TRACE_SCOPE("findChessboardCorners");
+        found = findChessboardCorners(image, boardSize, corners, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_NORMALIZE_IMAGE);
+    }
+    if (!found)
+        return false;
+
+    // improve the found corners' coordinate accuracy
+    Mat imageGray = image;
+    if (image.channels() == 3)
+        cvtColor(image, imageGray, CV_BGR2GRAY);
+    refineCorners(imageGray, corners, Size(11, 11), Size(-1, -1),
+                  TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 30, 0.1));
+    return true;
+}
+
+bool calibrateSingleCamera(const vector<vector<Point3f> >& objectPoints, const vector<vector<Point2f> >& imagePoints,
+                           Size imageSize, int flags, int solver, CameraParams& params)
+{
+    if (!(flags & CV_CALIB_USE_INTRINSIC_GUESS) || params.cameraMatrix.empty())
+    {
+        params.cameraMatrix = Mat::eye(3, 3, CV_64F);   // fx/fy = 1 with CV_CALIB_FIX_ASPECT_RATIO
+        params.distCoeffs = Mat::zeros(5, 1, CV_64F);
+    }
+    params.imageSize = imageSize;
+    params.flags = flags;
+
+    // find intrinsic and extrinsic camera parameters
+    {
+        TRACE_SCOPE(solver == SOLVER_SPARSE ? "calibrateCameraSparse" : "calibrateCamera");
+        if (solver == SOLVER_SPARSE)
+            params.rms = calibrateCameraSparse(objectPoints, imagePoints, imageSize,
+                    params.cameraMatrix, params.distCoeffs, params.rvecs, params.tvecs, flags);
+        else
+            params.rms = calibrateCamera(objectPoints, imagePoints, imageSize,
+                    params.cameraMatrix, params.distCoeffs, params.rvecs, params.tvecs, flags);
+    }
+
+    params.avgError = computeReprojectionErrors(objectPoints, imagePoints, params.rvecs, params.tvecs,
+            params.cameraMatrix, params.distCoeffs, params.perViewErrors);
+    return checkRange(params.cameraMatrix) && checkRange(params.distCoeffs);
+}
+
+double computeReprojectionErrors(const vector<vector<Point3f> >& objectPoints,
+                                 const vector<vector<Point2f> >& imagePoints,
+                                 const vector<Mat>& rvecs, const vector<Mat>& tvecs,
+                                 const Mat& cameraMatrix, const Mat& distCoeffs,
+                                 vector<float>& perViewErrors)
+{
+    vector<Point2f> imagePointsProjected;
+    int totalPoints = 0;
+    double totalErr = 0, err;
+    perViewErrors.resize(objectPoints.size());
+
+    for (int i = 0; i < (int)objectPoints.size(); i++)
+    {
+        // project 3D points to an image plane
+        projectPoints(objectPoints[i], rvecs[i], tvecs[i], cameraMatrix, distCoeffs, imagePointsProjected);
+        // calculate an absolute difference norm
+        err = norm(Mat(imagePoints[i]), Mat(imagePointsProjected), NORM_L2);
+
+        int n = (int)objectPoints[i].size();
+        perViewErrors[i] = (float)sqrt(err*err/n);
+        totalErr += err*err;
+        totalPoints += n;
+    }
+
+    return totalPoints ? sqrt(totalErr/totalPoints) : 0;
+}
+
+bool calibrateStereoPair(const vector<vector<Point3f> >& objectPoints,
+                         const vector<vector<Point2f> >& imagePoints1, const vector<vector<Point2f> >& imagePoints2,
+                         Size imageSize, int flags, int solver, StereoParams& params)
+{
+    for (int k = 0; k < 2; k++)
+        if (params.cameraMatrix[k].empty())
+            params.cameraMatrix[k] = Mat::eye(3, 3, CV_64F);
+    params.imageSize = imageSize;
+
+    const TermCriteria criteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 100, 1e-6);
+    {
+        TRACE_SCOPE(solver == SOLVER_SPARSE ? "stereoCalibrateSparse" : "stereoCalibrate");
+        if (solver == SOLVER_SPARSE)
+            params.rms = stereoCalibrateSparse(objectPoints, imagePoints1, imagePoints2,
+                    params.cameraMatrix[0], params.distCoeffs[0], params.cameraMatrix[1], params.distCoeffs[1],
+                    imageSize, params.R, params.T, params.E, params.F, criteria, flags);
+        else
+            params.rms = stereoCalibrate(objectPoints, imagePoints1, imagePoints2,
+                    params.cameraMatrix[0], params.distCoeffs[0], params.cameraMatrix[1], params.distCoeffs[1],
+                    imageSize, params.R, params.T, params.E, params.F, criteria, flags);
+    }
+
+    // a new calibration, the rectification of the old one does not hold
+    params.R1.release();
+    params.R2.release();
+    params.P1.release();
+    params.P2.release();
+    params.Q.release();
+    return checkRange(params.R) && checkRange(params.T);
+}
+
+double epipolarError(const vector<vector<Point2f> >& imagePoints1, const vector<vector<Point2f> >& imagePoints2,
+                     const StereoParams& params)
+{
+    // because the output fundamental matrix implicitly includes all the output information,
+    // we can check the quality of calibration using the epipolar geometry constraint:
+    // m2^T*F*m1=0
+    const vector<vector<Point2f> >* imagePoints[2] = {&imagePoints1, &imagePoints2};
+    double err = 0;
+    int npoints = 0;
+    vector<Vec3f> lines[2];
+    for (size_t i = 0; i < imagePoints1.size(); i++)
+    {
+        int npt = (int)imagePoints1[i].size();
+        Mat imgpt[2];
+        for (int k = 0; k < 2; k++)
+        {
+            imgpt[k] = Mat((*imagePoints[k])[i]);
+            undistortPoints(imgpt[k], imgpt[k], params.cameraMatrix[k], params.distCoeffs[k], Mat(),
+                            params.cameraMatrix[k]);
+            computeCorrespondEpilines(imgpt[k], k+1, params.F, lines[k]);
+        }
+        for (int j = 0; j < npt; j++)
+        {
+            double errij = fabs(imagePoints1[i][j].x*lines[1][j][0] +
+                                imagePoints1[i][j].y*lines[1][j][1] + lines[1][j][2]) +
+                           fabs(imagePoints2[i][j].x*lines[0][j][0] +
+                                imagePoints2[i][j].y*lines[0][j][1] + lines[0][j][2]);
+            err += errij;
+        }
+        npoints += npt;
+    }
+    return npoints ? err/npoints : 0;
+}
+
+void rectifyStereoPair(StereoParams& p, double alpha)
+{
+    TRACE_SCOPE("stereoRectify");
+    stereoRectify(p.cameraMatrix[0], p.distCoeffs[0], p.cameraMatrix[1], p.distCoeffs[1],
+                  p.imageSize, p.R, p.T, p.R1, p.R2, p.P1, p.P2, p.Q,
+                  CALIB_ZERO_DISPARITY, alpha, p.imageSize, &p.validRoi[0], &p.validRoi[1]);
+}
+
+void computeRectifyMaps(const StereoParams& p, Size imageSize, Mat map[2][2])
+{
+    TRACE_SCOPE("initUndistortRectifyMap");
+    CV_Assert(!p.R1.empty() && !p.P1.empty() && "rectifyStereoPair or loadStereoParams first");
+    initUndistortRectifyMap(p.cameraMatrix[0], p.distCoeffs[0], p.R1, p.P1,
+                            imageSize, CV_16SC2, map[0][0], map[0][1]);
+    initUndistortRectifyMap(p.cameraMatrix[1], p.distCoeffs[1], p.R2, p.P2,
+                            imageSize, CV_16SC2, map[1][0], map[1][1]);
+}
+
+Mat resolutionTransform(Size calibrated, Size size, bool* crop)
+{
+    double sx = (double)size.width/calibrated.width, sy = (double)size.height/calibrated.height;
+    double ox = 0, oy = 0;
+    const bool cropped = fabs(sx - sy) > 1e-3*max(sx, sy);
+    if (cropped)
+    {
+        sy = sx;
+        oy = (size.height - sy*calibrated.height)/2;
+    }
+    if (crop)
+        *crop = cropped;
+    // pixel centers: x' + 0.5 = sx*(x + 0.5) + ox
+    Mat S = Mat::eye(3, 3, CV_64F);
+    S.at<double>(0, 0) = sx;
+    S.at<double>(1, 1) = sy;
+    S.at<double>(0, 2) = 0.5*sx - 0.5 + ox;
+    S.at<double>(1, 2) = 0.5*sy - 0.5 + oy;
+    return S;
+}
+
+void scaleCameraParams(const CameraParams& src, Size size, CameraParams& dst)
+{
+    dst = src;
+    if (src.imageSize == Size() || src.imageSize == size)
+        return;
+    const Mat S = resolutionTransform(src.imageSize, size);
+    Mat K;
+    src.cameraMatrix.convertTo(K, CV_64F);
+    dst.cameraMatrix = S*K;
+    dst.imageSize = size;
+}
+
+void scaleStereoParams(const StereoParams& src, Size size, StereoParams& dst)
+{
+    dst = src;
+    if (src.imageSize == Size() || src.imageSize == size)
+        return;
+    const Mat S = resolutionTransform(src.imageSize, size), Si = S.inv();
+    const double sx = S.at<double>(0, 0), sy = S.at<double>(1, 1);
+    for (int k = 0; k < 2; k++)
+    {
+        Mat K;
+        src.cameraMatrix[k].convertTo(K, CV_64F);
+        dst.cameraMatrix[k] = S*K;
+    }
+    if (!src.F.empty())
+    {
+        // x2'Fx1 = 0 for the pixels x = Si*x' of the calibrated size
+        Mat F;
+        src.F.convertTo(F, CV_64F);
+        dst.F = Si.t()*F*Si;
+    }
+    dst.imageSize = size;
+    if (src.P1.empty() || src.P2.empty())
+        return;
+
+    Mat P[2];
+    src.P1.convertTo(P[0], CV_64F);
+    src.P2.convertTo(P[1], CV_64F);
+    dst.P1 = S*P[0];
+    dst.P2 = S*P[1];
+    if (!src.Q.empty())
+    {
+        // Q reprojects(x, y, d, 1) of the rectified images of the calibrated size: x = (x' - t)/s,
+        // the disparity along the baseline, the rows of a vertical pair
+        const bool vertical = fabs(P[1].at<double>(1, 3)) > fabs(P[1].at<double>(0, 3));
+        Mat A = Mat::eye(4, 4, CV_64F), Q;
+        A.at<double>(0, 0) = 1/sx;
+        A.at<double>(0, 3) = -S.at<double>(0, 2)/sx;
+        A.at<double>(1, 1) = 1/sy;
+        A.at<double>(1, 3) = -S.at<double>(1, 2)/sy;
+        A.at<double>(2, 2) = 1/(vertical ? sy : sx);
+        src.Q.convertTo(Q, CV_64F);
+        dst.Q = Q*A;
+    }
+
+    // pixel edges: x' = sx*x + ox
+    const double ox = S.at<double>(0, 2) + 0.5 - 0.5*sx, oy = S.at<double>(1, 2) + 0.5 - 0.5*sy;
+    for (int k = 0; k < 2; k++)
+    {
+        const Rect& r = src.validRoi[k];
+        dst.validRoi[k] = Rect(cvRound(r.x*sx + ox), cvRound(r.y*sy + oy), cvRound(r.width*sx), cvRound(r.height*sy))
+                          & Rect(0, 0, size.width, size.height);
+    }
+}
+
+static void timeString(char* buf, size_t size)
+{
+    time_t tm;
+    time(&tm);
+    struct tm *t2 = localtime(&tm);
+    strftime(buf, size - 1, "%c", t2);
+}
+
+bool saveCameraParams(const string& filename, const CameraParams& p, Size boardSize, float squareSize)
+{
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened())
+        return false;
+
+    char buf[1024];
+    timeString(buf, sizeof(buf));
+    fs << "calibration_Time" << buf;
+    fs << "numberOfGoodFrames" << (int)p.rvecs.size();
+    fs << "image_Width" << p.imageSize.width;
+    fs << "image_Height" << p.imageSize.height;
+    fs << "board_Width" << boardSize.width;
+    fs << "board_Height" << boardSize.height;
+    fs << "square_Size" << squareSize;
+
+    if (p.flags)
+    {
+        sprintf(buf, "flags: %s%s%s%s",
+                p.flags & CV_CALIB_USE_INTRINSIC_GUESS ? "+use_intrinsic_guess" : "",
+                p.flags & CV_CALIB_FIX_ASPECT_RATIO ? "+fix_aspectRatio" : "",
+                p.flags & CV_CALIB_FIX_PRINCIPAL_POINT ? "+fix_principal_point" : "",
+                p.flags & CV_CALIB_ZERO_TANGENT_DIST ? "+zero_tagent_dist" : "");
+        cvWriteComment(*fs, buf, 0);
+    }
+    fs << "flagValue" << p.flags;
+
+    fs << "cameraMatrix" << p.cameraMatrix;
+    fs << "distCoeffs" << p.distCoeffs;
+    fs << "Avg_Reprojection_Errors" << p.avgError;
+    return true;
+}
+
+bool loadCameraParams(const string& filename, Mat& cameraMatrix, Mat& distCoeffs)
+{
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened())
+        return false;
+    fs["cameraMatrix"] >> cameraMatrix;
+    fs["distCoeffs"]   >> distCoeffs;
+    return !cameraMatrix.empty();
+}
+
+bool loadCameraParams(const string& filename, CameraParams& p)
+{
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened())
+        return false;
+    p.imageSize = Size((int)fs["image_Width"], (int)fs["image_Height"]);
+    p.flags = (int)fs["flagValue"];
+    p.avgError = (double)fs["Avg_Reprojection_Errors"];
+    fs["cameraMatrix"] >> p.cameraMatrix;
+    fs["distCoeffs"]   >> p.distCoeffs;
+    return !p.cameraMatrix.empty();
+}
+
+bool saveStereoParams(const string& filename, const StereoParams& p)
+{
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened())
+        return false;
+
+    char buf[1024];
+    timeString(buf, sizeof(buf));
+    fs << "calibration_Time" << buf;
+    fs << "image_Width" << p.imageSize.width;
+    fs << "image_Height" << p.imageSize.height;
+
+    cvWriteComment(*fs, "Intrinsic params:\n", 0);
+    fs << "cameraMatrix1" << p.cameraMatrix[0] << "distCoeffs1" << p.distCoeffs[0]
+       << "cameraMatrix2" << p.cameraMatrix[1] << "distCoeffs2" << p.distCoeffs[1];
+    cvWriteComment(*fs, "Extrinsic params:\n", 0);
+    fs << "R" << p.R << "T" << p.T << "E" << p.E << "F" << p.F;
+    fs << "RMS" << p.rms;
+
+    if (!p.R1.empty())
+    {
+        cvWriteComment(*fs, "\nRectification params:\n", 0);
+        fs << "R1" << p.R1 << "R2" << p.R2
+           << "P1" << p.P1 << "P2" << p.P2 << "Q" << p.Q;
+    }
+    return true;
+}
+
+bool loadStereoParams(const string& filename, StereoParams& p)
+{
+    FileStorage fs(filename, FileStorage::READ);
+    if (!fs.isOpened())
+        return false;
+
+    // files of older versions have no image size
+    p.imageSize = Size((int)fs["image_Width"], (int)fs["image_Height"]);
+    fs["cameraMatrix1"] >> p.cameraMatrix[0];
+    fs["distCoeffs1"]   >> p.distCoeffs[0];
+    fs["cameraMatrix2"] >> p.cameraMatrix[1];
+    fs["distCoeffs2"]   >> p.distCoeffs[1];
+    fs["R"] >> p.R;
+    fs["T"] >> p.T;
+    fs["E"] >> p.E;
+    fs["F"] >> p.F;
+    p.rms = (double)fs["RMS"];
+    fs["R1"] >> p.R1;
+    fs["R2"] >> p.R2;
+    fs["P1"] >> p.P1;
+    fs["P2"] >> p.P2;
+    fs["Q"]  >> p.Q;
+    return !p.cameraMatrix[0].empty() && !p.cameraMatrix[1].empty();
+}
+
+bool loadRectifyMaps(const string& filename, Size imageSize, Mat map[2][2], Mat P[2], Mat& Q)
+{
+    StereoParams stored, p;
+    if (!loadStereoParams(filename, stored) || stored.R1.empty() || stored.R2.empty() ||
+        stored.P1.empty() || stored.P2.empty())
+        return false;
+    scaleStereoParams(stored, imageSize, p);
+    computeRectifyMaps(p, imageSize, map);
+    P[0] = p.P1;
+    P[1] = p.P2;
+    Q = p.Q;
+    return true;
+}
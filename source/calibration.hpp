@@ -0,0 +1,122 @@
+/// calibration.hpp
+/// Chessboard calibration of one camera or of a stereo pair, rectification, and the files of
+/// camera_calib(calib_result_*.xml) and stereo_calib(stereo_params.xml).
+/// camera_calib and stereo_calib are front-ends of these functions; a program linking the
+/// stereo library calls them directly instead of running the tools and reading their files.
+
+#ifndef CALIBRATION_HPP
+#define CALIBRATION_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include <string>
+#include <vector>
+
+enum CalibSolver
+{
+    SOLVER_OPENCV = 0,  // calibrateCamera, stereoCalibrate
+    SOLVER_SPARSE = 1   // calib_solver.hpp, for large sets of views
+};
+
+/// Result of camera_calib.
+struct CameraParams
+{
+    cv::Size imageSize;
+    cv::Mat cameraMatrix;
+    cv::Mat distCoeffs;
+    int flags;                          // CV_CALIB_* given to the solver
+    double rms;                         // reported by the solver
+    double avgError;                    // RMS reprojection error over all corners
+    std::vector<cv::Mat> rvecs, tvecs;  // pose of the board in every view
+    std::vector<float> perViewErrors;   // RMS reprojection error of every view
+
+    CameraParams();
+};
+
+/// Result of stereo_calib. The rectification is empty until rectifyStereoPair.
+struct StereoParams
+{
+    cv::Size imageSize;
+    cv::Mat cameraMatrix[2], distCoeffs[2];
+    cv::Mat R, T, E, F;                 // the right camera relative to the left one
+    double rms;
+    cv::Mat R1, R2, P1, P2, Q;          // rectification, see stereoRectify
+    cv::Rect validRoi[2];
+
+    StereoParams();
+};
+
+/// Reads the sequence of strings of an xml/yaml file, e.g. an image list.
+bool readStringList(const std::string& filename, std::vector<std::string>& l);
+
+/// Corners of the board in its own frame(z = 0), in the order of findChessboardCorners.
+void calcBoardCornerPositions(cv::Size boardSize, float squareSize, std::vector<cv::Point3f>& corners);
+
+/// Finds the inner corners of the board in a color or gray image and refines them to
+/// sub-pixel accuracy(corner_refine.hpp). Returns false if the board is not found.
+bool findBoardCorners(const cv::Mat& image, cv::Size boardSize, std::vector<cv::Point2f>& corners);
+
+/// Calibrates a camera from the corners of boards seen in several views, objectPoints as
+/// calcBoardCornerPositions. Starts from params.cameraMatrix/distCoeffs with
+/// CV_CALIB_USE_INTRINSIC_GUESS. Returns false if the result is not finite.
+bool calibrateSingleCamera(const std::vector<std::vector<cv::Point3f> >& objectPoints,
+                           const std::vector<std::vector<cv::Point2f> >& imagePoints,
+                           cv::Size imageSize, int flags, int solver, CameraParams& params);
+
+/// RMS reprojection error over all corners, and of every view.
+double computeReprojectionErrors(const std::vector<std::vector<cv::Point3f> >& objectPoints,
+                                 const std::vector<std::vector<cv::Point2f> >& imagePoints,
+                                 const std::vector<cv::Mat>& rvecs, const std::vector<cv::Mat>& tvecs,
+                                 const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs,
+                                 std::vector<float>& perViewErrors);
+
+/// Calibrates the pair. With CV_CALIB_FIX_INTRINSIC the intrinsics of params are kept(e.g. those
+/// of camera_calib), otherwise they are estimated too. Returns false if the result is not finite.
+bool calibrateStereoPair(const std::vector<std::vector<cv::Point3f> >& objectPoints,
+                         const std::vector<std::vector<cv::Point2f> >& imagePoints1,
+                         const std::vector<std::vector<cv::Point2f> >& imagePoints2,
+                         cv::Size imageSize, int flags, int solver, StereoParams& params);
+
+/// Mean over all corners of the distances(pixels) to the epipolar lines of their match
+/// in the other image, summed over both images.
+double epipolarError(const std::vector<std::vector<cv::Point2f> >& imagePoints1,
+                     const std::vector<std::vector<cv::Point2f> >& imagePoints2, const StereoParams& params);
+
+/// Computes the rectification with stereoRectify: alpha = 0 crops to valid pixels only,
+/// 1 keeps all the pixels of the images.
+void rectifyStereoPair(StereoParams& params, double alpha = 1);
+
+/// Rectification maps of both cameras for remap(CV_16SC2), for images of imageSize.
+void computeRectifyMaps(const StereoParams& params, cv::Size imageSize, cv::Mat map[2][2]);
+
+/// Pixel transform(3x3, homogeneous pixels) from images of the calibrated size to images of size
+/// taken by the same camera in another capture mode, binned or decimated: the axes scale by
+/// size/calibrated, pixel centers mapping to pixel centers. A mode of another aspect ratio is taken
+/// as a centered crop of the sensor scaled by the width ratio, and crop is set.
+cv::Mat resolutionTransform(cv::Size calibrated, cv::Size size, bool* crop = 0);
+
+/// The calibration for images of size: the camera matrix follows the pixels, the distortion and
+/// the poses of the views do not change. Kept as is if the calibrated size is unknown(Size()).
+void scaleCameraParams(const CameraParams& src, cv::Size size, CameraParams& dst);
+
+/// The calibration and the rectification of the pair for images of size: the camera matrices, F,
+/// P1, P2, Q and the valid ROIs follow the pixels; R, T, E, R1 and R2 do not change, so the
+/// rectified images are those of the calibrated size, resampled. Kept as is if the calibrated size
+/// is unknown(files of older versions).
+void scaleStereoParams(const StereoParams& src, cv::Size size, StereoParams& dst);
+
+bool saveCameraParams(const std::string& filename, const CameraParams& params, cv::Size boardSize, float squareSize);
+bool loadCameraParams(const std::string& filename, cv::Mat& cameraMatrix, cv::Mat& distCoeffs);
+/// Also the calibrated size(Size() in files of older versions), the flags and the error.
+bool loadCameraParams(const std::string& filename, CameraParams& params);
+
+/// Writes the calibration, and the rectification if computed.
+bool saveStereoParams(const std::string& filename, const StereoParams& params);
+bool loadStereoParams(const std::string& filename, StereoParams& params);
+
+/// Reads stereo_params.xml and computes the rectification maps for images of imageSize, scaled
+/// with scaleStereoParams if calibrated at another size(calib_profile.hpp keeps them per size).
+/// P: projection matrices of the rectified cameras, Q: reprojection matrix(empty if not saved).
+bool loadRectifyMaps(const std::string& filename, cv::Size imageSize, cv::Mat map[2][2], cv::Mat P[2], cv::Mat& Q);
+
+#endif
@@ -2,9 +2,14 @@
 /// A simplified calibration program.
 /// Calibrate single camera with a series of chessboard photos.
 ///
-/// Input: xml/yaml file containing image list, or input with keyboard;
+/// Input: xml/yaml file containing image list, or input with keyboard, or a camera(-v);
 /// Output: save calibration result to xml file.
 ///
+/// With -adaptive, views are collected until the calibration converges(calib_convergence.hpp)
+/// instead of up to frameNumber: from a few views on, every other view calibrates the views so
+/// far and the collection stops when the intrinsics change and their uncertainty stay below the
+/// tolerance.
+///
 /// Ref:
 ///     opencv/sample/cpp/calib3d/camera_calibration/camera_calibration.cpp;
 ///     http://docs.opencv.org/2.4/doc/tutorials/calib3d/camera_calibration/camera_calibration.html#cameracalibrationopencv
@@ -18,6 +23,12 @@
 #include <stdio.h>
 #include <time.h>
 
+#include "calib_convergence.hpp"
+#include "calibration.hpp"
+#include "image_cache.hpp"
+#include "stereo_capture.hpp"
+#include "trace.hpp"
+
 using namespace std;
 using namespace cv;
 
@@ -29,63 +40,88 @@ using namespace cv;
 const int boardWidth = 6;       // number of corners per row
 const int boardHeight = 5;      // number of corners per column
 const int frameNumber = 15;     // number of input images for calibration
+const int maxAdaptiveFrames = 50;   // at most, with -adaptive
 const float squareSize = 30;    // the size of a square in the chessboard(in mm)
-const int imageWidth = 640;
+const int imageWidth = 640;    // capture mode asked of a camera(-v); it may deliver another
 const int imageHeight = 480;
 const Size boardSize(boardWidth, boardHeight);
-const Size imageSize(imageWidth, imageHeight);
+Size imageSize;             // calibrated size, that of the first view; saved with the result
 string outputFileName;
 int delay_ms = 300;         // time delay between displaying two images
 int flag = 0;
+string solver = "opencv";    // calibration solver: opencv, sparse(calib_solver.hpp) or compare
+bool adaptive = false;      // collect views until the calibration converges
+ConvergenceParams convergenceParams;
 
 //--------------------------------------------------
 // Global Variables
 //--------------------------------------------------
-Mat cameraMatrix;           // camera intrinsic matrix
-Mat distCoeffs;             // distortion coefficients
+CameraParams params;        // camera intrinsic matrix, distortion coefficients, ...
 vector<Point2f> cornerBuf;  // corners found by findChessboardCorners()
 vector<vector<Point2f> > imagePoints;   // set of corners on each images in image coordinate
 vector<vector<Point3f> > objectPoints;  // set of corners on each images in world coordinate
 vector<string> imageList;               // list of image names
+VideoCapture video;                     // live frames instead of the image list
+ImageCache imageCache;                  // decoded once, ahead of the corner detection, for both passes
 //--------------------------------------------------
 // Function Declarations
 //--------------------------------------------------
 static void usage(void);
-static bool readImageListFile(const string& filename, vector<string>& imageList);
 static void createImageList(vector<string>& imageList);
 static Mat getImage(const vector<string>& imageList, const int currentIndex);
-static void calcBoardCornerPositions(Size boardSize, float squareSize, vector<Point3f>& corners);
-static double computeReprojectionErrors(const vector<vector<Point3f> >& objectPoints,
-                                        const vector<vector<Point2f> >& imagePoints,
-                                        const vector<Mat>& rvecs, const vector<Mat>& tvecs,
-                                        const Mat& cameraMatrix, const Mat& distCoeffs,
-                                        vector<float>& perViewErrors);
-static bool runCalibration(Size imageSize, Mat& cameraMatrix, Mat& distCoeffs,
-                           vector<vector<Point2f> > imagePoints, vector<vector<Point3f> > objectPoints,
-                           vector<Mat>& rvecs, vector<Mat>& tvecs,
-                           vector<float>& reprojErrs, double& totalAvgErr);
-static void saveCameraParams(Size imageSize, Mat& cameraMatrix, Mat& distCoeffs,
-                             const vector<Mat>& rvecs, const vector<Mat>& tvecs,
-                             const vector<float>& reprojErrs, double totalAvgErr);
+static string imageName(const vector<string>& imageList, const int currentIndex);
+static bool runCalibration(Size imageSize, const vector<vector<Point2f> >& imagePoints,
+                           const vector<vector<Point3f> >& objectPoints, CameraParams& params);
 static void displayUndistortedImage(const vector<string>& imageList, const Mat& cameraMatrix, const Mat& distCoeffs);
 //--------------------------------------------------
 
 int main(int argc, const char* argv[])
 {
-
+    traceFromEnv();
     usage();
 
     //-------------------- 0.parse arguments --------------------
     for (int i = 1; i < argc; i++)
     {
-        if (string(argv[i]) == "-i")    // !must convert to string! or use !strcmp()
-            readImageListFile(argv[++i], imageList);
+        if (string(argv[i]) == "-i" && !readStringList(argv[++i], imageList))    // !must convert to string! or use !strcmp()
+            cout << "Failed to read the image list " << argv[i] << endl;
         if (string(argv[i]) == "-o")
             outputFileName = argv[++i];
+        if (string(argv[i]) == "-v" && !openVideo(argv[++i], video))
+        {
+            cout << "Failed to open the camera or video " << argv[i] << endl;
+            return -1;
+        }
+        if (string(argv[i]) == "-adaptive")
+        {
+            adaptive = true;
+            if (i + 1 >= argc || sscanf(argv[++i], "%lf", &convergenceParams.tolerance) != 1 ||
+                !(convergenceParams.tolerance > 0))
+            {
+                cout << "-adaptive needs a tolerance in pixels, e.g. -adaptive 0.5" << endl;
+                return -1;
+            }
+        }
+        if (string(argv[i]) == "-solver")
+        {
+            solver = argv[++i];
+            if (solver != "opencv" && solver != "sparse" && solver != "compare")
+            {
+                cout << "Unknown solver " << solver << ", use opencv, sparse or compare." << endl;
+                return -1;
+            }
+        }
     }
+    // a camera is asked for its capture mode, the size of its frames is calibrated;
     // if have not read image list from file, create one from keyboard input
-    if (imageList.size() == 0)
+    if (video.isOpened())
+    {
+        video.set(CV_CAP_PROP_FRAME_WIDTH, imageWidth);
+        video.set(CV_CAP_PROP_FRAME_HEIGHT, imageHeight);
+    }
+    else if (imageList.size() == 0)
         createImageList(imageList);
+    imageCache.prefetch(imageList);
     // if no output file name assigned, name by 'result_DATE.xml'
     if (outputFileName.empty())
     {
@@ -106,43 +142,68 @@ int main(int argc, const char* argv[])
 
     //-------------------- 1.collect corners in image coord --------------------
     int goodFrameCnt = 0, currentIndex = 0;
+    const int maxFrames = adaptive ? maxAdaptiveFrames : frameNumber;
+    CalibConvergence convergence(convergenceParams);
+    vector<Point3f> boardCorners;
+    calcBoardCornerPositions(boardSize, squareSize, boardCorners);
     namedWindow("Camera Calibration");
-    while (goodFrameCnt < frameNumber)
+    while (goodFrameCnt < maxFrames)
     {
         Mat image = getImage(imageList, currentIndex);
         if (image.empty())
             break;
+        if (imageSize == Size())
+            imageSize = image.size();
+        else if (image.size() != imageSize)
+        {
+            // the calibration is that of one size(other sizes are scaled when used, calib_profile.hpp)
+            cout << imageName(imageList, currentIndex) << " has different size from the first image. Skipping it." << endl;
+            currentIndex++;
+            continue;
+        }
 
         // look for corners in the current image
-        bool found = findChessboardCorners(image, boardSize, cornerBuf, 
-                CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_NORMALIZE_IMAGE);
+        // (refined to sub-pixel accuracy)
+        bool found = findBoardCorners(image, boardSize, cornerBuf);
         if (found)
         {
-            // improve the found corners' coordinate accuracy
-            Mat imageGray;
-            cvtColor(image, imageGray, CV_BGR2GRAY);
-            cornerSubPix(imageGray, cornerBuf, Size(11, 11), Size(-1, -1),
-                    TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 30, 0.1));  // just follow reference manual
             imagePoints.push_back(cornerBuf);
 
             // draw the corners on the image
             drawChessboardCorners(image, boardSize, Mat(cornerBuf), found);
 
             goodFrameCnt++;
-            cout << "Detected corners in " << imageList[currentIndex] << endl;
+            cout << "Detected corners in " << imageName(imageList, currentIndex) << endl;
+
+            // calibrate the views so far when a check is due
+            if (adaptive && convergence.update(vector<vector<Point3f> >(imagePoints.size(), boardCorners),
+                                               imagePoints, imageSize, flag,
+                                               solver == "sparse" ? SOLVER_SPARSE : SOLVER_OPENCV))
+            {
+                const ConvergenceState& c = convergence.state;
+                cout << format("%d views: change %.3f px, uncertainty %.3f px, stable %d/%d(%.0f ms)",
+                               c.views, c.change, c.uncertainty, c.stable,
+                               convergenceParams.stableChecks, c.time) << endl;
+            }
         }
         else
-            cout << "Failed to detect corners in " << imageList[currentIndex] << endl;
+            cout << "Failed to detect corners in " << imageName(imageList, currentIndex) << endl;
 
         // output text
-        string msg = format("%d/%d", (int)imagePoints.size(), frameNumber);
+        string msg = format("%d/%d", (int)imagePoints.size(), maxFrames);
         int baseLine = 0;
         Size textSize = getTextSize(msg, 1, 1, 1, &baseLine);
         Point textOrigin(image.cols - 2*textSize.width - 10, image.rows - 2*baseLine - 10);
         putText(image, msg, textOrigin, 1, 1, Scalar(0, 255, 0));
         imshow("Camera Calibration", image);
-        
+
         currentIndex++;
+        if (convergence.state.converged)
+        {
+            cout << "Converged after " << goodFrameCnt << " views(tolerance "
+                 << convergenceParams.tolerance << " px)" << endl;
+            break;
+        }
         char key = waitKey(delay_ms);
         // start calibration immediately if 'q' or ESC is hitted
         if (key == 'q' || key == ESC_KEY)
@@ -175,24 +236,20 @@ int main(int argc, const char* argv[])
 #endif
 
     //-------------------- 3.calibrate --------------------
-    vector<Mat> rvecs, tvecs;   // rotation vectors and translation vectors
-    vector<float> reprojErrs;
-    double totalAvgErr = 0;
-
-    bool ok = runCalibration(imageSize, cameraMatrix, distCoeffs,
-            imagePoints, objectPoints, rvecs, tvecs, reprojErrs, totalAvgErr);
+    bool ok = runCalibration(imageSize, imagePoints, objectPoints, params);
 
     cout << (ok ? "Calibration succeeded" : "Calibration failed")
-         << ". avg re-projection error = " << totalAvgErr << endl;
+         << ". avg re-projection error = " << params.avgError << endl;
 
     //-------------------- 4.save calibration result --------------------
-    if(ok)
-        saveCameraParams(imageSize, cameraMatrix, distCoeffs,
-                rvecs, tvecs, reprojErrs, totalAvgErr);
+    if (ok && !saveCameraParams(outputFileName, params, boardSize, squareSize))
+        cout << "Failed to save the calibration result to " << outputFileName << endl;
 
     //-------------------- 5.display undistorted images --------------------
     destroyWindow("Camera Calibration");
-    displayUndistortedImage(imageList, cameraMatrix, distCoeffs);
+    if (imageSize != Size())    // any view read
+        displayUndistortedImage(imageList, params.cameraMatrix, params.distCoeffs);
+    imageCache.report();
 
     return 0;
 }
@@ -202,28 +259,13 @@ void usage()
     cout << "Usage:" << endl
          << "\t-i: xml/yaml file containing image list;" << endl
          << "\t    (if omitted, program will prompt to input from keyboard)" << endl
-         << "\t-o: output filename to save calibration result, default is 'calib_result_TIME.xml'." << endl;
-}
-
-bool readImageListFile(const string& filename, vector<string>& imageList)
-{
-    imageList.clear();
-    FileStorage fs(filename, FileStorage::READ);
-    if (!fs.isOpened())
-    {
-        cout << "Failed to open the file " << filename << endl;
-        return false;
-    }
-    FileNode n = fs.getFirstTopLevelNode();
-    if (n.type() != FileNode::SEQ)
-    {
-        cout << "File content is not a sequence! FAIL" << endl;
-        return false;
-    }
-    FileNodeIterator it = n.begin(), it_end = n.end();
-    for ( ; it != it_end; it++)
-        imageList.push_back((string)*it);
-    return true;
+         << "\t-o: output filename to save calibration result, default is 'calib_result_TIME.xml';" << endl
+         << "\t-v <camera id|video>: calibrate from live frames instead of an image list;" << endl
+         << "\t-adaptive <pixels>: collect views until the intrinsics change and their uncertainty" << endl
+         << "\t    stay below the tolerance(e.g. 0.5), at most " << maxAdaptiveFrames
+         << ", instead of " << frameNumber << " views;" << endl
+         << "\t-solver opencv|sparse|compare: calibrateCamera(default), the block-sparse solver for" << endl
+         << "\t    large sets of views, or both with their times and differences." << endl;
 }
 
 void createImageList(vector<string>& imageList)
@@ -245,116 +287,56 @@ void createImageList(vector<string>& imageList)
     }
 }
 
+// the corners and the counter are drawn on the image: a copy of the cached one
 Mat getImage(const vector<string>& imageList, const int currentIndex)
 {
     Mat ret;
-    if (currentIndex < (int)imageList.size())
-        ret = imread(imageList[currentIndex], CV_LOAD_IMAGE_COLOR);
+    if (video.isOpened())
+    {
+        if (!video.read(ret))
+            cout << "There are no more frames!" << endl;
+    }
+    else if (currentIndex < (int)imageList.size())
+        ret = imageCache.get(imageList[currentIndex]).clone();
     else
        cout << "There are no more images in the list!" << endl;
 
    return ret;
-} 
-
-// calculate the coordinates of board corners in world coord system
-void calcBoardCornerPositions(Size boardSize, float squareSize, vector<Point3f>& corners)
-{
-    corners.clear();
-
-    // findChessboardCorners() searches by rows, so we need to comply with it?
-    // No it does not matter at all...
-    for (int i = 0; i < boardSize.height; i++)
-        for (int j = 0; j < boardSize.width; j++)
-            corners.push_back(Point3f(i*squareSize, j*squareSize, 0));
 }
 
-bool runCalibration(Size imageSize, Mat& cameraMatrix, Mat& distCoeffs,
-                    vector<vector<Point2f> > imagePoints, vector<vector<Point3f> > objectPoints,
-                    vector<Mat>& rvecs, vector<Mat>& tvecs,
-                    vector<float>& reprojErrs, double& totalAvgErr)
+string imageName(const vector<string>& imageList, const int currentIndex)
 {
-    cameraMatrix = Mat::eye(3, 3, CV_64F);
-    if (flag & CV_CALIB_FIX_ASPECT_RATIO)
-        cameraMatrix.at<double>(0, 0) = 1.0;
-
-    distCoeffs = Mat::zeros(5, 1, CV_64F);
-
-    // find intrinsic and extrinsic camera parameters
-    double rms = calibrateCamera(objectPoints, imagePoints, imageSize,
-            cameraMatrix, distCoeffs, rvecs, tvecs, flag);
-
-    cout << "Re-projection error reported by calibrateCamera(): " << rms << endl;
-
-    bool ok = checkRange(cameraMatrix) && checkRange(distCoeffs);
-
-    totalAvgErr = computeReprojectionErrors(objectPoints, imagePoints,
-            rvecs, tvecs, cameraMatrix, distCoeffs, reprojErrs);
-
-    return ok;
+    return video.isOpened() ? format("frame %d", currentIndex) : imageList[currentIndex];
 }
 
-double computeReprojectionErrors(const vector<vector<Point3f> >& objectPoints,
-                                 const vector<vector<Point2f> >& imagePoints,
-                                 const vector<Mat>& rvecs, const vector<Mat>& tvecs,
-                                 const Mat& cameraMatrix, const Mat& distCoeffs,
-                                 vector<float>& perViewErrors)
+bool runCalibration(Size imageSize, const vector<vector<Point2f> >& imagePoints,
+                    const vector<vector<Point3f> >& objectPoints, CameraParams& params)
 {
-    vector<Point2f> imagePointsProjected;
-    int totalPoints = 0;
-    double totalErr = 0, err;
-    perViewErrors.resize(objectPoints.size());
-
-    for (int i = 0; i < (int)objectPoints.size(); i++)
+    if (solver == "sparse")
     {
-        // project 3D points to an image plane
-        projectPoints(objectPoints[i], rvecs[i], tvecs[i], cameraMatrix, distCoeffs, imagePointsProjected);
-        // calculate an absolute difference norm
-        err = norm(Mat(imagePoints[i]), Mat(imagePointsProjected), NORM_L2);
-
-        int n = (int)objectPoints.size();
-        perViewErrors[i] = (float)sqrt(err*err/n);
-        totalErr += err*err;
-        totalPoints += n;
+        bool ok = calibrateSingleCamera(objectPoints, imagePoints, imageSize, flag, SOLVER_SPARSE, params);
+        cout << "Re-projection error reported by calibrateCameraSparse(): " << params.rms << endl;
+        return ok;
     }
 
-    return sqrt(totalErr/totalPoints);
-}
+    int64 t = getTickCount();
+    bool ok = calibrateSingleCamera(objectPoints, imagePoints, imageSize, flag, SOLVER_OPENCV, params);
+    cout << "Re-projection error reported by calibrateCamera(): " << params.rms << endl;
 
-// write calibration result to the output file
-void saveCameraParams(Size imageSize, Mat& cameraMatrix, Mat& distCoeffs,
-                      const vector<Mat>& rvecs, const vector<Mat>& tvecs,
-                      const vector<float>& reprojErrs, double totalAvgErr)
-{
-    FileStorage fs(outputFileName, FileStorage::WRITE);
-
-    char buf[1024];
-    time_t tm;
-    time(&tm);
-    struct tm *t2 = localtime(&tm);
-    strftime(buf, sizeof(buf)-1, "%c", t2);
-
-    fs << "calibration_Time" << buf;
-    fs << "numberOfGoodFrames" << (int)rvecs.size();
-    fs << "image_Width" << imageSize.width;
-    fs << "image_Height" << imageSize.height;
-    fs << "board_Width" << boardWidth;
-    fs << "board_Height" << boardHeight;
-    fs << "square_Size" << squareSize;
-
-    if(flag)
+    if (solver == "compare")
     {
-        sprintf(buf, "flags: %s%s%s%s",
-                flag & CV_CALIB_USE_INTRINSIC_GUESS ? "+use_intrinsic_guess" : "",
-                flag & CV_CALIB_FIX_ASPECT_RATIO ? "+fix_aspectRatio" : "",
-                flag & CV_CALIB_FIX_PRINCIPAL_POINT ? "+fix_principal_point" : "",
-                flag & CV_CALIB_ZERO_TANGENT_DIST ? "+zero_tagent_dist" : "");
-        cvWriteComment(*fs, buf, 0);
+        // both solvers start from the same matrices
+        const double cvTime = (getTickCount() - t)*1000/getTickFrequency();
+        CameraParams sparse;
+        t = getTickCount();
+        calibrateSingleCamera(objectPoints, imagePoints, imageSize, flag, SOLVER_SPARSE, sparse);
+        const double sparseTime = (getTickCount() - t)*1000/getTickFrequency();
+        cout << "calibrateCamera():       " << cvTime << " ms, rms " << params.rms << endl
+             << "calibrateCameraSparse(): " << sparseTime << " ms, rms " << sparse.rms << endl
+             << "cameraMatrix difference: " << norm(params.cameraMatrix, sparse.cameraMatrix, NORM_INF)
+             << ", distCoeffs difference: " << norm(params.distCoeffs, sparse.distCoeffs, NORM_INF) << endl;
     }
-    fs << "flagValue" << flag;
-
-    fs << "cameraMatrix" << cameraMatrix;
-    fs << "distCoeffs" << distCoeffs;
-    fs << "Avg_Reprojection_Errors" << totalAvgErr;
+    return ok;
 }
 
 void displayUndistortedImage(const vector<string>& imageList, const Mat& cameraMatrix, const Mat& distCoeffs)
@@ -380,20 +362,29 @@ void displayUndistortedImage(const vector<string>& imageList, const Mat& cameraM
     //--------------------------------------------------
     // compute the undistortion and rectification transformation map
     // (getOptimalNewCameraMatrix() 4th arg is alpha. see refman)
-    initUndistortRectifyMap(cameraMatrix, distCoeffs, Mat(),
-            getOptimalNewCameraMatrix(cameraMatrix, distCoeffs, imageSize, 1, imageSize, 0),
-            imageSize, CV_16SC2, map1, map2);
+    {
+        TRACE_SCOPE("initUndistortRectifyMap");
+        initUndistortRectifyMap(cameraMatrix, distCoeffs, Mat(),
+                getOptimalNewCameraMatrix(cameraMatrix, distCoeffs, imageSize, 1, imageSize, 0),
+                imageSize, CV_16SC2, map1, map2);
+    }
     // apply a generic geometrical transformation to an image
-    for (int i = 0; i < (int)imageList.size(); i++)
+    for (int i = 0; video.isOpened() || i < (int)imageList.size(); i++)
     {
-        view = imread(imageList[i], CV_LOAD_IMAGE_COLOR);
-        if (view.empty())
+        if (video.isOpened() && !video.read(view))
+            break;
+        else if (!video.isOpened())
+            view = imageCache.get(imageList[i]);
+        if (view.empty() || view.size() != imageSize)
             continue;
-        remap(view, viewUndistorted, map1, map2, INTER_LINEAR);
+        {
+            TRACE_SCOPE("remap");
+            remap(view, viewUndistorted, map1, map2, INTER_LINEAR);
+        }
         imshow("Original Image", view);
         imshow("Undistorted Image", viewUndistorted);
 
-        char key = waitKey();
+        char key = waitKey(video.isOpened() ? 30 : 0);
         if (key == 'q' || key == ESC_KEY)
             break;
     }
@@ -0,0 +1,267 @@
+/// codec_check.cpp
+/// Checks the disparity codec and the stream files of disp_codec.hpp: noisy, smooth, mostly invalid,
+/// constant and full 16-bit range maps of several sizes must decode to themselves, damaged code must
+/// be rejected, and a stream must read back frame by frame in any order, from its index or, when the
+/// index is missing(a recording that was not closed), from its frame records.
+///
+/// Output: one line per check; the exit code is 0 if all pass, 1 if any fails.
+/// The stream files are written to the working directory and removed afterwards.
+///
+/// Ref:
+///     disp_codec.cpp
+
+#include "opencv2/core/core.hpp"
+
+#include "disparity.hpp"
+#include "disp_codec.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <limits.h>
+
+using namespace cv;
+using namespace std;
+
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+enum MapKind
+{
+    MAP_NOISY = 0,      // independent random disparities, some invalid
+    MAP_SMOOTH,         // a slanted plane with subpixel noise and holes
+    MAP_INVALID,        // mostly invalid, small constant islands
+    MAP_CONSTANT,       // one value: runs over whole rows
+    MAP_EXTREMES,       // any 16-bit value, the residuals wrap around
+    MAP_KINDS
+};
+const char* kindNames[MAP_KINDS] = {"noisy", "smooth", "invalid", "constant", "extremes"};
+const string streamFile = "codec_check.dsp";
+const string cutFile = "codec_check_cut.dsp";
+const int streamFrames = 12;
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void syntheticMap(int kind, Size size, RNG& rng, Mat& disp);
+static bool sameMaps(const Mat& a, const Mat& b, string& why);
+static bool checkCodec(const Mat& disp, string& why);
+static bool checkStream(const vector<Mat>& maps, string& why);
+static bool checkUnclosedStream(const vector<Mat>& maps, string& why);
+static bool copyPrefix(const string& src, const string& dst, int64 bytes);
+static int report(const string& name, bool ok, const string& why);
+//--------------------------------------------------
+
+int main()
+{
+    RNG rng(777);
+    int failures = 0, checks = 0;
+    string why;
+
+    const Size sizes[5] = {Size(640, 480), Size(97, 31), Size(37, 1), Size(1, 23), Size(1, 1)};
+    for (int k = 0; k < MAP_KINDS; k++)
+        for (int s = 0; s < 5; s++)
+        {
+            Mat disp;
+            syntheticMap(k, sizes[s], rng, disp);
+            why.clear();
+            const bool ok = checkCodec(disp, why);
+            failures += report(format("codec, %s %dx%d", kindNames[k], sizes[s].width, sizes[s].height), ok, why);
+            checks++;
+        }
+
+    vector<Mat> maps(streamFrames);
+    for (int i = 0; i < streamFrames; i++)
+        syntheticMap(i % MAP_KINDS, Size(160, 120), rng, maps[i]);
+    why.clear();
+    bool ok = checkStream(maps, why);
+    failures += report(format("stream of %d frames, with index", streamFrames), ok, why);
+    checks++;
+    why.clear();
+    ok = checkUnclosedStream(maps, why);
+    failures += report("stream without index, last frame cut off", ok, why);
+    checks++;
+    remove(streamFile.c_str());
+    remove(cutFile.c_str());
+
+    if (failures)
+        cout << failures << " of " << checks << " checks failed" << endl;
+    else
+        cout << "All " << checks << " checks passed" << endl;
+    return failures ? 1 : 0;
+}
+
+void syntheticMap(int kind, Size size, RNG& rng, Mat& disp)
+{
+    disp.create(size, CV_16S);
+    const short island = (short)rng.uniform(0, 128*DISP_SCALE);
+    for (int y = 0; y < size.height; y++)
+        for (int x = 0; x < size.width; x++)
+        {
+            int d;
+            if (kind == MAP_NOISY)
+                d = rng.uniform(0, 8) ? rng.uniform(0, 128*DISP_SCALE) : DISP_INVALID;
+            else if (kind == MAP_SMOOTH)
+                d = rng.uniform(0, 50) ? DISP_SCALE*(10 + x/8 + y/16) + rng.uniform(-2, 3) : DISP_INVALID;
+            else if (kind == MAP_INVALID)
+                d = (x/8 + y/8) % 11 == 0 && (x % 8) < 3 ? island : DISP_INVALID;
+            else if (kind == MAP_CONSTANT)
+                d = island;
+            else
+            {
+                const int v = rng.uniform(0, 5);
+                d = v == 0 ? SHRT_MIN : v == 1 ? SHRT_MAX : v == 2 ? DISP_INVALID : rng.uniform(SHRT_MIN, SHRT_MAX + 1);
+            }
+            disp.at<short>(y, x) = (short)d;
+        }
+}
+
+bool sameMaps(const Mat& a, const Mat& b, string& why)
+{
+    if (a.size() != b.size() || a.type() != b.type())
+    {
+        why = format("a %dx%d map instead of %dx%d", a.cols, a.rows, b.cols, b.rows);
+        return false;
+    }
+    for (int y = 0; y < a.rows; y++)
+        for (int x = 0; x < a.cols; x++)
+            if (a.at<short>(y, x) != b.at<short>(y, x))
+            {
+                why = format("(%d, %d) is %d instead of %d", x, y, a.at<short>(y, x), b.at<short>(y, x));
+                return false;
+            }
+    return true;
+}
+
+// Round trip of disp appended to other data; the code cut short, with a byte more or for a larger
+// map must not decode.
+bool checkCodec(const Mat& disp, string& why)
+{
+    vector<uchar> code(5, 0xA5);
+    const size_t n = encodeDisparity(disp, code);
+    if (code.size() != n + 5 || code[0] != 0xA5 || code[4] != 0xA5)
+    {
+        why = "the code was not appended";
+        return false;
+    }
+    const uchar* data = &code[5];
+    Mat decoded;
+    if (!decodeDisparity(data, n, disp.size(), decoded))
+    {
+        why = format("%d bytes of code do not decode", (int)n);
+        return false;
+    }
+    if (!sameMaps(decoded, disp, why))
+        return false;
+
+    code.push_back(0);
+    data = &code[5];
+    Mat damaged;
+    if (n > 0 && decodeDisparity(data, n - 1, disp.size(), damaged))
+    {
+        why = "the code decodes without its last byte";
+        return false;
+    }
+    if (decodeDisparity(data, n + 1, disp.size(), damaged))
+    {
+        why = "the code decodes with a byte appended";
+        return false;
+    }
+    if (decodeDisparity(data, n, Size(disp.cols, disp.rows + 1), damaged))
+    {
+        why = "the code decodes to a map with one more row";
+        return false;
+    }
+    why = format("%d bytes, ratio %.2f", (int)n, disp.total()*disp.elemSize()/(double)std::max(n, (size_t)1));
+    return true;
+}
+
+bool checkStream(const vector<Mat>& maps, string& why)
+{
+    DispStreamWriter writer;
+    bool ok = writer.open(streamFile, maps[0].size());
+    for (size_t i = 0; ok && i < maps.size(); i++)
+        ok = writer.write(maps[i], 1000 + 33*(int64)i);
+    ok = writer.close() && ok;
+    if (!ok)
+    {
+        why = "cannot write " + streamFile;
+        return false;
+    }
+
+    DispStreamReader reader;
+    if (!reader.open(streamFile) || reader.frames() != (int)maps.size() || reader.size() != maps[0].size())
+    {
+        why = format("%d frames read back instead of %d", reader.frames(), (int)maps.size());
+        return false;
+    }
+    // every 5th frame, wrapping around: all frames, none in order
+    for (int j = 0, i = 0; j < (int)maps.size(); j++, i = (i + 5) % (int)maps.size())
+    {
+        Mat disp;
+        if (reader.frameInfo(i).timestamp != 1000 + 33*(int64)i || !reader.read(i, disp) || !sameMaps(disp, maps[i], why))
+        {
+            why = format("frame %d: ", i) + (why.empty() ? string("wrong timestamp or not readable") : why);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The records of a closed stream without the index, then also without the end of the last frame.
+bool checkUnclosedStream(const vector<Mat>& maps, string& why)
+{
+    DispStreamReader reader;
+    if (!reader.open(streamFile) || reader.frames() == 0)
+    {
+        why = "cannot read " + streamFile;
+        return false;
+    }
+    const DispFrameInfo last = reader.frameInfo(reader.frames() - 1);
+    const int64 recordsEnd = last.offset + 16 + last.bytes;     // a record is 16 bytes of header and the code
+    reader.close();
+
+    for (int cut = 0; cut <= 1; cut++)
+    {
+        const int expected = (int)maps.size() - cut;
+        if (!copyPrefix(streamFile, cutFile, recordsEnd - cut*(last.bytes/2 + 1)) || !reader.open(cutFile)
+            || reader.frames() != expected)
+        {
+            why = format("%d frames found instead of %d", reader.frames(), expected);
+            return false;
+        }
+        for (int i = 0; i < expected; i++)
+        {
+            Mat disp;
+            if (!reader.read(i, disp) || !sameMaps(disp, maps[i], why))
+            {
+                why = format("frame %d of %d: ", i, expected) + why;
+                return false;
+            }
+        }
+        reader.close();
+    }
+    return true;
+}
+
+bool copyPrefix(const string& src, const string& dst, int64 bytes)
+{
+    FILE* in = fopen(src.c_str(), "rb");
+    FILE* out = fopen(dst.c_str(), "wb");
+    vector<uchar> buf((size_t)bytes + 1);
+    bool ok = in && out && fread(&buf[0], 1, (size_t)bytes, in) == (size_t)bytes
+              && fwrite(&buf[0], 1, (size_t)bytes, out) == (size_t)bytes;
+    if (in)
+        fclose(in);
+    if (out)
+        ok = fclose(out) == 0 && ok;
+    return ok;
+}
+
+// prints the result of a check, returns 1 if it failed
+int report(const string& name, bool ok, const string& why)
+{
+    cout << format("%s %-42s %s", ok ? "PASS" : "FAIL", name.c_str(), why.c_str()) << endl;
+    return ok ? 0 : 1;
+}
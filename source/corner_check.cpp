@@ -0,0 +1,121 @@
+/// corner_check.cpp
+/// Checks refineCorners(corner_refine.hpp) against cornerSubPix on the chessboards of images/:
+/// the corners found by findChessboardCorners, as findBoardCorners finds them, are refined by both
+/// with the settings of camera_calib(11x11 window, 30 iterations, epsilon 0.1), one image at a time
+/// and all the boards at once, and must agree within maxDifference pixels.
+///
+/// Input: the directory of the pairs(left01.jpg, right01.jpg, ...), default is images/;
+/// Output: the largest and mean differences; the exit code is 0 if all pass, 1 if any fails
+///         (-1 if no board is found).
+///
+/// Ref:
+///     corner_refine.cpp, calibration.cpp(findBoardCorners)
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include "corner_refine.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <math.h>
+
+using namespace cv;
+using namespace std;
+
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+string imageDir = "images";         // left01.jpg, right01.jpg, ...
+const Size boardSize(6, 5);         // as camera_calib
+const Size winSize(11, 11);
+const Size zeroZone(-1, -1);
+const TermCriteria criteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 30, 0.1);
+const double maxDifference = 1e-3;  // pixels, float rounding of a differently ordered computation
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static int compareCorners(const string& name, const vector<vector<Point2f> >& corners,
+                          const vector<vector<Point2f> >& expected, const vector<string>& names);
+//--------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+        imageDir = argv[1];
+
+    // the boards found in every image, and the gray images
+    vector<Mat> grays;
+    vector<vector<Point2f> > found;
+    vector<string> names;
+    for (int i = 1; ; i++)
+    {
+        bool read = false;
+        for (int k = 0; k < 2; k++)
+        {
+            char fn[32];
+            sprintf(fn, k ? "right%02d.jpg" : "left%02d.jpg", i);
+            Mat img = imread(imageDir + "/" + fn, CV_LOAD_IMAGE_COLOR);
+            if (img.empty())
+                continue;
+            read = true;
+            vector<Point2f> corners;
+            if (!findChessboardCorners(img, boardSize, corners, CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_NORMALIZE_IMAGE))
+                continue;
+            Mat gray;
+            cvtColor(img, gray, CV_BGR2GRAY);
+            grays.push_back(gray);
+            found.push_back(corners);
+            names.push_back(fn);
+        }
+        if (!read)
+            break;
+    }
+    if (found.empty())
+    {
+        cout << "No chessboard found in the pairs left01.jpg, right01.jpg... of " << imageDir << endl;
+        return -1;
+    }
+
+    vector<vector<Point2f> > expected(found), single(found), batched(found);
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        cornerSubPix(grays[i], expected[i], winSize, zeroZone, criteria);
+        refineCorners(grays[i], single[i], winSize, zeroZone, criteria);
+    }
+    refineCorners(grays, batched, winSize, zeroZone, criteria);
+
+    int failures = compareCorners("refineCorners, one image at a time", single, expected, names);
+    failures += compareCorners("refineCorners, all the boards at once", batched, expected, names);
+    return failures ? 1 : 0;
+}
+
+// prints the comparison, returns 1 if a corner is more than maxDifference away
+int compareCorners(const string& name, const vector<vector<Point2f> >& corners,
+                   const vector<vector<Point2f> >& expected, const vector<string>& names)
+{
+    double maxDiff = 0, sumDiff = 0;
+    int n = 0, worst = 0;
+    for (size_t i = 0; i < corners.size(); i++)
+        for (size_t j = 0; j < corners[i].size(); j++)
+        {
+            const double d = std::max(fabs(corners[i][j].x - expected[i][j].x), fabs(corners[i][j].y - expected[i][j].y));
+            if (d > maxDiff || d != d)     // a NaN stays the maximum
+            {
+                maxDiff = d;
+                worst = (int)i;
+            }
+            sumDiff += d;
+            n++;
+        }
+    const bool ok = maxDiff <= maxDifference;
+    cout << format("%s %-38s %d boards, max difference %.2g px(%s), mean %.2g px, tolerance %g",
+                   ok ? "PASS" : "FAIL", name.c_str(), (int)corners.size(), maxDiff, names[worst].c_str(),
+                   sumDiff/std::max(n, 1), maxDifference) << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,287 @@
+/// corner_refine.cpp
+/// Batched sub-pixel corner refinement.
+///
+/// For every corner q, the gradient g(p) at each point p of the window is orthogonal to p - q,
+/// so q solves sum(w g g') q = sum(w g g' p) with the Gaussian weights w of the window. Every
+/// iteration samples the window(and a 1 pixel border for the gradients) bilinearly around the
+/// current q, as getRectSubPix, and moves q to the solution, until the move is below epsilon.
+/// The samples and the five sums are computed 8 columns at a time, in float per row and in
+/// double over the rows.
+///
+/// Ref:
+///     opencv/modules/imgproc/src/cornersubpix.cpp;
+///     Forstner & Gulch, A Fast Operator for Detection and Precise Location of Distinct Points, 1987
+
+#include "corner_refine.hpp"
+#include "trace.hpp"
+
+#include <float.h>
+#include <math.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CORNER_NEON
+#endif
+
+using namespace cv;
+using namespace std;
+
+const int MAX_ITERATIONS = 100;     // as cornerSubPix
+
+// Gaussian weights of the window, 0 in the zero zone
+static void windowMask(Size win, Size zeroZone, vector<float>& mask)
+{
+    const int ww = 2*win.width + 1, wh = 2*win.height + 1;
+    mask.resize(ww*wh);
+    for (int i = 0; i < wh; i++)
+    {
+        const float y = (float)(i - win.height)/win.height;
+        const float vy = exp(-y*y);
+        for (int j = 0; j < ww; j++)
+        {
+            const float x = (float)(j - win.width)/win.width;
+            mask[i*ww + j] = vy*exp(-x*x);
+        }
+    }
+    if (zeroZone.width >= 0 && zeroZone.height >= 0 && zeroZone.width*2 + 1 < ww && zeroZone.height*2 + 1 < wh)
+    {
+        for (int i = win.height - zeroZone.height; i <= win.height + zeroZone.height; i++)
+            for (int j = win.width - zeroZone.width; j <= win.width + zeroZone.width; j++)
+                mask[i*ww + j] = 0;
+    }
+}
+
+// Bilinear samples of the pw x ph patch whose top left sample is at (x, y), border replicated.
+static void samplePatch(const Mat& img, float x, float y, int pw, int ph, float* patch)
+{
+    const int ix = cvFloor(x), iy = cvFloor(y);
+    const float fx = x - ix, fy = y - iy;
+    const float w00 = (1 - fx)*(1 - fy), w01 = fx*(1 - fy), w10 = (1 - fx)*fy, w11 = fx*fy;
+
+    if (ix >= 0 && iy >= 0 && ix + pw < img.cols && iy + ph < img.rows)
+    {
+        for (int i = 0; i < ph; i++)
+        {
+            const uchar* s0 = img.ptr<uchar>(iy + i) + ix;
+            const uchar* s1 = s0 + img.step;
+            float* d = patch + i*pw;
+            int j = 0;
+#if defined(__AVX2__)
+            const __m256 v00 = _mm256_set1_ps(w00), v01 = _mm256_set1_ps(w01);
+            const __m256 v10 = _mm256_set1_ps(w10), v11 = _mm256_set1_ps(w11);
+            for (; j + 8 <= pw; j += 8)
+            {
+                __m256 a = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(s0 + j))));
+                __m256 b = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(s0 + j + 1))));
+                __m256 c = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(s1 + j))));
+                __m256 e = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(s1 + j + 1))));
+                __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a, v00), _mm256_mul_ps(b, v01)),
+                                         _mm256_add_ps(_mm256_mul_ps(c, v10), _mm256_mul_ps(e, v11)));
+                _mm256_storeu_ps(d + j, v);
+            }
+#elif defined(CORNER_NEON)
+            for (; j + 8 <= pw; j += 8)
+            {
+                uint16x8_t a = vmovl_u8(vld1_u8(s0 + j)), b = vmovl_u8(vld1_u8(s0 + j + 1));
+                uint16x8_t c = vmovl_u8(vld1_u8(s1 + j)), e = vmovl_u8(vld1_u8(s1 + j + 1));
+                for (int h = 0; h < 2; h++)
+                {
+                    float32x4_t fa = vcvtq_f32_u32(vmovl_u16(h ? vget_high_u16(a) : vget_low_u16(a)));
+                    float32x4_t fb = vcvtq_f32_u32(vmovl_u16(h ? vget_high_u16(b) : vget_low_u16(b)));
+                    float32x4_t fc = vcvtq_f32_u32(vmovl_u16(h ? vget_high_u16(c) : vget_low_u16(c)));
+                    float32x4_t fe = vcvtq_f32_u32(vmovl_u16(h ? vget_high_u16(e) : vget_low_u16(e)));
+                    float32x4_t v = vmulq_n_f32(fa, w00);
+                    v = vmlaq_n_f32(v, fb, w01);
+                    v = vmlaq_n_f32(v, fc, w10);
+                    v = vmlaq_n_f32(v, fe, w11);
+                    vst1q_f32(d + j + 4*h, v);
+                }
+            }
+#endif
+            for (; j < pw; j++)
+                d[j] = s0[j]*w00 + s0[j + 1]*w01 + s1[j]*w10 + s1[j + 1]*w11;
+        }
+        return;
+    }
+
+    // near the border: coordinates clamped to the image
+    for (int i = 0; i < ph; i++)
+    {
+        const int y0 = std::min(std::max(iy + i, 0), img.rows - 1), y1 = std::min(std::max(iy + i + 1, 0), img.rows - 1);
+        const uchar* s0 = img.ptr<uchar>(y0);
+        const uchar* s1 = img.ptr<uchar>(y1);
+        for (int j = 0; j < pw; j++)
+        {
+            const int x0 = std::min(std::max(ix + j, 0), img.cols - 1), x1 = std::min(std::max(ix + j + 1, 0), img.cols - 1);
+            patch[i*pw + j] = s0[x0]*w00 + s0[x1]*w01 + s1[x0]*w10 + s1[x1]*w11;
+        }
+    }
+}
+
+// sums[5] = a, b, c, bb1, bb2: the normal equations of the window, coordinates relative to its center
+static void gradientSums(const float* patch, const float* mask, Size win, double* sums)
+{
+    const int ww = 2*win.width + 1, wh = 2*win.height + 1, pw = ww + 2;
+    double a = 0, b = 0, c = 0, bb1 = 0, bb2 = 0;
+    for (int i = 0; i < wh; i++)
+    {
+        const float* p = patch + (i + 1)*pw + 1;    // window row i
+        const float* m = mask + i*ww;
+        const float py = (float)(i - win.height);
+        float sxx = 0, sxy = 0, syy = 0, sxxPx = 0, sxyPx = 0;
+        int j = 0;
+#if defined(__AVX2__)
+        __m256 vxx = _mm256_setzero_ps(), vxy = _mm256_setzero_ps(), vyy = _mm256_setzero_ps();
+        __m256 vxxPx = _mm256_setzero_ps(), vxyPx = _mm256_setzero_ps();
+        __m256 px = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+        px = _mm256_sub_ps(px, _mm256_set1_ps((float)win.width));
+        const __m256 eight = _mm256_set1_ps(8);
+        for (; j + 8 <= ww; j += 8, px = _mm256_add_ps(px, eight))
+        {
+            __m256 gx = _mm256_sub_ps(_mm256_loadu_ps(p + j + 1), _mm256_loadu_ps(p + j - 1));
+            __m256 gy = _mm256_sub_ps(_mm256_loadu_ps(p + j + pw), _mm256_loadu_ps(p + j - pw));
+            __m256 w = _mm256_loadu_ps(m + j);
+            __m256 gxx = _mm256_mul_ps(_mm256_mul_ps(gx, gx), w);
+            __m256 gxy = _mm256_mul_ps(_mm256_mul_ps(gx, gy), w);
+            __m256 gyy = _mm256_mul_ps(_mm256_mul_ps(gy, gy), w);
+            vxx = _mm256_add_ps(vxx, gxx);
+            vxy = _mm256_add_ps(vxy, gxy);
+            vyy = _mm256_add_ps(vyy, gyy);
+            vxxPx = _mm256_add_ps(vxxPx, _mm256_mul_ps(gxx, px));
+            vxyPx = _mm256_add_ps(vxyPx, _mm256_mul_ps(gxy, px));
+        }
+        float t[8];
+        __m256 vs[5] = {vxx, vxy, vyy, vxxPx, vxyPx};
+        float* s[5] = {&sxx, &sxy, &syy, &sxxPx, &sxyPx};
+        for (int k = 0; k < 5; k++)
+        {
+            _mm256_storeu_ps(t, vs[k]);
+            *s[k] = t[0] + t[1] + t[2] + t[3] + t[4] + t[5] + t[6] + t[7];
+        }
+#elif defined(CORNER_NEON)
+        float32x4_t vxx = vdupq_n_f32(0), vxy = vdupq_n_f32(0), vyy = vdupq_n_f32(0);
+        float32x4_t vxxPx = vdupq_n_f32(0), vxyPx = vdupq_n_f32(0);
+        const float px0[4] = {0, 1, 2, 3};
+        float32x4_t px = vsubq_f32(vld1q_f32(px0), vdupq_n_f32((float)win.width));
+        for (; j + 4 <= ww; j += 4, px = vaddq_f32(px, vdupq_n_f32(4)))
+        {
+            float32x4_t gx = vsubq_f32(vld1q_f32(p + j + 1), vld1q_f32(p + j - 1));
+            float32x4_t gy = vsubq_f32(vld1q_f32(p + j + pw), vld1q_f32(p + j - pw));
+            float32x4_t w = vld1q_f32(m + j);
+            float32x4_t gxx = vmulq_f32(vmulq_f32(gx, gx), w);
+            float32x4_t gxy = vmulq_f32(vmulq_f32(gx, gy), w);
+            float32x4_t gyy = vmulq_f32(vmulq_f32(gy, gy), w);
+            vxx = vaddq_f32(vxx, gxx);
+            vxy = vaddq_f32(vxy, gxy);
+            vyy = vaddq_f32(vyy, gyy);
+            vxxPx = vmlaq_f32(vxxPx, gxx, px);
+            vxyPx = vmlaq_f32(vxyPx, gxy, px);
+        }
+        float32x4_t vs[5] = {vxx, vxy, vyy, vxxPx, vxyPx};
+        float* s[5] = {&sxx, &sxy, &syy, &sxxPx, &sxyPx};
+        for (int k = 0; k < 5; k++)
+        {
+            float t[4];
+            vst1q_f32(t, vs[k]);
+            *s[k] = t[0] + t[1] + t[2] + t[3];
+        }
+#endif
+        for (; j < ww; j++)
+        {
+            const float gx = p[j + 1] - p[j - 1], gy = p[j + pw] - p[j - pw];
+            const float px = (float)(j - win.width);
+            const float gxx = gx*gx*m[j], gxy = gx*gy*m[j], gyy = gy*gy*m[j];
+            sxx += gxx;
+            sxy += gxy;
+            syy += gyy;
+            sxxPx += gxx*px;
+            sxyPx += gxy*px;
+        }
+        a += sxx;
+        b += sxy;
+        c += syy;
+        bb1 += sxxPx + (double)sxy*py;
+        bb2 += sxyPx + (double)syy*py;
+    }
+    sums[0] = a;
+    sums[1] = b;
+    sums[2] = c;
+    sums[3] = bb1;
+    sums[4] = bb2;
+}
+
+static Point2f refineCorner(const Mat& img, Point2f start, Size win, const float* mask,
+                            int maxIterations, double eps, float* patch)
+{
+    const int pw = 2*win.width + 3, ph = 2*win.height + 3;
+    Point2f q = start;
+    int it = 0;
+    double err = 0;
+    do
+    {
+        samplePatch(img, q.x - win.width - 1, q.y - win.height - 1, pw, ph, patch);
+        double s[5];
+        gradientSums(patch, mask, win, s);
+        const double det = s[0]*s[2] - s[1]*s[1];
+        if (fabs(det) <= DBL_EPSILON*DBL_EPSILON)
+            break;
+        const double scale = 1/det;
+        const Point2f next((float)(q.x + s[2]*scale*s[3] - s[1]*scale*s[4]),
+                           (float)(q.y - s[1]*scale*s[3] + s[0]*scale*s[4]));
+        err = (next.x - q.x)*(next.x - q.x) + (next.y - q.y)*(next.y - q.y);
+        q = next;
+        if (q.x < 0 || q.x >= img.cols || q.y < 0 || q.y >= img.rows)
+            break;
+    } while (++it < maxIterations && err > eps);
+
+    // a corner that left its window is kept where it was found
+    if (fabs(q.x - start.x) > win.width || fabs(q.y - start.y) > win.height)
+        q = start;
+    return q;
+}
+
+void refineCorners(const vector<Mat>& grays, vector<vector<Point2f> >& corners,
+                   Size winSize, Size zeroZone, TermCriteria criteria)
+{
+    TRACE_SCOPE("refineCorners");
+    CV_Assert(grays.size() == corners.size() && winSize.width > 0 && winSize.height > 0);
+    const int maxIterations = criteria.type & TermCriteria::COUNT
+                            ? std::min(std::max(criteria.maxCount, 1), MAX_ITERATIONS) : MAX_ITERATIONS;
+    double eps = criteria.type & TermCriteria::EPS ? std::max(criteria.epsilon, 0.) : 0;
+    eps *= eps;     // on the squared move
+    vector<float> mask;
+    windowMask(winSize, zeroZone, mask);
+
+    // all the corners of all the images in one parallel loop
+    vector<int> image, first(grays.size() + 1, 0);
+    for (size_t i = 0; i < grays.size(); i++)
+    {
+        CV_Assert(grays[i].type() == CV_8UC1);
+        first[i + 1] = first[i] + (int)corners[i].size();
+        image.insert(image.end(), corners[i].size(), (int)i);
+    }
+    const int n = first.back();
+
+    #pragma omp parallel
+    {
+        vector<float> patch((2*winSize.width + 3)*(2*winSize.height + 3));
+        #pragma omp for schedule(dynamic, 8)
+        for (int k = 0; k < n; k++)
+        {
+            const int i = image[k];
+            Point2f& q = corners[i][k - first[i]];
+            q = refineCorner(grays[i], q, winSize, &mask[0], maxIterations, eps, &patch[0]);
+        }
+    }
+}
+
+void refineCorners(const Mat& gray, vector<Point2f>& corners, Size winSize, Size zeroZone, TermCriteria criteria)
+{
+    vector<Mat> grays(1, gray);
+    vector<vector<Point2f> > c(1);
+    c[0].swap(corners);
+    refineCorners(grays, c, winSize, zeroZone, criteria);
+    corners.swap(c[0]);
+}
@@ -0,0 +1,24 @@
+/// corner_refine.hpp
+/// Sub-pixel refinement of chessboard corners, as cornerSubPix(same window, mask, zero zone,
+/// termination and result up to float rounding), for all the corners of one or many images at
+/// once. The corners are refined in parallel(OpenMP), each stopping as soon as it converged,
+/// and the window sampling and gradient sums are vectorized.
+///
+/// Build with -mavx2 (x86) or on ARM with NEON to get the vectorized kernel.
+
+#ifndef CORNER_REFINE_HPP
+#define CORNER_REFINE_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+
+/// gray: CV_8UC1 image; corners: refined in place. Other arguments as cornerSubPix.
+void refineCorners(const cv::Mat& gray, std::vector<cv::Point2f>& corners,
+                   cv::Size winSize, cv::Size zeroZone, cv::TermCriteria criteria);
+
+/// The corners of all the images together: corners[i] are those of grays[i].
+void refineCorners(const std::vector<cv::Mat>& grays, std::vector<std::vector<cv::Point2f> >& corners,
+                   cv::Size winSize, cv::Size zeroZone, cv::TermCriteria criteria);
+
+#endif
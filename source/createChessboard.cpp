@@ -1,10 +1,30 @@
 /// Create an image of chessboard for camera calibration.
 /// Print the generated image on a A4 paper.
 /// (Actually displaying the image on the screen may be better)
+///
+/// With -views or -scenes, a synthetic dataset is generated instead, to benchmark calibration
+/// and matching at scale without captures:
+///   -views: stereo pairs of the board at random poses, rendered through the intrinsics,
+///           distortion and extrinsics of the rig(left0001.png, right0001.png, ...), with the
+///           image lists of camera_calib(left.xml, right.xml) and stereo_calib(stereo_calib.xml),
+///           and the true parameters and board poses(ground_truth.xml);
+///   -scenes: rectified pairs of textured planes(scene_left0001.png, ...) with their true
+///           disparity(scene_disp0001.png, 16-bit, scaled by DISP_SCALE as saved by stereo_match),
+///           the image list(scenes.xml) and the parameters of the ideal rig(scene_params.xml, in
+///           the format of stereo_calib, for stereo_match -p).
+/// Every sample is ray traced(2x2 per pixel). Views are rendered in parallel, each from its own
+/// seed, so a dataset does not depend on the number of threads.
 
+#include "opencv2/core/core.hpp"
 #include "opencv2/highgui/highgui.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include "disparity.hpp"
+#include "trace.hpp"
 
 #include <iostream>
+#include <math.h>
+#include <stdio.h>
 
 using namespace cv;
 using namespace std;
@@ -18,7 +38,236 @@ const int board_height = 9;     // the number of inner corners per col
 
 const int square_size = a4_width / (board_width + 1); // the number of square per row/col is one more than the number of corners
 
-int main()
+//--------------------------------------------------
+// Parameters of the synthetic dataset
+//--------------------------------------------------
+int views = 0;                      // board pairs
+int scenes = 0;                     // textured scene pairs
+string outputDir = ".";
+Size imageSize(640, 480);
+Size boardSize(6, 5);               // inner corners, the board of camera_calib and stereo_calib
+double squareSize = 30;             // mm
+double intrinsics[2][4] = {{500, 500, 319.5, 239.5}, {500, 500, 319.5, 239.5}};   // fx, fy, cx, cy
+double distortion[2][5] = {{-0.2, 0.05, 0, 0, 0}, {-0.2, 0.05, 0, 0, 0}};         // k1, k2, p1, p2, k3
+Vec3d rigRotation(0, 0, 0);         // right camera relative to the left one, rotation vector in degrees
+Vec3d rigTranslation(-60, 0, 0);    // mm
+double maxTilt = 35;                // degrees, of the board
+double noise = 1;                   // standard deviation of the gray levels
+uint64 seed = 1;
+
+const uchar BOARD_BLACK = 30, BOARD_WHITE = 220, BACKGROUND = 110;
+const int MAX_POSE_TRIES = 200;
+const int SCENE_BOXES = 4;
+const double SCENE_BACKGROUND_DISP[2] = {6, 16};    // pixels, range of the scene background
+const double SCENE_BOX_DISP[2] = {20, 56};          // pixels, range of the boxes in front
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void usage();
+static bool argParsing(int argc, char** argv);
+static void createA4Board();
+static Matx33d cameraMatrix(int k);
+static void sampleRays(int k, Mat& rays);
+static void randomBoardPose(RNG& rng, const Matx33d& R, const Vec3d& T, Matx33d& Rb, Vec3d& tb);
+static void renderBoard(const Mat& rays, const Matx33d& Rb, const Vec3d& tb, RNG& rng, Mat& img);
+static void renderScene(RNG& rng, double f, double cx, double cy, double baseline,
+                        Mat img[2], Mat& disp);
+static bool writeImageList(const string& fn, const vector<string>& l);
+static void generateViews();
+static void generateScenes();
+//--------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    traceFromEnv();
+    if (!argParsing(argc, argv))
+        return -1;
+
+    if (views == 0 && scenes == 0)
+    {
+        createA4Board();
+        return 0;
+    }
+    if (views > 0)
+        generateViews();
+    if (scenes > 0)
+        generateScenes();
+    return 0;
+}
+
+void usage()
+{
+    cout << "Usage:" << endl
+         << "\t./createChessboard: the A4 board, written to chessboard.jpg;" << endl
+         << "\t./createChessboard [options] -views <n> and/or -scenes <n>: synthetic dataset" << endl
+         << "\t-views <n>: stereo pairs of the board at random poses;" << endl
+         << "\t-scenes <n>: rectified stereo pairs of textured planes with their true disparity;" << endl
+         << "\t-o <dir>: output directory(must exist), default is the current one;" << endl
+         << "\t-size <width> <height>: image size, default is 640 480;" << endl
+         << "\t-w <n> -h <n>: inner corners per row and column of the board, default is 6 5;" << endl
+         << "\t-s <mm>: square size, default is 30;" << endl
+         << "\t-K <fx> <fy> <cx> <cy>: intrinsics of both cameras, default is 500 500 and the image center;" << endl
+         << "\t-K2 <fx> <fy> <cx> <cy>: intrinsics of the right camera, before or after -K;" << endl
+         << "\t-D <k1> <k2> <p1> <p2> <k3>: distortion of both cameras, default is -0.2 0.05 0 0 0;" << endl
+         << "\t-D2 <k1> <k2> <p1> <p2> <k3>: distortion of the right camera, before or after -D;" << endl
+         << "\t-R <rx> <ry> <rz>: rotation of the right camera(rotation vector in degrees), default is 0 0 0;" << endl
+         << "\t-T <tx> <ty> <tz>: translation of the right camera in mm, default is -60 0 0;" << endl
+         << "\t-tilt <degrees>: largest tilt of the board, default is 35;" << endl
+         << "\t-noise <sigma>: gray level noise, default is 1;" << endl
+         << "\t-seed <n>: random seed, default is 1." << endl;
+}
+
+static bool parseNumbers(char** argv, int& i, double* v, int n)
+{
+    for (int k = 0; k < n; k++)
+    {
+        if (sscanf(argv[++i], "%lf", &v[k]) != 1)
+            return false;
+    }
+    return true;
+}
+
+bool argParsing(int argc, char** argv)
+{
+    bool centered[2] = {true, true};
+    bool rightK = false, rightD = false;    // -K2, -D2 given: -K, -D do not apply to the right camera
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-views" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &views) != 1 || views < 0)
+            {
+                cout << "The number of views must not be negative!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-scenes" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &scenes) != 1 || scenes < 0)
+            {
+                cout << "The number of scenes must not be negative!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-o" && hasValue)
+            outputDir = argv[++i];
+        else if (arg == "-size" && i + 2 < argc)
+        {
+            if (sscanf(argv[++i], "%d", &imageSize.width) != 1 || sscanf(argv[++i], "%d", &imageSize.height) != 1 ||
+                imageSize.width < 64 || imageSize.height < 64)
+            {
+                cout << "The image size must be at least 64x64!" << endl;
+                return false;
+            }
+        }
+        else if ((arg == "-w" || arg == "-h") && hasValue)
+        {
+            int& n = arg == "-w" ? boardSize.width : boardSize.height;
+            if (sscanf(argv[++i], "%d", &n) != 1 || n < 2)
+            {
+                cout << "The board must have at least 2 inner corners per row and column!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-s" && hasValue)
+        {
+            if (sscanf(argv[++i], "%lf", &squareSize) != 1 || squareSize <= 0)
+            {
+                cout << "The square size must be positive!" << endl;
+                return false;
+            }
+        }
+        else if ((arg == "-K" || arg == "-K2") && i + 4 < argc)
+        {
+            double K[4];
+            if (!parseNumbers(argv, i, K, 4) || K[0] <= 0 || K[1] <= 0)
+            {
+                cout << "Invalid intrinsics!" << endl;
+                return false;
+            }
+            const bool right = arg == "-K2";
+            for (int k = right ? 1 : 0; k < (right || !rightK ? 2 : 1); k++)
+            {
+                copy(K, K + 4, intrinsics[k]);
+                centered[k] = false;
+            }
+            rightK = rightK || right;
+        }
+        else if ((arg == "-D" || arg == "-D2") && i + 5 < argc)
+        {
+            double D[5];
+            if (!parseNumbers(argv, i, D, 5))
+            {
+                cout << "Invalid distortion coefficients!" << endl;
+                return false;
+            }
+            const bool right = arg == "-D2";
+            for (int k = right ? 1 : 0; k < (right || !rightD ? 2 : 1); k++)
+                copy(D, D + 5, distortion[k]);
+            rightD = rightD || right;
+        }
+        else if ((arg == "-R" || arg == "-T") && i + 3 < argc)
+        {
+            if (!parseNumbers(argv, i, arg == "-R" ? rigRotation.val : rigTranslation.val, 3))
+            {
+                cout << "Invalid rotation or translation!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-tilt" && hasValue)
+        {
+            if (sscanf(argv[++i], "%lf", &maxTilt) != 1 || maxTilt < 0 || maxTilt >= 80)
+            {
+                cout << "The tilt must be between 0 and 80 degrees!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-noise" && hasValue)
+        {
+            if (sscanf(argv[++i], "%lf", &noise) != 1 || noise < 0)
+            {
+                cout << "The noise must not be negative!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-seed" && hasValue)
+        {
+            unsigned long long s;
+            if (sscanf(argv[++i], "%llu", &s) != 1)
+            {
+                cout << "Invalid seed!" << endl;
+                return false;
+            }
+            seed = s;
+        }
+        else
+        {
+            cout << "Invalid option " << arg << endl;
+            usage();
+            return false;
+        }
+    }
+
+    // the default principal point follows the image size
+    for (int k = 0; k < 2; k++)
+    {
+        if (centered[k])
+        {
+            intrinsics[k][2] = (imageSize.width - 1)/2.;
+            intrinsics[k][3] = (imageSize.height - 1)/2.;
+        }
+    }
+    if (scenes > 0 && fabs(rigTranslation[0]) < 1e-6)
+    {
+        cout << "The scenes need a horizontal baseline(-T)!" << endl;
+        return false;
+    }
+    return true;
+}
+
+void createA4Board()
 {
     // Create a black board
     Mat a4(a4_height, a4_width, CV_8U, Scalar(0));  // must assign with Scalar!
@@ -42,7 +291,413 @@ int main()
         << "board_width =" << board_width << ", board_height = " << board_height << endl;
 
     waitKey(0);
+}
 
-    return 0;
+//--------------------------------------------------
+// Board views
+//--------------------------------------------------
+Matx33d cameraMatrix(int k)
+{
+    return Matx33d(intrinsics[k][0], 0, intrinsics[k][2],
+                   0, intrinsics[k][1], intrinsics[k][3],
+                   0, 0, 1);
+}
+
+// Normalized coordinates of the undistorted ray through every sample of camera k, 2x2 samples
+// per pixel. The distortion model of projectPoints is inverted by fixed point iterations.
+void sampleRays(int k, Mat& rays)
+{
+    const double* K = intrinsics[k];
+    const double* D = distortion[k];
+    rays.create(imageSize.height*2, imageSize.width*2, CV_32FC2);
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < rays.rows; y++)
+    {
+        Point2f* r = rays.ptr<Point2f>(y);
+        const double yd = ((y + 0.5)/2 - 0.5 - K[3])/K[1];
+        for (int x = 0; x < rays.cols; x++)
+        {
+            const double xd = ((x + 0.5)/2 - 0.5 - K[2])/K[0];
+            double u = xd, v = yd;
+            for (int it = 0; it < 20; it++)
+            {
+                const double r2 = u*u + v*v;
+                const double radial = 1 + D[0]*r2 + D[1]*r2*r2 + D[4]*r2*r2*r2;
+                const double dx = 2*D[2]*u*v + D[3]*(r2 + 2*u*u);
+                const double dy = D[2]*(r2 + 2*v*v) + 2*D[3]*u*v;
+                u = (xd - dx)/radial;
+                v = (yd - dy)/radial;
+            }
+            r[x] = Point2f((float)u, (float)v);
+        }
+    }
+}
+
+// Board pose(left camera) with the whole board, margin included, inside both images.
+// The board is 30-70% of the image width wide, tilted by up to maxTilt.
+void randomBoardPose(RNG& rng, const Matx33d& R, const Vec3d& T, Matx33d& Rb, Vec3d& tb)
+{
+    const double w = (boardSize.width + 3)*squareSize, h = (boardSize.height + 3)*squareSize;
+    vector<Point3f> outline;
+    for (int k = 0; k < 4; k++)
+        outline.push_back(Point3f((float)((k & 1 ? w : 0) - 2*squareSize), (float)((k & 2 ? h : 0) - 2*squareSize), 0));
+    const Point3d center((boardSize.width - 1)*squareSize/2, (boardSize.height - 1)*squareSize/2, 0);
+
+    const Matx33d K = cameraMatrix(0);
+    for (int tries = 0; tries < MAX_POSE_TRIES; tries++)
+    {
+        // tilt about an axis in the board plane, then a rotation about the optical axis
+        const double axis = rng.uniform(0., 2*CV_PI), tilt = rng.uniform(0., maxTilt)*CV_PI/180;
+        const double roll = rng.uniform(-20., 20.)*CV_PI/180;
+        Mat Rt, Rr;
+        Rodrigues(Mat(Vec3d(cos(axis)*tilt, sin(axis)*tilt, 0)), Rt);
+        Rodrigues(Mat(Vec3d(0, 0, roll)), Rr);
+        Rb = Matx33d(Rr)*Matx33d(Rt);
+
+        const double z = K(0, 0)*w/(rng.uniform(0.3, 0.7)*imageSize.width);
+        const Vec3d c = Matx33d(K.inv())*Vec3d(rng.uniform(0.3, 0.7)*imageSize.width,
+                                                rng.uniform(0.3, 0.7)*imageSize.height, 1);
+        tb = z*c - Rb*Vec3d(center.x, center.y, center.z);
+
+        bool inside = true;
+        for (int k = 0; k < 2 && inside; k++)
+        {
+            // pose of the board in camera k
+            const Matx33d Rk = k ? R*Rb : Rb;
+            const Vec3d tk = k ? R*tb + T : tb;
+            Mat rvec;
+            Rodrigues(Mat(Rk), rvec);
+            vector<Point2f> p;
+            projectPoints(outline, rvec, Mat(tk), Mat(cameraMatrix(k)), Mat(1, 5, CV_64F, distortion[k]), p);
+            for (size_t i = 0; i < p.size() && inside; i++)
+                inside = p[i].x >= 2 && p[i].y >= 2 && p[i].x < imageSize.width - 3 && p[i].y < imageSize.height - 3;
+        }
+        if (inside)
+            return;
+    }
+    cout << "Warning: no board pose fits in both images, check the rig parameters." << endl;
+}
+
+// Gray level of the board at (X, Y) mm: inner corner (i, j) at (i*squareSize, j*squareSize),
+// one square of white margin around the squares.
+static uchar boardValue(double X, double Y)
+{
+    const int i = (int)floor(X/squareSize) + 1, j = (int)floor(Y/squareSize) + 1;
+    if (i < -1 || j < -1 || i > boardSize.width + 1 || j > boardSize.height + 1)
+        return BACKGROUND;
+    if (i < 0 || j < 0 || i > boardSize.width || j > boardSize.height)
+        return BOARD_WHITE;
+    return (i + j) % 2 ? BOARD_WHITE : BOARD_BLACK;
+}
+
+void renderBoard(const Mat& rays, const Matx33d& Rb, const Vec3d& tb, RNG& rng, Mat& img)
+{
+    // H = [r1 r2 t] maps the board point (X, Y, 1) to its ray, its inverse maps rays back
+    const Matx33d H(Rb(0, 0), Rb(0, 1), tb[0],
+                    Rb(1, 0), Rb(1, 1), tb[1],
+                    Rb(2, 0), Rb(2, 1), tb[2]);
+    const Matx33d Hi = H.inv();
+    img.create(imageSize, CV_8UC1);
+    for (int y = 0; y < img.rows; y++)
+    {
+        uchar* p = img.ptr<uchar>(y);
+        for (int x = 0; x < img.cols; x++)
+        {
+            int sum = 0;
+            for (int s = 0; s < 4; s++)
+            {
+                const Point2f& r = rays.at<Point2f>(2*y + (s >> 1), 2*x + (s & 1));
+                const Vec3d b = Hi*Vec3d(r.x, r.y, 1);
+                sum += b[2] > 0 ? boardValue(b[0]/b[2], b[1]/b[2]) : BACKGROUND;
+            }
+            p[x] = saturate_cast<uchar>(sum/4. + rng.gaussian(noise));
+        }
+    }
+}
+
+bool writeImageList(const string& fn, const vector<string>& l)
+{
+    FileStorage fs(fn, FileStorage::WRITE);
+    if (!fs.isOpened())
+    {
+        cout << "Cannot open " << fn << " for writing!" << endl;
+        return false;
+    }
+    fs << "imagelist" << "[";
+    for (size_t i = 0; i < l.size(); i++)
+        fs << l[i];
+    fs << "]";
+    return true;
+}
+
+void generateViews()
+{
+    Mat rays[2];
+    for (int k = 0; k < 2; k++)
+        sampleRays(k, rays[k]);
+    Mat Rm;
+    Rodrigues(Mat(rigRotation*(CV_PI/180)), Rm);
+    const Matx33d R = Rm;
+    const Vec3d T = rigTranslation;
+
+    vector<string> names[2], pairs;
+    Mat rvecs(views, 3, CV_64F), tvecs(views, 3, CV_64F);
+    char fn[256];
+    for (int i = 0; i < views; i++)
+    {
+        for (int k = 0; k < 2; k++)
+        {
+            sprintf(fn, "%s/%s%04d.png", outputDir.c_str(), k ? "right" : "left", i + 1);
+            names[k].push_back(fn);
+            pairs.push_back(fn);
+        }
+    }
+
+    int64 t = getTickCount();
+    bool ok = true;
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < views; i++)
+    {
+        RNG rng(seed*1000003 + i);
+        Matx33d Rb;
+        Vec3d tb;
+        randomBoardPose(rng, R, T, Rb, tb);
+        Mat rvec;
+        Rodrigues(Mat(Rb), rvec);
+        for (int j = 0; j < 3; j++)
+        {
+            rvecs.at<double>(i, j) = rvec.at<double>(j);
+            tvecs.at<double>(i, j) = tb[j];
+        }
+
+        for (int k = 0; k < 2; k++)
+        {
+            Mat img;
+            renderBoard(rays[k], k ? R*Rb : Rb, k ? R*tb + T : tb, rng, img);
+            TRACE_SCOPE("imwrite");
+            if (!imwrite(names[k][i], img))
+            {
+                #pragma omp atomic write
+                ok = false;
+            }
+        }
+    }
+    const double seconds = (getTickCount() - t)/getTickFrequency();
+    if (!ok)
+    {
+        cout << "Cannot write the images to " << outputDir << "!" << endl;
+        return;
+    }
+
+    writeImageList(outputDir + "/left.xml", names[0]);
+    writeImageList(outputDir + "/right.xml", names[1]);
+    writeImageList(outputDir + "/stereo_calib.xml", pairs);
+
+    // true parameters, in the format of stereo_calib
+    FileStorage fs(outputDir + "/ground_truth.xml", FileStorage::WRITE);
+    const Mat E = Mat(Matx33d(0, -T[2], T[1], T[2], 0, -T[0], -T[1], T[0], 0)*R);
+    const Matx33d K1 = cameraMatrix(0), K2 = cameraMatrix(1);
+    Mat F = Mat(K2.inv().t()*Matx33d(E)*K1.inv());
+    F /= F.at<double>(2, 2);
+    fs << "imageWidth" << imageSize.width << "imageHeight" << imageSize.height
+       << "boardWidth" << boardSize.width << "boardHeight" << boardSize.height << "squareSize" << squareSize;
+    fs << "cameraMatrix1" << Mat(K1) << "distCoeffs1" << Mat(5, 1, CV_64F, distortion[0]).clone()
+       << "cameraMatrix2" << Mat(K2) << "distCoeffs2" << Mat(5, 1, CV_64F, distortion[1]).clone();
+    fs << "R" << Mat(R) << "T" << Mat(T) << "E" << E << "F" << F;
+    cvWriteComment(*fs, "Board poses in the left camera, a row per view; the inner corner of column i and row j is at (i, j, 0)*squareSize:\n", 0);
+    fs << "rvecs" << rvecs << "tvecs" << tvecs;
+
+    cout << views << " board pairs written to " << outputDir << " in " << seconds << " s("
+         << 2*views/seconds << " images/s)" << endl;
+}
+
+//--------------------------------------------------
+// Textured scenes
+//--------------------------------------------------
+// Value noise: smooth interpolation of random values on a unit lattice
+static float latticeValue(int i, int j, unsigned s)
+{
+    unsigned h = (unsigned)i*73856093u ^ (unsigned)j*19349663u ^ s*83492791u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return (h & 0xffff)/65535.f;
 }
 
+static float valueNoise(double u, double v, unsigned s)
+{
+    const double fu = floor(u), fv = floor(v);
+    const int i = (int)fu, j = (int)fv;
+    double a = u - fu, b = v - fv;
+    a = a*a*(3 - 2*a);
+    b = b*b*(3 - 2*b);
+    const float v00 = latticeValue(i, j, s), v10 = latticeValue(i + 1, j, s);
+    const float v01 = latticeValue(i, j + 1, s), v11 = latticeValue(i + 1, j + 1, s);
+    return (float)((v00*(1 - a) + v10*a)*(1 - b) + (v01*(1 - a) + v11*a)*b);
+}
+
+// Gray level of a texture at (u, v) mm, octaves of 64 to 4 mm
+static double textureValue(double u, double v, unsigned s)
+{
+    double sum = 0, weight = 0, amplitude = 1;
+    for (double scale = 64; scale >= 4; scale /= 2, amplitude *= 0.7)
+    {
+        sum += amplitude*valueNoise(u/scale, v/scale, s++);
+        weight += amplitude;
+    }
+    return 20 + 215*sum/weight;
+}
+
+// n.X = d, limited to x0 <= X < x1, y0 <= Y < y1 if bounded
+struct ScenePlane
+{
+    Vec3d n;
+    double d;
+    bool bounded;
+    double x0, x1, y0, y1;
+    unsigned texture;
+};
+
+// Nearest plane along the ray C + s*(x, y, 1): returns its depth s(0 if none) and gray level.
+static double traceRay(const vector<ScenePlane>& planes, const Vec3d& C, double x, double y, double& value)
+{
+    const Vec3d dir(x, y, 1);
+    double best = 0;
+    int hit = -1;
+    for (size_t i = 0; i < planes.size(); i++)
+    {
+        const ScenePlane& p = planes[i];
+        const double den = p.n.dot(dir);
+        if (fabs(den) < 1e-12)
+            continue;
+        const double s = (p.d - p.n.dot(C))/den;
+        if (s <= 0 || (hit >= 0 && s >= best))
+            continue;
+        const double X = C[0] + s*x, Y = C[1] + s*y;
+        if (p.bounded && (X < p.x0 || X >= p.x1 || Y < p.y0 || Y >= p.y1))
+            continue;
+        best = s;
+        hit = (int)i;
+    }
+    value = hit >= 0 ? textureValue(C[0] + best*x, C[1] + best*y, planes[hit].texture) : BACKGROUND;
+    return best;
+}
+
+// Rectified pair of a slanted background plane and fronto-parallel boxes, and the true
+// disparity of the left image(CV_16S, scaled by DISP_SCALE, DISP_INVALID where nothing is hit).
+void renderScene(RNG& rng, double f, double cx, double cy, double baseline, Mat img[2], Mat& disp)
+{
+    const double zOf = f*baseline;     // depth of disparity 1
+    vector<ScenePlane> planes;
+    ScenePlane bg;
+    const double z0 = zOf/rng.uniform(SCENE_BACKGROUND_DISP[0], SCENE_BACKGROUND_DISP[1]);
+    const double a = rng.uniform(-0.25, 0.25), b = rng.uniform(-0.25, 0.25);
+    bg.n = Vec3d(-a, -b, 1);            // Z = z0 + a*X + b*Y
+    bg.d = z0;
+    bg.bounded = false;
+    bg.texture = rng.next();
+    planes.push_back(bg);
+    for (int k = 0; k < SCENE_BOXES; k++)
+    {
+        ScenePlane box;
+        const double z = zOf/rng.uniform(SCENE_BOX_DISP[0], SCENE_BOX_DISP[1]);
+        const double w = rng.uniform(0.1, 0.3)*imageSize.width, h = rng.uniform(0.1, 0.3)*imageSize.height;
+        const double u = rng.uniform(0., imageSize.width - w), v = rng.uniform(0., imageSize.height - h);
+        box.n = Vec3d(0, 0, 1);
+        box.d = z;
+        box.bounded = true;
+        box.x0 = (u - cx)*z/f;
+        box.x1 = (u + w - cx)*z/f;
+        box.y0 = (v - cy)*z/f;
+        box.y1 = (v + h - cy)*z/f;
+        box.texture = rng.next();
+        planes.push_back(box);
+    }
+
+    disp.create(imageSize, CV_16S);
+    for (int k = 0; k < 2; k++)
+    {
+        const Vec3d C(k ? baseline : 0, 0, 0);
+        img[k].create(imageSize, CV_8UC1);
+        for (int y = 0; y < imageSize.height; y++)
+        {
+            uchar* p = img[k].ptr<uchar>(y);
+            short* d = disp.ptr<short>(y);
+            for (int x = 0; x < imageSize.width; x++)
+            {
+                double sum = 0, value;
+                for (int s = 0; s < 4; s++)
+                {
+                    traceRay(planes, C, (x - 0.25 + 0.5*(s & 1) - cx)/f, (y - 0.25 + 0.5*(s >> 1) - cy)/f, value);
+                    sum += value;
+                }
+                p[x] = saturate_cast<uchar>(sum/4 + rng.gaussian(noise));
+                if (k == 0)
+                {
+                    const double z = traceRay(planes, C, (x - cx)/f, (y - cy)/f, value);
+                    d[x] = z > 0 ? saturate_cast<short>(zOf/z*DISP_SCALE) : DISP_INVALID;
+                }
+            }
+        }
+    }
+}
+
+void generateScenes()
+{
+    // ideal rectified rig: the left intrinsics without distortion, the horizontal baseline
+    const double f = intrinsics[0][0], cx = intrinsics[0][2], cy = intrinsics[0][3];
+    const double baseline = fabs(rigTranslation[0]);
+
+    vector<string> pairs;
+    char fn[256];
+    for (int i = 0; i < scenes; i++)
+    {
+        for (int k = 0; k < 2; k++)
+        {
+            sprintf(fn, "%s/scene_%s%04d.png", outputDir.c_str(), k ? "right" : "left", i + 1);
+            pairs.push_back(fn);
+        }
+    }
+
+    int64 t = getTickCount();
+    bool ok = true;
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < scenes; i++)
+    {
+        RNG rng((seed + 1)*1000003 + i);
+        Mat img[2], disp;
+        renderScene(rng, f, cx, cy, baseline, img, disp);
+        char dispFn[256];
+        sprintf(dispFn, "%s/scene_disp%04d.png", outputDir.c_str(), i + 1);
+        TRACE_SCOPE("imwrite");
+        if (!imwrite(pairs[2*i], img[0]) || !imwrite(pairs[2*i + 1], img[1]) || !imwrite(dispFn, disp))
+        {
+            #pragma omp atomic write
+            ok = false;
+        }
+    }
+    const double seconds = (getTickCount() - t)/getTickFrequency();
+    if (!ok)
+    {
+        cout << "Cannot write the scenes to " << outputDir << "!" << endl;
+        return;
+    }
+    writeImageList(outputDir + "/scenes.xml", pairs);
+
+    // stereo_params.xml of the rig, the rectification is the identity
+    FileStorage fs(outputDir + "/scene_params.xml", FileStorage::WRITE);
+    const Matx33d K(f, 0, cx, 0, f, cy, 0, 0, 1);
+    const Mat D = Mat::zeros(5, 1, CV_64F);
+    const Matx34d P1(f, 0, cx, 0, 0, f, cy, 0, 0, 0, 1, 0);
+    const Matx34d P2(f, 0, cx, -f*baseline, 0, f, cy, 0, 0, 0, 1, 0);
+    const Matx44d Q(1, 0, 0, -cx, 0, 1, 0, -cy, 0, 0, 0, f, 0, 0, 1/baseline, 0);
+    fs << "cameraMatrix1" << Mat(K) << "distCoeffs1" << D << "cameraMatrix2" << Mat(K) << "distCoeffs2" << D;
+    fs << "R" << Mat(Matx33d::eye()) << "T" << Mat(Vec3d(-baseline, 0, 0));
+    cvWriteComment(*fs, "\nRectification params:\n", 0);
+    fs << "R1" << Mat(Matx33d::eye()) << "R2" << Mat(Matx33d::eye())
+       << "P1" << Mat(P1) << "P2" << Mat(P2) << "Q" << Mat(Q);
+
+    cout << scenes << " scene pairs written to " << outputDir << " in " << seconds << " s("
+         << 2*scenes/seconds << " images/s)" << endl;
+}
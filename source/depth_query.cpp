@@ -0,0 +1,206 @@
+/// depth_query.cpp
+/// Depth of regions of interest in stereo image pairs, without matching the full frame.
+///
+/// Input: xml/yaml file containing image list(left01, right01, left02, ...) as used by stereo_calib,
+///        the stereo parameters saved by stereo_calib(stereo_params.xml), and regions of the raw
+///        left images, given with -roi or as a grid of regions with -grid;
+/// Output: median and nearest depth(unit of the calibration) and confidence of every region,
+///         and the query rate of each pair.
+///
+/// Ref:
+///     roi_depth.hpp
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "calibration.hpp"
+#include "roi_depth.hpp"
+#include "trace.hpp"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+
+using namespace cv;
+using namespace std;
+
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+string stereoParamsFn = "stereo_params.xml";    // output of stereo_calib
+string imageListFn;             // image list filename
+vector<Rect> rois;              // regions given with -roi
+int gridSize = 0;               // with -grid, regions of gridSize x gridSize pixels covering the image
+bool quiet = false;             // only report the query rate
+RoiDepthParams depthParams;
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void usage();
+static bool argParsing(int argc, char** argv);
+//--------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    traceFromEnv();
+    if (!argParsing(argc, argv))
+        return -1;
+
+    vector<string> imageList;
+    if (!readStringList(imageListFn, imageList) || imageList.size() < 2)
+    {
+        cout << "Cannot open " << imageListFn << " or the list contains no image pair. Exiting." << endl;
+        return -1;
+    }
+
+    RoiDepthEstimator estimator(depthParams);
+    Size imageSize;
+    for (size_t i = 0; i + 1 < imageList.size(); i += 2)
+    {
+        Mat left, right;
+        {
+            TRACE_SCOPE("imread");
+            left = imread(imageList[i], CV_LOAD_IMAGE_GRAYSCALE);
+            right = imread(imageList[i + 1], CV_LOAD_IMAGE_GRAYSCALE);
+        }
+        if (left.empty() || right.empty() || left.size() != right.size())
+        {
+            cout << "Cannot read the pair " << imageList[i] << ". Skipping." << endl;
+            continue;
+        }
+        if (imageSize != left.size())
+        {
+            imageSize = left.size();
+            if (!estimator.load(stereoParamsFn, imageSize))
+            {
+                cout << stereoParamsFn << " does not contain the rectification result of stereo_calib!" << endl;
+                return -1;
+            }
+        }
+
+        vector<Rect> queries = rois;
+        for (int y = 0; gridSize > 0 && y + gridSize <= imageSize.height; y += gridSize)
+            for (int x = 0; x + gridSize <= imageSize.width; x += gridSize)
+                queries.push_back(Rect(x, y, gridSize, gridSize));
+
+        vector<RoiDepth> depths;
+        int64 t = getTickCount();
+        estimator.setFrame(left, right);
+        estimator.query(queries, depths);
+        t = getTickCount() - t;
+        double ms = t*1000/getTickFrequency();
+        cout << imageList[i] << ": " << queries.size() << " regions in " << ms << " ms("
+             << queries.size()*1000/max(ms, 1e-3) << " per second), "
+             << 100.*estimator.rectifiedTiles()/max(estimator.tiles(), 1) << "% of the frame rectified" << endl;
+
+        for (size_t k = 0; k < depths.size() && !quiet; k++)
+        {
+            const Rect& r = queries[k];
+            const RoiDepth& d = depths[k];
+            cout << "\t[" << r.x << ", " << r.y << ", " << r.width << ", " << r.height << "]: ";
+            if (d.validPixels == 0)
+                cout << "no valid disparity" << endl;
+            else
+                cout << "median " << d.median << ", nearest " << d.nearest
+                     << ", confidence " << d.confidence << endl;
+        }
+    }
+    return 0;
+}
+
+void usage()
+{
+    cout << "Usage:" << endl
+         << "\t./depth_query [options] <image list XML/YML file>" << endl
+         << "\t-p <stereo_params.xml>: output of stereo_calib, default is 'stereo_params.xml';" << endl
+         << "\t-roi <x> <y> <width> <height>: region of the left image, may be repeated;" << endl
+         << "\t-grid <size>: query all size x size regions of the image(e.g. to measure the rate);" << endl
+         << "\t-n <numDisparities>: search range, multiple of 16, default is 64;" << endl
+         << "\t-census <5x5|7x9>: census window, default is 5x5;" << endl
+         << "\t-near <percentile>: percentile of the depths reported as the nearest, default is 2;" << endl
+         << "\t-q: only report the query rate." << endl;
+}
+
+bool argParsing(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-p" && hasValue)
+            stereoParamsFn = argv[++i];
+        else if (arg == "-roi" && i + 4 < argc)
+        {
+            Rect r;
+            if (sscanf(argv[i + 1], "%d", &r.x) != 1 || sscanf(argv[i + 2], "%d", &r.y) != 1
+                || sscanf(argv[i + 3], "%d", &r.width) != 1 || sscanf(argv[i + 4], "%d", &r.height) != 1
+                || r.width <= 0 || r.height <= 0)
+            {
+                cout << "Invalid region!" << endl;
+                return false;
+            }
+            rois.push_back(r);
+            i += 4;
+        }
+        else if (arg == "-grid" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &gridSize) != 1 || gridSize <= 0)
+            {
+                cout << "The grid size must be positive!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-n" && hasValue)
+        {
+            int& n = depthParams.match.numDisparities;
+            if (sscanf(argv[++i], "%d", &n) != 1 || n <= 0 || n % 16 != 0)
+            {
+                cout << "numDisparities must be a positive multiple of 16!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-census" && hasValue)
+        {
+            string window = argv[++i];
+            if (window == "5x5")
+                depthParams.match.cost = COST_CENSUS_5X5;
+            else if (window == "7x9")
+                depthParams.match.cost = COST_CENSUS_7X9;
+            else
+            {
+                cout << "Invalid census window " << window << endl;
+                return false;
+            }
+        }
+        else if (arg == "-near" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &depthParams.nearPercentile) != 1
+                || depthParams.nearPercentile < 0 || depthParams.nearPercentile > 100)
+            {
+                cout << "The percentile must be in [0, 100]!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-q")
+            quiet = true;
+        else if (arg[0] == '-')
+        {
+            cout << "Invalid option " << arg << endl;
+            usage();
+            return false;
+        }
+        else
+            imageListFn = arg;
+    }
+
+    if (rois.empty() && gridSize == 0)
+    {
+        cout << "No region given!" << endl;
+        usage();
+        return false;
+    }
+    if (imageListFn.empty())
+        imageListFn = "stereo_calib.xml";
+    return true;
+}
@@ -8,6 +8,8 @@
 #include "opencv2/core/core.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
+#include "stereo_capture.hpp"
+#include "trace.hpp"
 #include "omp.h"
 #include <iostream>
 
@@ -20,28 +22,24 @@ int main(int argc, char* argv[])
 {
     // In case that the computer has built-in cameras, we allow the ID of left camera as optional input
     int camera_offset = 0;
+    traceFromEnv();
     if(argc == 2)
         if(*argv[1] >= '0' && *argv[1] <= '9')
             camera_offset = *argv[1] - '0';
 
-	VideoCapture cap[CAM_NUM];
+    // The cameras camera_offset and camera_offset+1 are opened and grabbed in parallel
+	StereoCapture stereo;
 	int i;
 
-	#pragma omp parallel for //private(i)    // loop index is private by default
-	for (i = camera_offset; i < CAM_NUM; i++)
-	{
-		cap[i].open(i);
-        // Check if the file was opened properly
-        if(!cap[i].isOpened())
-        {
-            cout << "Capture could not be opened successfully" << endl;
-            return -1;
-        }
-	}
+    if(!stereo.openCameras(camera_offset))
+    {
+        cout << "Capture could not be opened successfully" << endl;
+        return -1;
+    }
 
     // Origin size of camera input
-	int origin_width = cap[0].get(CV_CAP_PROP_FRAME_WIDTH);
-	int origin_height = cap[0].get(CV_CAP_PROP_FRAME_HEIGHT);
+	int origin_width = stereo.frameSize().width;
+	int origin_height = stereo.frameSize().height;
     // If we put two video in a row directly, the window will be too wide for the screen.
     // So scale them by 4/5.
     int width = origin_width * 4 / 5;
@@ -51,7 +49,7 @@ int main(int argc, char* argv[])
 	int display_height = height;
 
 	Mat imageShow(display_height, display_width, CV_8UC3);  // used for display
-	Mat img;                    // store input frames
+	Mat frame[CAM_NUM];         // store input frames
 	Mat img_scaled;             // used for scaling the inputs
     // coordinates of top left corner of each camera input at different place of the display window
 	int coord_left, coord_top;
@@ -61,22 +59,23 @@ int main(int argc, char* argv[])
 
 	while (runflag)
 	{
+        // Either input channel finishes will stop both channels.
+        // (break/return may not leave a parallel region, so the frames are read before it)
+        if (stereo.read(frame) != 1)
+            break;
+
 #define PARALLEL_METHOD 1
         //----------------------------------------------------------------------
 #if PARALLEL_METHOD == 1
         // 1.We can use parallel loops
-		#pragma omp parallel for private(img, img_scaled, coord_left, coord_top)    // private eliminates data competition
-		for (i = camera_offset; i < CAM_NUM; i++)
+		#pragma omp parallel for private(img_scaled, coord_left, coord_top)    // private eliminates data competition
+		for (i = 0; i < CAM_NUM; i++)
 		{
-			cap[i] >> img;
-			if (img.empty())
-			{
-				runflag = false;    // Either input channel finishes will stop both channels
-				break;
-			}
-
             // Scale the input
-            resize(img, img_scaled, Size(width, height));
+            {
+                TRACE_SCOPE("resize");
+                resize(frame[i], img_scaled, Size(width, height));
+            }
 
             // Solve for the coordinates of top left corner of the child window
 			coord_left = i % 2 * width;
@@ -87,19 +86,12 @@ int main(int argc, char* argv[])
         //----------------------------------------------------------------------
 #elif PARALLEL_METHOD == 2
         // 2.or we can also use sections worksharing construct(usually used for acyclic structure)
-        #pragma omp parallel sections private(img img_scaled coord_left coord_top)
+        #pragma omp parallel sections private(img_scaled, coord_left, coord_top)
         {
             #pragma omp section
             {
-                cap[0] >> img;
-                if (img.empty())
-                {
-                    runflag = false;    // Either input channel finishes will stop both channels
-                    break;
-                }
-
                 // Scale the input
-                resize(img, img_scaled, Size(width, height));
+                resize(frame[0], img_scaled, Size(width, height));
 
                 // Solve for the coordinates of top left corner of the child window
                 coord_left = 0;
@@ -110,15 +102,8 @@ int main(int argc, char* argv[])
             }
             #pragma omp section
             {
-                cap[1] >> img;
-                if (img.empty())
-                {
-                    runflag = false;    // Either input channel finishes will stop both channels
-                    break;
-                }
-
                 // Scale the input
-                resize(img, img_scaled, Size(width, height));
+                resize(frame[1], img_scaled, Size(width, height));
 
                 // Solve for the coordinates of top left corner of the child window
                 coord_left = width;
@@ -0,0 +1,467 @@
+/// disp_codec.cpp
+/// Disparity map codec and stream files.
+///
+/// Every pixel is predicted by the median edge detector of LOCO-I from its left(a), upper(b)
+/// and upper left(c) neighbours: min(a, b) or max(a, b) across an edge, a + b - c on smooth
+/// surfaces. The 16-bit residual is zigzag mapped(0, -1, 1, -2, ... -> 0, 1, 2, 3, ...) and coded
+/// as bytes:
+///     0x00-0xDF       the residual itself
+///     0xE0-0xFD       a run of 1-30 zero residuals
+///     0xFE <varint>   a longer run of zero residuals(runs may cross rows)
+///     0xFF <lo> <hi>  a residual of 16 bits
+/// Invalid regions and flat surfaces become runs, smooth surfaces mostly one byte per pixel.
+///
+/// Stream file, little endian:
+///     header  "DSPS", version, width, height                       (4 x 4 bytes)
+///     frames  "DFRM", code bytes, timestamp(8 bytes), code
+///     index   per frame: offset(8 bytes), code bytes, 0, timestamp(8 bytes)
+///     tail    index offset(8 bytes), frames, "DIDX"
+///
+/// Ref:
+///     Weinberger et al., The LOCO-I Lossless Image Compression Algorithm, 2000
+
+#include "disp_codec.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/types.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+const int LITERAL_MAX = 0xDF;
+const int RUN_BASE = 0xE0;
+const int RUN_MAX = 0xFD - RUN_BASE + 1;
+const int LONG_RUN = 0xFE;
+const int LONG_LITERAL = 0xFF;
+
+const unsigned STREAM_VERSION = 1;
+const int HEADER_BYTES = 16;
+const int RECORD_BYTES = 16;
+const int INDEX_ENTRY_BYTES = 24;
+const int TAIL_BYTES = 16;
+
+//--------------------------------------------------
+// Codec
+//--------------------------------------------------
+// u: row above, NULL in the first row
+static inline int predict(const short* r, const short* u, int x)
+{
+    if (!u)
+        return x ? r[x-1] : 0;
+    if (x == 0)
+        return u[0];
+    const int a = r[x-1], b = u[x], c = u[x-1];
+    const int hi = std::max(a, b), lo = std::min(a, b);
+    return c >= hi ? lo : c <= lo ? hi : a + b - c;
+}
+
+// Zigzag residuals of row r against predict(). The encoder knows all neighbours beforehand,
+// so it uses the branch-free form median(a, b, a + b - c), which the compiler vectorizes.
+static void residualRow(const short* r, const short* u, int W, ushort* z)
+{
+    for (int x = 0; x < W; x++)
+    {
+        int pred;
+        if (u && x > 0)
+        {
+            const int a = r[x-1], b = u[x], g = a + b - u[x-1];
+            pred = std::max(std::min(a, b), std::min(std::max(a, b), g));
+        }
+        else
+            pred = predict(r, u, x);
+        const int e = (short)(r[x] - pred);
+        z[x] = (ushort)(((unsigned)e << 1) ^ (unsigned)(e >> 15));
+    }
+}
+
+static inline uchar* putRun(uchar* p, int run)
+{
+    if (run <= RUN_MAX)
+    {
+        *p++ = (uchar)(RUN_BASE + run - 1);
+        return p;
+    }
+    *p++ = LONG_RUN;
+    for ( ; run >= 0x80; run >>= 7)
+        *p++ = (uchar)(run | 0x80);
+    *p++ = (uchar)run;
+    return p;
+}
+
+size_t encodeDisparity(const Mat& disp, vector<uchar>& out)
+{
+    CV_Assert(disp.type() == CV_16S);
+    const int W = disp.cols, H = disp.rows;
+    const size_t start = out.size();
+    // at most 3 bytes per pixel, plus the last run
+    out.resize(start + 3*(size_t)W*H + 8);
+    uchar* p = &out[start];
+    vector<ushort> residuals(W);
+    ushort* zr = &residuals[0];
+
+    int run = 0;
+    for (int y = 0; y < H; y++)
+    {
+        residualRow(disp.ptr<short>(y), y ? disp.ptr<short>(y - 1) : NULL, W, zr);
+        for (int x = 0; x < W; x++)
+        {
+            const unsigned z = zr[x];
+            if (z == 0)
+            {
+                run++;
+                continue;
+            }
+            if (run)
+            {
+                p = putRun(p, run);
+                run = 0;
+            }
+            if (z <= (unsigned)LITERAL_MAX)
+                *p++ = (uchar)z;
+            else
+            {
+                p[0] = LONG_LITERAL;
+                p[1] = (uchar)z;
+                p[2] = (uchar)(z >> 8);
+                p += 3;
+            }
+        }
+    }
+    if (run)
+        p = putRun(p, run);
+
+    const size_t n = p - &out[start];
+    out.resize(start + n);
+    return n;
+}
+
+bool decodeDisparity(const uchar* data, size_t n, Size size, Mat& disp)
+{
+    disp.create(size, CV_16S);
+    const uchar* p = data;
+    const uchar* end = data + n;
+
+    int run = 0;
+    for (int y = 0; y < size.height; y++)
+    {
+        short* r = disp.ptr<short>(y);
+        const short* u = y ? disp.ptr<short>(y - 1) : NULL;
+        for (int x = 0; x < size.width; x++)
+        {
+            unsigned z = 0;
+            if (run > 0)
+                run--;
+            else
+            {
+                if (p >= end)
+                    return false;
+                const int c = *p++;
+                if (c <= LITERAL_MAX)
+                    z = c;
+                else if (c < LONG_RUN)
+                    run = c - RUN_BASE;     // this pixel is the first of the run
+                else if (c == LONG_RUN)
+                {
+                    int len = 0;
+                    for (int shift = 0; ; shift += 7)
+                    {
+                        if (p >= end || shift > 28)
+                            return false;
+                        const int b = *p++;
+                        len |= (b & 0x7F) << shift;
+                        if (!(b & 0x80))
+                            break;
+                    }
+                    if (len <= RUN_MAX)
+                        return false;
+                    run = len - 1;
+                }
+                else
+                {
+                    if (end - p < 2)
+                        return false;
+                    z = p[0] | (p[1] << 8);
+                    p += 2;
+                }
+            }
+            const int e = (int)(z >> 1) ^ -(int)(z & 1);
+            r[x] = (short)(predict(r, u, x) + e);
+        }
+    }
+    return run == 0 && p == end;
+}
+
+//--------------------------------------------------
+// Stream files
+//--------------------------------------------------
+static inline void put32(uchar* p, unsigned v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (uchar)(v >> 8*i);
+}
+
+static inline void put64(uchar* p, int64 v)
+{
+    put32(p, (unsigned)v);
+    put32(p + 4, (unsigned)((uint64)v >> 32));
+}
+
+static inline unsigned get32(const uchar* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static inline int64 get64(const uchar* p)
+{
+    return (int64)(get32(p) | ((uint64)get32(p + 4) << 32));
+}
+
+static inline unsigned tag(const char* s)
+{
+    return get32((const uchar*)s);
+}
+
+// 64-bit file positions: fseeko/ftello are POSIX, the Windows runtime has _fseeki64/_ftelli64
+static inline int seekFile(FILE* f, int64 offset, int origin)
+{
+#ifdef _WIN32
+    return _fseeki64(f, offset, origin);
+#else
+    return fseeko(f, (off_t)offset, origin);
+#endif
+}
+
+static inline int64 tellFile(FILE* f)
+{
+#ifdef _WIN32
+    return _ftelli64(f);
+#else
+    return ftello(f);
+#endif
+}
+
+DispStreamWriter::DispStreamWriter()
+    : f(NULL), offset(0)
+{
+}
+
+DispStreamWriter::~DispStreamWriter()
+{
+    close();
+}
+
+bool DispStreamWriter::open(const string& filename, Size _size)
+{
+    close();
+    CV_Assert(_size.width > 0 && _size.height > 0);
+    f = fopen(filename.c_str(), "wb");
+    if (!f)
+        return false;
+    size = _size;
+    index.clear();
+
+    uchar header[HEADER_BYTES];
+    put32(header, tag("DSPS"));
+    put32(header + 4, STREAM_VERSION);
+    put32(header + 8, size.width);
+    put32(header + 12, size.height);
+    offset = HEADER_BYTES;
+    return fwrite(header, 1, HEADER_BYTES, f) == HEADER_BYTES;
+}
+
+bool DispStreamWriter::isOpened() const
+{
+    return f != NULL;
+}
+
+bool DispStreamWriter::write(const Mat& disp, int64 timestamp)
+{
+    TRACE_SCOPE("DispStreamWriter::write");
+    CV_Assert(f && disp.type() == CV_16S && disp.size() == size);
+    buf.resize(RECORD_BYTES);
+    const size_t n = encodeDisparity(disp, buf);
+    put32(&buf[0], tag("DFRM"));
+    put32(&buf[4], (unsigned)n);
+    put64(&buf[8], timestamp);
+    if (fwrite(&buf[0], 1, buf.size(), f) != buf.size())
+        return false;
+
+    DispFrameInfo info;
+    info.offset = offset;
+    info.bytes = (int)n;
+    info.timestamp = timestamp;
+    index.push_back(info);
+    offset += buf.size();
+    return true;
+}
+
+bool DispStreamWriter::close()
+{
+    if (!f)
+        return true;
+    vector<uchar> tail(index.size()*INDEX_ENTRY_BYTES + TAIL_BYTES, 0);
+    for (size_t i = 0; i < index.size(); i++)
+    {
+        uchar* e = &tail[i*INDEX_ENTRY_BYTES];
+        put64(e, index[i].offset);
+        put32(e + 8, index[i].bytes);
+        put64(e + 16, index[i].timestamp);
+    }
+    uchar* t = &tail[index.size()*INDEX_ENTRY_BYTES];
+    put64(t, offset);
+    put32(t + 8, (unsigned)index.size());
+    put32(t + 12, tag("DIDX"));
+
+    bool ok = fwrite(&tail[0], 1, tail.size(), f) == tail.size();
+    ok = fclose(f) == 0 && ok;
+    f = NULL;
+    offset += tail.size();
+    return ok;
+}
+
+int DispStreamWriter::frames() const
+{
+    return (int)index.size();
+}
+
+int64 DispStreamWriter::bytesWritten() const
+{
+    return offset;
+}
+
+DispStreamReader::DispStreamReader()
+    : f(NULL)
+{
+}
+
+DispStreamReader::~DispStreamReader()
+{
+    close();
+}
+
+bool DispStreamReader::open(const string& filename)
+{
+    close();
+    f = fopen(filename.c_str(), "rb");
+    if (!f)
+        return false;
+
+    uchar header[HEADER_BYTES];
+    if (fread(header, 1, HEADER_BYTES, f) != HEADER_BYTES || get32(header) != tag("DSPS")
+        || get32(header + 4) != STREAM_VERSION)
+    {
+        close();
+        return false;
+    }
+    mapSize = Size((int)get32(header + 8), (int)get32(header + 12));
+    if (mapSize.width <= 0 || mapSize.height <= 0 || (!readIndex() && !scanFrames()))
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+// the index written by close()
+bool DispStreamReader::readIndex()
+{
+    uchar t[TAIL_BYTES];
+    if (seekFile(f, -TAIL_BYTES, SEEK_END) != 0)
+        return false;
+    const int64 end = tellFile(f);
+    if (fread(t, 1, TAIL_BYTES, f) != TAIL_BYTES || get32(t + 12) != tag("DIDX"))
+        return false;
+    const int64 at = get64(t);
+    const int64 n = get32(t + 8);
+    if (at < HEADER_BYTES || at + n*INDEX_ENTRY_BYTES != end)
+        return false;
+
+    vector<uchar> entries(n*INDEX_ENTRY_BYTES + 1);
+    if (seekFile(f, at, SEEK_SET) != 0 || fread(&entries[0], 1, n*INDEX_ENTRY_BYTES, f) != (size_t)(n*INDEX_ENTRY_BYTES))
+        return false;
+    index.resize(n);
+    for (int64 i = 0; i < n; i++)
+    {
+        const uchar* e = &entries[i*INDEX_ENTRY_BYTES];
+        index[i].offset = get64(e);
+        index[i].bytes = (int)get32(e + 8);
+        index[i].timestamp = get64(e + 16);
+        if (index[i].offset < HEADER_BYTES || index[i].bytes < 0
+            || index[i].offset + RECORD_BYTES + index[i].bytes > at)
+            return false;
+    }
+    return true;
+}
+
+// without an index(the writer was not closed), the frame records are walked from the start;
+// a frame cut off at the end of the file is left out
+bool DispStreamReader::scanFrames()
+{
+    index.clear();
+    if (seekFile(f, 0, SEEK_END) != 0)
+        return false;
+    const int64 end = tellFile(f);
+    int64 at = HEADER_BYTES;
+    uchar record[RECORD_BYTES];
+    while (at + RECORD_BYTES <= end)
+    {
+        if (seekFile(f, at, SEEK_SET) != 0 || fread(record, 1, RECORD_BYTES, f) != RECORD_BYTES
+            || get32(record) != tag("DFRM"))
+            break;
+        DispFrameInfo info;
+        info.offset = at;
+        info.bytes = (int)get32(record + 4);
+        info.timestamp = get64(record + 8);
+        if (info.bytes < 0 || at + RECORD_BYTES + info.bytes > end)
+            break;
+        index.push_back(info);
+        at += RECORD_BYTES + info.bytes;
+    }
+    return true;
+}
+
+bool DispStreamReader::isOpened() const
+{
+    return f != NULL;
+}
+
+void DispStreamReader::close()
+{
+    if (f)
+        fclose(f);
+    f = NULL;
+    index.clear();
+}
+
+int DispStreamReader::frames() const
+{
+    return (int)index.size();
+}
+
+Size DispStreamReader::size() const
+{
+    return mapSize;
+}
+
+const DispFrameInfo& DispStreamReader::frameInfo(int frame) const
+{
+    CV_Assert(0 <= frame && frame < (int)index.size());
+    return index[frame];
+}
+
+bool DispStreamReader::read(int frame, Mat& disp)
+{
+    TRACE_SCOPE("DispStreamReader::read");
+    if (!f || frame < 0 || frame >= (int)index.size())
+        return false;
+    const DispFrameInfo& info = index[frame];
+    buf.resize(info.bytes + 1);
+    if (seekFile(f, info.offset + RECORD_BYTES, SEEK_SET) != 0
+        || fread(&buf[0], 1, info.bytes, f) != (size_t)info.bytes)
+        return false;
+    return decodeDisparity(&buf[0], info.bytes, mapSize, disp);
+}
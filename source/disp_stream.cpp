@@ -0,0 +1,156 @@
+/// disp_stream.cpp
+/// Inspect disparity streams recorded by stereo_match -record, and extract frames from them.
+///
+/// Input: a disparity stream file, and optionally a range of frames;
+/// Output: the frame index(size and timestamp of every frame) is listed; with -o the frames of
+///         the range are decoded and saved as 16-bit png(as stereo_match -o saves them), with -d
+///         they are displayed. Frames are read through the index, so any range is fast to reach.
+///
+/// Ref:
+///     disp_codec.hpp
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "disparity.hpp"
+#include "disp_codec.hpp"
+#include "trace.hpp"
+
+#include <iostream>
+#include <string>
+#include <stdio.h>
+
+using namespace cv;
+using namespace std;
+
+#define ESC_KEY 27
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+string streamFn;                // disparity stream filename
+string outputDir;               // directory to save the frames, not saved if empty
+int firstFrame = 1;             // range of frames to list or extract, 1-based, inclusive
+int lastFrame = -1;             // -1: up to the last frame
+bool display = false;
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void usage();
+static bool argParsing(int argc, char** argv);
+//--------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    traceFromEnv();
+    if (!argParsing(argc, argv))
+        return -1;
+
+    DispStreamReader reader;
+    if (!reader.open(streamFn))
+    {
+        cout << "Cannot open " << streamFn << " or it is not a disparity stream. Exiting." << endl;
+        return -1;
+    }
+    const Size size = reader.size();
+    const int n = reader.frames();
+    const int last = lastFrame < 0 ? n : min(lastFrame, n);
+    cout << streamFn << ": " << n << " frames of " << size.width << "x" << size.height << endl;
+
+    int64 coded = 0;
+    double decodeTime = 0;
+    for (int frame = firstFrame; frame <= last; frame++)
+    {
+        const DispFrameInfo& info = reader.frameInfo(frame - 1);
+        coded += info.bytes;
+        cout << "\tframe " << frame << ": timestamp " << info.timestamp << ", " << info.bytes << " bytes, ratio "
+             << (double)size.area()*sizeof(short)/max(info.bytes, 1) << endl;
+        if (outputDir.empty() && !display)
+            continue;
+
+        Mat disp;
+        int64 t = getTickCount();
+        if (!reader.read(frame - 1, disp))
+        {
+            cout << "Frame " << frame << " is corrupt. Skipping." << endl;
+            continue;
+        }
+        decodeTime += (getTickCount() - t)/getTickFrequency();
+
+        if (!outputDir.empty())
+        {
+            TRACE_SCOPE("imwrite");
+            char fn[256];
+            sprintf(fn, "%s/disp%02d.png", outputDir.c_str(), frame);
+            imwrite(fn, disp);
+        }
+        if (display)
+        {
+            // the search range is not recorded, scale by the largest disparity of the frame
+            double maxDisp = 0;
+            minMaxLoc(disp, NULL, &maxDisp);
+            Mat vis;
+            disp.convertTo(vis, CV_8U, 255./max(maxDisp, (double)DISP_SCALE));
+            imshow("disparity", vis);
+            char key = (char)waitKey(0);
+            if (key == ESC_KEY || key == 'q' || key == 'Q')
+                break;
+        }
+    }
+
+    if (last >= firstFrame)
+    {
+        cout << "Frames " << firstFrame << " to " << last << ": " << coded/(1024*1024.) << " MB, ratio "
+             << (double)(last - firstFrame + 1)*size.area()*sizeof(short)/max(coded, (int64)1);
+        if (decodeTime > 0)
+            cout << ", decoded at " << (last - firstFrame + 1)*size.area()*sizeof(short)/(1024*1024.*decodeTime)
+                 << " MB/s";
+        cout << endl;
+    }
+    return 0;
+}
+
+void usage()
+{
+    cout << "Usage:" << endl
+         << "\t./disp_stream [options] <disparity stream>" << endl
+         << "\t-f <first> <last>: range of frames(1-based), default is all frames;" << endl
+         << "\t-o <dir>: save the frames of the range to dir as 16-bit png;" << endl
+         << "\t-d: display the frames of the range." << endl;
+}
+
+bool argParsing(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-f" && i + 2 < argc)
+        {
+            if (sscanf(argv[i + 1], "%d", &firstFrame) != 1 || sscanf(argv[i + 2], "%d", &lastFrame) != 1
+                || firstFrame < 1 || lastFrame < firstFrame)
+            {
+                cout << "Invalid range of frames!" << endl;
+                return false;
+            }
+            i += 2;
+        }
+        else if (arg == "-o" && i + 1 < argc)
+            outputDir = argv[++i];
+        else if (arg == "-d")
+            display = true;
+        else if (arg[0] == '-')
+        {
+            cout << "Invalid option " << arg << endl;
+            usage();
+            return false;
+        }
+        else
+            streamFn = arg;
+    }
+
+    if (streamFn.empty())
+    {
+        usage();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,1409 @@
+/// disparity.cpp
+/// Dense stereo matching on rectified pairs: BM and SGM, on SAD or census costs.
+///
+/// SGM follows Hirschmuller's path recursion, but never stores the full W*H*D cost volume.
+/// The image is processed in horizontal strips:
+///   1. block costs are computed into a ring of (stripRows + overlapRows) rows;
+///   2. top-down paths run over the strip, their state is carried on to the next strip;
+///   3. left-right and right-left paths run over every row of the strip;
+///   4. bottom-up paths start overlapRows below the strip and run up to its first row,
+///      the disparity of a row is selected as soon as all paths have been added.
+/// For 1280x720 with 128 disparities and 8-bit costs this needs ~25 MB instead of ~230 MB.
+///
+/// Coarse-to-fine: the pair is halved 'levels' times, only the coarsest level searches the whole
+/// (halved) range. Each finer level searches RANGE_WIDTH disparities per pixel around twice the
+/// disparity below it, so its cost no longer grows with numDisparities. Ranged path entries are
+/// indexed relative to the window of their pixel; a path step reads the predecessor entries
+/// shifted by the difference of the windows, entries outside the predecessor window are SGM_INF.
+///
+/// Ref:
+///     H. Hirschmuller, Stereo Processing by Semiglobal Matching and Mutual Information, PAMI 2008;
+///     opencv/modules/calib3d/src/stereosgbm.cpp
+
+#include "disparity.hpp"
+#include "trace.hpp"
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <algorithm>
+#include <limits.h>
+#include <vector>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SGM_NEON
+#endif
+
+using namespace cv;
+using namespace std;
+
+const ushort SGM_INF = 0xFFFF;  // padding around the path entries of a pixel, never the minimum
+const int MAX_BLOCK_SIZE = 15;  // keeps window sums of 8-bit costs in 16 bits
+const int RANGE_PAD = 24;       // SGM_INF entries on each side of a ranged path entry, > RANGE_WIDTH + 1
+
+StereoMatchParams::StereoMatchParams()
+{
+    mode = MATCH_SGM;
+    cost = COST_SAD;
+    numDisparities = 64;
+    blockSize = 5;
+    P1 = 8;
+    P2 = 96;
+    paths = 8;
+    costBits = 8;
+    uniquenessRatio = 10;
+    disp12MaxDiff = 1;
+    speckleWindowSize = 100;
+    speckleRange = 2;
+    stripRows = 32;
+    overlapRows = 32;
+    levels = 0;
+}
+
+StereoMatcher::StereoMatcher(const StereoMatchParams& params)
+    : params(params)
+{
+}
+
+//--------------------------------------------------
+// Census transform
+//--------------------------------------------------
+// Each bit tells whether a neighbour in the window is darker than the center(center excluded).
+// Codes are robust to gain and offset differences between the cameras.
+template<typename CodeT>
+static void censusTransform(const Mat& img, int winRows, int winCols, Mat& codes)
+{
+    const int W = img.cols, H = img.rows, ry = winRows/2, rx = winCols/2;
+    Mat padded;
+    copyMakeBorder(img, padded, ry, ry, rx, rx, BORDER_REPLICATE);
+    codes.create(H, W, sizeof(CodeT) == 4 ? CV_32S : CV_32SC2);
+
+    #pragma omp parallel for
+    for (int y = 0; y < H; y++)
+    {
+        CodeT* c = codes.ptr<CodeT>(y);
+        const uchar* center = padded.ptr<uchar>(y + ry) + rx;
+        for (int x = 0; x < W; x++)
+            c[x] = 0;
+        for (int dy = -ry; dy <= ry; dy++)
+        {
+            const uchar* row = padded.ptr<uchar>(y + ry + dy) + rx;
+            for (int dx = -rx; dx <= rx; dx++)
+            {
+                if (dy == 0 && dx == 0)
+                    continue;
+                for (int x = 0; x < W; x++)
+                    c[x] = (c[x] << 1) | (CodeT)(row[x + dx] < center[x]);
+            }
+        }
+    }
+}
+
+// Hamming distances between code c and the n codes r[0..n-1], times CENSUS_BIT_COST.
+// n must be a multiple of 16.
+static inline void hammingCosts(unsigned c, const unsigned* r, uchar* out, int n)
+{
+#if defined(__AVX2__)
+    // per-byte popcount by nibble lookup, then bytes are summed to 32-bit lanes
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    // byte 0 of every 32-bit lane to bytes 0-3(low lane) and 4-7(high lane)
+    const __m256i pick = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, 0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i vc = _mm256_set1_epi32((int)c);
+    for (int i = 0; i < n; i += 8)
+    {
+        __m256i x = _mm256_xor_si256(vc, _mm256_loadu_si256((const __m256i*)(r + i)));
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+                                      _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+        cnt = _mm256_add_epi8(cnt, _mm256_srli_epi32(cnt, 8));
+        cnt = _mm256_add_epi8(cnt, _mm256_srli_epi32(cnt, 16));
+        cnt = _mm256_shuffle_epi8(cnt, pick);
+        __m128i v = _mm_or_si128(_mm256_castsi256_si128(cnt), _mm256_extracti128_si256(cnt, 1));
+        v = _mm_slli_epi16(v, 2);   // CENSUS_BIT_COST, bytes cannot carry(at most 32*4)
+        _mm_storel_epi64((__m128i*)(out + i), v);
+    }
+#elif defined(SGM_NEON)
+    const uint32x4_t vc = vdupq_n_u32(c);
+    for (int i = 0; i < n; i += 8)
+    {
+        uint32x4_t a = vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u32(veorq_u32(vc, vld1q_u32(r + i))))));
+        uint32x4_t b = vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u32(veorq_u32(vc, vld1q_u32(r + i + 4))))));
+        uint8x8_t v = vmovn_u16(vcombine_u16(vmovn_u32(a), vmovn_u32(b)));
+        vst1_u8(out + i, vshl_n_u8(v, 2));
+    }
+#else
+    for (int i = 0; i < n; i++)
+        out[i] = (uchar)(__builtin_popcount(c ^ r[i])*CENSUS_BIT_COST);
+#endif
+}
+
+static inline void hammingCosts(uint64 c, const uint64* r, uchar* out, int n)
+{
+#if defined(__AVX2__)
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    // byte 0 of every 64-bit lane to bytes 0-1(low lane) and 2-3(high lane)
+    const __m256i pick = _mm256_setr_epi8(0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                          -1, -1, 0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i vc = _mm256_set1_epi64x((long long)c);
+    for (int i = 0; i < n; i += 4)
+    {
+        __m256i x = _mm256_xor_si256(vc, _mm256_loadu_si256((const __m256i*)(r + i)));
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+                                      _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+        cnt = _mm256_shuffle_epi8(_mm256_sad_epu8(cnt, _mm256_setzero_si256()), pick);
+        __m128i v = _mm_or_si128(_mm256_castsi256_si128(cnt), _mm256_extracti128_si256(cnt, 1));
+        v = _mm_slli_epi16(v, 2);   // CENSUS_BIT_COST, bytes cannot carry(at most 64*4 - 8)
+        int packed = _mm_cvtsi128_si32(v);
+        memcpy(out + i, &packed, 4);
+    }
+#elif defined(SGM_NEON)
+    const uint64x2_t vc = vdupq_n_u64(c);
+    for (int i = 0; i < n; i += 4)
+    {
+        uint64x2_t a = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u64(veorq_u64(vc, vld1q_u64(r + i)))))));
+        uint64x2_t b = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u64(veorq_u64(vc, vld1q_u64(r + i + 2)))))));
+        ushort cnt[4];
+        vst1_u16(cnt, vmovn_u32(vcombine_u32(vmovn_u64(a), vmovn_u64(b))));
+        for (int k = 0; k < 4; k++)
+            out[i + k] = (uchar)(cnt[k]*CENSUS_BIT_COST);
+    }
+#else
+    for (int i = 0; i < n; i++)
+        out[i] = (uchar)(__builtin_popcountll(c ^ r[i])*CENSUS_BIT_COST);
+#endif
+}
+
+//--------------------------------------------------
+// Matching cost rows
+//--------------------------------------------------
+// Block cost of pixel x at disparity d is stored at row[x*D + d]: the mean per-pixel cost
+// over the window, in cost units(8-bit costs) or 1/16 units(16-bit costs).
+// Disparities reaching out of the right image get the maximum cost.
+template<typename CostT>
+struct CostRows
+{
+    static const bool RANGED = false;
+
+    StereoMatcher& m;
+    const Mat& left;
+    const Mat& right;
+    int W, H, D, r;     // r: radius of the window
+    int cost;           // MatchCost
+    int ring;           // number of rows kept in m.costRows
+    int next;           // next row to compute
+    unsigned mul;       // window sum * mul >> 16 = scaled mean
+    CostT costMax;
+
+    CostRows(StereoMatcher& m, const StereoMatchParams& p, const Mat& left, const Mat& right, int ring, int scale)
+        : m(m), left(left), right(right), cost(p.cost), ring(ring), next(0)
+    {
+        W = left.cols;
+        H = left.rows;
+        D = p.numDisparities;
+        r = p.blockSize/2;
+        int area = p.blockSize*p.blockSize;
+        mul = (unsigned)(((scale << 16) + area/2)/area);
+        costMax = (CostT)(255*scale);
+
+        m.pixelCosts.create(2*r + 2, W*D, CV_8U);
+        m.columnSums.create(1, W*D, CV_16U);
+        m.costRows.create(ring, W*D, sizeof(CostT) == 1 ? CV_8U : CV_16U);
+    }
+
+    CostT* row(int y) { return m.costRows.ptr<CostT>(y % ring); }
+
+    // first disparity of the entries of row y, none for the full range
+    const short* lo(int) { return NULL; }
+
+    void computeUpTo(int y)
+    {
+        for ( ; next <= y; next++)
+            computeRow(next);
+    }
+
+    // per-pixel costs of image row y(clamped) at all disparities
+    void pixelCostRow(int y, uchar* out)
+    {
+        y = std::min(std::max(y, 0), H - 1);
+        if (cost == COST_CENSUS_5X5)
+            censusCostRow<unsigned>(y, out);
+        else if (cost == COST_CENSUS_7X9)
+            censusCostRow<uint64>(y, out);
+        else
+            sadCostRow(y, out);
+    }
+
+    void sadCostRow(int y, uchar* out)
+    {
+        // locals, so that stores through uchar pointers cannot alias them
+        const int W = this->W, D = this->D;
+        const uchar* l = left.ptr<uchar>(y);
+        const uchar* rrow = right.ptr<uchar>(y);
+
+        // right row reversed, so that right(x - d) = rrev[W-1-x + d] is contiguous in d.
+        // Pixels left of the image repeat the border.
+        vector<uchar> rrev(W + D);
+        for (int i = 0; i < W; i++)
+            rrev[i] = rrow[W-1-i];
+        for (int i = W; i < W + D; i++)
+            rrev[i] = rrow[0];
+
+        #pragma omp parallel for
+        for (int x = 0; x < W; x++)
+        {
+            const uchar a = l[x];
+            const uchar* rp = &rrev[W-1-x];
+            uchar* o = out + x*D;
+            for (int d = 0; d < D; d++)
+            {
+                uchar b = rp[d];
+                o[d] = a > b ? a - b : b - a;
+            }
+        }
+    }
+
+    template<typename CodeT>
+    void censusCostRow(int y, uchar* out)
+    {
+        const int W = this->W, D = this->D;
+        const CodeT* cl = m.census[0].ptr<CodeT>(y);
+        const CodeT* cr = m.census[1].ptr<CodeT>(y);
+
+        // reversed like in sadCostRow; codes left of the image get costMax in computeRow anyway
+        vector<CodeT> rrev(W + D, 0);
+        for (int i = 0; i < W; i++)
+            rrev[i] = cr[W-1-i];
+
+        #pragma omp parallel for
+        for (int x = 0; x < W; x++)
+            hammingCosts(cl[x], &rrev[W-1-x], out + x*D, D);
+    }
+
+    uchar* pixelCostSlot(int k)
+    {
+        int n = 2*r + 2;
+        return m.pixelCosts.ptr<uchar>(((k % n) + n) % n);
+    }
+
+    void computeRow(int y)
+    {
+        const int W = this->W, D = this->D, r = this->r;
+        const unsigned mul = this->mul;
+        const CostT costMax = this->costMax;
+        ushort* cs = m.columnSums.ptr<ushort>();
+        const int WD = W*D;
+
+        // column sums over rows y-r..y+r
+        if (y == 0)
+        {
+            std::fill(cs, cs + WD, 0);
+            for (int k = -r; k <= r; k++)
+            {
+                uchar* pc = pixelCostSlot(k);
+                pixelCostRow(k, pc);
+                for (int i = 0; i < WD; i++)
+                    cs[i] += pc[i];
+            }
+        }
+        else
+        {
+            uchar* add = pixelCostSlot(y + r);
+            const uchar* sub = pixelCostSlot(y - r - 1);
+            pixelCostRow(y + r, add);
+            #pragma omp parallel for
+            for (int x = 0; x < W; x++)
+                for (int i = x*D; i < (x + 1)*D; i++)
+                    cs[i] = cs[i] + add[i] - sub[i];
+        }
+
+        // horizontal window sums, sliding over x in chunks of 64 pixels
+        CostT* out = row(y);
+        const int chunk = 64;
+        #pragma omp parallel for
+        for (int x0 = 0; x0 < W; x0 += chunk)
+        {
+            vector<ushort> hsBuf(D, 0);
+            ushort* hs = &hsBuf[0];
+            for (int k = x0 - r; k <= x0 + r; k++)
+            {
+                const ushort* c = cs + std::min(std::max(k, 0), W - 1)*D;
+                for (int d = 0; d < D; d++)
+                    hs[d] += c[d];
+            }
+
+            int x1 = std::min(x0 + chunk, W);
+            for (int x = x0; x < x1; x++)
+            {
+                CostT* o = out + x*D;
+                for (int d = 0; d < D; d++)
+                    o[d] = (CostT)((hs[d]*mul) >> 16);
+                for (int d = x + 1; d < D; d++)
+                    o[d] = costMax;
+
+                const ushort* a = cs + std::min(x + r + 1, W - 1)*D;
+                const ushort* s = cs + std::max(x - r, 0)*D;
+                for (int d = 0; d < D; d++)
+                    hs[d] = hs[d] + a[d] - s[d];
+            }
+        }
+    }
+};
+
+// Every row of src reversed, followed by 'extra' copies of its first element.
+// Then src(y, x - d) = dst(y, W-1-x + d) is contiguous in d.
+template<typename T>
+static void reverseRows(const Mat& src, int extra, Mat& dst)
+{
+    const int W = src.cols;
+    dst.create(src.rows, W + extra, src.type());
+    #pragma omp parallel for
+    for (int y = 0; y < src.rows; y++)
+    {
+        const T* s = src.ptr<T>(y);
+        T* d = dst.ptr<T>(y);
+        for (int i = 0; i < W; i++)
+            d[i] = s[W-1-i];
+        for (int i = W; i < W + extra; i++)
+            d[i] = s[0];
+    }
+}
+
+// Block costs of pixel x at the disparities lo(y,x) + i, i < RANGE_WIDTH, stored at row[x*RANGE_WIDTH + i].
+// Scaled like CostRows. Windows differ from pixel to pixel, so the window sums cannot slide
+// and are added up per pixel: cheap for census with small blocks, blockSize^2 times dearer for SAD.
+template<typename CostT>
+struct RangeCostRows
+{
+    static const bool RANGED = true;
+
+    StereoMatcher& m;
+    const Mat& left;
+    const Mat& searchLo;
+    int W, H, D, r;     // D = RANGE_WIDTH
+    int cost;
+    int ring;
+    int next;
+    unsigned mul;
+    CostT costMax;
+
+    RangeCostRows(StereoMatcher& m, const StereoMatchParams& p, const Mat& left, const Mat& right,
+                  const Mat& searchLo, int ring, int scale)
+        : m(m), left(left), searchLo(searchLo), cost(p.cost), ring(ring), next(0)
+    {
+        W = left.cols;
+        H = left.rows;
+        D = RANGE_WIDTH;
+        r = p.blockSize/2;
+        int area = p.blockSize*p.blockSize;
+        mul = (unsigned)(((scale << 16) + area/2)/area);
+        costMax = (CostT)(255*scale);
+
+        if (cost == COST_CENSUS_5X5)
+            reverseRows<unsigned>(m.census[1], p.numDisparities, m.reversed);
+        else if (cost == COST_CENSUS_7X9)
+            reverseRows<uint64>(m.census[1], p.numDisparities, m.reversed);
+        else
+            reverseRows<uchar>(right, p.numDisparities, m.reversed);
+        m.costRows.create(ring, W*D, sizeof(CostT) == 1 ? CV_8U : CV_16U);
+    }
+
+    CostT* row(int y) { return m.costRows.ptr<CostT>(y % ring); }
+
+    const short* lo(int y) { return searchLo.ptr<short>(y); }
+
+    void computeUpTo(int y)
+    {
+        for ( ; next <= y; next++)
+            computeRow(next);
+    }
+
+    // per-pixel costs of left pixel (y,x) at the disparities d0..d0+RANGE_WIDTH-1
+    inline void pixelCosts(int y, int x, int d0, uchar* out) const
+    {
+        const int i = W-1-x + d0;
+        if (cost == COST_CENSUS_5X5)
+            hammingCosts(m.census[0].ptr<unsigned>(y)[x], m.reversed.ptr<unsigned>(y) + i, out, RANGE_WIDTH);
+        else if (cost == COST_CENSUS_7X9)
+            hammingCosts(m.census[0].ptr<uint64>(y)[x], m.reversed.ptr<uint64>(y) + i, out, RANGE_WIDTH);
+        else
+        {
+            const uchar a = left.ptr<uchar>(y)[x];
+            const uchar* rp = m.reversed.ptr<uchar>(y) + i;
+            for (int d = 0; d < RANGE_WIDTH; d++)
+                out[d] = a > rp[d] ? a - rp[d] : rp[d] - a;
+        }
+    }
+
+    void computeRow(int y)
+    {
+        const int W = this->W, H = this->H, r = this->r;
+        const unsigned mul = this->mul;
+        const CostT costMax = this->costMax;
+        const short* lo = searchLo.ptr<short>(y);
+        CostT* out = row(y);
+
+        #pragma omp parallel for
+        for (int x = 0; x < W; x++)
+        {
+            const int d0 = lo[x];
+            ushort sum[RANGE_WIDTH] = { 0 };
+            uchar pc[RANGE_WIDTH];
+            for (int dy = -r; dy <= r; dy++)
+            {
+                int yy = std::min(std::max(y + dy, 0), H - 1);
+                for (int dx = -r; dx <= r; dx++)
+                {
+                    pixelCosts(yy, std::min(std::max(x + dx, 0), W - 1), d0, pc);
+                    for (int d = 0; d < RANGE_WIDTH; d++)
+                        sum[d] += pc[d];
+                }
+            }
+
+            CostT* o = out + x*RANGE_WIDTH;
+            for (int d = 0; d < RANGE_WIDTH; d++)
+                o[d] = (CostT)((sum[d]*mul) >> 16);
+            for (int d = std::max(x + 1 - d0, 0); d < RANGE_WIDTH; d++)
+                o[d] = costMax;
+        }
+    }
+};
+
+//--------------------------------------------------
+// Disparity selection
+//--------------------------------------------------
+#if defined(__AVX2__)
+static inline __m256i loadCost16(const uchar* p)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+}
+
+static inline __m256i loadCost16(const ushort* p)
+{
+    return _mm256_loadu_si256((const __m256i*)p);
+}
+
+static inline int hmin16(__m256i v)
+{
+    __m128i b = _mm_min_epu16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_cvtsi128_si32(_mm_minpos_epu16(b)) & 0xFFFF;
+}
+#elif defined(SGM_NEON)
+static inline uint16x8_t loadCost16(const uchar* p)
+{
+    return vmovl_u8(vld1_u8(p));
+}
+
+static inline uint16x8_t loadCost16(const ushort* p)
+{
+    return vld1q_u16(p);
+}
+
+static inline int hmin16(uint16x8_t v)
+{
+    uint16x4_t b = vmin_u16(vget_low_u16(v), vget_high_u16(v));
+    b = vpmin_u16(b, b);
+    b = vpmin_u16(b, b);
+    return vget_lane_u16(b, 0);
+}
+#endif
+
+// Minimum cost c[best] and the minimum outside best-1..best+1 of one pixel.
+template<typename T>
+static inline void findMinima(const T* c, int D, int& best, int& minC, int& other)
+{
+#if defined(__AVX2__)
+    __m256i vMin = _mm256_set1_epi16(-1);
+    for (int d = 0; d < D; d += 16)
+        vMin = _mm256_min_epu16(vMin, loadCost16(c + d));
+    minC = hmin16(vMin);
+
+    __m256i vMinC = _mm256_set1_epi16((short)minC);
+    best = 0;
+    for (int d = 0; d < D; d += 16)
+    {
+        int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(loadCost16(c + d), vMinC));
+        if (mask)
+        {
+            best = d + __builtin_ctz(mask)/2;
+            break;
+        }
+    }
+
+    // indices d with (unsigned short)(d - best + 1) <= 2 are masked out
+    const __m256i two = _mm256_set1_epi16(2);
+    __m256i idx = _mm256_sub_epi16(_mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                   _mm256_set1_epi16((short)(best - 1)));
+    const __m256i step = _mm256_set1_epi16(16);
+    vMin = _mm256_set1_epi16(-1);
+    for (int d = 0; d < D; d += 16)
+    {
+        __m256i near = _mm256_cmpeq_epi16(_mm256_min_epu16(idx, two), idx);
+        vMin = _mm256_min_epu16(vMin, _mm256_or_si256(loadCost16(c + d), near));
+        idx = _mm256_add_epi16(idx, step);
+    }
+    other = hmin16(vMin);
+#elif defined(SGM_NEON)
+    uint16x8_t vMin = vdupq_n_u16(0xFFFF);
+    for (int d = 0; d < D; d += 8)
+        vMin = vminq_u16(vMin, loadCost16(c + d));
+    minC = hmin16(vMin);
+
+    best = 0;
+    while (c[best] != minC)
+        best++;
+
+    static const ushort iota[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    uint16x8_t idx = vsubq_u16(vld1q_u16(iota), vdupq_n_u16((ushort)(best - 1)));
+    const uint16x8_t two = vdupq_n_u16(2);
+    vMin = vdupq_n_u16(0xFFFF);
+    for (int d = 0; d < D; d += 8)
+    {
+        uint16x8_t near = vcleq_u16(idx, two);
+        vMin = vminq_u16(vMin, vorrq_u16(loadCost16(c + d), near));
+        idx = vaddq_u16(idx, vdupq_n_u16(8));
+    }
+    other = hmin16(vMin);
+#else
+    minC = c[0];
+    for (int d = 1; d < D; d++)
+        minC = std::min(minC, (int)c[d]);
+    best = 0;
+    while (c[best] != minC)
+        best++;
+
+    other = INT_MAX;
+    for (int d = 0; d < best - 1; d++)
+        other = std::min(other, (int)c[d]);
+    for (int d = best + 2; d < D; d++)
+        other = std::min(other, (int)c[d]);
+#endif
+}
+
+// Disparity of every right image pixel xr of the row: the d minimizing the cost of left pixel xr + d
+// at d. Right pixel xr is at rmin[W-1-xr], so the entries of a left pixel are contiguous.
+// One sweep over x, vectorized over the disparities; ties go to the larger disparity.
+template<typename T>
+static void rightDisparityRow(const T* costs, int W, int D, const short* lo, ushort* rmin, short* rdisp)
+{
+    for (int x = 0; x < W; x++)
+    {
+        const T* c = costs + x*D;
+        const int d0 = lo ? lo[x] : 0;
+        ushort* m = rmin + W-1-x + d0;
+        short* rd = rdisp + W-1-x + d0;
+#if defined(__AVX2__)
+        const __m256i lanes = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        for (int d = 0; d < D; d += 16)
+        {
+            __m256i vc = loadCost16(c + d);
+            __m256i vm = _mm256_loadu_si256((const __m256i*)(m + d));
+            __m256i le = _mm256_cmpeq_epi16(_mm256_min_epu16(vc, vm), vc);
+            __m256i vd = _mm256_add_epi16(_mm256_set1_epi16((short)(d0 + d)), lanes);
+            _mm256_storeu_si256((__m256i*)(m + d), _mm256_min_epu16(vc, vm));
+            _mm256_storeu_si256((__m256i*)(rd + d),
+                    _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i*)(rd + d)), vd, le));
+        }
+#elif defined(SGM_NEON)
+        static const short lanesArr[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+        const int16x8_t lanes = vld1q_s16(lanesArr);
+        for (int d = 0; d < D; d += 8)
+        {
+            uint16x8_t vc = loadCost16(c + d);
+            uint16x8_t vm = vld1q_u16(m + d);
+            uint16x8_t le = vcleq_u16(vc, vm);
+            int16x8_t vd = vaddq_s16(vdupq_n_s16((short)(d0 + d)), lanes);
+            vst1q_u16(m + d, vminq_u16(vc, vm));
+            vst1q_s16(rd + d, vbslq_s16(le, vd, vld1q_s16(rd + d)));
+        }
+#else
+        for (int d = 0; d < D; d++)
+        {
+            if (c[d] <= m[d])
+            {
+                m[d] = c[d];
+                rd[d] = (short)(d0 + d);
+            }
+        }
+#endif
+    }
+}
+
+// Disparity selection of row y, fused with the post-processing that only needs the costs of the row:
+// winner-takes-all, uniqueness check, left-right check, subpixel refinement by fitting a parabola,
+// and the confidence. Entry d of pixel x is disparity lo[x] + d, or d if lo is NULL.
+template<typename T>
+static void selectDisparityRow(StereoMatcher& m, const StereoMatchParams& p, const T* costs,
+                               int W, int D, const short* lo, int y, Mat& dispMap)
+{
+    short* disp = dispMap.ptr<short>(y);
+    uchar* conf = m.confidence.ptr<uchar>(y);
+    const int uniquenessRatio = p.uniquenessRatio, maxDiff = p.disp12MaxDiff;
+    short* rdisp = m.rightDisp.ptr<short>();
+    if (maxDiff >= 0)
+    {
+        ushort* rmin = m.rightCosts.ptr<ushort>();
+        std::fill(rmin, rmin + m.rightCosts.cols, SGM_INF);
+        std::fill(rdisp, rdisp + m.rightDisp.cols, DISP_INVALID);
+        rightDisparityRow(costs, W, D, lo, rmin, rdisp);
+    }
+
+    #pragma omp parallel for
+    for (int x = 0; x < W; x++)
+    {
+        const T* c = costs + x*D;
+        int best, minC, other;
+        findMinima(c, D, best, minC, other);
+        const int d = best + (lo ? lo[x] : 0);
+        if ((int64)other*(100 - uniquenessRatio) < (int64)minC*100 ||
+            (maxDiff >= 0 && d <= x && abs(rdisp[W-1-x + d] - d) > maxDiff))
+        {
+            disp[x] = DISP_INVALID;
+            conf[x] = 0;
+            continue;
+        }
+
+        int v = d*DISP_SCALE;
+        if (best > 0 && best < D - 1)
+        {
+            int cm = c[best-1], cp = c[best+1];
+            int denom2 = std::max(cm + cp - 2*minC, 1);
+            v += ((cm - cp)*DISP_SCALE + denom2)/(denom2*2);
+        }
+        disp[x] = (short)v;
+        conf[x] = (uchar)(255 - (int64)minC*255/std::max(other, 1));
+    }
+}
+
+//--------------------------------------------------
+// SGM path aggregation
+//--------------------------------------------------
+// One step of a path r for pixel p, vectorized over the disparities:
+//   Lr(p,d) = C(p,d) + min(Lr(p-r,d), Lr(p-r,d-1) + P1, Lr(p-r,d+1) + P1, minLp + P2) - minLp
+// Lp[-1] and Lp[D] must hold SGM_INF. Lr(p,.) is also added to the path sums S.
+// Returns min_d Lr(p,d).
+template<typename CostT>
+static inline ushort aggregatePixel(const CostT* C, const ushort* Lp, ushort minLp,
+                                    ushort* Lr, ushort* S, int D, ushort P1, ushort P2)
+{
+    int minP2 = std::min((int)minLp + P2, (int)SGM_INF);
+#if defined(__AVX2__)
+    // Lp(d-1) and Lp(d+1) are shifted in from the neighbouring registers rather than
+    // loaded unaligned, which would miss store forwarding on the horizontal paths.
+    const __m256i vInf = _mm256_set1_epi16((short)SGM_INF);
+    const __m256i vP1 = _mm256_set1_epi16((short)P1);
+    const __m256i vMinP2 = _mm256_set1_epi16((short)minP2);
+    const __m256i vMinLp = _mm256_set1_epi16((short)minLp);
+    __m256i vBest = vInf;
+    __m256i l0 = _mm256_loadu_si256((const __m256i*)Lp);
+    __m256i lprev = vInf;
+    for (int d = 0; d < D; d += 16)
+    {
+        __m256i lnext = d + 16 < D ? _mm256_loadu_si256((const __m256i*)(Lp + d + 16)) : vInf;
+        __m256i lm = _mm256_alignr_epi8(l0, _mm256_permute2x128_si256(lprev, l0, 0x21), 14);
+        __m256i lp = _mm256_alignr_epi8(_mm256_permute2x128_si256(l0, lnext, 0x21), l0, 2);
+        __m256i v = _mm256_min_epu16(l0, _mm256_adds_epu16(_mm256_min_epu16(lm, lp), vP1));
+        v = _mm256_min_epu16(v, vMinP2);
+        v = _mm256_add_epi16(loadCost16(C + d), _mm256_sub_epi16(v, vMinLp));
+        _mm256_storeu_si256((__m256i*)(Lr + d), v);
+        __m256i s = _mm256_loadu_si256((const __m256i*)(S + d));
+        _mm256_storeu_si256((__m256i*)(S + d), _mm256_adds_epu16(s, v));
+        vBest = _mm256_min_epu16(vBest, v);
+        lprev = l0;
+        l0 = lnext;
+    }
+    return (ushort)hmin16(vBest);
+#elif defined(SGM_NEON)
+    const uint16x8_t vInf = vdupq_n_u16(SGM_INF);
+    const uint16x8_t vP1 = vdupq_n_u16(P1);
+    const uint16x8_t vMinP2 = vdupq_n_u16((ushort)minP2);
+    const uint16x8_t vMinLp = vdupq_n_u16(minLp);
+    uint16x8_t vBest = vInf;
+    uint16x8_t l0 = vld1q_u16(Lp);
+    uint16x8_t lprev = vInf;
+    for (int d = 0; d < D; d += 8)
+    {
+        uint16x8_t lnext = d + 8 < D ? vld1q_u16(Lp + d + 8) : vInf;
+        uint16x8_t lm = vextq_u16(lprev, l0, 7);
+        uint16x8_t lp = vextq_u16(l0, lnext, 1);
+        uint16x8_t v = vminq_u16(l0, vqaddq_u16(vminq_u16(lm, lp), vP1));
+        v = vminq_u16(v, vMinP2);
+        v = vaddq_u16(loadCost16(C + d), vsubq_u16(v, vMinLp));
+        vst1q_u16(Lr + d, v);
+        vst1q_u16(S + d, vqaddq_u16(vld1q_u16(S + d), v));
+        vBest = vminq_u16(vBest, v);
+        lprev = l0;
+        l0 = lnext;
+    }
+    return (ushort)hmin16(vBest);
+#else
+    int best = SGM_INF;
+    for (int d = 0; d < D; d++)
+    {
+        int v = std::min((int)Lp[d], std::min((int)Lp[d-1], (int)Lp[d+1]) + P1);
+        v = C[d] + std::min(v, minP2) - minLp;
+        Lr[d] = (ushort)v;
+        S[d] = (ushort)std::min(S[d] + v, (int)SGM_INF);
+        best = std::min(best, v);
+    }
+    return (ushort)best;
+#endif
+}
+
+// aggregatePixel for the RANGE_WIDTH entries of a ranged pixel. Lp is already shifted to the
+// window of the pixel and may point into the pads, so Lp(d-1) and Lp(d+1) are real entries
+// of the predecessor and have to be loaded.
+template<typename CostT>
+static inline ushort aggregatePixelRanged(const CostT* C, const ushort* Lp, ushort minLp,
+                                          ushort* Lr, ushort* S, ushort P1, ushort P2)
+{
+#if defined(__AVX2__)
+    const int minP2 = std::min((int)minLp + P2, (int)SGM_INF);
+    __m256i lm = _mm256_loadu_si256((const __m256i*)(Lp - 1));
+    __m256i lp = _mm256_loadu_si256((const __m256i*)(Lp + 1));
+    __m256i v = _mm256_min_epu16(_mm256_loadu_si256((const __m256i*)Lp),
+                                 _mm256_adds_epu16(_mm256_min_epu16(lm, lp), _mm256_set1_epi16((short)P1)));
+    v = _mm256_min_epu16(v, _mm256_set1_epi16((short)minP2));
+    v = _mm256_add_epi16(loadCost16(C), _mm256_sub_epi16(v, _mm256_set1_epi16((short)minLp)));
+    _mm256_storeu_si256((__m256i*)Lr, v);
+    _mm256_storeu_si256((__m256i*)S, _mm256_adds_epu16(_mm256_loadu_si256((const __m256i*)S), v));
+    return (ushort)hmin16(v);
+#elif defined(SGM_NEON)
+    const int minP2 = std::min((int)minLp + P2, (int)SGM_INF);
+    uint16x8_t vBest = vdupq_n_u16(SGM_INF);
+    for (int d = 0; d < RANGE_WIDTH; d += 8)
+    {
+        uint16x8_t lm = vld1q_u16(Lp + d - 1);
+        uint16x8_t lp = vld1q_u16(Lp + d + 1);
+        uint16x8_t v = vminq_u16(vld1q_u16(Lp + d), vqaddq_u16(vminq_u16(lm, lp), vdupq_n_u16(P1)));
+        v = vminq_u16(v, vdupq_n_u16((ushort)minP2));
+        v = vaddq_u16(loadCost16(C + d), vsubq_u16(v, vdupq_n_u16(minLp)));
+        vst1q_u16(Lr + d, v);
+        vst1q_u16(S + d, vqaddq_u16(vld1q_u16(S + d), v));
+        vBest = vminq_u16(vBest, v);
+    }
+    return (ushort)hmin16(vBest);
+#else
+    return aggregatePixel(C, Lp, minLp, Lr, S, RANGE_WIDTH, P1, P2);
+#endif
+}
+
+// Predecessor entries seen from a pixel whose window starts 'shift' disparities above the
+// predecessor's; beyond RANGE_WIDTH + 1 all entries are in the pads anyway.
+static inline const ushort* shiftPath(const ushort* Lp, int shift)
+{
+    return Lp + std::min(std::max(shift, -(RANGE_WIDTH + 1)), RANGE_WIDTH + 1);
+}
+
+template<bool RANGED, typename CostT>
+static inline ushort aggregateStep(const CostT* C, const ushort* Lp, ushort minLp,
+                                   ushort* Lr, ushort* S, int D, ushort P1, ushort P2)
+{
+    return RANGED ? aggregatePixelRanged(C, Lp, minLp, Lr, S, P1, P2)
+                  : aggregatePixel(C, Lp, minLp, Lr, S, D, P1, P2);
+}
+
+// Vertical and diagonal paths of one row. The predecessor of pixel x along path k
+// is pixel x + dxs[k] of the previous row(above or below, depending on the sweep).
+// Path entries have 'pad' SGM_INF entries on each side, Dp = D + 2*pad apart.
+// RANGED: lo and loPrev are the windows of the row and of the previous row.
+template<bool RANGED, typename CostT>
+static void aggregateRow(const CostT* C, ushort* S, int W, int D, int pad, ushort P1, ushort P2,
+                         int nDirs, const int* dxs, bool first, const ushort* zeroPath,
+                         const short* lo, const short* loPrev,
+                         ushort* const* prev, ushort* const* prevMin,
+                         ushort* const* cur, ushort* const* curMin)
+{
+    const int Dp = D + 2*pad;
+    #pragma omp parallel for
+    for (int x = 0; x < W; x++)
+    {
+        for (int k = 0; k < nDirs; k++)
+        {
+            int xp = x + dxs[k];
+            const ushort* Lp = zeroPath;
+            ushort minLp = 0;
+            if (!first && xp >= 0 && xp < W)
+            {
+                Lp = prev[k] + xp*Dp + pad;
+                if (RANGED)
+                    Lp = shiftPath(Lp, lo[x] - loPrev[xp]);
+                minLp = prevMin[k][xp];
+            }
+            curMin[k][x] = aggregateStep<RANGED>(C + x*D, Lp, minLp, cur[k] + x*Dp + pad, S + x*D, D, P1, P2);
+        }
+    }
+}
+
+// Left-right and right-left paths of one row.
+template<bool RANGED, typename CostT>
+static void aggregateHorizontal(const CostT* C, ushort* S, int W, int D, int pad, ushort P1, ushort P2,
+                                const ushort* zeroPath, const short* lo)
+{
+    const int Dp = D + 2*pad;
+    vector<ushort> buf(2*Dp, SGM_INF);
+    ushort* L[2] = { &buf[pad], &buf[Dp + pad] };
+
+    const ushort* Lp = zeroPath;
+    ushort minLp = 0;
+    for (int x = 0; x < W; x++)
+    {
+        ushort* Lr = L[x & 1];
+        minLp = aggregateStep<RANGED>(C + x*D, Lp, minLp, Lr, S + x*D, D, P1, P2);
+        Lp = RANGED && x + 1 < W ? shiftPath(Lr, lo[x+1] - lo[x]) : Lr;
+    }
+
+    Lp = zeroPath;
+    minLp = 0;
+    for (int x = W - 1; x >= 0; x--)
+    {
+        ushort* Lr = L[x & 1];
+        minLp = aggregateStep<RANGED>(C + x*D, Lp, minLp, Lr, S + x*D, D, P1, P2);
+        Lp = RANGED && x > 0 ? shiftPath(Lr, lo[x-1] - lo[x]) : Lr;
+    }
+}
+
+// Rows: CostRows or RangeCostRows, constructed with a ring of sgmRing rows.
+template<typename CostT, typename Rows>
+static void computeSGM(StereoMatcher& m, const StereoMatchParams& p, Rows& costs, Mat& disp)
+{
+    const bool ranged = Rows::RANGED;
+    const int W = costs.W, H = costs.H, D = costs.D;
+    const int pad = ranged ? RANGE_PAD : 1, Dp = D + 2*pad;
+    const int stripRows = std::min(p.stripRows, H);
+    const int scale = sizeof(CostT) == 1 ? 1 : 16;
+    const ushort P1 = (ushort)(p.P1*scale), P2 = (ushort)(p.P2*scale);
+
+    // vertical/diagonal paths per sweep, and the x offset of their predecessors
+    const int nDirs = p.paths == 8 ? 3 : 1;
+    static const int downDxs[3] = { 0, -1, 1 };     // from above, upper-left, upper-right
+    static const int upDxs[3] = { 0, 1, -1 };       // from below, lower-right, lower-left
+
+    m.pathSums.create(stripRows, W*D, CV_16U);
+    m.pathRows.create(4*nDirs, W*Dp, CV_16U);
+    m.pathRows.setTo(Scalar::all(SGM_INF));
+    m.pathMins.create(4*nDirs, W, CV_16U);
+    m.scratch.create(1, W*D, CV_16U);
+
+    vector<ushort> zero(Dp, SGM_INF);
+    std::fill(zero.begin() + pad, zero.begin() + pad + D, 0);
+    const ushort* zeroPath = &zero[pad];
+
+    ushort* prev[3];
+    ushort* prevMin[3];
+    ushort* cur[3];
+    ushort* curMin[3];
+
+    int down = 0;   // which of the two rows of a top-down path is the previous one
+    for (int y0 = 0; y0 < H; y0 += stripRows)
+    {
+        int y1 = std::min(y0 + stripRows, H);
+        int yEnd = std::min(y1 + p.overlapRows, H);
+        costs.computeUpTo(yEnd - 1);
+        m.pathSums.setTo(Scalar::all(0));
+
+        // top-down paths
+        for (int y = y0; y < y1; y++)
+        {
+            for (int k = 0; k < nDirs; k++)
+            {
+                prev[k] = m.pathRows.ptr<ushort>(2*k + down);
+                cur[k] = m.pathRows.ptr<ushort>(2*k + 1 - down);
+                prevMin[k] = m.pathMins.ptr<ushort>(2*k + down);
+                curMin[k] = m.pathMins.ptr<ushort>(2*k + 1 - down);
+            }
+            aggregateRow<ranged>(costs.row(y), m.pathSums.ptr<ushort>(y - y0), W, D, pad, P1, P2,
+                    nDirs, downDxs, y == 0, zeroPath, costs.lo(y), costs.lo(std::max(y - 1, 0)),
+                    prev, prevMin, cur, curMin);
+            down ^= 1;
+        }
+
+        // left-right and right-left paths
+        #pragma omp parallel for
+        for (int y = y0; y < y1; y++)
+            aggregateHorizontal<ranged>(costs.row(y), m.pathSums.ptr<ushort>(y - y0), W, D, pad, P1, P2,
+                    zeroPath, costs.lo(y));
+
+        // bottom-up paths, warmed up on the rows below the strip
+        int up = 0;
+        for (int y = yEnd - 1; y >= y0; y--)
+        {
+            for (int k = 0; k < nDirs; k++)
+            {
+                prev[k] = m.pathRows.ptr<ushort>(2*(nDirs + k) + up);
+                cur[k] = m.pathRows.ptr<ushort>(2*(nDirs + k) + 1 - up);
+                prevMin[k] = m.pathMins.ptr<ushort>(2*(nDirs + k) + up);
+                curMin[k] = m.pathMins.ptr<ushort>(2*(nDirs + k) + 1 - up);
+            }
+            ushort* S = y < y1 ? m.pathSums.ptr<ushort>(y - y0) : m.scratch.ptr<ushort>();
+            aggregateRow<ranged>(costs.row(y), S, W, D, pad, P1, P2,
+                    nDirs, upDxs, y == yEnd - 1, zeroPath, costs.lo(y), costs.lo(std::min(y + 1, H - 1)),
+                    prev, prevMin, cur, curMin);
+            up ^= 1;
+
+            if (y < y1)
+                selectDisparityRow(m, p, S, W, D, costs.lo(y), y, disp);
+        }
+    }
+}
+
+template<typename CostT, typename Rows>
+static void computeBM(StereoMatcher& m, const StereoMatchParams& p, Rows& costs, Mat& disp)
+{
+    for (int y = 0; y < costs.H; y++)
+    {
+        costs.computeUpTo(y);
+        selectDisparityRow(m, p, costs.row(y), costs.W, costs.D, costs.lo(y), y, disp);
+    }
+}
+
+//--------------------------------------------------
+// Speckle filter
+//--------------------------------------------------
+// Union-find over the pixels. Links always go to the smaller index, so parent[i] <= i
+// and the root of a region is its first pixel in row-major order.
+static inline int findRoot(int* parent, int i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];  // path halving
+        i = parent[i];
+    }
+    return i;
+}
+
+static inline void unite(int* parent, int a, int b)
+{
+    a = findRoot(parent, a);
+    b = findRoot(parent, b);
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
+
+// Links the valid pixels of row y to their similar left and upper neighbours.
+static inline void labelRow(const Mat& disp, int y, bool linkUp, int maxDiff, int* parent)
+{
+    const int W = disp.cols;
+    const short* d = disp.ptr<short>(y);
+    const short* up = linkUp ? disp.ptr<short>(y - 1) : NULL;
+    for (int x = 0; x < W; x++)
+    {
+        const int i = y*W + x;
+        if (d[x] < 0)
+            continue;
+        if (x > 0 && d[x-1] >= 0 && abs(d[x] - d[x-1]) <= maxDiff)
+            unite(parent, i - 1, i);
+        if (up && up[x] >= 0 && abs(d[x] - up[x]) <= maxDiff)
+            unite(parent, i - W, i);
+    }
+}
+
+// Invalidates the 4-connected regions of similar disparity(neighbours differing by at most maxDiff)
+// with fewer than maxSize pixels, like cv::filterSpeckles but parallel: row strips are labelled
+// independently, then merged along their borders. Since roots are the smallest index of their tree,
+// one ordered pass flattens all trees and counts the regions.
+static void filterSpeckleRegions(StereoMatcher& m, Mat& disp, int maxSize, int maxDiff)
+{
+    TRACE_SCOPE("filterSpeckles");
+    const int W = disp.cols, H = disp.rows, N = W*H;
+    const int stripRows = 32;
+    m.labels.create(H, W, CV_32S);
+    m.regionSizes.create(H, W, CV_32S);
+    int* parent = m.labels.ptr<int>();
+    int* size = m.regionSizes.ptr<int>();
+
+    #pragma omp parallel for
+    for (int y0 = 0; y0 < H; y0 += stripRows)
+    {
+        const int y1 = std::min(y0 + stripRows, H);
+        for (int i = y0*W; i < y1*W; i++)
+            parent[i] = i;
+        for (int y = y0; y < y1; y++)
+            labelRow(disp, y, y > y0, maxDiff, parent);
+    }
+
+    // strip borders: only the links to the row above, the rest is done
+    for (int y = stripRows; y < H; y += stripRows)
+    {
+        const short* d = disp.ptr<short>(y);
+        const short* up = disp.ptr<short>(y - 1);
+        for (int x = 0; x < W; x++)
+            if (d[x] >= 0 && up[x] >= 0 && abs(d[x] - up[x]) <= maxDiff)
+                unite(parent, y*W + x - W, y*W + x);
+    }
+
+    // parent[i] < i is already flattened when i is reached
+    for (int i = 0; i < N; i++)
+    {
+        const int r = parent[parent[i]];
+        parent[i] = r;
+        if (r == i)
+            size[i] = 0;
+        size[r]++;
+    }
+
+    #pragma omp parallel for
+    for (int y = 0; y < H; y++)
+    {
+        short* d = disp.ptr<short>(y);
+        uchar* c = m.confidence.ptr<uchar>(y);
+        const int* l = parent + y*W;
+        for (int x = 0; x < W; x++)
+        {
+            if (d[x] >= 0 && size[l[x]] < maxSize)
+            {
+                d[x] = DISP_INVALID;
+                c[x] = 0;
+            }
+        }
+    }
+}
+
+template<typename CostT>
+static void matchLevel(StereoMatcher& m, const StereoMatchParams& p,
+                       const Mat& left, const Mat& right, const Mat& searchLo, Mat& disp)
+{
+    const int scale = sizeof(CostT) == 1 ? 1 : 16;
+    const int ring = p.mode == MATCH_SGM ? std::min(p.stripRows, left.rows) + p.overlapRows : 1;
+    if (searchLo.empty())
+    {
+        CostRows<CostT> costs(m, p, left, right, ring, scale);
+        if (p.mode == MATCH_SGM)
+            computeSGM<CostT>(m, p, costs, disp);
+        else
+            computeBM<CostT>(m, p, costs, disp);
+    }
+    else
+    {
+        RangeCostRows<CostT> costs(m, p, left, right, searchLo, ring, scale);
+        if (p.mode == MATCH_SGM)
+            computeSGM<CostT>(m, p, costs, disp);
+        else
+            computeBM<CostT>(m, p, costs, disp);
+    }
+}
+
+// Disparity of one level, over the full range of p if searchLo is empty.
+static void matchLevel(StereoMatcher& m, const StereoMatchParams& p,
+                       const Mat& left, const Mat& right, const Mat& searchLo, Mat& disp)
+{
+    TRACE_SCOPE("matchLevel");
+    disp.create(left.size(), CV_16S);
+    m.confidence.create(left.size(), CV_8U);
+    if (p.disp12MaxDiff >= 0)
+    {
+        m.rightCosts.create(1, left.cols + p.numDisparities, CV_16U);
+        m.rightDisp.create(1, left.cols + p.numDisparities, CV_16S);
+    }
+
+    if (p.cost == COST_CENSUS_5X5)
+    {
+        censusTransform<unsigned>(left, 5, 5, m.census[0]);
+        censusTransform<unsigned>(right, 5, 5, m.census[1]);
+    }
+    else if (p.cost == COST_CENSUS_7X9)
+    {
+        censusTransform<uint64>(left, 7, 9, m.census[0]);
+        censusTransform<uint64>(right, 7, 9, m.census[1]);
+    }
+
+    if (p.costBits == 8)
+        matchLevel<uchar>(m, p, left, right, searchLo, disp);
+    else
+        matchLevel<ushort>(m, p, left, right, searchLo, disp);
+}
+
+static void checkParams(const StereoMatchParams& p, const Mat& left, const Mat& right)
+{
+    CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+    CV_Assert(p.numDisparities > 0 && p.numDisparities % 16 == 0);
+    CV_Assert(p.blockSize % 2 == 1 && p.blockSize <= MAX_BLOCK_SIZE);
+    CV_Assert(p.paths == 4 || p.paths == 8);
+    CV_Assert(p.costBits == 8 || p.costBits == 16);
+    CV_Assert(p.cost == COST_SAD || p.cost == COST_CENSUS_5X5 || p.cost == COST_CENSUS_7X9);
+    CV_Assert(p.stripRows > 0 && p.overlapRows >= 0);
+    CV_Assert(p.speckleWindowSize >= 0 && p.speckleRange >= 0);
+    CV_Assert(p.levels >= 0 && (left.cols >> p.levels) > 0 && (left.rows >> p.levels) > 0);
+}
+
+void StereoMatcher::compute(const Mat& left, const Mat& right, Mat& disp)
+{
+    TRACE_SCOPE("StereoMatcher::compute");
+    checkParams(params, left, right);
+    if (params.levels == 0)
+    {
+        matchLevel(*this, params, left, right, Mat(), disp);
+        if (params.speckleWindowSize > 0)
+            filterSpeckleRegions(*this, disp, params.speckleWindowSize, params.speckleRange*DISP_SCALE);
+        return;
+    }
+
+    const int L = params.levels;
+    pyramid[0].resize(L + 1);
+    pyramid[1].resize(L + 1);
+    levelDisp.resize(L);
+    pyramid[0][0] = left;
+    pyramid[1][0] = right;
+    for (int l = 1; l <= L; l++)
+    {
+        pyrDown(pyramid[0][l-1], pyramid[0][l]);
+        pyrDown(pyramid[1][l-1], pyramid[1][l]);
+    }
+
+    // the search range halves with every level, but stays at least one window wide
+    StereoMatchParams p = params;
+    p.levels = 0;
+    p.numDisparities = std::max(((params.numDisparities >> L) + 15) & ~15, RANGE_WIDTH);
+    matchLevel(*this, p, pyramid[0][L], pyramid[1][L], Mat(), levelDisp[L-1]);
+
+    for (int l = L - 1; l >= 0; l--)
+    {
+        p.numDisparities = std::max(((params.numDisparities >> l) + 15) & ~15, RANGE_WIDTH);
+        Mat& out = l > 0 ? levelDisp[l-1] : disp;
+        disparitySearchRanges(levelDisp[l], 2, pyramid[0][l].size(), p.numDisparities, searchLo);
+        matchLevel(*this, p, pyramid[0][l], pyramid[1][l], searchLo, out);
+    }
+    if (params.speckleWindowSize > 0)
+        filterSpeckleRegions(*this, disp, params.speckleWindowSize, params.speckleRange*DISP_SCALE);
+}
+
+void StereoMatcher::computeInRange(const Mat& left, const Mat& right, const Mat& lo, Mat& disp)
+{
+    TRACE_SCOPE("StereoMatcher::computeInRange");
+    checkParams(params, left, right);
+    CV_Assert(lo.type() == CV_16S && lo.size() == left.size());
+    CV_Assert(params.numDisparities >= RANGE_WIDTH);
+    matchLevel(*this, params, left, right, lo, disp);
+    if (params.speckleWindowSize > 0)
+        filterSpeckleRegions(*this, disp, params.speckleWindowSize, params.speckleRange*DISP_SCALE);
+}
+
+void disparitySearchRanges(const Mat& disp, int scale, Size size, int numDisparities, Mat& lo)
+{
+    CV_Assert(disp.type() == CV_16S && scale >= 1 && numDisparities >= RANGE_WIDTH);
+    lo.create(size, CV_16S);
+    const int maxLo = numDisparities - RANGE_WIDTH;
+
+    #pragma omp parallel for
+    for (int y = 0; y < size.height; y++)
+    {
+        const int cy = std::min(y/scale, disp.rows - 1);
+        short* l = lo.ptr<short>(y);
+        int center = 0;     // kept from the last pixel if nothing valid is around
+        for (int x = 0; x < size.width; x++)
+        {
+            const int cx = std::min(x/scale, disp.cols - 1);
+            int v = disp.at<short>(cy, cx);
+            if (v < 0)
+            {
+                v = INT_MAX;
+                for (int ny = std::max(cy - 1, 0); ny <= std::min(cy + 1, disp.rows - 1); ny++)
+                    for (int nx = std::max(cx - 1, 0); nx <= std::min(cx + 1, disp.cols - 1); nx++)
+                    {
+                        int n = disp.at<short>(ny, nx);
+                        if (n >= 0)
+                            v = std::min(v, n);
+                    }
+            }
+            if (v != INT_MAX)
+                center = (v*scale + DISP_SCALE/2) >> DISP_SHIFT;
+            l[x] = (short)std::min(std::max(center - RANGE_WIDTH/2, 0), maxLo);
+        }
+    }
+}
+
+size_t StereoMatcher::bufferSize() const
+{
+    const Mat* bufs[] = { &census[0], &census[1], &pixelCosts, &columnSums, &costRows, &pathSums, &pathRows, &pathMins,
+                          &scratch, &reversed, &searchLo, &rightCosts, &rightDisp, &labels, &regionSizes, &confidence };
+    size_t n = 0;
+    for (size_t i = 0; i < sizeof(bufs)/sizeof(bufs[0]); i++)
+        n += bufs[i]->total()*bufs[i]->elemSize();
+    // level 0 of the pyramid is the input pair
+    for (int k = 0; k < 2; k++)
+        for (size_t l = 1; l < pyramid[k].size(); l++)
+            n += pyramid[k][l].total()*pyramid[k][l].elemSize();
+    for (size_t l = 0; l < levelDisp.size(); l++)
+        n += levelDisp[l].total()*levelDisp[l].elemSize();
+    return n;
+}
+
+//--------------------------------------------------
+// Temporal matching
+//--------------------------------------------------
+const int TEMPORAL_COARSE_LEVELS = 2;   // the refreshed tiles are searched at quarter resolution
+
+TemporalParams::TemporalParams()
+{
+    keyframeInterval = 30;
+    tileSize = 16;
+    changeThreshold = 6;
+    minValidPercent = 50;
+    maxRefreshPercent = 50;
+}
+
+static StereoMatchParams coarseParams(const StereoMatchParams& params)
+{
+    StereoMatchParams p = params;
+    p.levels = 0;
+    p.numDisparities = std::max(((params.numDisparities >> TEMPORAL_COARSE_LEVELS) + 15) & ~15, RANGE_WIDTH);
+    return p;
+}
+
+TemporalStereoMatcher::TemporalStereoMatcher(const StereoMatchParams& params, const TemporalParams& temporal)
+    : temporal(temporal), matcher(params), coarseMatcher(coarseParams(params))
+{
+    reset();
+}
+
+void TemporalStereoMatcher::reset()
+{
+    prevLeft.release();
+    prevRight.release();
+    prevDisp.release();
+    sinceKeyframe = 0;
+    keyframe = false;
+    refreshedTiles = tiles = 0;
+}
+
+// Nonzero for the tiles of img whose mean absolute difference to prev is above the threshold.
+static void changedTiles(const Mat& img, const Mat& prev, int T, int threshold, Mat& changed)
+{
+    changed.create((img.rows + T - 1)/T, (img.cols + T - 1)/T, CV_8U);
+
+    #pragma omp parallel for
+    for (int ty = 0; ty < changed.rows; ty++)
+    {
+        const int y0 = ty*T, y1 = std::min(y0 + T, img.rows);
+        for (int tx = 0; tx < changed.cols; tx++)
+        {
+            const int x0 = tx*T, x1 = std::min(x0 + T, img.cols);
+            int diff = 0;
+            for (int y = y0; y < y1; y++)
+            {
+                const uchar* a = img.ptr<uchar>(y);
+                const uchar* b = prev.ptr<uchar>(y);
+                for (int x = x0; x < x1; x++)
+                    diff += abs(a[x] - b[x]);
+            }
+            changed.at<uchar>(ty, tx) = diff > threshold*(y1 - y0)*(x1 - x0);
+        }
+    }
+}
+
+// Marks the tiles to search again and returns their number: tiles whose left image changed,
+// whose previous disparities are mostly invalid, or that match against a changed part of the
+// right image(an occluder may have moved there, even if the left view is the same).
+static int markRefreshTiles(const Mat& prevDisp, const Mat& lo, const Mat& changedL, const Mat& changedR,
+                            const TemporalParams& tp, Mat& refresh)
+{
+    const int T = tp.tileSize, W = prevDisp.cols, H = prevDisp.rows;
+    refresh.create(changedL.size(), CV_8U);
+    int count = 0;
+
+    #pragma omp parallel for reduction(+:count)
+    for (int ty = 0; ty < refresh.rows; ty++)
+    {
+        const int y0 = ty*T, y1 = std::min(y0 + T, H);
+        for (int tx = 0; tx < refresh.cols; tx++)
+        {
+            const int x0 = tx*T, x1 = std::min(x0 + T, W);
+            int valid = 0, minLo = INT_MAX, maxLo = 0;
+            for (int y = y0; y < y1; y++)
+            {
+                const short* d = prevDisp.ptr<short>(y);
+                const short* l = lo.ptr<short>(y);
+                for (int x = x0; x < x1; x++)
+                {
+                    valid += d[x] >= 0;
+                    minLo = std::min(minLo, (int)l[x]);
+                    maxLo = std::max(maxLo, (int)l[x]);
+                }
+            }
+
+            bool r = changedL.at<uchar>(ty, tx) || valid*100 < tp.minValidPercent*(y1 - y0)*(x1 - x0);
+            // right image columns reached by the windows of the tile
+            const int r0 = std::max(x0 - (maxLo + RANGE_WIDTH - 1), 0)/T;
+            const int r1 = std::max(x1 - 1 - minLo, 0)/T;
+            for (int rx = r0; rx <= r1 && !r; rx++)
+                r = changedR.at<uchar>(ty, rx) != 0;
+
+            refresh.at<uchar>(ty, tx) = r;
+            count += r;
+        }
+    }
+    return count;
+}
+
+void TemporalStereoMatcher::compute(const Mat& left, const Mat& right, Mat& disp)
+{
+    TRACE_SCOPE("TemporalStereoMatcher::compute");
+    CV_Assert(temporal.keyframeInterval > 0 && temporal.tileSize > 0);
+    const int D = matcher.params.numDisparities;
+    const int T = temporal.tileSize;
+
+    keyframe = prevDisp.empty() || prevDisp.size() != left.size() || D <= RANGE_WIDTH ||
+               ++sinceKeyframe >= temporal.keyframeInterval;
+    tiles = ((left.rows + T - 1)/T)*((left.cols + T - 1)/T);
+    refreshedTiles = 0;
+    if (!keyframe)
+    {
+        disparitySearchRanges(prevDisp, 1, left.size(), D, lo);
+        changedTiles(left, prevLeft, T, temporal.changeThreshold, changed[0]);
+        changedTiles(right, prevRight, T, temporal.changeThreshold, changed[1]);
+        refreshedTiles = markRefreshTiles(prevDisp, lo, changed[0], changed[1], temporal, refresh);
+        keyframe = refreshedTiles*100 > tiles*temporal.maxRefreshPercent;
+    }
+
+    if (keyframe)
+    {
+        matcher.compute(left, right, disp);
+        sinceKeyframe = 0;
+    }
+    else
+    {
+        if (refreshedTiles > 0)
+        {
+            pyrDown(left, small[0]);
+            pyrDown(right, small[1]);
+            for (int l = 1; l < TEMPORAL_COARSE_LEVELS; l++)
+            {
+                pyrDown(small[0], small[0]);
+                pyrDown(small[1], small[1]);
+            }
+            coarseMatcher.compute(small[0], small[1], coarseDisp);
+            disparitySearchRanges(coarseDisp, 1 << TEMPORAL_COARSE_LEVELS, left.size(), D, coarseLo);
+
+            for (int ty = 0; ty < refresh.rows; ty++)
+                for (int tx = 0; tx < refresh.cols; tx++)
+                    if (refresh.at<uchar>(ty, tx))
+                    {
+                        Rect tile = Rect(tx*T, ty*T, T, T) & Rect(0, 0, left.cols, left.rows);
+                        coarseLo(tile).copyTo(lo(tile));
+                    }
+        }
+        matcher.computeInRange(left, right, lo, disp);
+    }
+
+    left.copyTo(prevLeft);
+    right.copyTo(prevRight);
+    disp.copyTo(prevDisp);
+}
+
+size_t TemporalStereoMatcher::bufferSize() const
+{
+    const Mat* bufs[] = { &prevLeft, &prevRight, &prevDisp, &small[0], &small[1], &coarseDisp, &coarseLo, &lo,
+                          &changed[0], &changed[1], &refresh };
+    size_t n = matcher.bufferSize() + coarseMatcher.bufferSize();
+    for (size_t i = 0; i < sizeof(bufs)/sizeof(bufs[0]); i++)
+        n += bufs[i]->total()*bufs[i]->elemSize();
+    return n;
+}
@@ -0,0 +1,157 @@
+/// disparity.hpp
+/// Dense disparity computation on rectified image pairs.
+/// Block matching(BM) and memory-efficient semi-global matching(SGM),
+/// over the full disparity range or coarse-to-fine on an image pyramid,
+/// and a temporal matcher for video that searches around the previous disparity.
+///
+/// Build with -mavx2 (x86) or on ARM with NEON to get the vectorized SGM kernels,
+/// otherwise a scalar fallback is used.
+
+#ifndef DISPARITY_HPP
+#define DISPARITY_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+
+// Disparity maps are CV_16S fixed point with DISP_SHIFT fractional bits (same as OpenCV matchers).
+const int DISP_SHIFT = 4;
+const int DISP_SCALE = 1 << DISP_SHIFT;
+const short DISP_INVALID = -DISP_SCALE;    // pixels without a reliable match
+
+// Per-pixel costs are in gray levels for SAD and CENSUS_BIT_COST units per differing bit for census.
+const int CENSUS_BIT_COST = 4;
+
+// Disparities searched per pixel when the search is narrowed around a known disparity.
+const int RANGE_WIDTH = 16;
+
+enum MatchCost
+{
+    COST_SAD = 0,           // absolute intensity differences
+    COST_CENSUS_5X5 = 1,    // Hamming distance of 5x5 census codes(24 bits)
+    COST_CENSUS_7X9 = 2     // Hamming distance of 7(rows)x9(cols) census codes(62 bits)
+};
+
+enum MatchMode
+{
+    MATCH_BM = 0,   // winner-takes-all on block costs
+    MATCH_SGM = 1   // semi-global aggregation of block costs
+};
+
+struct StereoMatchParams
+{
+    int mode;               // MATCH_BM or MATCH_SGM
+    int cost;               // MatchCost of a pixel, summed over blockSize x blockSize
+    int numDisparities;     // search range is [0, numDisparities), must be a multiple of 16
+    int blockSize;          // odd size of the matching window
+    int P1, P2;             // SGM penalties for disparity changes of 1 and >1, in per-pixel cost units
+    int paths;              // SGM aggregation paths, 4 or 8
+    int costBits;           // 8 or 16, element size of the stored cost rows
+    int uniquenessRatio;    // percent by which the best cost must beat the others
+    int disp12MaxDiff;      // left-right check: pixels the right image disparity may differ by, < 0 disables
+    int speckleWindowSize;  // regions of similar disparity with fewer pixels are invalidated, 0 disables
+    int speckleRange;       // pixels neighbours of a region may differ by
+    int stripRows;          // SGM: rows aggregated together in one strip
+    int overlapRows;        // SGM: rows below a strip used to warm up the bottom-up paths
+    int levels;             // coarse-to-fine: half resolution levels below the full one, 0 = full range search
+
+    StereoMatchParams();
+};
+
+/// Dense matcher. Keeps its working buffers between frames, so create one per stream.
+/// SGM never holds the full W*H*D volume: matching costs live in a ring of
+/// (stripRows + overlapRows) rows, path sums in one strip of stripRows rows.
+/// With levels > 0 only the coarsest level searches all disparities; every finer level
+/// searches RANGE_WIDTH disparities per pixel around the upsampled result of the level below.
+struct StereoMatcher
+{
+    StereoMatchParams params;
+
+    // working buffers
+    cv::Mat census[2];      // census codes of the left and right image
+    cv::Mat pixelCosts;     // ring of per-pixel cost rows, W*D uchar each
+    cv::Mat columnSums;     // block costs summed over a column of the window, W*D ushort
+    cv::Mat costRows;       // ring of block cost rows, W*D CostT each
+    cv::Mat pathSums;       // SGM: sum of all paths for the rows of one strip, W*D ushort each
+    cv::Mat pathRows;       // SGM: previous/current row of each vertical or diagonal path
+    cv::Mat pathMins;       // SGM: min over disparities of each path row entry
+    cv::Mat scratch;        // SGM: path sums of the warm-up rows, thrown away
+    cv::Mat rightCosts;     // left-right check: min cost per right image pixel of the current row, reversed
+    cv::Mat rightDisp;      // left-right check: its disparity
+    cv::Mat labels;         // speckle filter: union-find parent of every pixel
+    cv::Mat regionSizes;    // speckle filter: pixels per region, at the index of its root
+    cv::Mat reversed;       // ranged search: right image or codes, every row reversed
+    cv::Mat searchLo;       // coarse-to-fine: first disparity searched per pixel
+    std::vector<cv::Mat> pyramid[2];    // coarse-to-fine: downsampled left and right images
+    std::vector<cv::Mat> levelDisp;     // coarse-to-fine: disparity of every level but the full one
+
+    // output
+    cv::Mat confidence;     // CV_8U, 255*(1 - best cost/best cost of the other disparities), 0 where invalid
+
+    StereoMatcher(const StereoMatchParams& params = StereoMatchParams());
+
+    /// left, right: rectified 8-bit grayscale images of the same size.
+    /// disp: CV_16S disparity of the left image, scaled by DISP_SCALE, DISP_INVALID where unknown.
+    /// Left-right check, subpixel refinement, uniqueness and confidence are fused into the
+    /// disparity selection of every row, the speckle filter runs once over the result.
+    void compute(const cv::Mat& left, const cv::Mat& right, cv::Mat& disp);
+
+    /// Like compute with levels = 0, but pixel (x,y) only searches the disparities
+    /// [lo(y,x), lo(y,x) + RANGE_WIDTH). lo: CV_16S, values in [0, numDisparities - RANGE_WIDTH].
+    void computeInRange(const cv::Mat& left, const cv::Mat& right, const cv::Mat& lo, cv::Mat& disp);
+
+    /// Bytes currently held by the working buffers.
+    size_t bufferSize() const;
+};
+
+struct TemporalParams
+{
+    int keyframeInterval;   // frames between searches from scratch, bounds the propagation of errors
+    int tileSize;           // pixels, the image is checked for changes tile by tile
+    int changeThreshold;    // mean absolute gray level change of a tile that has it searched again
+    int minValidPercent;    // tiles with fewer valid previous disparities are searched again(low confidence)
+    int maxRefreshPercent;  // frames with more tiles to search again become keyframes
+
+    TemporalParams();
+};
+
+/// Matcher for stereo video. Pixels search RANGE_WIDTH disparities around their disparity in the
+/// previous frame. Tiles that changed or had no confident disparity take their windows from a full
+/// range search at quarter resolution instead. Keyframes are matched from scratch with
+/// matcher.params(full range, or coarse-to-fine with levels > 0).
+struct TemporalStereoMatcher
+{
+    TemporalParams temporal;
+    StereoMatcher matcher;          // the full resolution search
+    StereoMatcher coarseMatcher;    // full range search at quarter resolution for the refreshed tiles
+
+    // state and working buffers
+    cv::Mat prevLeft, prevRight, prevDisp;  // previous frame
+    cv::Mat small[2];               // quarter resolution pair
+    cv::Mat coarseDisp, coarseLo, lo;
+    cv::Mat changed[2];             // CV_8U per tile of the left and right image, nonzero if changed
+    cv::Mat refresh;                // CV_8U per tile, nonzero if searched again
+    int sinceKeyframe;
+
+    // about the last frame
+    bool keyframe;
+    int refreshedTiles, tiles;
+
+    TemporalStereoMatcher(const StereoMatchParams& params = StereoMatchParams(),
+                          const TemporalParams& temporal = TemporalParams());
+
+    /// Same input and output as StereoMatcher::compute, frames must come in order.
+    void compute(const cv::Mat& left, const cv::Mat& right, cv::Mat& disp);
+
+    /// Forget the previous frame, e.g. after a cut, the next frame is a keyframe.
+    void reset();
+
+    size_t bufferSize() const;
+};
+
+/// Search windows for computeInRange centered on a known disparity map, which may be
+/// 'scale' times smaller than the images(scale 2: the next coarser pyramid level).
+/// Invalid pixels take the smallest valid disparity around them, occlusions belong to the background.
+void disparitySearchRanges(const cv::Mat& disp, int scale, cv::Size size, int numDisparities, cv::Mat& lo);
+
+#endif
@@ -0,0 +1,435 @@
+/// disparity_check.cpp
+/// Checks the matcher of disparity.hpp against a plain reference implementation on a synthetic
+/// pair: the block costs, the SGM paths, the disparity selection, the left-right check and the
+/// speckle filter are recomputed pixel by pixel, without strips, cost rings, vector kernels or
+/// union-find, and the disparity maps must be identical.
+/// The scalar, AVX2 and NEON builds all have to pass, so the kernels cannot change their results
+/// unnoticed.
+///
+/// The strips of SGM approximate the bottom-up paths(overlapRows of warm-up); they are exact when
+/// the strip is the whole image or the warm-up reaches the last row, as in the configurations here.
+///
+/// Output: one line per configuration; the exit code is 0 if all pass, 1 if any fails.
+///
+/// Ref:
+///     disparity.cpp
+
+#include "opencv2/core/core.hpp"
+
+#include "disparity.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <string>
+#include <stdio.h>
+#include <limits.h>
+
+using namespace cv;
+using namespace std;
+
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+const int imageWidth = 224;
+const int imageHeight = 160;
+const int numDisparities = 64;
+const int INF = INT_MAX/4;      // outside the disparity range, never the minimum
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void syntheticPair(Mat& left, Mat& right);
+static void referenceDisparity(const StereoMatchParams& p, const Mat& left, const Mat& right, Mat& disp);
+static int checkConfiguration(const string& name, const StereoMatchParams& p, const Mat& left, const Mat& right);
+//--------------------------------------------------
+
+int main()
+{
+    Mat left, right;
+    syntheticPair(left, right);
+
+    StereoMatchParams base;
+    base.numDisparities = numDisparities;
+    base.disp12MaxDiff = -1;
+    base.speckleWindowSize = 0;
+    base.stripRows = imageHeight;   // one strip
+
+    const char* costNames[3] = {"sad", "census5x5", "census7x9"};
+    int failures = 0, configurations = 0;
+    for (int mode = MATCH_BM; mode <= MATCH_SGM; mode++)
+        for (int cost = COST_SAD; cost <= COST_CENSUS_7X9; cost++)
+            for (int costBits = 8; costBits <= 16; costBits += 8)
+            {
+                StereoMatchParams p = base;
+                p.mode = mode;
+                p.cost = cost;
+                p.costBits = costBits;
+                p.blockSize = cost == COST_SAD ? (mode == MATCH_BM ? 9 : 5) : (cost == COST_CENSUS_5X5 ? 3 : 1);
+                // both path sets, and strips whose bottom-up paths start at the last row
+                p.paths = costBits == 8 ? 8 : 4;
+                if (mode == MATCH_SGM && cost == COST_CENSUS_5X5)
+                {
+                    p.stripRows = 16;
+                    p.overlapRows = imageHeight;
+                }
+                string name = format("%s %s block %d, %d-bit costs", mode == MATCH_SGM ? "sgm" : "bm",
+                                     costNames[cost], p.blockSize, costBits);
+                if (mode == MATCH_SGM)
+                    name += format(", %d paths, strips of %d rows", p.paths, p.stripRows);
+                failures += checkConfiguration(name, p, left, right);
+                configurations++;
+            }
+
+    // the post-processing with its default settings, and strict: with range 0 many small regions
+    // cross the 32-row strips the speckle filter labels separately
+    const StereoMatchParams defaults;
+    for (int mode = MATCH_BM; mode <= MATCH_SGM; mode++)
+        for (int cost = COST_SAD; cost <= COST_CENSUS_7X9; cost += COST_CENSUS_7X9 - COST_SAD)
+            for (int strict = 0; strict <= 1; strict++)
+            {
+                StereoMatchParams p = base;
+                p.mode = mode;
+                p.cost = cost;
+                p.blockSize = cost == COST_SAD ? (mode == MATCH_BM ? 9 : 5) : 1;
+                p.disp12MaxDiff = strict ? 0 : defaults.disp12MaxDiff;
+                p.speckleWindowSize = strict ? 50 : defaults.speckleWindowSize;
+                p.speckleRange = strict ? 0 : defaults.speckleRange;
+                string name = format("%s %s block %d, lr %d, speckles %d/%d", mode == MATCH_SGM ? "sgm" : "bm",
+                                     costNames[cost], p.blockSize, p.disp12MaxDiff, p.speckleWindowSize,
+                                     p.speckleRange);
+                failures += checkConfiguration(name, p, left, right);
+                configurations++;
+            }
+
+    if (failures)
+        cout << failures << " of " << configurations << " configurations differ from the reference" << endl;
+    else
+        cout << "All " << configurations << " configurations match the reference" << endl;
+    return failures ? 1 : 0;
+}
+
+// A slanted textured background and a box in front of it, with noise in both images and a few
+// blotches in the left one only: the pair has disparity steps, occlusions and mismatches.
+void syntheticPair(Mat& left, Mat& right)
+{
+    const int W = imageWidth, H = imageHeight, margin = numDisparities;
+    RNG rng(12345);
+    Mat texture[2];     // background and box, wide enough for the shifts
+    for (int k = 0; k < 2; k++)
+    {
+        texture[k].create(H, W + 2*margin, CV_8U);
+        for (int y = 0; y < H; y++)
+        {
+            uchar* t = texture[k].ptr<uchar>(y);
+            int v = rng.uniform(0, 256);
+            for (int x = 0; x < W + 2*margin; x++)
+                t[x] = (uchar)(v = (v + rng.uniform(0, 256))/2);   // smoothed along the rows
+        }
+    }
+
+    const Rect box(W/2, H/4, W/4, H/2);
+    const int boxDisparity = 40;
+    left.create(H, W, CV_8U);
+    right.create(H, W, CV_8U);
+    for (int y = 0; y < H; y++)
+    {
+        for (int x = 0; x < W; x++)
+        {
+            const bool inBox = box.contains(Point(x, y));
+            left.at<uchar>(y, x) = texture[inBox].at<uchar>(y, x + margin);
+        }
+        for (int xr = 0; xr < W; xr++)
+        {
+            // the background at left x has disparity 8 + x/16
+            if (box.contains(Point(xr + boxDisparity, y)))
+                right.at<uchar>(y, xr) = texture[1].at<uchar>(y, xr + boxDisparity + margin);
+            else
+            {
+                int x = xr;
+                while (x - (8 + x/16) < xr)
+                    x++;
+                right.at<uchar>(y, xr) = texture[0].at<uchar>(y, x + margin);
+            }
+        }
+    }
+
+    for (int k = 0; k < 2; k++)
+    {
+        Mat& img = k ? right : left;
+        for (int y = 0; y < H; y++)
+            for (int x = 0; x < W; x++)
+                img.at<uchar>(y, x) = saturate_cast<uchar>(img.at<uchar>(y, x) + rng.uniform(-3, 4));
+    }
+    for (int i = 0; i < 12; i++)
+    {
+        const Rect blotch(rng.uniform(0, W - 6), rng.uniform(0, H - 6), rng.uniform(2, 7), rng.uniform(2, 7));
+        left(blotch).setTo(Scalar::all(rng.uniform(0, 256)));
+    }
+}
+
+//--------------------------------------------------
+// Reference
+//--------------------------------------------------
+// Census codes as the matcher computes them, with the image border repeated.
+static void censusCodes(const Mat& img, int winRows, int winCols, vector<uint64>& codes)
+{
+    const int W = img.cols, H = img.rows;
+    codes.assign(W*H, 0);
+    for (int y = 0; y < H; y++)
+        for (int x = 0; x < W; x++)
+        {
+            const uchar center = img.at<uchar>(y, x);
+            uint64 c = 0;
+            for (int dy = -winRows/2; dy <= winRows/2; dy++)
+                for (int dx = -winCols/2; dx <= winCols/2; dx++)
+                {
+                    if (dy == 0 && dx == 0)
+                        continue;
+                    const int yy = min(max(y + dy, 0), H - 1), xx = min(max(x + dx, 0), W - 1);
+                    c = (c << 1) | (uint64)(img.at<uchar>(yy, xx) < center);
+                }
+            codes[y*W + x] = c;
+        }
+}
+
+static int popcount(uint64 v)
+{
+    int n = 0;
+    for ( ; v; v &= v - 1)
+        n++;
+    return n;
+}
+
+// Block costs C(y, x, d) at [(y*W + x)*D + d]. Pixels left of the right image repeat its first
+// column(SAD) or have the code 0(census); disparities beyond x have the maximum cost.
+static void blockCosts(const StereoMatchParams& p, const Mat& left, const Mat& right, vector<int>& C)
+{
+    const int W = left.cols, H = left.rows, D = p.numDisparities, r = p.blockSize/2;
+    const int scale = p.costBits == 8 ? 1 : 16;
+    const int area = p.blockSize*p.blockSize;
+    const uint64 mul = ((scale << 16) + area/2)/area;
+
+    vector<uint64> codes[2];
+    if (p.cost != COST_SAD)
+    {
+        const int rows = p.cost == COST_CENSUS_5X5 ? 5 : 7, cols = p.cost == COST_CENSUS_5X5 ? 5 : 9;
+        censusCodes(left, rows, cols, codes[0]);
+        censusCodes(right, rows, cols, codes[1]);
+    }
+
+    // per-pixel costs
+    vector<int> pc(W*H*D);
+    for (int y = 0; y < H; y++)
+        for (int x = 0; x < W; x++)
+            for (int d = 0; d < D; d++)
+            {
+                const int xr = x - d;
+                int c;
+                if (p.cost == COST_SAD)
+                    c = abs(left.at<uchar>(y, x) - right.at<uchar>(y, max(xr, 0)));
+                else
+                    c = popcount(codes[0][y*W + x] ^ (xr >= 0 ? codes[1][y*W + xr] : 0))*CENSUS_BIT_COST;
+                pc[(y*W + x)*D + d] = c;
+            }
+
+    C.resize(W*H*D);
+    for (int y = 0; y < H; y++)
+        for (int x = 0; x < W; x++)
+            for (int d = 0; d < D; d++)
+            {
+                uint64 sum = 0;
+                for (int dy = -r; dy <= r; dy++)
+                    for (int dx = -r; dx <= r; dx++)
+                        sum += pc[(min(max(y + dy, 0), H - 1)*W + min(max(x + dx, 0), W - 1))*D + d];
+                C[(y*W + x)*D + d] = d > x ? 255*scale : (int)((sum*mul) >> 16);
+            }
+}
+
+// Adds the path whose predecessor of pixel (x, y) is (x + px, y + py) to S:
+//   Lr(p,d) = C(p,d) + min(Lr(p-r,d), Lr(p-r,d-1) + P1, Lr(p-r,d+1) + P1, min_k Lr(p-r,k) + P2) - min_k Lr(p-r,k)
+// with Lr = C where the predecessor is outside the image.
+static void addPath(const vector<int>& C, int W, int H, int D, int px, int py, int P1, int P2, vector<int>& S)
+{
+    vector<int> L(W*H*D), Lmin(W*H);
+    for (int i = 0; i < H; i++)
+    {
+        const int y = py <= 0 ? i : H - 1 - i;     // predecessors first
+        for (int j = 0; j < W; j++)
+        {
+            const int x = px <= 0 ? j : W - 1 - j;
+            const int q = y*W + x, xp = x + px, yp = y + py;
+            const bool inside = xp >= 0 && xp < W && yp >= 0 && yp < H;
+            const int* Lp = inside ? &L[(yp*W + xp)*D] : NULL;
+            const int minLp = inside ? Lmin[yp*W + xp] : 0;
+            int best = INF;
+            for (int d = 0; d < D; d++)
+            {
+                int v = C[q*D + d];
+                if (inside)
+                {
+                    int m = min(Lp[d], minLp + P2);
+                    m = min(m, (d > 0 ? Lp[d-1] : INF) + P1);
+                    m = min(m, (d < D - 1 ? Lp[d+1] : INF) + P1);
+                    v += m - minLp;
+                }
+                L[q*D + d] = v;
+                best = min(best, v);
+            }
+            Lmin[q] = best;
+        }
+    }
+    for (size_t i = 0; i < S.size(); i++)
+        S[i] += L[i];
+}
+
+// Winner-takes-all with the uniqueness check, the left-right check and parabola subpixel
+// refinement, in DISP_SCALE units.
+static void selectDisparities(const StereoMatchParams& p, const vector<int>& S, int W, int H, Mat& disp)
+{
+    const int D = p.numDisparities;
+    disp.create(H, W, CV_16S);
+    vector<int> rdisp(W);
+    for (int y = 0; y < H; y++)
+    {
+        // right pixel xr matches the left pixel xr + d of least cost at d, ties go to the larger d
+        for (int xr = 0; xr < W; xr++)
+        {
+            int best = 0;
+            for (int d = 1; d < D && xr + d < W; d++)
+                if (S[(y*W + xr + d)*D + d] <= S[(y*W + xr + best)*D + best])
+                    best = d;
+            rdisp[xr] = best;
+        }
+
+        for (int x = 0; x < W; x++)
+        {
+            const int* c = &S[(y*W + x)*D];
+            int best = 0;
+            for (int d = 1; d < D; d++)
+                if (c[d] < c[best])
+                    best = d;
+            const int minC = c[best];
+            int other = INF;
+            for (int d = 0; d < D; d++)
+                if (abs(d - best) > 1)
+                    other = min(other, c[d]);
+
+            if ((int64)other*(100 - p.uniquenessRatio) < (int64)minC*100 ||
+                (p.disp12MaxDiff >= 0 && best <= x && abs(rdisp[x - best] - best) > p.disp12MaxDiff))
+            {
+                disp.at<short>(y, x) = DISP_INVALID;
+                continue;
+            }
+            int v = best*DISP_SCALE;
+            if (best > 0 && best < D - 1)
+            {
+                const int cm = c[best-1], cp = c[best+1];
+                const int denom2 = max(cm + cp - 2*minC, 1);
+                v += ((cm - cp)*DISP_SCALE + denom2)/(denom2*2);
+            }
+            disp.at<short>(y, x) = (short)v;
+        }
+    }
+}
+
+// Invalidates the 4-connected regions of valid disparities, neighbours differing by at most
+// maxDiff, with fewer than maxSize pixels: each region is collected by a breadth-first search.
+static void filterSpeckles(Mat& disp, int maxSize, int maxDiff)
+{
+    const int W = disp.cols, H = disp.rows;
+    static const int dxs[4] = {-1, 1, 0, 0};
+    static const int dys[4] = {0, 0, -1, 1};
+    vector<bool> visited(W*H, false);
+    vector<Point> region;
+    for (int y0 = 0; y0 < H; y0++)
+        for (int x0 = 0; x0 < W; x0++)
+        {
+            if (visited[y0*W + x0] || disp.at<short>(y0, x0) < 0)
+                continue;
+            region.clear();
+            queue<Point> open;
+            open.push(Point(x0, y0));
+            visited[y0*W + x0] = true;
+            while (!open.empty())
+            {
+                const Point q = open.front();
+                open.pop();
+                region.push_back(q);
+                const short d = disp.at<short>(q.y, q.x);
+                for (int k = 0; k < 4; k++)
+                {
+                    const int x = q.x + dxs[k], y = q.y + dys[k];
+                    if (x < 0 || x >= W || y < 0 || y >= H || visited[y*W + x])
+                        continue;
+                    const short n = disp.at<short>(y, x);
+                    if (n >= 0 && abs(n - d) <= maxDiff)
+                    {
+                        visited[y*W + x] = true;
+                        open.push(Point(x, y));
+                    }
+                }
+            }
+            if ((int)region.size() < maxSize)
+                for (size_t i = 0; i < region.size(); i++)
+                    disp.at<short>(region[i].y, region[i].x) = DISP_INVALID;
+        }
+}
+
+void referenceDisparity(const StereoMatchParams& p, const Mat& left, const Mat& right, Mat& disp)
+{
+    const int W = left.cols, H = left.rows, D = p.numDisparities;
+    vector<int> C;
+    blockCosts(p, left, right, C);
+    if (p.mode == MATCH_BM)
+    {
+        selectDisparities(p, C, W, H, disp);
+        if (p.speckleWindowSize > 0)
+            filterSpeckles(disp, p.speckleWindowSize, p.speckleRange*DISP_SCALE);
+        return;
+    }
+
+    // predecessors: above, upper-left, upper-right, below, lower-right, lower-left, left, right
+    static const int pxs[8] = {0, -1, 1, 0, 1, -1, -1, 1};
+    static const int pys[8] = {-1, -1, -1, 1, 1, 1, 0, 0};
+    static const int fourPaths[4] = {0, 3, 6, 7};
+    const int scale = p.costBits == 8 ? 1 : 16;
+    vector<int> S(W*H*D, 0);
+    for (int k = 0; k < p.paths; k++)
+    {
+        const int i = p.paths == 8 ? k : fourPaths[k];
+        addPath(C, W, H, D, pxs[i], pys[i], p.P1*scale, p.P2*scale, S);
+    }
+    for (size_t i = 0; i < S.size(); i++)
+        S[i] = min(S[i], 0xFFFF);   // the path sums saturate at 16 bits
+    selectDisparities(p, S, W, H, disp);
+    if (p.speckleWindowSize > 0)
+        filterSpeckles(disp, p.speckleWindowSize, p.speckleRange*DISP_SCALE);
+}
+
+// prints the comparison, returns 1 if the maps differ
+int checkConfiguration(const string& name, const StereoMatchParams& p, const Mat& left, const Mat& right)
+{
+    StereoMatcher matcher(p);
+    Mat disp, expected;
+    matcher.compute(left, right, disp);
+    referenceDisparity(p, left, right, expected);
+
+    int differ = 0, valid = 0;
+    Point first(-1, -1);
+    for (int y = 0; y < disp.rows; y++)
+        for (int x = 0; x < disp.cols; x++)
+        {
+            const short v = disp.at<short>(y, x), e = expected.at<short>(y, x);
+            valid += e != DISP_INVALID;
+            if (v != e && differ++ == 0)
+                first = Point(x, y);
+        }
+    cout << format("%s %-66s valid %5.1f%%, %d pixels differ", differ ? "FAIL" : "PASS", name.c_str(),
+                   100.*valid/disp.total(), differ);
+    if (differ)
+        cout << format(", first at (%d, %d): %d instead of %d", first.x, first.y,
+                       disp.at<short>(first.y, first.x), expected.at<short>(first.y, first.x));
+    cout << endl;
+    return differ ? 1 : 0;
+}
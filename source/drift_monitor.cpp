@@ -0,0 +1,251 @@
+/// drift_monitor.cpp
+/// Vertical disparity monitor for rectified stereo pairs.
+///
+///   1. in every checked cell, the candidate pixel with the most texture in both directions
+///      (a vertical offset can only be measured on horizontal structure) is the feature;
+///   2. its block is matched against the right image over the disparity range and a few rows
+///      above and below, the SAD minimum must be unique and is refined with parabolas;
+///   3. the median absolute vertical residual of the recently measured cells is averaged over
+///      frames, and its trend is the slope of a line fitted to the last frames.
+/// Like the epipolar error reported by stereo_calib, the residual is in pixels and near 0.1-0.2
+/// for a good calibration.
+///
+/// Ref:
+///     stereo_calib.cpp, computeReprojectionError
+
+#include "drift_monitor.hpp"
+#include "sparse_stereo.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+using namespace cv;
+using namespace std;
+
+const int MIN_CELLS = 4;        // cells needed for a residual
+const int CANDIDATE_STEP = 4;   // pixels between the feature candidates of a cell
+const int MAX_DISPARITIES = 256;
+
+DriftParams::DriftParams()
+{
+    gridCols = 8;
+    gridRows = 6;
+    cellsPerFrame = 16;
+    numDisparities = 64;
+    maxOffset = 4;
+    blockRows = 9;
+    minTexture = 6;
+    uniquenessRatio = 10;
+    maxMeanCost = 20;
+    maxAge = 30;
+    averageWeight = 0.05f;
+    trendFrames = 300;
+    threshold = 0.5f;
+    budget = 1;
+}
+
+DriftMonitor::DriftMonitor(const DriftParams& _params)
+    : params(_params)
+{
+    reset();
+}
+
+void DriftMonitor::reset()
+{
+    CV_Assert(params.gridCols > 0 && params.gridRows > 0 && params.cellsPerFrame > 0);
+    CV_Assert(params.numDisparities > 0 && params.numDisparities <= MAX_DISPARITIES);
+    CV_Assert(params.maxOffset > 0 && params.blockRows % 2 == 1 && params.blockRows <= 15);
+    CV_Assert(params.trendFrames > 1);
+
+    const int cells = params.gridCols*params.gridRows;
+    cellResidual.assign(cells, 0.f);
+    cellFrame.assign(cells, -1);
+    history.assign(params.trendFrames, 0.f);
+    costs.resize(MAX_DISPARITIES*(2*params.maxOffset + 1));
+    matches.clear();
+    nextCell = 0;
+    measured = 0;
+
+    state.frame = 0;
+    state.matches = 0;
+    state.cells = 0;
+    state.residual = state.offset = state.average = state.trend = 0.f;
+    state.alarm = state.changed = false;
+    state.time = 0;
+}
+
+// Minimum of a parabola through (-1, c0), (0, c1), (1, c2), in [-0.5, 0.5].
+static float parabolaMin(int c0, int c1, int c2)
+{
+    const int denom = c0 - 2*c1 + c2;
+    if (denom <= 0)
+        return 0.f;
+    return std::max(-0.5f, std::min(0.5f, (c0 - c2)/(2.f*denom)));
+}
+
+bool DriftMonitor::matchCell(const Mat& left, const Mat& right, const Rect& cell, DriftMatch& m)
+{
+    const int half = params.blockRows/2;
+    const int halfCols = SPARSE_BLOCK_COLS/2;
+    // the block, its gradients and all vertical offsets must stay inside the image
+    const int x0 = std::max(cell.x, halfCols + 1), x1 = std::min(cell.x + cell.width, left.cols - halfCols - 1);
+    const int margin = half + params.maxOffset + 1;
+    const int y0 = std::max(cell.y, margin), y1 = std::min(cell.y + cell.height, left.rows - margin);
+
+    // 1. feature: most texture in the weaker direction, on a subsampled block
+    int bestScore = -1, x = 0, y = 0;
+    for (int cy = y0 + CANDIDATE_STEP/2; cy < y1; cy += CANDIDATE_STEP)
+    {
+        for (int cx = x0 + CANDIDATE_STEP/2; cx < x1; cx += CANDIDATE_STEP)
+        {
+            int gx = 0, gy = 0;
+            for (int r = -half; r <= half; r += 2)
+            {
+                const uchar* p = left.ptr<uchar>(cy + r);
+                for (int c = -halfCols; c < halfCols; c += 2)
+                {
+                    gx += abs(p[cx + c + 1] - p[cx + c - 1]);
+                    gy += abs(p[cx + c + left.step] - p[cx + c - left.step]);
+                }
+            }
+            const int score = std::min(gx, gy);
+            if (score > bestScore)
+            {
+                bestScore = score;
+                x = cx;
+                y = cy;
+            }
+        }
+    }
+    const int samples = (half + 1)*halfCols;
+    if (bestScore < params.minTexture*samples)
+        return false;
+
+    // 2. costs of all disparities and vertical offsets, row k of costs is offset k - maxOffset
+    const int n = std::min(params.numDisparities, x - halfCols + 1);
+    const int offsets = 2*params.maxOffset + 1;
+    const uchar* a = left.ptr<uchar>(y - half) + x - halfCols;
+    for (int k = 0; k < offsets; k++)
+    {
+        const uchar* b = right.ptr<uchar>(y - half + k - params.maxOffset) + x - halfCols;
+        blockCosts(a, left.step, b, right.step, params.blockRows, n, -1, &costs[k*n]);
+    }
+
+    int best = 0;
+    for (int i = 1; i < offsets*n; i++)
+    {
+        if (costs[i] < costs[best])
+            best = i;
+    }
+    const int bk = best/n, bd = best%n;
+    if (bk == 0 || bk == offsets - 1)       // the offset may lie outside the search range
+        return false;
+    if (costs[best] > params.maxMeanCost*SPARSE_BLOCK_COLS*params.blockRows)
+        return false;
+    const int limit = costs[best]*(100 + params.uniquenessRatio)/100;
+    for (int k = 0; k < offsets; k++)
+    {
+        for (int d = 0; d < n; d++)
+        {
+            if ((abs(k - bk) > 1 || abs(d - bd) > 1) && costs[k*n + d] <= limit)
+                return false;
+        }
+    }
+
+    const float dy = bk - params.maxOffset
+                   + parabolaMin(costs[(bk - 1)*n + bd], costs[best], costs[(bk + 1)*n + bd]);
+    const float dx = bd > 0 && bd < n - 1 ? bd + parabolaMin(costs[best - 1], costs[best], costs[best + 1])
+                                         : (float)bd;
+    m.left = Point2f((float)x, (float)y);
+    m.right = Point2f(x - dx, y + dy);
+    return true;
+}
+
+const DriftState& DriftMonitor::process(const Mat& left, const Mat& right)
+{
+    TRACE_SCOPE("DriftMonitor::process");
+    CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+    const int64 start = getTickCount();
+    const double budgetTicks = params.budget*getTickFrequency()/1000;
+    if (left.size() != imageSize)
+    {
+        reset();
+        imageSize = left.size();
+    }
+
+    // 1. the next cells of the round robin, as many as the budget allows
+    const int cells = params.gridCols*params.gridRows;
+    matches.clear();
+    for (int i = 0; i < params.cellsPerFrame && i < cells; i++)
+    {
+        if (i > 0 && getTickCount() - start > budgetTicks)
+            break;
+        const int c = nextCell;
+        nextCell = (nextCell + 1)%cells;
+        const int cx = c%params.gridCols, cy = c/params.gridCols;
+        Rect cell(cx*imageSize.width/params.gridCols, cy*imageSize.height/params.gridRows, 0, 0);
+        cell.width = (cx + 1)*imageSize.width/params.gridCols - cell.x;
+        cell.height = (cy + 1)*imageSize.height/params.gridRows - cell.y;
+
+        DriftMatch m;
+        if (matchCell(left, right, cell, m))
+        {
+            cellResidual[c] = m.right.y - m.left.y;
+            cellFrame[c] = state.frame;
+            matches.push_back(m);
+        }
+    }
+
+    // 2. residual of the recently measured cells
+    vector<float> residuals, absResiduals;
+    for (int c = 0; c < cells; c++)
+    {
+        if (cellFrame[c] >= 0 && state.frame - cellFrame[c] <= params.maxAge)
+        {
+            residuals.push_back(cellResidual[c]);
+            absResiduals.push_back(fabs(cellResidual[c]));
+        }
+    }
+    state.matches = (int)matches.size();
+    state.cells = (int)residuals.size();
+    if (state.cells >= MIN_CELLS)
+    {
+        const size_t mid = residuals.size()/2;
+        nth_element(residuals.begin(), residuals.begin() + mid, residuals.end());
+        nth_element(absResiduals.begin(), absResiduals.begin() + mid, absResiduals.end());
+        state.offset = residuals[mid];
+        state.residual = absResiduals[mid];
+        state.average = measured == 0 ? state.residual
+                      : state.average + params.averageWeight*(state.residual - state.average);
+        history[measured%params.trendFrames] = state.residual;
+        measured++;
+    }
+
+    // 3. trend: least squares slope over the frames in the history, oldest first
+    const int n = std::min(measured, params.trendFrames);
+    if (n > 1)
+    {
+        double sy = 0, sxy = 0;
+        for (int k = 0; k < n; k++)
+        {
+            const double v = history[(measured - n + k)%params.trendFrames];
+            sy += v;
+            sxy += k*v;
+        }
+        const double sx = n*(n - 1)/2., sxx = (n - 1.)*n*(2*n - 1)/6.;
+        state.trend = (float)(1000*(n*sxy - sx*sy)/(n*sxx - sx*sx));
+    }
+
+    // 4. alarm with hysteresis
+    const bool alarm = state.alarm;
+    if (measured > 0 && state.average > params.threshold)
+        state.alarm = true;
+    else if (state.average < 0.8f*params.threshold)
+        state.alarm = false;
+    state.changed = state.alarm != alarm;
+
+    state.frame++;
+    state.time = (getTickCount() - start)*1000/getTickFrequency();
+    return state;
+}
@@ -0,0 +1,82 @@
+/// drift_monitor.hpp
+/// Watch the calibration of a stereo rig on live rectified pairs: with a valid calibration,
+/// corresponding points lie on the same row, so the vertical offset of matched features
+/// (the vertical disparity) measures how far the extrinsics have drifted.
+///
+/// A few grid cells are checked per frame within a time budget, so the monitor can run on
+/// every frame of the pipeline. Their residuals are combined into a running average and a
+/// trend, and an alarm is raised when the average exceeds the threshold.
+
+#ifndef DRIFT_MONITOR_HPP
+#define DRIFT_MONITOR_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+
+struct DriftParams
+{
+    int gridCols, gridRows; // one feature per cell of the grid
+    int cellsPerFrame;      // cells checked per frame, the whole grid every gridCols*gridRows/cellsPerFrame frames
+    int numDisparities;     // horizontal search range [0, numDisparities)
+    int maxOffset;          // vertical search range [-maxOffset, maxOffset] rows
+    int blockRows;          // height of the 16 pixel wide matching blocks, odd, at most 15
+    int minTexture;         // mean absolute gradient, horizontal and vertical, a feature must have
+    int uniquenessRatio;    // percent by which the best cost must beat the others
+    int maxMeanCost;        // matches with a larger mean absolute difference per pixel are dropped
+    int maxAge;             // frames the residual of a cell is used after it was measured
+    float averageWeight;    // of the newest frame in the running average
+    int trendFrames;        // frames of the trend regression
+    float threshold;        // pixels, alarm when the average residual exceeds it
+    double budget;          // ms per frame, cells left over are checked in the next frame
+
+    DriftParams();
+};
+
+/// A feature of the left rectified image and its match in the right one.
+struct DriftMatch
+{
+    cv::Point2f left, right;    // subpixel; right.y - left.y is the vertical residual
+};
+
+struct DriftState
+{
+    int frame;              // frames processed
+    int matches;            // features matched in this frame
+    int cells;              // cells with a recent residual
+    float residual;         // median absolute vertical residual of these cells, pixels
+    float offset;           // median signed residual(right below left is positive)
+    float average;          // running average of residual
+    float trend;            // slope of residual, pixels per 1000 frames
+    bool alarm;             // average above threshold(cleared below 80% of it)
+    bool changed;           // the alarm was raised or cleared by this frame
+    double time;            // ms spent on this frame
+};
+
+struct DriftMonitor
+{
+    DriftParams params;
+    DriftState state;
+    std::vector<DriftMatch> matches;    // of the last frame
+
+    DriftMonitor(const DriftParams& params = DriftParams());
+
+    /// Forgets all residuals, e.g. after the rig was calibrated again.
+    void reset();
+
+    /// left, right: rectified 8-bit grayscale images of the same size.
+    const DriftState& process(const cv::Mat& left, const cv::Mat& right);
+
+private:
+    cv::Size imageSize;
+    int nextCell;                       // round robin over the grid
+    int measured;                       // frames with enough cells for a residual
+    std::vector<float> cellResidual;    // last signed residual of every cell
+    std::vector<int> cellFrame;         // frame it was measured in, -1: never
+    std::vector<float> history;         // residual of the last trendFrames frames, ring buffer
+    std::vector<ushort> costs;
+
+    bool matchCell(const cv::Mat& left, const cv::Mat& right, const cv::Rect& cell, DriftMatch& m);
+};
+
+#endif
@@ -0,0 +1,412 @@
+/// image_cache.cpp
+/// Decoding workers and LRU of the image cache.
+///
+/// One mutex guards the entries, the request queue and the LRU list; decoding runs outside of
+/// it. An entry is queued(prefetch), loading(a worker or get() decodes it) or ready. A get()
+/// of a loading entry waits for it, of a queued entry takes it from the workers.
+
+#include "image_cache.hpp"
+#include "trace.hpp"
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <deque>
+#include <iostream>
+#include <list>
+#include <map>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#define IMAGE_CACHE_THREADS
+#endif
+
+using namespace cv;
+using namespace std;
+
+enum EntryState
+{
+    ENTRY_QUEUED = 0,
+    ENTRY_LOADING = 1,
+    ENTRY_READY = 2
+};
+
+struct CacheEntry
+{
+    string filename;
+    int flags, reduction;
+    int state;
+    Mat image;
+    size_t bytes;
+    bool used;                      // requested by get() since decoded
+    list<string>::iterator lru;     // position in the LRU list, when ready
+};
+
+struct ImageCache::Impl
+{
+    ImageCacheParams params;
+    map<string, CacheEntry> entries;
+    deque<string> queue;            // keys to decode, in the order of the prefetches
+    list<string> lru;               // keys of the ready entries, most recently used first
+    size_t bytes;                   // of the ready entries
+    size_t unusedBytes;             // of the ready entries prefetched and not requested yet
+    ImageCacheStats stats;
+    bool stopping;
+#ifdef IMAGE_CACHE_THREADS
+    pthread_mutex_t mutex;
+    pthread_cond_t decoded;         // an entry is ready
+    pthread_cond_t work;            // a request is queued, or there is room again
+    vector<pthread_t> workers;
+#endif
+
+    Impl(const ImageCacheParams& p);
+    ~Impl();
+
+    void lock();
+    void unlock();
+    void startWorkers();
+    void finish(const string& key, const Mat& image, bool used);
+    void evict();
+    bool full() const { return unusedBytes*2 >= params.capacityBytes; }
+#ifdef IMAGE_CACHE_THREADS
+    static void* worker(void* arg);
+#endif
+};
+
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static string cacheKey(const string& filename, int flags, int reduction);
+static double elapsedMs(int64 since);
+
+//--------------------------------------------------
+ImageCacheParams::ImageCacheParams() :
+    capacityBytes((size_t)256 << 20), threads(0)
+{
+}
+
+ImageCacheStats::ImageCacheStats() :
+    hits(0), waits(0), misses(0), prefetched(0), evicted(0), decodeMs(0), waitMs(0)
+{
+}
+
+Mat loadImage(const string& filename, int flags, int reduction)
+{
+    CV_Assert(reduction == 1 || reduction == 2 || reduction == 4 || reduction == 8);
+    TRACE_SCOPE("imread");
+#if CV_MAJOR_VERSION >= 3
+    // decode reduced: libjpeg scales in the DCT, much less work than decoding in full
+    if (reduction > 1 && (flags == IMREAD_COLOR || flags == IMREAD_GRAYSCALE))
+    {
+        static const int reducedColor[4] = {IMREAD_REDUCED_COLOR_2, IMREAD_REDUCED_COLOR_4, 0, IMREAD_REDUCED_COLOR_8};
+        static const int reducedGray[4] = {IMREAD_REDUCED_GRAYSCALE_2, IMREAD_REDUCED_GRAYSCALE_4, 0, IMREAD_REDUCED_GRAYSCALE_8};
+        const int i = reduction/2 - 1;
+        return imread(filename, flags == IMREAD_COLOR ? reducedColor[i] : reducedGray[i]);
+    }
+#endif
+    Mat image = imread(filename, flags);
+    if (reduction > 1 && !image.empty())
+    {
+        Mat reduced;
+        resize(image, reduced, Size((image.cols + reduction - 1)/reduction, (image.rows + reduction - 1)/reduction),
+               0, 0, INTER_AREA);
+        image = reduced;
+    }
+    return image;
+}
+
+//--------------------------------------------------
+ImageCache::Impl::Impl(const ImageCacheParams& p) :
+    params(p), bytes(0), unusedBytes(0), stopping(false)
+{
+    if (params.threads <= 0)
+        params.threads = std::min(std::max(getNumberOfCPUs()/2, 1), 4);
+#ifdef IMAGE_CACHE_THREADS
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&decoded, 0);
+    pthread_cond_init(&work, 0);
+#endif
+}
+
+ImageCache::Impl::~Impl()
+{
+#ifdef IMAGE_CACHE_THREADS
+    lock();
+    stopping = true;
+    pthread_cond_broadcast(&work);
+    unlock();
+    for (size_t i = 0; i < workers.size(); i++)
+        pthread_join(workers[i], 0);
+    pthread_cond_destroy(&work);
+    pthread_cond_destroy(&decoded);
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+
+void ImageCache::Impl::lock()
+{
+#ifdef IMAGE_CACHE_THREADS
+    pthread_mutex_lock(&mutex);
+#endif
+}
+
+void ImageCache::Impl::unlock()
+{
+#ifdef IMAGE_CACHE_THREADS
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+// with the lock held
+void ImageCache::Impl::startWorkers()
+{
+#ifdef IMAGE_CACHE_THREADS
+    if (!workers.empty())
+        return;
+    for (int i = 0; i < params.threads; i++)
+    {
+        pthread_t t;
+        if (pthread_create(&t, 0, worker, this) == 0)
+            workers.push_back(t);
+    }
+#endif
+}
+
+// with the lock held: the entry of key becomes ready
+void ImageCache::Impl::finish(const string& key, const Mat& image, bool used)
+{
+    CacheEntry& e = entries[key];
+    e.image = image;
+    e.bytes = image.total()*image.elemSize();
+    e.state = ENTRY_READY;
+    e.used = used;
+    lru.push_front(key);
+    e.lru = lru.begin();
+    bytes += e.bytes;
+    if (!used)
+        unusedBytes += e.bytes;
+    evict();
+}
+
+// with the lock held: the used images go first, from the least recently used. The most
+// recent image stays even if alone it does not fit.
+void ImageCache::Impl::evict()
+{
+    while (bytes > params.capacityBytes && lru.size() > 1)
+    {
+        list<string>::iterator victim = --lru.end();
+        for (list<string>::iterator it = victim; it != lru.begin(); --it)
+            if (entries[*it].used)
+            {
+                victim = it;
+                break;
+            }
+        map<string, CacheEntry>::iterator e = entries.find(*victim);
+        bytes -= e->second.bytes;
+        if (!e->second.used)
+            unusedBytes -= e->second.bytes;
+        lru.erase(victim);
+        entries.erase(e);
+        stats.evicted++;
+    }
+}
+
+#ifdef IMAGE_CACHE_THREADS
+void* ImageCache::Impl::worker(void* arg)
+{
+    Impl& c = *(Impl*)arg;
+    traceThreadName("image loader");
+    c.lock();
+    for (;;)
+    {
+        while (!c.stopping && (c.queue.empty() || c.full()))
+            pthread_cond_wait(&c.work, &c.mutex);
+        if (c.stopping)
+            break;
+        const string key = c.queue.front();
+        c.queue.pop_front();
+        map<string, CacheEntry>::iterator it = c.entries.find(key);
+        if (it == c.entries.end() || it->second.state != ENTRY_QUEUED)
+            continue;   // taken by get(), or cleared
+        it->second.state = ENTRY_LOADING;
+        const string filename = it->second.filename;
+        const int flags = it->second.flags, reduction = it->second.reduction;
+
+        c.unlock();
+        const int64 t = getTickCount();
+        Mat image = loadImage(filename, flags, reduction);
+        const double ms = elapsedMs(t);
+        c.lock();
+
+        c.finish(key, image, false);
+        c.stats.prefetched++;
+        c.stats.decodeMs += ms;
+        pthread_cond_broadcast(&c.decoded);
+    }
+    c.unlock();
+    return 0;
+}
+#endif
+
+//--------------------------------------------------
+ImageCache::ImageCache(const ImageCacheParams& params) :
+    impl(new Impl(params))
+{
+}
+
+ImageCache::~ImageCache()
+{
+    delete impl;
+}
+
+void ImageCache::prefetch(const string& filename, int flags, int reduction)
+{
+#ifdef IMAGE_CACHE_THREADS
+    const string key = cacheKey(filename, flags, reduction);
+    impl->lock();
+    if (!impl->entries.count(key))
+    {
+        CacheEntry& e = impl->entries[key];
+        e.filename = filename;
+        e.flags = flags;
+        e.reduction = reduction;
+        e.state = ENTRY_QUEUED;
+        e.bytes = 0;
+        e.used = false;
+        impl->queue.push_back(key);
+        impl->startWorkers();
+        pthread_cond_signal(&impl->work);
+    }
+    impl->unlock();
+#else
+    (void)filename;
+    (void)flags;
+    (void)reduction;
+#endif
+}
+
+void ImageCache::prefetch(const vector<string>& filenames, int flags, int reduction)
+{
+    for (size_t i = 0; i < filenames.size(); i++)
+        prefetch(filenames[i], flags, reduction);
+}
+
+Mat ImageCache::get(const string& filename, int flags, int reduction)
+{
+    const string key = cacheKey(filename, flags, reduction);
+    Impl& c = *impl;
+    c.lock();
+    map<string, CacheEntry>::iterator it = c.entries.find(key);
+#ifdef IMAGE_CACHE_THREADS
+    if (it != c.entries.end() && it->second.state == ENTRY_LOADING)
+    {
+        const int64 t = getTickCount();
+        while (it != c.entries.end() && it->second.state == ENTRY_LOADING)
+        {
+            pthread_cond_wait(&c.decoded, &c.mutex);
+            it = c.entries.find(key);
+        }
+        c.stats.waits++;
+        c.stats.waitMs += elapsedMs(t);
+    }
+#endif
+    if (it != c.entries.end() && it->second.state == ENTRY_READY)
+    {
+        CacheEntry& e = it->second;
+        if (!e.used)
+        {
+            e.used = true;
+            c.unusedBytes -= e.bytes;
+#ifdef IMAGE_CACHE_THREADS
+            pthread_cond_signal(&c.work);   // the workers may be waiting for room
+#endif
+        }
+        c.lru.splice(c.lru.begin(), c.lru, e.lru);
+        c.stats.hits++;
+        Mat image = e.image;
+        c.unlock();
+        return image;
+    }
+
+    // not decoded yet: decode it here rather than wait for the workers to reach it
+    CacheEntry& e = c.entries[key];
+    e.filename = filename;
+    e.flags = flags;
+    e.reduction = reduction;
+    e.state = ENTRY_LOADING;
+    e.bytes = 0;
+    e.used = true;
+    c.unlock();
+    const int64 t = getTickCount();
+    Mat image = loadImage(filename, flags, reduction);
+    const double ms = elapsedMs(t);
+    c.lock();
+    c.finish(key, image, true);
+    c.stats.misses++;
+    c.stats.decodeMs += ms;
+#ifdef IMAGE_CACHE_THREADS
+    pthread_cond_broadcast(&c.decoded);
+#endif
+    c.unlock();
+    return image;
+}
+
+void ImageCache::clear()
+{
+    Impl& c = *impl;
+    c.lock();
+    // the entries being decoded are kept: their threads finish them
+    for (map<string, CacheEntry>::iterator it = c.entries.begin(); it != c.entries.end(); )
+    {
+        if (it->second.state == ENTRY_LOADING)
+            ++it;
+        else
+            c.entries.erase(it++);
+    }
+    c.queue.clear();
+    c.lru.clear();
+    c.bytes = c.unusedBytes = 0;
+#ifdef IMAGE_CACHE_THREADS
+    pthread_cond_broadcast(&c.work);
+#endif
+    c.unlock();
+}
+
+ImageCacheStats ImageCache::stats() const
+{
+    impl->lock();
+    ImageCacheStats s = impl->stats;
+    impl->unlock();
+    return s;
+}
+
+size_t ImageCache::bytes() const
+{
+    impl->lock();
+    size_t b = impl->bytes;
+    impl->unlock();
+    return b;
+}
+
+void ImageCache::report() const
+{
+    const ImageCacheStats s = stats();
+    char buf[256];
+    sprintf(buf, "Image cache: %d hits, %d waits(%.1f ms), %d decoded on demand, %d prefetched, %d evicted; "
+            "decoding %.1f ms, %.1f MB held", s.hits, s.waits, s.waitMs, s.misses, s.prefetched, s.evicted,
+            s.decodeMs, bytes()/(1024.*1024));
+    cout << buf << endl;
+}
+
+//--------------------------------------------------
+static string cacheKey(const string& filename, int flags, int reduction)
+{
+    char buf[32];
+    sprintf(buf, "|%d|%d", flags, reduction);
+    return filename + buf;
+}
+
+static double elapsedMs(int64 since)
+{
+    return (getTickCount() - since)*1000/getTickFrequency();
+}
@@ -0,0 +1,78 @@
+/// image_cache.hpp
+/// Decoded images shared by the stages of a tool(corner detection, calibration display,
+/// rectification display...), so that no file is decoded twice, and decoded ahead of use on
+/// worker threads, so that decoding overlaps with the work on the previous images.
+///
+/// The cache holds at most capacityBytes of decoded images and evicts the least recently used
+/// ones; images prefetched but not requested yet are evicted last, and the workers wait while
+/// they fill half of the capacity. An image is kept per file, imread flags and reduction, which
+/// decodes to 1/2, 1/4 or 1/8 of the size(JPEG decoders skip most of the work, OpenCV >= 3).
+///
+/// The images returned share their data with the cache: clone them before drawing on them.
+/// Without POSIX threads(Windows) the prefetches are ignored and get() decodes on demand.
+
+#ifndef IMAGE_CACHE_HPP
+#define IMAGE_CACHE_HPP
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include <string>
+#include <vector>
+
+struct ImageCacheParams
+{
+    size_t capacityBytes;   // of decoded images, default 256 MB
+    int threads;            // decoding workers, 0: half of the CPUs, at most 4
+
+    ImageCacheParams();
+};
+
+struct ImageCacheStats
+{
+    int hits;               // get() found the image decoded
+    int waits;              // get() waited for a worker decoding it
+    int misses;             // get() decoded it itself
+    int prefetched;         // decoded by the workers
+    int evicted;
+    double decodeMs;        // decoding, all threads
+    double waitMs;          // get() waiting for the workers
+
+    ImageCacheStats();
+};
+
+/// Decodes filename with imread flags, reduced 1, 2, 4 or 8 times.
+cv::Mat loadImage(const std::string& filename, int flags = CV_LOAD_IMAGE_COLOR, int reduction = 1);
+
+class ImageCache
+{
+public:
+    explicit ImageCache(const ImageCacheParams& params = ImageCacheParams());
+    ~ImageCache();
+
+    /// Queues the files to be decoded, in order. The workers start with the first prefetch.
+    void prefetch(const std::string& filename, int flags = CV_LOAD_IMAGE_COLOR, int reduction = 1);
+    void prefetch(const std::vector<std::string>& filenames, int flags = CV_LOAD_IMAGE_COLOR, int reduction = 1);
+
+    /// The decoded image, empty if the file cannot be read. Waits if a worker is decoding it,
+    /// decodes it on the calling thread if no worker started it yet.
+    cv::Mat get(const std::string& filename, int flags = CV_LOAD_IMAGE_COLOR, int reduction = 1);
+
+    /// Drops the images and the queued prefetches.
+    void clear();
+
+    ImageCacheStats stats() const;
+    size_t bytes() const;           // held now
+
+    /// Prints the statistics, e.g. at the end of a tool.
+    void report() const;
+
+private:
+    struct Impl;
+    Impl* impl;
+
+    ImageCache(const ImageCache&);
+    ImageCache& operator=(const ImageCache&);
+};
+
+#endif
@@ -0,0 +1,340 @@
+/// pipeline.cpp
+/// Stage threads and queue policies of the pipeline runtime.
+///
+/// A stage thread loops: take a frame from its input queue, process it, hand it to the next
+/// queue. The first stage makes the frames; when it ends(or stop() is called) it sends a last,
+/// empty frame that every stage passes on before finishing, so no queue is left with a frame.
+/// Waiting sides spin briefly, then sleep in short steps.
+///
+/// Ref:
+///     Lamport, Specifying Concurrent Program Modules, 1983(the single-producer/consumer queue)
+
+#include "pipeline.hpp"
+#include "affinity.hpp"
+#include "trace.hpp"
+
+#include <iostream>
+#include <stdio.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+const int SPIN_COUNT = 200;         // tries before sleeping
+const int SLEEP_MICROSECONDS = 200;
+
+// wait a little longer every call, spins: tries so far
+static void backoff(int& spins)
+{
+    if (++spins < SPIN_COUNT)
+        return;
+#ifdef _WIN32
+    Sleep(1);
+#else
+    usleep(SLEEP_MICROSECONDS);
+#endif
+}
+
+static double elapsedMs(int64 since)
+{
+    return (getTickCount() - since)*1000/getTickFrequency();
+}
+
+PipelineFrame::PipelineFrame() :
+    index(0), last(false), ticks(0)
+{
+}
+
+StageStats::StageStats() :
+    frames(0), dropped(0), rejected(0), busyMs(0), maxMs(0), idleMs(0), blockedMs(0)
+{
+}
+
+Pipeline::Pipeline() :
+    affinity(0), stopFlag(0), delivered(0), latencyMs(0), runSeconds(0)
+{
+}
+
+Pipeline::~Pipeline()
+{
+    for (size_t i = 0; i < links.size(); i++)
+        delete links[i].queue;
+}
+
+void Pipeline::add(const string& name, PipelineStage* stage, int policy, int capacity)
+{
+    CV_Assert(stage && capacity > 0 && policy >= DROP_NONE && policy <= DROP_OLDEST);
+    Link l;
+    l.queue = stages.empty() ? 0 : new SpscQueue<PipelineFrame>(capacity);
+    l.policy = policy;
+    l.traceName = traceIntern(name);
+    l.hasPending = false;
+    l.ended = false;
+    l.droppedByProducer = l.droppedByConsumer = 0;
+    stages.push_back(stage);
+    links.push_back(l);
+    StageStats s;
+    s.name = name;
+    stageStats.push_back(s);
+}
+
+void Pipeline::stop()
+{
+    #pragma omp atomic write
+    stopFlag = 1;
+}
+
+bool Pipeline::stopping() const
+{
+    int s;
+    #pragma omp atomic read
+    s = stopFlag;
+    return s != 0;
+}
+
+double Pipeline::meanLatencyMs() const
+{
+    return delivered ? latencyMs/delivered : 0;
+}
+
+int Pipeline::run(bool threaded)
+{
+    CV_Assert(!stages.empty());
+    const int n = (int)stages.size();
+    for (int i = 0; i < n; i++)
+    {
+        StageStats s;
+        s.name = stageStats[i].name;
+        stageStats[i] = s;
+        links[i].droppedByProducer = links[i].droppedByConsumer = 0;
+        links[i].ended = false;
+    }
+    stopFlag = 0;
+    delivered = 0;
+    latencyMs = 0;
+    const int64 t0 = getTickCount();
+
+#ifdef _OPENMP
+    if (threaded && n > 1)
+    {
+        // every stage needs its thread, or the queues would never drain
+        const int dynamic = omp_get_dynamic(), levels = omp_get_max_active_levels();
+        omp_set_dynamic(0);
+        omp_set_max_active_levels(max(levels, 2));
+        #pragma omp parallel num_threads(n)
+        {
+            if (omp_get_num_threads() == n)
+                runStage(omp_get_thread_num());
+            else if (omp_get_thread_num() == 0)
+                runSequential();
+        }
+        omp_set_max_active_levels(levels);
+        omp_set_dynamic(dynamic);
+    }
+    else
+        runSequential();
+#else
+    (void)threaded;
+    runSequential();
+#endif
+
+    runSeconds = elapsedMs(t0)/1000;
+    for (int i = 0; i < n; i++)
+        stageStats[i].dropped = links[i].droppedByProducer + links[i].droppedByConsumer;
+    return delivered;
+}
+
+bool Pipeline::timedProcess(int i, PipelineFrame& f)
+{
+    StageStats& s = stageStats[i];
+    TRACE_SCOPE(links[i].traceName);
+    const int64 t = getTickCount();
+    const bool ok = stages[i]->process(f);
+    const double ms = elapsedMs(t);
+    s.busyMs += ms;
+    s.maxMs = max(s.maxMs, ms);
+    if (ok)
+        s.frames++;
+    else if (i > 0)
+        s.rejected++;
+    return ok;
+}
+
+// next frame for stage i(> 0), waits for it
+void Pipeline::receive(int i, PipelineFrame& f)
+{
+    Link& l = links[i];
+    if (l.ended)
+    {
+        f = PipelineFrame();
+        f.last = true;
+        return;
+    }
+    const int64 t = getTickCount();
+    int spins = 0;
+    while (!l.queue->pop(f))
+    {
+        // a producer waiting for its own input still delivers what it kept back
+        if (i + 1 < (int)links.size())
+            flushPending(i + 1, false);
+        backoff(spins);
+    }
+    if (l.policy == DROP_OLDEST)
+    {
+        PipelineFrame newer;
+        while (!f.last && l.queue->pop(newer))
+        {
+            // the end of the stream comes after the newest frame, on the next call
+            if (newer.last)
+            {
+                l.ended = true;
+                break;
+            }
+            l.droppedByConsumer++;
+            f = newer;
+        }
+    }
+    stageStats[i].idleMs += elapsedMs(t);
+}
+
+// the frame kept back by the producer into the queue of stage i, returns true if there is none left
+bool Pipeline::flushPending(int i, bool wait)
+{
+    Link& l = links[i];
+    if (!l.hasPending)
+        return true;
+    int spins = 0;
+    while (!l.queue->push(l.pending))
+    {
+        if (!wait)
+            return false;
+        backoff(spins);
+    }
+    l.pending = PipelineFrame();
+    l.hasPending = false;
+    return true;
+}
+
+// hand f from stage i - 1 to stage i, applying the policy of its queue
+void Pipeline::send(int i, const PipelineFrame& f)
+{
+    Link& l = links[i];
+    const int64 t = getTickCount();
+    int spins = 0;
+    if (f.last || l.policy == DROP_NONE)
+    {
+        flushPending(i, true);
+        while (!l.queue->push(f))
+            backoff(spins);
+    }
+    else if (l.policy == DROP_NEWEST)
+    {
+        if (!l.queue->push(f))
+            l.droppedByProducer++;
+    }
+    else if (!flushPending(i, false) || !l.queue->push(f))
+    {
+        // keep the newest frame until there is room, the one kept before is dropped
+        if (l.hasPending)
+            l.droppedByProducer++;
+        l.pending = f;
+        l.hasPending = true;
+    }
+    stageStats[i - 1].blockedMs += elapsedMs(t);
+}
+
+// thread of stage i
+void Pipeline::runStage(int i)
+{
+    const int n = (int)stages.size();
+    traceThreadName(links[i].traceName);
+    if (affinity)
+        placeCurrentThread(*affinity, stageStats[i].name);
+    for (int index = 0; ; index++)
+    {
+        PipelineFrame f;
+        if (i == 0)
+        {
+            f.index = index;
+            f.ticks = getTickCount();
+            if (stopping() || !timedProcess(0, f))
+            {
+                f = PipelineFrame();
+                f.last = true;
+            }
+        }
+        else
+        {
+            receive(i, f);
+            if (!f.last && !timedProcess(i, f))
+                continue;
+        }
+
+        if (i + 1 < n)
+            send(i + 1, f);
+        else if (!f.last)
+        {
+            delivered++;
+            latencyMs += elapsedMs(f.ticks);
+        }
+        if (f.last)
+            break;
+    }
+    stages[i]->finish();
+}
+
+// all the stages in turn on this thread, frame by frame
+void Pipeline::runSequential()
+{
+    const int n = (int)stages.size();
+    for (int index = 0; !stopping(); index++)
+    {
+        PipelineFrame f;
+        f.index = index;
+        f.ticks = getTickCount();
+        if (!timedProcess(0, f))
+            break;
+        int i = 1;
+        while (i < n && timedProcess(i, f))
+            i++;
+        if (i == n)
+        {
+            delivered++;
+            latencyMs += elapsedMs(f.ticks);
+        }
+    }
+    for (int i = 0; i < n; i++)
+        stages[i]->finish();
+}
+
+void Pipeline::report() const
+{
+    // the slowest stage sets the throughput
+    int slowest = 0;
+    for (size_t i = 1; i < stageStats.size(); i++)
+        if (stageStats[i].busyMs > stageStats[slowest].busyMs)
+            slowest = (int)i;
+    const StageStats& b = stageStats[slowest];
+    cout << delivered << " frames in " << runSeconds << " s, " << delivered/max(runSeconds, 1e-9)
+         << " fps, latency " << meanLatencyMs() << " ms, slowest stage: " << b.name << "("
+         << b.busyMs/max(b.frames + b.rejected, 1) << " ms per frame)" << endl;
+
+    cout << format("%-12s %8s %8s %8s %9s %9s %7s %8s", "stage", "frames", "dropped", "rejected",
+                   "mean(ms)", "max(ms)", "idle%", "blocked%") << endl;
+    const double totalMs = max(runSeconds*1000, 1e-9);
+    for (size_t i = 0; i < stageStats.size(); i++)
+    {
+        const StageStats& s = stageStats[i];
+        cout << format("%-12s %8d %8d %8d %9.2f %9.2f %7.1f %8.1f", s.name.c_str(), s.frames, s.dropped,
+                       s.rejected, s.busyMs/max(s.frames + s.rejected, 1), s.maxMs,
+                       100*s.idleMs/totalMs, 100*s.blockedMs/totalMs) << endl;
+    }
+}
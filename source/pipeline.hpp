@@ -0,0 +1,200 @@
+/// pipeline.hpp
+/// Runtime for stereo video processing as a chain of stages(capture, rectification, matching,
+/// post-processing, sinks) that run on their own threads and overlap, so the throughput is
+/// that of the slowest stage instead of the sum of all the stages.
+///
+/// Consecutive stages are connected by bounded single-producer/single-consumer lock-free
+/// queues. The drop policy of a queue decides what happens when its stage falls behind:
+/// the producer waits(backpressure) or frames are dropped. Every stage is timed.
+///
+/// The stages are the threads of an OpenMP parallel region, one per stage; parallel regions
+/// inside a stage(e.g. the matcher) still get their own threads. Built without OpenMP, every
+/// frame goes through all the stages in turn.
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include <string>
+#include <vector>
+
+class AffinityConfig;
+
+enum DropPolicy
+{
+    DROP_NONE = 0,      // the producer waits for room: no frame is lost, the input is slowed down
+    DROP_NEWEST = 1,    // the incoming frame is dropped when the queue is full
+    DROP_OLDEST = 2     // the stage takes the newest frame, the older ones waiting are dropped
+};
+
+/// Bounded lock-free queue between one producer and one consumer thread.
+/// The indices are published with OpenMP atomics and flushes, each written by one side only.
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(int capacity = 2) : slots(capacity + 1), head(0), tail(0) {}
+
+    int capacity() const { return (int)slots.size() - 1; }
+
+    /// Producer side. Returns false if the queue is full.
+    bool push(const T& v);
+
+    /// Consumer side. Returns false if the queue is empty.
+    bool pop(T& v);
+
+private:
+    std::vector<T> slots;   // one slot stays free to tell a full queue from an empty one
+    char pad0[64];          // the indices on their own cache lines
+    int head;               // next slot to pop, written by the consumer
+    char pad1[64];
+    int tail;               // next slot to push, written by the producer
+    char pad2[64];
+};
+
+template <typename T>
+bool SpscQueue<T>::push(const T& v)
+{
+    const int t = tail;
+    const int next = t + 1 == (int)slots.size() ? 0 : t + 1;
+    int h;
+    #pragma omp atomic read
+    h = head;
+    if (next == h)
+        return false;
+    #pragma omp flush
+    slots[t] = v;
+    #pragma omp flush
+    #pragma omp atomic write
+    tail = next;
+    return true;
+}
+
+template <typename T>
+bool SpscQueue<T>::pop(T& v)
+{
+    const int h = head;
+    int t;
+    #pragma omp atomic read
+    t = tail;
+    if (h == t)
+        return false;
+    #pragma omp flush
+    v = slots[h];
+    slots[h] = T();     // the consumer releases what the slot holds
+    #pragma omp flush
+    #pragma omp atomic write
+    head = h + 1 == (int)slots.size() ? 0 : h + 1;
+    return true;
+}
+
+/// What goes through the stages. Mats are shared, not copied, between the stages:
+/// a stage must write its results to new Mats, not to the buffers of an earlier frame.
+struct PipelineFrame
+{
+    int index;              // number of the frame in the input, set by the pipeline
+    bool last;              // end of the stream, goes through without being processed
+    int64 ticks;            // getTickCount() when the first stage started the frame
+    std::string name;       // of the input, for the messages
+    cv::Mat img[2];         // left and right grayscale images, rectified after the rectification
+    cv::Mat color;          // left color image if a stage needs it, rectified likewise
+    cv::Mat disp;           // CV_16S disparity of the left image(disparity.hpp)
+    cv::Mat confidence;     // CV_8U confidence of disp
+    cv::Mat view;           // image to display
+
+    PipelineFrame();
+};
+
+/// A stage. process() is always called from the same thread, so a stage may keep state.
+class PipelineStage
+{
+public:
+    virtual ~PipelineStage() {}
+
+    /// The first stage fills f and returns false at the end of the input.
+    /// The other stages process f and return false to drop it.
+    virtual bool process(PipelineFrame& f) = 0;
+
+    /// Called once on the thread of the stage after the last frame.
+    virtual void finish() {}
+};
+
+struct StageStats
+{
+    std::string name;
+    int frames;             // frames processed
+    int dropped;            // frames dropped by the policy of the input queue
+    int rejected;           // frames process() dropped
+    double busyMs;          // in process()
+    double maxMs;           // longest process()
+    double idleMs;          // waiting for a frame
+    double blockedMs;       // waiting for room in the queue of the next stage
+
+    StageStats();
+};
+
+class Pipeline
+{
+public:
+    Pipeline();
+    ~Pipeline();
+
+    /// Appends a stage(not owned) whose input queue holds capacity frames and applies policy
+    /// when it is full. The first stage has no input queue.
+    void add(const std::string& name, PipelineStage* stage, int policy = DROP_NONE, int capacity = 2);
+
+    /// Runs until the first stage ends or stop() is called, with one thread per stage, or all the
+    /// stages in turn on the calling thread if !threaded. Returns the frames that went through.
+    int run(bool threaded = true);
+
+    /// Places the thread of every stage named in config(affinity.hpp, not owned) before its first
+    /// frame, so the buffers the stage allocates land on its node. The OpenMP teams a stage starts
+    /// inherit its CPUs. The threads stay placed after the run.
+    void setAffinity(const AffinityConfig* config) { affinity = config; }
+
+    /// Ends the input after the frame being captured, e.g. on a key in the display. Thread safe.
+    void stop();
+    bool stopping() const;
+
+    /// Of the last run.
+    const std::vector<StageStats>& stats() const { return stageStats; }
+    double seconds() const { return runSeconds; }
+    double meanLatencyMs() const;   // first stage start to last stage end
+
+    /// Prints the throughput and a table of the stage timings.
+    void report() const;
+
+private:
+    struct Link
+    {
+        SpscQueue<PipelineFrame>* queue;    // input of the stage
+        int policy;
+        const char* traceName;  // of the stage, for trace.hpp
+        PipelineFrame pending;  // DROP_OLDEST: newest frame that did not fit, kept by the producer
+        bool hasPending;
+        bool ended;             // DROP_OLDEST: the consumer already took the end of the stream off the queue
+        int droppedByProducer, droppedByConsumer;
+    };
+
+    std::vector<PipelineStage*> stages;
+    std::vector<Link> links;    // links[i]: input of stage i, none for i = 0
+    std::vector<StageStats> stageStats;
+    const AffinityConfig* affinity;
+    int stopFlag;
+    int delivered;
+    double latencyMs;
+    double runSeconds;
+
+    Pipeline(const Pipeline&);
+    Pipeline& operator=(const Pipeline&);
+
+    bool timedProcess(int i, PipelineFrame& f);
+    void receive(int i, PipelineFrame& f);
+    void send(int i, const PipelineFrame& f);
+    bool flushPending(int i, bool wait);
+    void runStage(int i);
+    void runSequential();
+};
+
+#endif
@@ -0,0 +1,296 @@
+/// pointcloud.cpp
+/// Disparity to point cloud reprojection and binary PLY/PCD writers.
+///
+/// A pixel (x, y) with disparity d becomes (X/W, Y/W, Z/W), [X Y Z W]' = Q*[x y d 1]'.
+/// Rows are counted first, so that every row knows where its points go and rows can be
+/// reprojected in parallel straight into the packed output.
+///
+/// Ref:
+///     opencv/modules/calib3d/src/calibration.cpp(reprojectImageTo3D);
+///     PLY and PCD(v0.7) file format specifications
+
+#include "pointcloud.hpp"
+#include "disparity.hpp"
+#include "trace.hpp"
+
+#include <vector>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CLOUD_NEON
+#endif
+
+using namespace cv;
+using namespace std;
+
+static inline int countRow(const short* d, int W)
+{
+    int n = 0;
+    for (int x = 0; x < W; x++)
+        n += d[x] > 0;
+    return n;
+}
+
+int countValidDisparities(const Mat& disp)
+{
+    CV_Assert(disp.type() == CV_16S);
+    int n = 0;
+    #pragma omp parallel for reduction(+:n)
+    for (int y = 0; y < disp.rows; y++)
+        n += countRow(disp.ptr<short>(y), disp.cols);
+    return n;
+}
+
+static inline unsigned packColor(const uchar* color, int cn, int x)
+{
+    if (!color)
+        return 0;
+    const uchar* p = color + x*cn;
+    if (cn == 1)
+        return p[0] | (p[0] << 8) | (p[0] << 16) | 0xFF000000u;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | 0xFF000000u;
+}
+
+// Writes the count valid points of row y to out, q: Q as float, row-major.
+static void reprojectRow(const short* d, const uchar* color, int cn, int W, int y, const float* q,
+                         int count, CloudPoint* out)
+{
+    // contribution of y and of the constant column, the same for the whole row
+    const float bx = q[1]*y + q[3], by = q[5]*y + q[7], bz = q[9]*y + q[11], bw = q[13]*y + q[15];
+    const float scale = 1.f/DISP_SCALE;
+    int n = 0, x = 0;
+
+#if defined(__AVX2__)
+    const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 vScale = _mm256_set1_ps(scale);
+    for ( ; x <= W - 8; x += 8)
+    {
+        __m128i d16 = _mm_loadu_si128((const __m128i*)(d + x));
+        __m128i valid = _mm_cmpgt_epi16(d16, _mm_setzero_si128());
+        int mask = _mm_movemask_epi8(_mm_packs_epi16(valid, _mm_setzero_si128())) & 0xFF;
+        if (!mask)
+            continue;
+
+        __m256 vd = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(d16)), vScale);
+        __m256 vx = _mm256_add_ps(_mm256_set1_ps((float)x), lanes);
+        __m256 X = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(q[0]), vx),
+                                 _mm256_mul_ps(_mm256_set1_ps(q[2]), vd)), _mm256_set1_ps(bx));
+        __m256 Y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(q[4]), vx),
+                                 _mm256_mul_ps(_mm256_set1_ps(q[6]), vd)), _mm256_set1_ps(by));
+        __m256 Z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(q[8]), vx),
+                                 _mm256_mul_ps(_mm256_set1_ps(q[10]), vd)), _mm256_set1_ps(bz));
+        __m256 Wt = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(q[12]), vx),
+                                  _mm256_mul_ps(_mm256_set1_ps(q[14]), vd)), _mm256_set1_ps(bw));
+        __m256 iw = _mm256_div_ps(_mm256_set1_ps(1.f), Wt);
+        X = _mm256_mul_ps(X, iw);
+        Y = _mm256_mul_ps(Y, iw);
+        Z = _mm256_mul_ps(Z, iw);
+
+        unsigned c[8];
+        for (int k = 0; k < 8; k++)
+            c[k] = packColor(color, cn, x + k);
+        __m256 C = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)c));
+
+        // transpose to one (x, y, z, color) __m128 per point: points 0-3 in the low lanes, 4-7 in the high
+        __m256 t0 = _mm256_unpacklo_ps(X, Y);
+        __m256 t1 = _mm256_unpackhi_ps(X, Y);
+        __m256 t2 = _mm256_unpacklo_ps(Z, C);
+        __m256 t3 = _mm256_unpackhi_ps(Z, C);
+        __m256 p[4] = { _mm256_shuffle_ps(t0, t2, 0x44), _mm256_shuffle_ps(t0, t2, 0xEE),
+                        _mm256_shuffle_ps(t1, t3, 0x44), _mm256_shuffle_ps(t1, t3, 0xEE) };
+        float* o = (float*)(out + n);
+        if (mask == 0xFF)
+        {
+            for (int k = 0; k < 4; k++)
+            {
+                _mm_storeu_ps(o + 4*k, _mm256_castps256_ps128(p[k]));
+                _mm_storeu_ps(o + 4*(k + 4), _mm256_extractf128_ps(p[k], 1));
+            }
+            n += 8;
+        }
+        else
+        {
+            // every lane is stored, invalid ones are overwritten by the next point. Past the
+            // last point of the row they go to a dummy: the next row is written in parallel.
+            CloudPoint dummy;
+            for (int k = 0; k < 8; k++)
+            {
+                __m128 v = k < 4 ? _mm256_castps256_ps128(p[k]) : _mm256_extractf128_ps(p[k - 4], 1);
+                _mm_storeu_ps((float*)(n < count ? out + n : &dummy), v);
+                n += (mask >> k) & 1;
+            }
+        }
+    }
+#elif defined(CLOUD_NEON)
+    (void)count;
+    static const float lanesArr[4] = { 0, 1, 2, 3 };
+    const float32x4_t lanes = vld1q_f32(lanesArr);
+    for ( ; x <= W - 4; x += 4)
+    {
+        int16x4_t d16 = vld1_s16(d + x);
+        uint16x4_t valid = vcgt_s16(d16, vdup_n_s16(0));
+        if (!vget_lane_u64(vreinterpret_u64_u16(valid), 0))
+            continue;
+
+        float32x4_t vd = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(d16)), scale);
+        float32x4_t vx = vaddq_f32(vdupq_n_f32((float)x), lanes);
+        float32x4_t X = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(bx), vx, q[0]), vd, q[2]);
+        float32x4_t Y = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(by), vx, q[4]), vd, q[6]);
+        float32x4_t Z = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(bz), vx, q[8]), vd, q[10]);
+        float32x4_t Wt = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(bw), vx, q[12]), vd, q[14]);
+        float32x4_t iw = vrecpeq_f32(Wt);
+        iw = vmulq_f32(vrecpsq_f32(Wt, iw), iw);   // two Newton steps: full float precision
+        iw = vmulq_f32(vrecpsq_f32(Wt, iw), iw);
+
+        unsigned c[4];
+        for (int k = 0; k < 4; k++)
+            c[k] = packColor(color, cn, x + k);
+        float32x4x4_t pts;
+        pts.val[0] = vmulq_f32(X, iw);
+        pts.val[1] = vmulq_f32(Y, iw);
+        pts.val[2] = vmulq_f32(Z, iw);
+        pts.val[3] = vreinterpretq_f32_u32(vld1q_u32(c));
+        CloudPoint tmp[4];
+        vst4q_f32((float*)tmp, pts);
+        for (int k = 0; k < 4; k++)
+            if (d[x + k] > 0)
+                out[n++] = tmp[k];
+    }
+#else
+    (void)count;
+#endif
+
+    for ( ; x < W; x++)
+    {
+        if (d[x] <= 0)
+            continue;
+        float fd = d[x]*scale;
+        float iw = 1.f/(q[12]*x + q[14]*fd + bw);
+        CloudPoint& pt = out[n++];
+        pt.x = (q[0]*x + q[2]*fd + bx)*iw;
+        pt.y = (q[4]*x + q[6]*fd + by)*iw;
+        pt.z = (q[8]*x + q[10]*fd + bz)*iw;
+        unsigned c = packColor(color, cn, x);
+        memcpy(&pt.b, &c, 4);
+    }
+}
+
+int reprojectDisparity(const Mat& disp, const Mat& color, const Mat& Q, int y0, int y1, CloudPoint* out)
+{
+    CV_Assert(disp.type() == CV_16S && Q.rows == 4 && Q.cols == 4);
+    CV_Assert(color.empty() || ((color.type() == CV_8UC3 || color.type() == CV_8UC1) && color.size() == disp.size()));
+    CV_Assert(0 <= y0 && y0 <= y1 && y1 <= disp.rows);
+
+    Mat Qf;
+    Q.convertTo(Qf, CV_32F);
+    float q[16];
+    for (int i = 0; i < 16; i++)
+        q[i] = Qf.at<float>(i/4, i%4);
+
+    // where the points of every row start
+    const int n = y1 - y0, W = disp.cols;
+    vector<int> start(n + 1, 0);
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++)
+        start[i + 1] = countRow(disp.ptr<short>(y0 + i), W);
+    for (int i = 0; i < n; i++)
+        start[i + 1] += start[i];
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; i++)
+    {
+        const int y = y0 + i;
+        reprojectRow(disp.ptr<short>(y), color.empty() ? NULL : color.ptr<uchar>(y), color.channels(),
+                     W, y, q, start[i + 1] - start[i], out + start[i]);
+    }
+    return start[n];
+}
+
+static void writeHeader(FILE* f, int format, int n, bool hasColor)
+{
+    if (format == CLOUD_PCD)
+    {
+        fprintf(f, "# .PCD v0.7 - Point Cloud Data file format\n"
+                   "VERSION 0.7\n"
+                   "FIELDS x y z%s\n"
+                   "SIZE 4 4 4%s\n"
+                   "TYPE F F F%s\n"
+                   "COUNT 1 1 1%s\n"
+                   "WIDTH %d\n"
+                   "HEIGHT 1\n"
+                   "VIEWPOINT 0 0 0 1 0 0 0\n"
+                   "POINTS %d\n"
+                   "DATA binary\n",
+                hasColor ? " rgba" : "", hasColor ? " 4" : "", hasColor ? " U" : "", hasColor ? " 1" : "", n, n);
+    }
+    else
+    {
+        fprintf(f, "ply\n"
+                   "format binary_little_endian 1.0\n"
+                   "element vertex %d\n"
+                   "property float x\n"
+                   "property float y\n"
+                   "property float z\n", n);
+        if (hasColor)
+            fprintf(f, "property uchar blue\n"
+                       "property uchar green\n"
+                       "property uchar red\n"
+                       "property uchar alpha\n");
+        fprintf(f, "end_header\n");
+    }
+}
+
+// Points are written as they are in memory(little endian, as on x86 and ARM), without color
+// only the coordinates. xyz: room for 3*n floats.
+static bool writePoints(FILE* f, const CloudPoint* points, int n, bool hasColor, float* xyz)
+{
+    if (n == 0)
+        return true;
+    if (hasColor)
+        return fwrite(points, sizeof(CloudPoint), n, f) == (size_t)n;
+    for (int i = 0; i < n; i++)
+    {
+        xyz[3*i] = points[i].x;
+        xyz[3*i + 1] = points[i].y;
+        xyz[3*i + 2] = points[i].z;
+    }
+    return fwrite(xyz, 3*sizeof(float), n, f) == (size_t)n;
+}
+
+bool writePointCloud(FILE* f, int format, const Mat& disp, const Mat& color, const Mat& Q, int stripRows)
+{
+    TRACE_SCOPE("writePointCloud");
+    CV_Assert(f && (format == CLOUD_PLY || format == CLOUD_PCD) && stripRows > 0);
+    const bool hasColor = !color.empty();
+    const int W = disp.cols;
+    writeHeader(f, format, countValidDisparities(disp), hasColor);
+
+    vector<CloudPoint> buf(stripRows*W);
+    vector<float> xyz(hasColor ? 1 : 3*stripRows*W);
+    for (int y0 = 0; y0 < disp.rows; y0 += stripRows)
+    {
+        int y1 = std::min(y0 + stripRows, disp.rows);
+        int n = reprojectDisparity(disp, color, Q, y0, y1, &buf[0]);
+        if (!writePoints(f, &buf[0], n, hasColor, &xyz[0]))
+            return false;
+    }
+    return fflush(f) == 0;
+}
+
+bool writeCloudPoints(FILE* f, int format, const CloudPoint* points, int n, bool hasColor)
+{
+    CV_Assert(f && (format == CLOUD_PLY || format == CLOUD_PCD) && n >= 0);
+    writeHeader(f, format, n, hasColor);
+    // coordinates only are repacked in chunks, not all at once
+    const int chunk = 1 << 16;
+    vector<float> xyz(hasColor ? 1 : 3*chunk);
+    for (int i = 0; i < n; i += chunk)
+    {
+        if (!writePoints(f, points + i, std::min(chunk, n - i), hasColor, &xyz[0]))
+            return false;
+    }
+    return fflush(f) == 0;
+}
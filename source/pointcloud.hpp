@@ -0,0 +1,48 @@
+/// pointcloud.hpp
+/// Reprojection of disparity maps to 3D points with the Q matrix of stereoRectify,
+/// and streaming binary PLY/PCD output.
+///
+/// Unlike cv::reprojectImageTo3D, only pixels with a valid disparity become points, packed
+/// 16 bytes each, and clouds are written strip by strip without ever being held in memory.
+/// Build with -mavx2 (x86) or on ARM with NEON to get the vectorized reprojection.
+
+#ifndef POINTCLOUD_HPP
+#define POINTCLOUD_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include <stdio.h>
+
+// Coordinates are in the unit of the calibration(squareSize of stereo_calib), in the left
+// rectified camera frame. The color is 0xAARRGGBB as a little endian word, the PCL rgba layout.
+struct CloudPoint
+{
+    float x, y, z;
+    unsigned char b, g, r, a;
+};
+
+enum CloudFormat
+{
+    CLOUD_PLY = 0,
+    CLOUD_PCD = 1
+};
+
+/// Number of points reprojectDisparity makes of disp: pixels with a positive disparity.
+int countValidDisparities(const cv::Mat& disp);
+
+/// Reprojects the pixels of rows [y0, y1) of disp(CV_16S, scaled by DISP_SCALE) that have a positive
+/// disparity, in row-major order. Q: 4x4 reprojection matrix saved by stereo_calib.
+/// color: empty(points get a = 0), or the rectified left image, CV_8UC3 or CV_8UC1.
+/// out needs room for (y1 - y0)*disp.cols points. Returns the number of points written.
+int reprojectDisparity(const cv::Mat& disp, const cv::Mat& color, const cv::Mat& Q,
+                       int y0, int y1, CloudPoint* out);
+
+/// Writes the cloud of disp as binary PLY or PCD to f, which may be a pipe: the points are counted
+/// first, then reprojected and written stripRows rows at a time. Colors are written if color is given.
+bool writePointCloud(FILE* f, int format, const cv::Mat& disp, const cv::Mat& color, const cv::Mat& Q,
+                     int stripRows = 32);
+
+/// Writes n points held in memory as binary PLY or PCD to f, with their colors if hasColor.
+bool writeCloudPoints(FILE* f, int format, const CloudPoint* points, int n, bool hasColor);
+
+#endif
@@ -0,0 +1,385 @@
+/// pointcloud_check.cpp
+/// Checks the reprojection and the PLY/PCD writers of pointcloud.hpp on a synthetic disparity map:
+/// the points must match a plain double precision evaluation of Q*[x y d 1]', whole or by row
+/// ranges, and every file written must read back, through its own header, as the same points.
+/// Rows are full, empty or mixed and the width is not a multiple of 8, so the vector kernels
+/// take all their paths.
+///
+/// Output: one line per check; the exit code is 0 if all pass, 1 if any fails.
+///
+/// Ref:
+///     pointcloud.cpp;
+///     PLY and PCD(v0.7) file format specifications
+
+#include "opencv2/core/core.hpp"
+
+#include "disparity.hpp"
+#include "pointcloud.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+using namespace cv;
+using namespace std;
+
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+const int imageWidth = 203;
+const int imageHeight = 57;
+const double maxRelError = 1e-5;    // float evaluation against double, relative to the point's norm
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void syntheticMaps(Mat& disp, Mat& color, Mat& Q);
+static void referencePoints(const Mat& disp, const Mat& color, const Mat& Q, vector<CloudPoint>& points);
+static bool samePoints(const CloudPoint* a, const CloudPoint* b, int n, bool colors, string& why);
+static bool readCloud(FILE* f, int cloudFormat, vector<CloudPoint>& points, bool& hasColor, string& why);
+static int report(const string& name, bool ok, const string& why);
+//--------------------------------------------------
+
+int main()
+{
+    Mat disp, color, Q;
+    syntheticMaps(disp, color, Q);
+    Mat gray(color.size(), CV_8U);
+    for (int y = 0; y < gray.rows; y++)
+        for (int x = 0; x < gray.cols; x++)
+            gray.at<uchar>(y, x) = color.at<Vec3b>(y, x)[1];
+
+    int failures = 0, checks = 0;
+    const Mat colors[3] = {Mat(), color, gray};
+    const char* colorNames[3] = {"no color", "bgr", "gray"};
+    for (int c = 0; c < 3; c++)
+    {
+        vector<CloudPoint> expected;
+        referencePoints(disp, colors[c], Q, expected);
+        const int n = (int)expected.size();
+        string why;
+
+        // whole map, and the rows split in uneven ranges
+        bool ok = countValidDisparities(disp) == n;
+        if (!ok)
+            why = format("%d points counted instead of %d", countValidDisparities(disp), n);
+        vector<CloudPoint> points(disp.total());
+        ok = ok && reprojectDisparity(disp, colors[c], Q, 0, disp.rows, &points[0]) == n &&
+             samePoints(&points[0], &expected[0], n, c > 0, why);
+        int m = 0;
+        for (int y0 = 0; ok && y0 < disp.rows; y0 += 13)
+            m += reprojectDisparity(disp, colors[c], Q, y0, std::min(y0 + 13, disp.rows), &points[m]);
+        ok = ok && m == n && samePoints(&points[0], &expected[0], n, c > 0, why);
+        failures += report(format("reprojectDisparity, %s", colorNames[c]), ok, why);
+        checks++;
+
+        for (int cloudFormat = CLOUD_PLY; cloudFormat <= CLOUD_PCD; cloudFormat++)
+        {
+            // streamed by strips, and from memory
+            for (int fromMemory = 0; fromMemory <= 1; fromMemory++)
+            {
+                FILE* f = tmpfile();
+                why.clear();
+                ok = f != NULL;
+                if (ok)
+                {
+                    ok = fromMemory ? writeCloudPoints(f, cloudFormat, &expected[0], n, c > 0)
+                                    : writePointCloud(f, cloudFormat, disp, colors[c], Q, 7);
+                    if (!ok)
+                        why = "write failed";
+                }
+                vector<CloudPoint> read;
+                bool hasColor = false;
+                if (ok)
+                {
+                    rewind(f);
+                    ok = readCloud(f, cloudFormat, read, hasColor, why);
+                }
+                if (ok && (hasColor != (c > 0) || (int)read.size() != n))
+                {
+                    ok = false;
+                    why = format("%d points%s read instead of %d%s", (int)read.size(), hasColor ? " with color" : "",
+                                 n, c > 0 ? " with color" : "");
+                }
+                ok = ok && samePoints(&read[0], &expected[0], n, c > 0, why);
+                if (f)
+                    fclose(f);
+                failures += report(format("%s %s, %s", cloudFormat == CLOUD_PCD ? "pcd" : "ply",
+                                          fromMemory ? "writeCloudPoints" : "writePointCloud", colorNames[c]), ok, why);
+                checks++;
+            }
+        }
+    }
+
+    if (failures)
+        cout << failures << " of " << checks << " checks failed" << endl;
+    else
+        cout << "All " << checks << " checks passed" << endl;
+    return failures ? 1 : 0;
+}
+
+// Disparities with invalid pixels(DISP_INVALID and 0), rows fully valid and fully invalid, a color
+// image, and the Q of a rectified pair: f 700, principal points 101.5/28.5 and 105.75, baseline 60.
+void syntheticMaps(Mat& disp, Mat& color, Mat& Q)
+{
+    const int W = imageWidth, H = imageHeight;
+    RNG rng(4321);
+    disp.create(H, W, CV_16S);
+    color.create(H, W, CV_8UC3);
+    for (int y = 0; y < H; y++)
+        for (int x = 0; x < W; x++)
+        {
+            const int kind = y % 5 == 1 ? 0 : y % 5 == 3 ? 3 : rng.uniform(0, 4);
+            disp.at<short>(y, x) = (short)(kind == 0 ? DISP_INVALID : kind == 1 ? 0
+                                                     : rng.uniform(1, 128*DISP_SCALE));
+            color.at<Vec3b>(y, x) = Vec3b((uchar)rng.uniform(0, 256), (uchar)rng.uniform(0, 256),
+                                          (uchar)rng.uniform(0, 256));
+        }
+
+    const double f = 700, cx = 101.5, cy = 28.5, cx2 = 105.75, Tx = -60;
+    Q = Mat::zeros(4, 4, CV_64F);
+    Q.at<double>(0, 0) = 1;
+    Q.at<double>(0, 3) = -cx;
+    Q.at<double>(1, 1) = 1;
+    Q.at<double>(1, 3) = -cy;
+    Q.at<double>(2, 3) = f;
+    Q.at<double>(3, 2) = -1/Tx;
+    Q.at<double>(3, 3) = (cx - cx2)/Tx;
+}
+
+//--------------------------------------------------
+// Reference
+//--------------------------------------------------
+// Points of the pixels with a positive disparity in row-major order, colors as 0xAARRGGBB.
+void referencePoints(const Mat& disp, const Mat& color, const Mat& Q, vector<CloudPoint>& points)
+{
+    points.clear();
+    for (int y = 0; y < disp.rows; y++)
+        for (int x = 0; x < disp.cols; x++)
+        {
+            const short d = disp.at<short>(y, x);
+            if (d <= 0)
+                continue;
+            const double v[4] = {(double)x, (double)y, (double)d/DISP_SCALE, 1};
+            double r[4] = {0, 0, 0, 0};
+            for (int i = 0; i < 4; i++)
+                for (int j = 0; j < 4; j++)
+                    r[i] += Q.at<double>(i, j)*v[j];
+            CloudPoint pt;
+            pt.x = (float)(r[0]/r[3]);
+            pt.y = (float)(r[1]/r[3]);
+            pt.z = (float)(r[2]/r[3]);
+            pt.b = pt.g = pt.r = pt.a = 0;
+            if (color.type() == CV_8UC3)
+            {
+                const Vec3b c = color.at<Vec3b>(y, x);
+                pt.b = c[0];
+                pt.g = c[1];
+                pt.r = c[2];
+                pt.a = 255;
+            }
+            else if (!color.empty())
+            {
+                pt.b = pt.g = pt.r = color.at<uchar>(y, x);
+                pt.a = 255;
+            }
+            points.push_back(pt);
+        }
+}
+
+// Coordinates within maxRelError, colors identical if compared.
+bool samePoints(const CloudPoint* a, const CloudPoint* b, int n, bool colors, string& why)
+{
+    for (int i = 0; i < n; i++)
+    {
+        const double norm = sqrt((double)b[i].x*b[i].x + (double)b[i].y*b[i].y + (double)b[i].z*b[i].z);
+        const double err = std::max(std::max(fabs(a[i].x - b[i].x), fabs(a[i].y - b[i].y)), fabs(a[i].z - b[i].z));
+        if (!(err <= maxRelError*std::max(norm, 1.)) ||
+            (colors && (a[i].b != b[i].b || a[i].g != b[i].g || a[i].r != b[i].r || a[i].a != b[i].a)))
+        {
+            why = format("point %d is (%g, %g, %g) #%02x%02x%02x%02x instead of (%g, %g, %g) #%02x%02x%02x%02x", i,
+                         a[i].x, a[i].y, a[i].z, a[i].a, a[i].r, a[i].g, a[i].b,
+                         b[i].x, b[i].y, b[i].z, b[i].a, b[i].r, b[i].g, b[i].b);
+            return false;
+        }
+    }
+    return true;
+}
+
+//--------------------------------------------------
+// Readers
+//--------------------------------------------------
+// A field of the records: its name, byte offset and type(F float, U unsigned byte).
+struct Field
+{
+    string name;
+    int offset;
+    char type;
+};
+
+static bool readLine(FILE* f, string& line)
+{
+    line.clear();
+    int c;
+    while ((c = fgetc(f)) != EOF && c != '\n')
+        line += (char)c;
+    return c != EOF;
+}
+
+// Reads the header of a binary little endian PLY or PCD file, then its records through the
+// fields it declares. hasColor: the file has all of blue, green, red and alpha(PCD: rgba).
+bool readCloud(FILE* f, int cloudFormat, vector<CloudPoint>& points, bool& hasColor, string& why)
+{
+    vector<Field> fields;
+    int n = -1, recordSize = 0;
+    string line;
+    if (cloudFormat == CLOUD_PLY)
+    {
+        if (!readLine(f, line) || line != "ply" || !readLine(f, line) || line != "format binary_little_endian 1.0")
+        {
+            why = "not a binary little endian PLY file";
+            return false;
+        }
+        while (readLine(f, line) && line != "end_header")
+        {
+            istringstream s(line);
+            string key, a, b;
+            s >> key >> a >> b;
+            if (key == "element" && a == "vertex")
+                n = atoi(b.c_str());
+            else if (key == "property" && (a == "float" || a == "uchar"))
+            {
+                Field field = {b, recordSize, a == "float" ? 'F' : 'U'};
+                fields.push_back(field);
+                recordSize += a == "float" ? 4 : 1;
+            }
+            else
+            {
+                why = "unexpected header line: " + line;
+                return false;
+            }
+        }
+    }
+    else
+    {
+        vector<string> names, sizes, types;
+        int width = -1, height = -1;
+        bool binary = false;
+        while (!binary && readLine(f, line))
+        {
+            istringstream s(line);
+            string key, v;
+            s >> key;
+            if (key == "FIELDS" || key == "SIZE" || key == "TYPE" || key == "COUNT")
+            {
+                vector<string>& list = key == "FIELDS" ? names : key == "SIZE" ? sizes : types;
+                while (s >> v)
+                    if (key != "COUNT")
+                        list.push_back(v);
+                    else if (v != "1")
+                    {
+                        why = "field counts other than 1";
+                        return false;
+                    }
+            }
+            else if (key == "WIDTH")
+                s >> width;
+            else if (key == "HEIGHT")
+                s >> height;
+            else if (key == "POINTS")
+                s >> n;
+            else if (key == "DATA")
+            {
+                s >> v;
+                binary = v == "binary";
+                if (!binary)
+                {
+                    why = "DATA " + v;
+                    return false;
+                }
+            }
+        }
+        if (!binary || names.size() != sizes.size() || names.size() != types.size() || width*height != n)
+        {
+            why = "inconsistent PCD header";
+            return false;
+        }
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            const int size = atoi(sizes[i].c_str());
+            // rgba is one unsigned word, bytes blue, green, red, alpha in little endian
+            if (names[i] == "rgba" && types[i] == "U" && size == 4)
+            {
+                const char* channels[4] = {"blue", "green", "red", "alpha"};
+                for (int k = 0; k < 4; k++)
+                {
+                    Field field = {channels[k], recordSize + k, 'U'};
+                    fields.push_back(field);
+                }
+            }
+            else if (types[i] == "F" && size == 4)
+            {
+                Field field = {names[i], recordSize, 'F'};
+                fields.push_back(field);
+            }
+            else
+            {
+                why = "unexpected field " + names[i];
+                return false;
+            }
+            recordSize += size;
+        }
+    }
+
+    const char* names[7] = {"x", "y", "z", "blue", "green", "red", "alpha"};
+    int offsets[7] = {-1, -1, -1, -1, -1, -1, -1};
+    for (size_t i = 0; i < fields.size(); i++)
+        for (int k = 0; k < 7; k++)
+            if (fields[i].name == names[k] && fields[i].type == (k < 3 ? 'F' : 'U'))
+                offsets[k] = fields[i].offset;
+    hasColor = offsets[3] >= 0 && offsets[4] >= 0 && offsets[5] >= 0 && offsets[6] >= 0;
+    if (n < 0 || offsets[0] < 0 || offsets[1] < 0 || offsets[2] < 0)
+    {
+        why = "no point count or coordinates in the header";
+        return false;
+    }
+
+    points.resize(n);
+    vector<uchar> record(recordSize);
+    for (int i = 0; i < n; i++)
+    {
+        if (fread(&record[0], recordSize, 1, f) != 1)
+        {
+            why = format("file ends at point %d of %d", i, n);
+            return false;
+        }
+        CloudPoint& pt = points[i];
+        memcpy(&pt.x, &record[offsets[0]], 4);
+        memcpy(&pt.y, &record[offsets[1]], 4);
+        memcpy(&pt.z, &record[offsets[2]], 4);
+        pt.b = hasColor ? record[offsets[3]] : 0;
+        pt.g = hasColor ? record[offsets[4]] : 0;
+        pt.r = hasColor ? record[offsets[5]] : 0;
+        pt.a = hasColor ? record[offsets[6]] : 0;
+    }
+    if (fgetc(f) != EOF)
+    {
+        why = "bytes after the last point";
+        return false;
+    }
+    return true;
+}
+
+// prints the result of a check, returns 1 if it failed
+int report(const string& name, bool ok, const string& why)
+{
+    cout << format("%s %-40s", ok ? "PASS" : "FAIL", name.c_str());
+    if (!ok)
+        cout << " " << why;
+    cout << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,341 @@
+/// rectify_refine.cpp
+/// Re-estimation of the relative rotation of a stereo rig from live matches.
+///
+///   1. matches of rectified pairs are taken back to normalized coordinates of the original
+///      cameras with R1, R2, P1, P2 of the rectification they were made with, so they stay
+///      valid when the rectification changes;
+///   2. R = Rodrigues(w)*R0 minimizes the robust(Huber) Sampson error of the epipolar
+///      constraint x2'*[T]x*R*x1 = 0 over the 3 parameters of w, with Levenberg-Marquardt and
+///      numerical derivatives; T and the intrinsics are fixed;
+///   3. stereoRectify of the new R as in stereo_calib, and initUndistortRectifyMap band by band:
+///      the maps of rows [y0, y1) are the maps of a camera whose principal point is y0 rows higher.
+///
+/// Ref:
+///     Hartley & Zisserman, Multiple View Geometry, 2nd ed., 11.4.3(Sampson error)
+
+#include "rectify_refine.hpp"
+#include "calibration.hpp"
+#include "trace.hpp"
+
+#include "opencv2/calib3d/calib3d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <algorithm>
+#include <math.h>
+#include <time.h>
+
+using namespace cv;
+using namespace std;
+
+RefineParams::RefineParams()
+{
+    maxMatches = 2000;
+    minMatches = 300;
+    iterations = 20;
+    robustWidth = 1.f;
+    bandRows = 32;
+    alpha = 1;
+}
+
+RectifyRefiner::RectifyRefiner(const RefineParams& _params)
+    : params(_params), rmsBefore(0), rmsAfter(0), rotationChange(0), nextMatch(0), nextRow(-1)
+{
+}
+
+bool RectifyRefiner::load(const string& stereoParamsFn, const string intrinsicsFn[2], Size _imageSize)
+{
+    // both files scaled to the size of the images if calibrated at another one
+    StereoParams stored, p;
+    if (!loadStereoParams(stereoParamsFn, stored))
+        return false;
+    scaleStereoParams(stored, _imageSize, p);
+    for (int k = 0; k < 2; k++)
+    {
+        cameraMatrix[k] = p.cameraMatrix[k];
+        distCoeffs[k] = p.distCoeffs[k];
+    }
+    R = p.R;
+    T = p.T;
+    current.R1 = p.R1;
+    current.R2 = p.R2;
+    current.P1 = p.P1;
+    current.P2 = p.P2;
+    current.Q = p.Q;
+    if (R.empty() || T.empty() || current.R1.empty() || current.R2.empty() || current.P1.empty() || current.P2.empty())
+        return false;
+
+    // the intrinsics of camera_calib replace those of stereo_calib if given
+    for (int k = 0; k < 2; k++)
+    {
+        if (intrinsicsFn[k].empty())
+            continue;
+        CameraParams c, scaled;
+        if (!loadCameraParams(intrinsicsFn[k], c))
+            return false;
+        scaleCameraParams(c, _imageSize, scaled);
+        cameraMatrix[k] = scaled.cameraMatrix;
+        distCoeffs[k] = scaled.distCoeffs;
+    }
+    if (cameraMatrix[0].empty() || cameraMatrix[1].empty())
+        return false;
+    R.convertTo(R, CV_64F);
+    T.convertTo(T, CV_64F);
+
+    imageSize = _imageSize;
+    clearMatches();
+    nextRow = -1;
+    return true;
+}
+
+void RectifyRefiner::addMatches(const vector<DriftMatch>& matches)
+{
+    Matx33d back[2];    // rectified pixel to ray of the original camera
+    for (int k = 0; k < 2; k++)
+    {
+        const Mat& P = k ? current.P2 : current.P1;
+        Matx33d Kr = P(Rect(0, 0, 3, 3));
+        Matx33d Rk = k ? current.R2 : current.R1;
+        back[k] = Rk.t()*Kr.inv();
+    }
+
+    for (size_t i = 0; i < matches.size(); i++)
+    {
+        Point2d x[2];
+        for (int k = 0; k < 2; k++)
+        {
+            const Point2f& p = k ? matches[i].right : matches[i].left;
+            Vec3d ray = back[k]*Vec3d(p.x, p.y, 1);
+            x[k] = Point2d(ray[0]/ray[2], ray[1]/ray[2]);
+        }
+        if ((int)points[0].size() < params.maxMatches)
+        {
+            points[0].push_back(x[0]);
+            points[1].push_back(x[1]);
+        }
+        else
+        {
+            points[0][nextMatch] = x[0];
+            points[1][nextMatch] = x[1];
+            nextMatch = (nextMatch + 1)%params.maxMatches;
+        }
+    }
+}
+
+void RectifyRefiner::clearMatches()
+{
+    points[0].clear();
+    points[1].clear();
+    nextMatch = 0;
+}
+
+int RectifyRefiner::matches() const
+{
+    return (int)points[0].size();
+}
+
+//--------------------------------------------------
+// Estimation of R
+//--------------------------------------------------
+static Matx33d crossMatrix(const Vec3d& t)
+{
+    return Matx33d(0, -t[2], t[1],
+                   t[2], 0, -t[0],
+                   -t[1], t[0], 0);
+}
+
+static Matx33d rotation(const Vec3d& w)
+{
+    Mat Rw;
+    Rodrigues(Mat(w), Rw);
+    return Rw;
+}
+
+// first order geometric distance of a match to the epipolar constraint of E, normalized units
+static double sampsonError(const Matx33d& E, const Point2d& a, const Point2d& b)
+{
+    const Vec3d x1(a.x, a.y, 1), x2(b.x, b.y, 1);
+    const Vec3d l2 = E*x1, l1 = E.t()*x2;
+    const double den = l2[0]*l2[0] + l2[1]*l2[1] + l1[0]*l1[0] + l1[1]*l1[1];
+    return den > 0 ? x2.dot(l2)/sqrt(den) : 0;
+}
+
+static double huberCost(double r, double k)
+{
+    return fabs(r) <= k ? r*r/2 : k*(fabs(r) - k/2);
+}
+
+bool RectifyRefiner::solve()
+{
+    TRACE_SCOPE("RectifyRefiner::solve");
+    const int n = matches();
+    if (n < params.minMatches)
+        return false;
+
+    // errors in pixels of the mean focal length
+    const double f = (cameraMatrix[0].at<double>(0, 0) + cameraMatrix[1].at<double>(0, 0))/2;
+    const double k = params.robustWidth;
+    const Matx33d R0 = R, Tx = crossMatrix(Vec3d(T));
+    vector<double> r(n);
+
+    Vec3d w(0, 0, 0);
+    double cost = 0, sq = 0;
+    Matx33d E = Tx*R0;
+    for (int i = 0; i < n; i++)
+    {
+        r[i] = f*sampsonError(E, points[0][i], points[1][i]);
+        cost += huberCost(r[i], k);
+        sq += r[i]*r[i];
+    }
+    rmsBefore = sqrt(sq/n);
+
+    const double h = 1e-7;
+    double lambda = 1e-3;
+    for (int it = 0; it < params.iterations; it++)
+    {
+        // Gauss-Newton system with Huber weights, forward differences
+        Matx33d Ej[3];
+        for (int j = 0; j < 3; j++)
+        {
+            Vec3d wj = w;
+            wj[j] += h;
+            Ej[j] = Tx*rotation(wj)*R0;
+        }
+        Matx33d H = Matx33d::zeros();
+        Vec3d g(0, 0, 0);
+        for (int i = 0; i < n; i++)
+        {
+            Vec3d J;
+            for (int j = 0; j < 3; j++)
+                J[j] = (f*sampsonError(Ej[j], points[0][i], points[1][i]) - r[i])/h;
+            const double weight = fabs(r[i]) <= k ? 1 : k/fabs(r[i]);
+            H += weight*J*J.t();
+            g += weight*r[i]*J;
+        }
+
+        // damped steps until the cost decreases
+        bool accepted = false;
+        Vec3d step;
+        for (int tries = 0; tries < 10 && !accepted; tries++)
+        {
+            Matx33d A = H;
+            for (int j = 0; j < 3; j++)
+                A(j, j) += lambda*std::max(H(j, j), 1e-12);
+            step = A.solve(-g, DECOMP_CHOLESKY);
+            const Matx33d Es = Tx*rotation(w + step)*R0;
+            double c = 0;
+            for (int i = 0; i < n; i++)
+                c += huberCost(f*sampsonError(Es, points[0][i], points[1][i]), k);
+            if (c < cost)
+            {
+                accepted = true;
+                cost = c;
+                w += step;
+                lambda = std::max(lambda/10, 1e-9);
+            }
+            else
+                lambda *= 10;
+        }
+        if (!accepted)
+            break;
+
+        E = Tx*rotation(w)*R0;
+        for (int i = 0; i < n; i++)
+            r[i] = f*sampsonError(E, points[0][i], points[1][i]);
+        if (norm(step) < 1e-10)
+            break;
+    }
+
+    sq = 0;
+    for (int i = 0; i < n; i++)
+        sq += r[i]*r[i];
+    rmsAfter = sqrt(sq/n);
+    rotationChange = norm(w)*180/CV_PI;
+    if (rmsAfter >= rmsBefore)
+        return false;
+
+    // rectification of the new R, as in stereo_calib
+    Mat(rotation(w)*R0).copyTo(R);
+    stereoRectify(cameraMatrix[0], distCoeffs[0], cameraMatrix[1], distCoeffs[1], imageSize, R, T,
+                  pending.R1, pending.R2, pending.P1, pending.P2, pending.Q,
+                  CALIB_ZERO_DISPARITY, params.alpha, imageSize);
+    for (int k = 0; k < 2; k++)
+    {
+        nextMaps[k][0].create(imageSize, CV_16SC2);
+        nextMaps[k][1].create(imageSize, CV_16UC1);
+    }
+    nextRow = 0;
+    return true;
+}
+
+//--------------------------------------------------
+// Maps
+//--------------------------------------------------
+bool RectifyRefiner::updating() const
+{
+    return nextRow >= 0;
+}
+
+bool RectifyRefiner::updateMaps(Mat map[2][2], Mat P[2], Mat& Q)
+{
+    if (nextRow < 0)
+        return false;
+
+    const int y0 = nextRow, y1 = std::min(nextRow + params.bandRows, imageSize.height);
+    for (int k = 0; k < 2; k++)
+    {
+        Mat Pk = (k ? pending.P2 : pending.P1).clone();
+        Pk.at<double>(1, 2) -= y0;
+        Mat band[2];
+        TRACE_SCOPE("initUndistortRectifyMap");
+        initUndistortRectifyMap(cameraMatrix[k], distCoeffs[k], k ? pending.R2 : pending.R1, Pk,
+                                Size(imageSize.width, y1 - y0), CV_16SC2, band[0], band[1]);
+        band[0].copyTo(nextMaps[k][0].rowRange(y0, y1));
+        band[1].copyTo(nextMaps[k][1].rowRange(y0, y1));
+    }
+    nextRow = y1;
+    if (nextRow < imageSize.height)
+        return false;
+
+    for (int k = 0; k < 2; k++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            map[k][j] = nextMaps[k][j];
+            nextMaps[k][j].release();
+        }
+    }
+    current = pending;
+    P[0] = current.P1;
+    P[1] = current.P2;
+    Q = current.Q;
+    nextRow = -1;
+    return true;
+}
+
+bool RectifyRefiner::save(const string& filename) const
+{
+    FileStorage fs(filename, FileStorage::WRITE);
+    if (!fs.isOpened())
+        return false;
+
+    char buf[1024];
+    time_t tm;
+    time(&tm);
+    strftime(buf, sizeof(buf) - 1, "%c", localtime(&tm));
+    fs << "calibration_Time" << buf;
+    fs << "image_Width" << imageSize.width;
+    fs << "image_Height" << imageSize.height;
+
+    const Matx33d E = crossMatrix(Vec3d(T))*Matx33d(R);
+    const Matx33d K1 = cameraMatrix[0], K2 = cameraMatrix[1];
+    const Matx33d F = K2.inv().t()*E*K1.inv();
+    cvWriteComment(*fs, "Intrinsic params:\n", 0);
+    fs << "cameraMatrix1" << cameraMatrix[0] << "distCoeffs1" << distCoeffs[0]
+       << "cameraMatrix2" << cameraMatrix[1] << "distCoeffs2" << distCoeffs[1];
+    cvWriteComment(*fs, "Extrinsic params(R refined online):\n", 0);
+    fs << "R" << R << "T" << T << "E" << Mat(E) << "F" << Mat(F);
+    cvWriteComment(*fs, "\nRectification params:\n", 0);
+    fs << "R1" << current.R1 << "R2" << current.R2
+       << "P1" << current.P1 << "P2" << current.P2 << "Q" << current.Q;
+    return true;
+}
@@ -0,0 +1,84 @@
+/// rectify_refine.hpp
+/// Online refinement of the stereo extrinsics from natural features, for rigs whose cameras
+/// have rotated against each other since stereo_calib(e.g. the rig was bumped).
+///
+/// The intrinsics(camera_calib results) and the baseline T are kept, only the rotation R of the
+/// right camera is estimated again from matches of the live stream. The rectification maps of
+/// the new R are then computed a band of rows at a time, so that capture and matching go on with
+/// the old maps until the new ones are complete and swapped in.
+
+#ifndef RECTIFY_REFINE_HPP
+#define RECTIFY_REFINE_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include "drift_monitor.hpp"
+
+#include <string>
+#include <vector>
+
+struct RefineParams
+{
+    int maxMatches;         // matches kept, the oldest are replaced
+    int minMatches;         // matches needed to estimate R
+    int iterations;         // most Levenberg-Marquardt iterations
+    float robustWidth;      // pixels, Sampson errors beyond it are down-weighted(Huber)
+    int bandRows;           // rows of the maps computed per call of updateMaps
+    double alpha;           // free scaling of stereoRectify, 1 as in stereo_calib
+
+    RefineParams();
+};
+
+/// Rectification of one estimate of R(output of stereoRectify).
+struct Rectification
+{
+    cv::Mat R1, R2, P1, P2, Q;
+};
+
+struct RectifyRefiner
+{
+    RefineParams params;
+
+    cv::Mat cameraMatrix[2], distCoeffs[2];
+    cv::Mat R, T;               // right camera relative to the left one(stereoCalibrate), R refined
+    Rectification current;      // of the maps in use, the matches are given in it
+    double rmsBefore, rmsAfter; // Sampson error of the matches before and after the last solve, pixels
+    double rotationChange;      // degrees, by the last solve
+
+    RectifyRefiner(const RefineParams& params = RefineParams());
+
+    /// stereoParamsFn: output of stereo_calib, for R, T and the rectification in use;
+    /// intrinsicsFn: outputs of camera_calib for the left and right cameras. Both are scaled to
+    /// imageSize if calibrated at another size.
+    bool load(const std::string& stereoParamsFn, const std::string intrinsicsFn[2], cv::Size imageSize);
+
+    /// Matches of rectified pairs, e.g. DriftMonitor::matches, made with the current rectification.
+    void addMatches(const std::vector<DriftMatch>& matches);
+    void clearMatches();
+    int matches() const;
+
+    /// Estimates R from the matches and starts computing the maps of its rectification.
+    /// Returns false if there are too few matches or the estimate does not lower the error.
+    bool solve();
+
+    /// True while the maps of a new rectification are computed.
+    bool updating() const;
+
+    /// Computes the next band of the new maps. Once all bands are done, the maps are swapped
+    /// with map(as made by initUndistortRectifyMap with CV_16SC2), P and Q are replaced, and
+    /// true is returned.
+    bool updateMaps(cv::Mat map[2][2], cv::Mat P[2], cv::Mat& Q);
+
+    /// Saves the refined calibration in the format of stereo_calib.
+    bool save(const std::string& filename) const;
+
+private:
+    cv::Size imageSize;
+    std::vector<cv::Point2d> points[2];     // normalized undistorted coordinates of the matches
+    int nextMatch;                          // replaced next once maxMatches are kept
+    Rectification pending;                  // of the maps being computed
+    cv::Mat nextMaps[2][2];
+    int nextRow;                            // next band of nextMaps, -1 if not updating
+};
+
+#endif
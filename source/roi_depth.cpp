@@ -0,0 +1,275 @@
+/// roi_depth.cpp
+/// Lazy rectification and windowed matching for region depth queries.
+///
+/// A region of the raw left image is mapped to the rectified image through the border of the
+/// region(undistortPoints with R1, P1). Its window for the matcher spans numDisparities more
+/// columns to the left, where its right image matches can be, plus a margin for the matching
+/// window. The rectified pair is computed lazily, TILE_W x TILE_H tiles at a time, and kept
+/// until the next frame, so overlapping queries rectify once.
+/// Batches rectify all the missing tiles first, then match the regions in parallel with one
+/// matcher per thread.
+///
+/// Ref:
+///     opencv/modules/imgproc/src/undistort.cpp(undistortPoints, initUndistortRectifyMap)
+
+#include "roi_depth.hpp"
+#include "calibration.hpp"
+#include "trace.hpp"
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <algorithm>
+#include <float.h>
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+using namespace cv;
+using namespace std;
+
+const int TILE_W = 32;
+const int TILE_H = 16;
+const int BORDER_SAMPLES = 8;   // points per region edge mapped to the rectified image
+const int PARALLEL_AREA = 1 << 16;  // smaller windows are matched by one thread
+
+RoiDepthParams::RoiDepthParams()
+    : nearPercentile(2)
+{
+    match.mode = MATCH_BM;
+    match.cost = COST_CENSUS_5X5;
+    match.blockSize = 5;
+    match.numDisparities = 64;
+    match.speckleWindowSize = 0;    // regions are often smaller than a speckle
+}
+
+RoiDepthEstimator::RoiDepthEstimator(const RoiDepthParams& _params)
+    : params(_params), q23(0), q32(0), q33(0)
+{
+}
+
+void RoiDepthEstimator::init(const Mat _cameraMatrix[2], const Mat _distCoeffs[2], const Mat& _R1, const Mat& R2,
+                             const Mat& _P1, const Mat& P2, const Mat& Q, Size imageSize)
+{
+    CV_Assert(Q.rows == 4 && Q.cols == 4);
+    _cameraMatrix[0].copyTo(cameraMatrix);
+    _distCoeffs[0].copyTo(distCoeffs);
+    _R1.copyTo(R1);
+    _P1.copyTo(P1);
+    TRACE_SCOPE("initUndistortRectifyMap");
+    initUndistortRectifyMap(_cameraMatrix[0], _distCoeffs[0], _R1, _P1, imageSize, CV_16SC2, map[0][0], map[0][1]);
+    initUndistortRectifyMap(_cameraMatrix[1], _distCoeffs[1], R2, P2, imageSize, CV_16SC2, map[1][0], map[1][1]);
+
+    Mat Qd;
+    Q.convertTo(Qd, CV_64F);
+    q23 = Qd.at<double>(2, 3);
+    q32 = Qd.at<double>(3, 2);
+    q33 = Qd.at<double>(3, 3);
+    done.release();
+}
+
+bool RoiDepthEstimator::load(const string& filename, Size imageSize)
+{
+    // scaled to imageSize if calibrated at another size
+    StereoParams stored, p;
+    if (!loadStereoParams(filename, stored))
+        return false;
+    scaleStereoParams(stored, imageSize, p);
+    if (p.R1.empty() || p.R2.empty() || p.P1.empty() || p.P2.empty() || p.Q.empty())
+        return false;
+    init(p.cameraMatrix, p.distCoeffs, p.R1, p.R2, p.P1, p.P2, p.Q, imageSize);
+    return true;
+}
+
+void RoiDepthEstimator::setFrame(const Mat& left, const Mat& right)
+{
+    CV_Assert(!map[0][0].empty() && "init or load first");
+    CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+    CV_Assert(left.size() == map[0][0].size());
+    raw[0] = left;
+    raw[1] = right;
+    rect[0].create(left.size(), CV_8U);
+    rect[1].create(left.size(), CV_8U);
+    done.create((left.rows + TILE_H - 1)/TILE_H, (left.cols + TILE_W - 1)/TILE_W, CV_8U);
+    done = Scalar::all(0);
+}
+
+Rect RoiDepthEstimator::rectifiedRoi(const Rect& roi) const
+{
+    // the border of a region stays its border through the smooth rectification, sample it
+    vector<Point2f> border, mapped;
+    for (int i = 0; i <= BORDER_SAMPLES; i++)
+    {
+        float tx = roi.x + (float)roi.width*i/BORDER_SAMPLES;
+        float ty = roi.y + (float)roi.height*i/BORDER_SAMPLES;
+        border.push_back(Point2f(tx, (float)roi.y));
+        border.push_back(Point2f(tx, (float)(roi.y + roi.height)));
+        border.push_back(Point2f((float)roi.x, ty));
+        border.push_back(Point2f((float)(roi.x + roi.width), ty));
+    }
+    undistortPoints(border, mapped, cameraMatrix, distCoeffs, R1, P1);
+
+    float x0 = FLT_MAX, y0 = FLT_MAX, x1 = -FLT_MAX, y1 = -FLT_MAX;
+    for (size_t i = 0; i < mapped.size(); i++)
+    {
+        x0 = std::min(x0, mapped[i].x);
+        y0 = std::min(y0, mapped[i].y);
+        x1 = std::max(x1, mapped[i].x);
+        y1 = std::max(y1, mapped[i].y);
+    }
+    Rect r(cvFloor(x0), cvFloor(y0), cvCeil(x1) - cvFloor(x0), cvCeil(y1) - cvFloor(y0));
+    return r & Rect(0, 0, map[0][0].cols, map[0][0].rows);
+}
+
+RoiDepth RoiDepthEstimator::query(const Rect& roi)
+{
+    vector<Rect> rois(1, roi);
+    vector<RoiDepth> depths;
+    query(rois, depths);
+    return depths[0];
+}
+
+// Median, percentile and confidence of the disparities of r(disp coordinates).
+static RoiDepth depthStatistics(const Mat& disp, const Mat& confidence, const Rect& r,
+                                int nearPercentile, double q23, double q32, double q33)
+{
+    RoiDepth depth;
+    depth.median = depth.nearest = depth.confidence = 0;
+    depth.validPixels = 0;
+
+    vector<short> valid;
+    valid.reserve(r.area());
+    double confSum = 0;
+    for (int y = r.y; y < r.y + r.height; y++)
+    {
+        const short* d = disp.ptr<short>(y);
+        const uchar* c = confidence.ptr<uchar>(y);
+        for (int x = r.x; x < r.x + r.width; x++)
+        {
+            if (d[x] <= 0)
+                continue;
+            valid.push_back(d[x]);
+            confSum += c[x];
+        }
+    }
+    if (valid.empty())
+        return depth;
+
+    // depth falls with disparity: the median disparity gives the median depth, the
+    // (100 - p)th percentile disparity the pth percentile depth
+    const int n = (int)valid.size();
+    int m = n/2, k = std::min(n - 1, n - 1 - n*nearPercentile/100);
+    nth_element(valid.begin(), valid.begin() + m, valid.end());
+    const double dm = (double)valid[m]/DISP_SCALE;
+    nth_element(valid.begin(), valid.begin() + k, valid.end());
+    const double dk = (double)valid[k]/DISP_SCALE;
+
+    depth.validPixels = n;
+    depth.median = (float)(q23/(q32*dm + q33));
+    depth.nearest = (float)(q23/(q32*dk + q33));
+    depth.confidence = (float)(confSum/(255.*r.area()));
+    return depth;
+}
+
+void RoiDepthEstimator::query(const vector<Rect>& rois, vector<RoiDepth>& depths)
+{
+    TRACE_SCOPE("RoiDepthEstimator::query");
+    CV_Assert(!done.empty() && "setFrame first");
+    const int n = (int)rois.size();
+    const StereoMatchParams& mp = params.match;
+    const int censusRadius = mp.cost == COST_CENSUS_7X9 ? 4 : mp.cost == COST_CENSUS_5X5 ? 2 : 0;
+    const int margin = mp.blockSize/2 + censusRadius + 1;
+    const Rect image(0, 0, raw[0].cols, raw[0].rows);
+
+    // region and window of every query, in the rectified image
+    vector<Rect> regions(n), windows(n);
+    for (int i = 0; i < n; i++)
+    {
+        regions[i] = rectifiedRoi(rois[i]);
+        const Rect& r = regions[i];
+        windows[i] = Rect(r.x - mp.numDisparities - margin, r.y - margin,
+                          r.width + mp.numDisparities + 2*margin, r.height + 2*margin) & image;
+    }
+
+    // rectify the tiles under the windows that are still missing
+    vector<Point> missing;
+    for (int i = 0; i < n; i++)
+    {
+        if (regions[i].area() == 0)
+            continue;
+        const Rect& w = windows[i];
+        for (int ty = w.y/TILE_H; ty <= (w.y + w.height - 1)/TILE_H; ty++)
+        {
+            uchar* d = done.ptr<uchar>(ty);
+            for (int tx = w.x/TILE_W; tx <= (w.x + w.width - 1)/TILE_W; tx++)
+            {
+                if (!d[tx])
+                    missing.push_back(Point(tx, ty));
+                d[tx] = 1;
+            }
+        }
+    }
+    #pragma omp parallel for
+    for (int i = 0; i < (int)missing.size(); i++)
+    {
+        Rect t = Rect(missing[i].x*TILE_W, missing[i].y*TILE_H, TILE_W, TILE_H) & image;
+        for (int k = 0; k < 2; k++)
+        {
+            // writes into rect[k] directly: the tile header already has the right size and type
+            Mat dst = rect[k](t);
+            TRACE_SCOPE("remap");
+            remap(raw[k], dst, map[k][0](t), map[k][1](t), INTER_LINEAR);
+        }
+    }
+
+    // then match the windows, in parallel if there are several
+#ifdef _OPENMP
+    const int threads = n > 1 ? omp_get_max_threads() : 1;
+#else
+    const int threads = 1;
+#endif
+    if ((int)matchers.size() < threads)
+        matchers.resize(threads);
+    depths.resize(n);
+    #pragma omp parallel for schedule(dynamic) if (n > 1)
+    for (int i = 0; i < n; i++)
+    {
+#ifdef _OPENMP
+        StereoMatcher& m = matchers[omp_get_thread_num()];
+#else
+        StereoMatcher& m = matchers[0];
+#endif
+        const Rect& r = regions[i];
+        const Rect& w = windows[i];
+        if (r.area() == 0)
+        {
+            depths[i] = depthStatistics(Mat(), Mat(), r, 0, q23, q32, q33);
+            depths[i].rectified = r;
+            continue;
+        }
+        m.params = mp;
+        Mat disp;
+#ifdef _OPENMP
+        // forking for every row of a small window costs more than matching it
+        const int inner = omp_get_max_threads();
+        if (w.area() < PARALLEL_AREA)
+            omp_set_num_threads(1);
+        m.compute(rect[0](w), rect[1](w), disp);
+        omp_set_num_threads(inner);
+#else
+        m.compute(rect[0](w), rect[1](w), disp);
+#endif
+        depths[i] = depthStatistics(disp, m.confidence, r - w.tl(), params.nearPercentile, q23, q32, q33);
+        depths[i].rectified = r;
+    }
+}
+
+int RoiDepthEstimator::rectifiedTiles() const
+{
+    return done.empty() ? 0 : countNonZero(done);
+}
+
+int RoiDepthEstimator::tiles() const
+{
+    return (int)done.total();
+}
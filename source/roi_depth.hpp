@@ -0,0 +1,76 @@
+/// roi_depth.hpp
+/// Depth of regions of interest without matching the full frame.
+///
+/// The regions are given in the left camera image. Only the image tiles a query needs are
+/// rectified, and only a window around each region is matched, so a query costs in proportion
+/// to the region(plus the search range), not to the frame.
+
+#ifndef ROI_DEPTH_HPP
+#define ROI_DEPTH_HPP
+
+#include "disparity.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include <string>
+#include <vector>
+
+struct RoiDepthParams
+{
+    StereoMatchParams match;    // matcher of the windows, by default census BM over 64 disparities
+    int nearPercentile;         // percentile of the valid depths reported as the nearest depth
+
+    RoiDepthParams();
+};
+
+struct RoiDepth
+{
+    float median;           // median depth of the valid pixels, in the unit of the calibration; 0 if none
+    float nearest;          // depth at nearPercentile, a nearest depth robust to a few wrong matches
+    float confidence;       // in [0, 1]: share of valid pixels times their mean match confidence
+    int validPixels;        // pixels of the region with a valid disparity
+    cv::Rect rectified;     // the region in the rectified left image
+};
+
+struct RoiDepthEstimator
+{
+    RoiDepthParams params;
+
+    RoiDepthEstimator(const RoiDepthParams& params = RoiDepthParams());
+
+    /// Rectification of stereo_calib, for images of imageSize.
+    void init(const cv::Mat cameraMatrix[2], const cv::Mat distCoeffs[2], const cv::Mat& R1, const cv::Mat& R2,
+              const cv::Mat& P1, const cv::Mat& P2, const cv::Mat& Q, cv::Size imageSize);
+
+    /// init from the output of stereo_calib, scaled to imageSize if calibrated at another size.
+    /// Returns false if it lacks the rectification result.
+    bool load(const std::string& filename, cv::Size imageSize);
+
+    /// Raw(unrectified) 8-bit grayscale images of the next queries, not copied:
+    /// they must stay unchanged until the next setFrame.
+    void setFrame(const cv::Mat& left, const cv::Mat& right);
+
+    /// Depth of a region of the raw left image.
+    RoiDepth query(const cv::Rect& roi);
+
+    /// Depths of many regions, matched in parallel.
+    void query(const std::vector<cv::Rect>& rois, std::vector<RoiDepth>& depths);
+
+    /// The bounding box of roi(raw left image) in the rectified left image.
+    cv::Rect rectifiedRoi(const cv::Rect& roi) const;
+
+    /// Tiles of the rectified pair computed since setFrame, out of tiles() per image.
+    int rectifiedTiles() const;
+    int tiles() const;
+
+private:
+    cv::Mat cameraMatrix, distCoeffs, R1, P1;   // of the left camera, to map the regions
+    cv::Mat map[2][2];              // rectification maps of both cameras
+    double q23, q32, q33;           // depth of disparity d: q23/(q32*d + q33)
+    cv::Mat raw[2];                 // current frame
+    cv::Mat rect[2];                // rectified frame, valid in the tiles marked in 'done'
+    cv::Mat done;                   // CV_8U per tile, nonzero if rectified
+    std::vector<StereoMatcher> matchers;    // one per thread
+};
+
+#endif
@@ -0,0 +1,330 @@
+/// sparse_stereo.cpp
+/// Sparse stereo matching of FAST corners.
+///
+///   1. FAST corners of the left image, spread over a grid of cells, the strongest first;
+///   2. for every corner, the SAD of a SPARSE_BLOCK_COLS x blockRows block against the blocks
+///      of the numDisparities candidates on the same row of the right image;
+///   3. the best match must be unique and cheap enough, and match back from the right image
+///      to the corner(left-right check); its disparity is refined with a parabola;
+///   4. triangulation with P1/P2, and a binary descriptor of the corner.
+/// Only the rows around the corners are ever read, no image-wide transform is computed.
+///
+/// Ref:
+///     Rosten & Drummond, Machine learning for high-speed corner detection, 2006;
+///     Calonder et al., BRIEF: Binary Robust Independent Elementary Features, 2010
+
+#include "sparse_stereo.hpp"
+#include "trace.hpp"
+
+#include "opencv2/features2d/features2d.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SPARSE_NEON
+#endif
+
+using namespace cv;
+using namespace std;
+
+const int PATCH_RADIUS = 12;    // descriptor tests lie within this distance of the corner
+const int MAX_DISPARITIES = 256;
+
+SparseStereoParams::SparseStereoParams()
+{
+    fastThreshold = 20;
+    maxFeatures = 1000;
+    cellSize = 32;
+    numDisparities = 64;
+    blockRows = 9;
+    uniquenessRatio = 15;
+    maxMeanCost = 24;
+    disp12MaxDiff = 1;
+}
+
+SparseStereo::SparseStereo(const SparseStereoParams& params)
+    : params(params), fx(1), fy(1), cx(0), cy(0), fB(1), dcx(0)
+{
+}
+
+void SparseStereo::setProjections(const Mat& P1, const Mat& P2)
+{
+    CV_Assert(P1.rows == 3 && P1.cols == 4 && P2.rows == 3 && P2.cols == 4);
+    Mat p1, p2;
+    P1.convertTo(p1, CV_64F);
+    P2.convertTo(p2, CV_64F);
+    fx = p1.at<double>(0, 0);
+    fy = p1.at<double>(1, 1);
+    cx = p1.at<double>(0, 2);
+    cy = p1.at<double>(1, 2);
+    dcx = cx - p2.at<double>(0, 2);
+    fB = -p2.at<double>(0, 3);
+}
+
+//--------------------------------------------------
+// Block matching along a row
+//--------------------------------------------------
+void blockCosts(const uchar* a, size_t sa, const uchar* b, size_t sb, int rows, int n, int dir,
+                ushort* costs)
+{
+#if defined(__AVX2__)
+    // two rows per 256-bit SAD
+    __m256i va[8];
+    for (int r = 0; r < rows; r += 2)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(a + r*sa));
+        __m128i hi = r + 1 < rows ? _mm_loadu_si128((const __m128i*)(a + (r + 1)*sa)) : lo;
+        va[r/2] = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    }
+    for (int k = 0; k < n; k++)
+    {
+        const uchar* bk = b + dir*k;
+        __m256i sum = _mm256_setzero_si256();
+        for (int r = 0; r < rows; r += 2)
+        {
+            __m128i lo = _mm_loadu_si128((const __m128i*)(bk + r*sb));
+            // an odd last row is compared with itself in the high lane: adds 0
+            __m128i hi = r + 1 < rows ? _mm_loadu_si128((const __m128i*)(bk + (r + 1)*sb))
+                                      : _mm256_extracti128_si256(va[r/2], 1);
+            __m256i vb = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+            sum = _mm256_add_epi64(sum, _mm256_sad_epu8(va[r/2], vb));
+        }
+        __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        costs[k] = (ushort)(_mm_cvtsi128_si32(s) + _mm_extract_epi16(s, 4));
+    }
+#elif defined(SPARSE_NEON)
+    for (int k = 0; k < n; k++)
+    {
+        const uchar* bk = b + dir*k;
+        uint16x8_t sum = vdupq_n_u16(0);
+        for (int r = 0; r < rows; r++)
+            sum = vpadalq_u8(sum, vabdq_u8(vld1q_u8(a + r*sa), vld1q_u8(bk + r*sb)));
+        uint32x4_t s4 = vpaddlq_u16(sum);
+        uint64x2_t s2 = vpaddlq_u32(s4);
+        costs[k] = (ushort)(vgetq_lane_u64(s2, 0) + vgetq_lane_u64(s2, 1));
+    }
+#else
+    for (int k = 0; k < n; k++)
+    {
+        const uchar* bk = b + dir*k;
+        int sum = 0;
+        for (int r = 0; r < rows; r++)
+            for (int c = 0; c < SPARSE_BLOCK_COLS; c++)
+                sum += abs(a[r*sa + c] - bk[r*sb + c]);
+        costs[k] = (ushort)sum;
+    }
+#endif
+}
+
+// Index of the minimum of costs[0..n-1], -1 if another cost outside +-1 of it is not
+// uniquenessRatio percent higher.
+static int bestUnique(const ushort* costs, int n, int uniquenessRatio)
+{
+    int best = 0;
+    for (int k = 1; k < n; k++)
+    {
+        if (costs[k] < costs[best])
+            best = k;
+    }
+    const int limit = costs[best]*(100 + uniquenessRatio)/100;
+    for (int k = 0; k < n; k++)
+    {
+        if ((k < best - 1 || k > best + 1) && costs[k] <= limit)
+            return -1;
+    }
+    return best;
+}
+
+//--------------------------------------------------
+// Descriptor
+//--------------------------------------------------
+struct TestPair
+{
+    schar x1, y1, x2, y2;
+};
+
+// Fixed pseudo-random tests, roughly Gaussian around the corner(sum of uniform variables).
+static const TestPair* descriptorTests()
+{
+    static TestPair tests[SPARSE_DESCRIPTOR_BYTES*8];
+    static bool ready = false;
+    #pragma omp critical(sparse_descriptor_tests)
+    if (!ready)
+    {
+        unsigned state = 0x2545F491u;
+        for (int i = 0; i < SPARSE_DESCRIPTOR_BYTES*8; i++)
+        {
+            schar v[4];
+            for (int j = 0; j < 4; j++)
+            {
+                int s = 0;
+                for (int k = 0; k < 3; k++)
+                {
+                    state = state*1664525u + 1013904223u;
+                    s += (int)(state >> 24) % (2*PATCH_RADIUS/3 + 1) - PATCH_RADIUS/3;
+                }
+                v[j] = (schar)std::min(std::max(s, -PATCH_RADIUS), PATCH_RADIUS - 1);
+            }
+            TestPair t = { v[0], v[1], v[2], v[3] };
+            tests[i] = t;
+        }
+        ready = true;
+    }
+    return tests;
+}
+
+// Tests compare 2x2 block sums, which smooths the pixel noise for free.
+static void computeDescriptor(const Mat& img, int x, int y, const TestPair* tests, uchar* desc)
+{
+    const size_t step = img.step;
+    const uchar* c = img.ptr<uchar>(y) + x;
+    for (int i = 0; i < SPARSE_DESCRIPTOR_BYTES; i++)
+    {
+        uchar byte = 0;
+        for (int b = 0; b < 8; b++)
+        {
+            const TestPair& t = tests[8*i + b];
+            const uchar* p = c + t.y1*(ptrdiff_t)step + t.x1;
+            const uchar* q = c + t.y2*(ptrdiff_t)step + t.x2;
+            int a = p[0] + p[1] + p[step] + p[step + 1];
+            int d = q[0] + q[1] + q[step] + q[step + 1];
+            byte |= (uchar)((a < d) << b);
+        }
+        desc[i] = byte;
+    }
+}
+
+int descriptorDistance(const SparsePoint& a, const SparsePoint& b)
+{
+    int n = 0;
+    for (int i = 0; i < SPARSE_DESCRIPTOR_BYTES; i += 8)
+    {
+        uint64 x, y;
+        memcpy(&x, a.descriptor + i, 8);
+        memcpy(&y, b.descriptor + i, 8);
+        n += __builtin_popcountll(x ^ y);
+    }
+    return n;
+}
+
+//--------------------------------------------------
+// Matching
+//--------------------------------------------------
+static bool strongerCorner(const KeyPoint& a, const KeyPoint& b)
+{
+    return a.response > b.response;
+}
+
+// Keeps the strongest corners, at most 'perCell' in every cell.
+static void spreadCorners(vector<KeyPoint>& kps, Size size, int cellSize, int maxFeatures)
+{
+    sort(kps.begin(), kps.end(), strongerCorner);
+    const int cols = (size.width + cellSize - 1)/cellSize, rows = (size.height + cellSize - 1)/cellSize;
+    const int perCell = std::max(2*maxFeatures/(cols*rows), 1);
+    vector<int> count(cols*rows, 0);
+    size_t n = 0;
+    for (size_t i = 0; i < kps.size() && (int)n < maxFeatures; i++)
+    {
+        int& c = count[(int)kps[i].pt.y/cellSize*cols + (int)kps[i].pt.x/cellSize];
+        if (c < perCell)
+        {
+            c++;
+            kps[n++] = kps[i];
+        }
+    }
+    kps.resize(n);
+}
+
+void SparseStereo::compute(const Mat& left, const Mat& right, vector<SparsePoint>& points)
+{
+    TRACE_SCOPE("SparseStereo::compute");
+    const SparseStereoParams& p = params;
+    CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+    CV_Assert(p.numDisparities > 0 && p.numDisparities <= MAX_DISPARITIES);
+    CV_Assert(p.blockRows % 2 == 1 && p.blockRows <= 15 && p.maxFeatures > 0 && p.cellSize > 0);
+
+    const int W = left.cols, H = left.rows;
+    const int ry = p.blockRows/2, rx = SPARSE_BLOCK_COLS/2;
+    const int margin = std::max(std::max(ry, rx), PATCH_RADIUS + 1);
+
+    keypoints.clear();
+    FAST(left, keypoints, p.fastThreshold, true);
+    // corners without room for the block and the descriptor are of no use
+    size_t kept = 0;
+    for (size_t i = 0; i < keypoints.size(); i++)
+    {
+        const Point2f& pt = keypoints[i].pt;
+        if (pt.x >= margin && pt.x < W - margin && pt.y >= margin && pt.y < H - margin)
+            keypoints[kept++] = keypoints[i];
+    }
+    keypoints.resize(kept);
+    spreadCorners(keypoints, left.size(), p.cellSize, p.maxFeatures);
+
+    const int n = (int)keypoints.size();
+    const TestPair* tests = descriptorTests();
+    const int maxCost = p.maxMeanCost*SPARSE_BLOCK_COLS*p.blockRows;
+    candidates.resize(n);
+    matched.assign(n, 0);
+
+    #pragma omp parallel for schedule(dynamic, 32)
+    for (int i = 0; i < n; i++)
+    {
+        ushort costs[MAX_DISPARITIES], back[MAX_DISPARITIES];
+        const int x = cvRound(keypoints[i].pt.x), y = cvRound(keypoints[i].pt.y);
+        const int x0 = x - rx, y0 = y - ry;
+        // candidate d puts the right block at x0 - d, which must stay in the image
+        const int nd = std::min(p.numDisparities, x0 + 1);
+        if (nd < 3)
+            continue;
+        const uchar* a = left.ptr<uchar>(y0) + x0;
+        const uchar* b = right.ptr<uchar>(y0) + x0;
+        blockCosts(a, left.step, b, right.step, p.blockRows, nd, -1, costs);
+        const int d = bestUnique(costs, nd, p.uniquenessRatio);
+        if (d <= 0 || d >= nd - 1 || costs[d] > maxCost)
+            continue;
+
+        // match the right block back along the left row
+        if (p.disp12MaxDiff >= 0)
+        {
+            const int xr0 = x0 - d;
+            const int nb = std::min(p.numDisparities, W - SPARSE_BLOCK_COLS - xr0 + 1);
+            blockCosts(right.ptr<uchar>(y0) + xr0, right.step, left.ptr<uchar>(y0) + xr0, left.step,
+                       p.blockRows, nb, 1, back);
+            int bestBack = 0;
+            for (int k = 1; k < nb; k++)
+            {
+                if (back[k] < back[bestBack])
+                    bestBack = k;
+            }
+            if (abs(bestBack - d) > p.disp12MaxDiff)
+                continue;
+        }
+
+        // parabola through the costs around the minimum
+        const int c0 = costs[d - 1], c1 = costs[d], c2 = costs[d + 1];
+        const int denom = c0 + c2 - 2*c1;
+        const float disparity = d + (denom > 0 ? 0.5f*(c0 - c2)/denom : 0.f);
+        if (disparity - dcx <= 0)
+            continue;
+
+        SparsePoint& sp = candidates[i];
+        sp.pt = keypoints[i].pt;
+        sp.disparity = disparity;
+        const double Z = fB/(disparity - dcx);
+        sp.X = Point3f((float)((sp.pt.x - cx)*Z/fx), (float)((sp.pt.y - cy)*Z/fy), (float)Z);
+        sp.response = keypoints[i].response;
+        computeDescriptor(left, x, y, tests, sp.descriptor);
+        matched[i] = 1;
+    }
+
+    points.clear();
+    for (int i = 0; i < n; i++)
+    {
+        if (matched[i])
+            points.push_back(candidates[i]);
+    }
+}
@@ -0,0 +1,72 @@
+/// sparse_stereo.hpp
+/// Sparse stereo for tracking: FAST corners of the left rectified image are matched along
+/// their row in the right image and triangulated with P1/P2 of stereoRectify.
+///
+/// Build with -mavx2 (x86) or on ARM with NEON to get the vectorized block matching.
+
+#ifndef SPARSE_STEREO_HPP
+#define SPARSE_STEREO_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+
+const int SPARSE_BLOCK_COLS = 16;       // width of the matching blocks
+const int SPARSE_DESCRIPTOR_BYTES = 32; // 256 binary tests
+
+struct SparseStereoParams
+{
+    int fastThreshold;      // FAST intensity threshold
+    int maxFeatures;        // the strongest corners are kept, at most 2*maxFeatures/cells per grid cell
+    int cellSize;           // pixels, grid spreading the corners over the image
+    int numDisparities;     // search range is [0, numDisparities)
+    int blockRows;          // height of the SPARSE_BLOCK_COLS wide matching blocks, odd, at most 15
+    int uniquenessRatio;    // percent by which the best cost must beat the others(outside +-1)
+    int maxMeanCost;        // matches with a larger mean absolute difference per pixel are dropped
+    int disp12MaxDiff;      // left-right check: pixels the match back from the right may differ by, < 0 disables
+
+    SparseStereoParams();
+};
+
+struct SparsePoint
+{
+    cv::Point2f pt;         // in the left rectified image
+    float disparity;        // pixels, subpixel
+    cv::Point3f X;          // in the left rectified camera frame, unit of the calibration
+    float response;         // FAST score
+    uchar descriptor[SPARSE_DESCRIPTOR_BYTES];  // BRIEF-like binary tests around pt, unrotated
+};
+
+struct SparseStereo
+{
+    SparseStereoParams params;
+
+    // working buffers
+    std::vector<cv::KeyPoint> keypoints;
+    std::vector<SparsePoint> candidates;
+    std::vector<uchar> matched;
+
+    SparseStereo(const SparseStereoParams& params = SparseStereoParams());
+
+    /// P1, P2: projection matrices of the rectified cameras saved by stereo_calib.
+    void setProjections(const cv::Mat& P1, const cv::Mat& P2);
+
+    /// left, right: rectified 8-bit grayscale images of the same size.
+    /// points: matched and triangulated corners, the others are dropped.
+    void compute(const cv::Mat& left, const cv::Mat& right, std::vector<SparsePoint>& points);
+
+private:
+    double fx, fy, cx, cy;  // left rectified camera
+    double fB;              // focal length times baseline, -P2(0,3): Z = fB/(d - dcx)
+    double dcx;             // cx1 - cx2, nonzero without CALIB_ZERO_DISPARITY
+};
+
+/// Hamming distance of two descriptors, to track points between frames.
+int descriptorDistance(const SparsePoint& a, const SparsePoint& b);
+
+/// SAD of the SPARSE_BLOCK_COLS x rows block at a(row step sa) against the n blocks at
+/// b + dir*k(row step sb), k = 0..n-1. rows is at most 15.
+void blockCosts(const uchar* a, size_t sa, const uchar* b, size_t sb, int rows, int n, int dir,
+                ushort* costs);
+
+#endif
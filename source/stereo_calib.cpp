@@ -17,6 +17,10 @@
 #include <stdio.h>
 #include <time.h>
 
+#include "calibration.hpp"
+#include "image_cache.hpp"
+#include "trace.hpp"
+
 using namespace cv;
 using namespace std;
 
@@ -35,6 +39,7 @@ bool useIndividualCalibResult = true;  // use individual calib result
 // individual calib result filenames
 string calibResultLFn("calib_result_l.xml");
 string calibResultRFn("calib_result_r.xml");
+string solver = "opencv";   // calibration solver: opencv, sparse(calib_solver.hpp) or compare
 //--------------------------------------------------
 // Global Variables
 //--------------------------------------------------
@@ -42,38 +47,30 @@ string imageListFn;             // image list filename
 string outputFn = "stereo_params.xml";
 vector<string> imageList;       // list of images
 vector<string> goodImageList;   // list of images in which corners are detected
+ImageCache imageCache;          // decoded once, ahead of the corner detection, for both passes
 //--------------------------------------------------
 // Function Declarations
 //--------------------------------------------------
 static void usage();
 static void argParsing(int argc, char** argv, string& imageListFn);
-static bool readStringList(const string& filename, vector<string>& l);
-static void calcBoardCornerPositions(const Size& boardSize, const float squareSize,
-        vector<vector<Point3f> >& corners);
 static void stereoCalib(const vector<string>& imageList, const Size& boardSize,
         bool showRectified=true);
 static int findCorners(const vector<string>& imageList,
         vector<vector<Point2f> > imagePoints[],
         Size& imageSize, int& nimages);
-static void computeReprojectionError(const vector<vector<Point2f> > imagePoints[],
-        const int nimages, const Mat cameraMatrix[], const Mat distCoeffs[], const Mat& F);
 static void mergeImages(Mat& canvas, const Size imageSize,
         const Mat& imgL, const Mat& imgR);
-static void saveStereoCalibResult(const string& outputFn, const Mat cameraMatrix[],
-        const Mat distCoeffs[], const Mat& R, const Mat& T, const Mat& E, const Mat& F,
-        const double rms);
-static void saveRectificationResult(const string& outputFn, Mat& R1, Mat& R2,
-        Mat& P1, Mat& P2, Mat& Q);
-static void rectify(Mat cameraMatrix[], Mat distCoeffs[], Size& imageSize,
-        const Mat& R, const Mat& T, const string& outputFn);
+static void displayRectified(const StereoParams& params, double alpha);
 //--------------------------------------------------
 
 int main(int argc, char** argv)
 {
+    traceFromEnv();
     argParsing(argc, argv, imageListFn);
 
     // Read image list. Exit if fails
     bool ok = readStringList(imageListFn, imageList);
+    imageCache.prefetch(imageList);
     if (!ok || imageList.empty())
     {
         cout << "Cannot open " << imageListFn << " or the string is empty. Exiting." << endl;
@@ -90,6 +87,9 @@ void usage()
     cout << "Usage:" << endl;
     cout << "\t./stereo_calib -w board_witdh -h board_height <image list XML/YML file>" << endl;
     cout << "\tdefault: ./stereo_calib -w 6 -h 5 stereo_calib.xml" << endl;
+    cout << "\t-nr: do not show the rectified images" << endl;
+    cout << "\t-solver opencv|sparse|compare: stereoCalibrate(default), the block-sparse solver for" << endl;
+    cout << "\t    large sets of views, or both with their times and differences" << endl;
 }
 
 void argParsing(int argc, char** argv, string& imageListFn)
@@ -104,7 +104,7 @@ void argParsing(int argc, char** argv, string& imageListFn)
                 return usage();
             }
         }
-        else if (string(argv[++i]) == "-h")
+        else if (string(argv[i]) == "-h")
         {
             if (sscanf(argv[++i], "%d", &boardSize.height) != 1 || boardSize.height <= 0)
             {
@@ -114,6 +114,15 @@ void argParsing(int argc, char** argv, string& imageListFn)
         }
         else if (string(argv[i]) == "-nr")
             showRectified = false;
+        else if (string(argv[i]) == "-solver" && i + 1 < argc)
+        {
+            solver = argv[++i];
+            if (solver != "opencv" && solver != "sparse" && solver != "compare")
+            {
+                cout << "Invalid solver " << solver << "!" << endl;
+                return usage();
+            }
+        }
         else if (argv[i][0] == '-')
         {
             cout << "Invalid option " << argv[i] << endl;
@@ -129,37 +138,6 @@ void argParsing(int argc, char** argv, string& imageListFn)
         imageListFn = "stereo_calib.xml";
 }
 
-bool readStringList(const string& filename, vector<string>& l)
-{
-    l.clear();
-    FileStorage fs(filename, FileStorage::READ);
-    if (!fs.isOpened())
-    {
-        cout << "Failed to open file " << filename << endl;
-        return false;
-    }
-    FileNode n = fs.getFirstTopLevelNode();
-    if (n.type() != FileNode::SEQ)
-    {
-        cout << "File content is not a sequence! FAIL" << endl;
-    }
-    FileNodeIterator it = n.begin(), it_end = n.end();
-    for ( ; it != it_end; it++)
-        l.push_back((string)*it);
-    return true;
-}
-
-// calculate the coordinates of board corners in world coord system
-void calcBoardCornerPositions(const Size& boardSize, const float squareSize, vector<vector<Point3f> >& corners)
-{
-    for (int n = 0; n < corners.size(); n++)
-    {
-        for (int i = 0; i < boardSize.height; i++)
-            for (int j = 0; j < boardSize.width; j++)
-                corners[n].push_back(Point3f(i*squareSize, j*squareSize, 0));
-    }
-}
-
 void stereoCalib(const vector<string>& imageList, const Size& boardSize, bool showRectified)
 {
     vector<vector<Point2f> > imagePoints[2];   // set of corners on each images in image coordinate
@@ -172,54 +150,91 @@ void stereoCalib(const vector<string>& imageList, const Size& boardSize, bool sh
     if (ret) return;
 
     //-------------------- 2.calc corners coords in world coord --------------------
-    objectPoints.resize(nimages);
-    calcBoardCornerPositions(boardSize, squareSize, objectPoints);
+    vector<Point3f> board;
+    calcBoardCornerPositions(boardSize, squareSize, board);
+    objectPoints.assign(nimages, board);
 
     //-------------------- 3.calibrate --------------------
     cout << "Running stereo calibration..." << endl;
 
-    Mat cameraMatrix[2], distCoeffs[2];
-    cameraMatrix[0] = Mat::eye(3, 3, CV_64F);
-    cameraMatrix[1] = Mat::eye(3, 3, CV_64F);
-    Mat R, T, E, F;
+    StereoParams params;
     int flag = 0;
     flag = CV_CALIB_FIX_ASPECT_RATIO + CV_CALIB_ZERO_TANGENT_DIST;
 
     if (useIndividualCalibResult)
     {
         flag = CV_CALIB_FIX_INTRINSIC;  // only R, T, E, and F are estimated
+        CameraParams single[2];
+        if (!loadCameraParams(calibResultLFn, single[0]) || !loadCameraParams(calibResultRFn, single[1]))
+        {
+            cout << "Cannot read the results of camera_calib " << calibResultLFn << " and "
+                 << calibResultRFn << ". Exiting." << endl;
+            return;
+        }
+        for (int k = 0; k < 2; k++)
+        {
+            // e.g. the cameras calibrated in a mode of higher resolution than the pairs
+            if (single[k].imageSize != Size() && single[k].imageSize != imageSize)
+                cout << "camera_calib calibrated camera " << k << " for " << single[k].imageSize.width << "x"
+                     << single[k].imageSize.height << " images, scaled to " << imageSize.width << "x"
+                     << imageSize.height << "." << endl;
+            CameraParams scaled;
+            scaleCameraParams(single[k], imageSize, scaled);
+            params.cameraMatrix[k] = scaled.cameraMatrix;
+            params.distCoeffs[k] = scaled.distCoeffs;
+        }
+    }
 
-        FileStorage fs(calibResultLFn, FileStorage::READ);
-        fs["cameraMatrix"] >> cameraMatrix[0];
-        fs["distCoeffs"]   >> distCoeffs[0];
-        fs.release();
+    if (solver == "sparse")
+        calibrateStereoPair(objectPoints, imagePoints[0], imagePoints[1], imageSize, flag, SOLVER_SPARSE, params);
+    else
+    {
+        // both solvers start from the same matrices
+        StereoParams sparse;
+        for (int k = 0; k < 2; k++)
+        {
+            sparse.cameraMatrix[k] = params.cameraMatrix[k].clone();
+            sparse.distCoeffs[k] = params.distCoeffs[k].clone();
+        }
+        int64 t = getTickCount();
+        calibrateStereoPair(objectPoints, imagePoints[0], imagePoints[1], imageSize, flag, SOLVER_OPENCV, params);
 
-        fs.open(calibResultRFn, FileStorage::READ);
-        fs["cameraMatrix"] >> cameraMatrix[1];
-        fs["distCoeffs"]   >> distCoeffs[1];
-        fs.release();
+        if (solver == "compare")
+        {
+            const double cvTime = (getTickCount() - t)*1000/getTickFrequency();
+            t = getTickCount();
+            calibrateStereoPair(objectPoints, imagePoints[0], imagePoints[1], imageSize, flag, SOLVER_SPARSE, sparse);
+            const double sparseTime = (getTickCount() - t)*1000/getTickFrequency();
+            cout << "stereoCalibrate():       " << cvTime << " ms, rms " << params.rms << endl;
+            cout << "stereoCalibrateSparse(): " << sparseTime << " ms, rms " << sparse.rms << endl;
+            cout << "cameraMatrix differences: " << norm(params.cameraMatrix[0], sparse.cameraMatrix[0], NORM_INF)
+                 << ", " << norm(params.cameraMatrix[1], sparse.cameraMatrix[1], NORM_INF)
+                 << "; R difference: " << norm(params.R, sparse.R, NORM_INF)
+                 << ", T difference: " << norm(params.T, sparse.T, NORM_INF) << endl;
+        }
     }
 
-    double rms = stereoCalibrate(objectPoints, imagePoints[0], imagePoints[1],
-            cameraMatrix[0], distCoeffs[0], cameraMatrix[1], distCoeffs[1],
-            imageSize, R, T, E, F,
-            TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 100, 1e-6),
-            flag);
-
-    cout << "Finished, with RMS error = " << rms << endl;
+    cout << "Finished, with RMS error = " << params.rms << endl;
 
     // check calibration quality
-    computeReprojectionError(imagePoints, nimages, cameraMatrix, distCoeffs, F);
+    cout << "average reprojection err = " << epipolarError(imagePoints[0], imagePoints[1], params) << endl;
 
-    // save intrinsic params
-    cout << "Saving stereo calibration result to " << outputFn << "...";
-    saveStereoCalibResult(outputFn, cameraMatrix, distCoeffs, R, T, E, F, rms);
-    cout << " Done." << endl;
+    //-------------------- 4.rectify, save, and display --------------------
+    // If alpha=0, the ROIs cover the whole images.
+    // Otherwise, they are likely to be smaller.
+    const double alpha = 1;
+    rectifyStereoPair(params, alpha);
+
+    cout << "Saving stereo calibration and rectification result to " << outputFn << "...";
+    if (saveStereoParams(outputFn, params))
+        cout << " Done." << endl;
+    else
+        cout << endl << "Failed to save stereo calibration result to file." << endl;
 
-    //-------------------- 4.rectify, display, and save --------------------
     destroyAllWindows();
     if (showRectified)
-        rectify(cameraMatrix, distCoeffs, imageSize, R, T, outputFn);
+        displayRectified(params, alpha);
+    imageCache.report();
 }
 
 int findCorners(const vector<string>& imageList, vector<vector<Point2f> > imagePoints[],
@@ -245,7 +260,8 @@ int findCorners(const vector<string>& imageList, vector<vector<Point2f> > imageP
         for (k = 0; k < 2; k++)
         {
             const string& filename = imageList[i*2+k];  // 'left01.jpg','right01.jpg','left02.jpg',...
-            Mat img = imread(filename, CV_LOAD_IMAGE_COLOR);
+            // (shared with the cache: the corners are drawn on a copy)
+            Mat img = imageCache.get(filename);
             if (img.empty())
                 break;
 
@@ -264,19 +280,14 @@ int findCorners(const vector<string>& imageList, vector<vector<Point2f> > imageP
             // This saves the effort to call vector::push_back().
             // (If the 2nd image is not good, npairs will not increase, imagePoints[k][npairs] will be assigned again)
             vector<Point2f>& corners = imagePoints[k][npairs];
-            bool found = findChessboardCorners(img, boardSize, corners,
-                    CV_CALIB_CB_ADAPTIVE_THRESH | CV_CALIB_CB_NORMALIZE_IMAGE);
+            // (refined to sub-pixel accuracy)
+            bool found = findBoardCorners(img, boardSize, corners);
             if (found)
             {
-                // improve the found corners' coordinate accuracy
-                Mat imageGray;
-                cvtColor(img, imageGray, CV_BGR2GRAY);
-                cornerSubPix(imageGray, corners, Size(11, 11), Size(-1, -1),
-                        TermCriteria(CV_TERMCRIT_EPS + CV_TERMCRIT_ITER, 30, 0.1));
-
                 // draw the corners on the image
                 if (displayCorners)
                 {
+                    img = img.clone();
                     drawChessboardCorners(img, boardSize, Mat(corners), found);
                     if (k == 0) imgL = img;
                     if (k == 1) imgR = img;
@@ -345,6 +356,7 @@ void mergeImages(Mat& canvas, const Size imageSize, const Mat& imgL, const Mat&
     Mat canvasL = canvas(Rect(0, 0, w, h));
     Mat canvasR = canvas(Rect(w, 0, w, h));
     // put two images in the window
+    TRACE_SCOPE("resize");
     resize(imgL, canvasL, canvasL.size(), 0, 0, CV_INTER_LINEAR);
     resize(imgR, canvasR, canvasR.size(), 0, 0, CV_INTER_LINEAR);
     // or:
@@ -352,126 +364,35 @@ void mergeImages(Mat& canvas, const Size imageSize, const Mat& imgL, const Mat&
     // imgR.copyTo(canvasR);
 }
 
-void computeReprojectionError(const vector<vector<Point2f> > imagePoints[],
-                              const int nimages, const Mat cameraMatrix[],
-                              const Mat distCoeffs[], const Mat& F)
-{
-    // because the output fundamental matrix implicitly includes all the output information,
-    // we can check the quality of calibration using the epipolar geometry constraint:
-    // m2^T*F*m1=0
-    double err = 0;
-    int npoints = 0;
-    vector<Vec3f> lines[2];
-    for (int i = 0; i < nimages; i++)
-    {
-        int npt = (int)imagePoints[0][i].size();
-        Mat imgpt[2];
-        for(int k = 0; k < 2; k++)
-        {
-            imgpt[k] = Mat(imagePoints[k][i]);
-            undistortPoints(imgpt[k], imgpt[k], cameraMatrix[k], distCoeffs[k], Mat(), cameraMatrix[k]);
-            computeCorrespondEpilines(imgpt[k], k+1, F, lines[k]);
-        }
-        for(int j = 0; j < npt; j++)
-        {
-            double errij = fabs(imagePoints[0][i][j].x*lines[1][j][0] +
-                                imagePoints[0][i][j].y*lines[1][j][1] + lines[1][j][2]) +
-                           fabs(imagePoints[1][i][j].x*lines[0][j][0] +
-                                imagePoints[1][i][j].y*lines[0][j][1] + lines[0][j][2]);
-            err += errij;
-        }
-        npoints += npt;
-    }
-    cout << "average reprojection err = " << err/npoints << endl;
-}
-
-void saveStereoCalibResult(const string& outputFn, const Mat cameraMatrix[],
-                           const Mat distCoeffs[], const Mat& R, const Mat& T,
-                           const Mat& E, const Mat& F, const double rms)
-{
-    FileStorage fs(outputFn, CV_STORAGE_WRITE);
-    if (fs.isOpened())
-    {
-        char buf[1024];
-        time_t tm;
-        time(&tm);
-        struct tm *t2 = localtime(&tm);
-        strftime(buf, sizeof(buf)-1, "%c", t2);
-
-        fs << "calibration_Time" << buf;
-
-        cvWriteComment(*fs, "Intrinsic params:\n", 0);
-        fs << "cameraMatrix1" << cameraMatrix[0] << "distCoeffs1" << distCoeffs[0]
-           << "cameraMatrix2" << cameraMatrix[1] << "distCoeffs2" << distCoeffs[1];
-        cvWriteComment(*fs, "Extrinsic params:\n", 0);
-        fs << "R" << R << "T" << T << "E" << E << "F" << F;
-        fs << "RMS" << rms;
-        fs.release();
-    }
-    else
-        cout << "Failed to save stereo calibration result to file." << endl;
-}
-
-void saveRectificationResult(const string& outputFn, Mat& R1, Mat& R2, Mat& P1, Mat& P2 , Mat& Q)
-{
-    FileStorage fs(outputFn, CV_STORAGE_APPEND);
-    if (fs.isOpened())
-    {
-        cvWriteComment(*fs, "\nRectification params:\n", 0);
-        fs << "R1" << R1 << "R2" << R2
-           << "P1" << P1 << "P2" << P2 << "Q" << Q;
-        fs.release();
-    }
-    else
-        cout << "Failed to save rectification result to file." << endl;
-}
-
-// rectify, display, and save extrinsic params
-void rectify(Mat cameraMatrix[], Mat distCoeffs[], Size& imageSize,
-             const Mat& R, const Mat& T, const string& outputFn)
+// display the rectified pairs with horizontal lines
+void displayRectified(const StereoParams& params, double alpha)
 {
-    Mat R1, R2, P1, P2, Q;
-    Rect validRoi[2];
-
-    // If alpha=0, the ROIs cover the whole images.
-    // Otherwise, they are likely to be smaller.
-    double alpha = 1;
-    stereoRectify(cameraMatrix[0], distCoeffs[0],
-            cameraMatrix[1], distCoeffs[1],
-            imageSize, R, T, R1, R2, P1, P2, Q,
-            CALIB_ZERO_DISPARITY, alpha, imageSize, &validRoi[0], &validRoi[1]);
-
-    cout << "Saving rectification result to " << outputFn << "...";
-    saveRectificationResult(outputFn, R1, R2, P1, P2, Q);
-    cout << " Done." << endl;
-
-    // compute and display rectification
     Mat map[2][2];
-    initUndistortRectifyMap(cameraMatrix[0], distCoeffs[0], R1, P1,
-                            imageSize, CV_16SC2, map[0][0], map[0][1]);
-    initUndistortRectifyMap(cameraMatrix[1], distCoeffs[1], R2, P2,
-                            imageSize, CV_16SC2, map[1][0], map[1][1]);
+    computeRectifyMaps(params, params.imageSize, map);
 
-    for (int i = 0; i < goodImageList.size(); i++)
+    for (int i = 0; i < (int)goodImageList.size()/2; i++)
     {
         int k;
         Mat imgL, imgR;
         for (k = 0; k < 2; k++)
         {
-            Mat img = imread(goodImageList[i*2+k], CV_LOAD_IMAGE_COLOR);
+            Mat img = imageCache.get(goodImageList[i*2+k]);
             Mat imgRectified;
-            remap(img, imgRectified, map[k][0], map[k][1], CV_INTER_LINEAR);
+            {
+                TRACE_SCOPE("remap");
+                remap(img, imgRectified, map[k][0], map[k][1], CV_INTER_LINEAR);
+            }
 
             // draw rectangle if alpha != 0(there are black areas after rectification)
             if (alpha != 0)
-                rectangle(imgRectified, validRoi[k], Scalar(0, 0, 255), 3, 8);
+                rectangle(imgRectified, params.validRoi[k], Scalar(0, 0, 255), 3, 8);
 
             if (k == 0) imgL = imgRectified;
             if (k == 1) imgR = imgRectified;
         }
 
         Mat canvas;
-        mergeImages(canvas, imageSize, imgL, imgR);
+        mergeImages(canvas, params.imageSize, imgL, imgR);
         // draw horizontal lines
         for (int j = 0; j < canvas.rows; j += 16)
             line(canvas, Point(0, j), Point(canvas.cols, j), Scalar(0, 255, 0), 1, 8);
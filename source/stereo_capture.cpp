@@ -0,0 +1,113 @@
+/// stereo_capture.cpp
+/// Capture of stereo pairs.
+///
+/// Ref:
+///     http://tuicool.com/articles/26fei2 (http://blog.csdn.net/dengtaocs/article/details/38065955)
+
+#include "stereo_capture.hpp"
+#include "calibration.hpp"
+#include "trace.hpp"
+
+#include <stdio.h>
+
+using namespace cv;
+using namespace std;
+
+// open a video file, or a camera if source is a number
+bool openVideo(const string& source, VideoCapture& cap)
+{
+    int id;
+    char c;
+    if (sscanf(source.c_str(), "%d%c", &id, &c) == 1)
+        cap.open(id);
+    else
+        cap.open(source);
+    return cap.isOpened();
+}
+
+StereoCapture::StereoCapture() :
+    pairs(0)
+{
+}
+
+bool StereoCapture::openCameras(int leftId)
+{
+    release();
+    bool ok[2];
+    #pragma omp parallel for
+    for (int k = 0; k < 2; k++)
+        ok[k] = cap[k].open(leftId + k);
+    return ok[0] && ok[1];
+}
+
+bool StereoCapture::openVideos(const string& left, const string& right)
+{
+    release();
+    return openVideo(left, cap[0]) && openVideo(right, cap[1]);
+}
+
+bool StereoCapture::openImageList(const string& filename)
+{
+    release();
+    return readStringList(filename, imageList) && imageList.size() >= 2;
+}
+
+bool StereoCapture::isOpened() const
+{
+    return (cap[0].isOpened() && cap[1].isOpened()) || !imageList.empty();
+}
+
+void StereoCapture::release()
+{
+    cap[0].release();
+    cap[1].release();
+    imageList.clear();
+    pairs = 0;
+    name.clear();
+}
+
+Size StereoCapture::frameSize() const
+{
+    if (!cap[0].isOpened())
+        return Size();
+    // VideoCapture::get is not const in OpenCV 2.4
+    VideoCapture& c = const_cast<VideoCapture&>(cap[0]);
+    return Size((int)c.get(CV_CAP_PROP_FRAME_WIDTH), (int)c.get(CV_CAP_PROP_FRAME_HEIGHT));
+}
+
+int StereoCapture::read(Mat frame[2], int flags)
+{
+    TRACE_SCOPE("StereoCapture::read");
+    if (cap[0].isOpened())
+    {
+        // grab both first: it only latches the frames, decoding takes longer. Camera k is always
+        // on thread k of the team, which may be pinned(affinity.hpp) and allocates its frames
+        bool grabbed[2];
+        #pragma omp parallel for num_threads(2) schedule(static)
+        for (int k = 0; k < 2; k++)
+            grabbed[k] = cap[k].grab();
+        if (!grabbed[0] || !grabbed[1])
+            return 0;
+        #pragma omp parallel for num_threads(2) schedule(static)
+        for (int k = 0; k < 2; k++)
+            cap[k].retrieve(frame[k]);
+        if (frame[0].empty() || frame[1].empty())
+            return 0;
+        char buf[32];
+        sprintf(buf, "frame %d", pairs + 1);
+        name = buf;
+    }
+    else
+    {
+        if (2*pairs + 1 >= (int)imageList.size())
+            return 0;
+        name = imageList[2*pairs];
+        frame[0] = imread(imageList[2*pairs], flags);
+        frame[1] = imread(imageList[2*pairs + 1], flags);
+    }
+    pairs++;
+
+    if (frame[0].empty() || frame[1].empty() || frame[0].size() != frame[1].size())
+        return -1;
+    return 1;
+}
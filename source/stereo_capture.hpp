@@ -0,0 +1,46 @@
+/// stereo_capture.hpp
+/// Stereo pairs from two cameras, two video files or an image list(left01, right01, ...).
+/// Both cameras are grabbed at once(OpenMP) and decoded afterwards, so the frames of a pair
+/// are as close in time as the drivers allow.
+
+#ifndef STEREO_CAPTURE_HPP
+#define STEREO_CAPTURE_HPP
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include <string>
+#include <vector>
+
+/// Opens a video file, or a camera if source is a number.
+bool openVideo(const std::string& source, cv::VideoCapture& cap);
+
+class StereoCapture
+{
+public:
+    cv::VideoCapture cap[2];
+    std::vector<std::string> imageList;
+    int pairs;                  // pairs read so far
+    std::string name;           // of the last pair: the left image, or "frame n"
+
+    StereoCapture();
+
+    /// The cameras leftId and leftId + 1.
+    bool openCameras(int leftId);
+    /// Two video files or camera IDs.
+    bool openVideos(const std::string& left, const std::string& right);
+    /// An xml/yaml image list as used by stereo_calib.
+    bool openImageList(const std::string& filename);
+    bool isOpened() const;
+    void release();
+
+    /// Size of the frames of the cameras or videos, Size() for image lists.
+    cv::Size frameSize() const;
+
+    /// Next pair. flags: imread flags of the image lists(videos are always color).
+    /// Returns 1 if read, 0 at the end of the input, -1 if an image of the list cannot be read
+    /// or the images differ in size: the pair should be skipped.
+    int read(cv::Mat frame[2], int flags = CV_LOAD_IMAGE_COLOR);
+};
+
+#endif
@@ -0,0 +1,802 @@
+/// stereo_match.cpp
+/// Compute disparity maps of stereo image pairs with BM or SGM.
+///
+/// Input: xml/yaml file containing image list(left01, right01, left02, ...) as used by stereo_calib,
+///        or the left and right videos(e.g. recorded by binocular_capture) or camera IDs,
+///        and the stereo parameters saved by stereo_calib(stereo_params.xml);
+/// Output: disparity maps are displayed, and saved as 16-bit png(with 8-bit confidence maps)
+///         if an output directory is given. With -cloud, the point cloud of every pair is
+///         reprojected with Q and streamed to binary PLY/PCD files or stdout. With -fuse, the
+///         clouds of all pairs are averaged in a voxel grid, saved at the end(or on key 'f').
+///         The rig is assumed static: there is no pose estimation, points of all pairs are fused
+///         in the left camera frame.
+///         With -record, the disparity maps are compressed losslessly into one stream file with
+///         a frame index(disp_codec.hpp), readable in any order with disp_stream.
+///         With -drift, the vertical disparity of a few features is checked on every pair, and a
+///         warning is printed(and logged with -driftlog) when the calibration drifts. With -refine,
+///         the rotation between the cameras is then estimated again from these features, the new
+///         rectification maps are computed in the following frames and swapped in, and the
+///         refined calibration is saved to stereo_params_refined.xml.
+///         With -sparse, only FAST corners are matched and triangulated instead of a dense map,
+///         their 3D points and descriptors are saved to the output directory(points01.yml, ...).
+///         With -compare, the time and accuracy of the chosen settings are reported against
+///         the full range search with the same matcher(e.g. to evaluate -levels or -temporal).
+///         The pairs need not be of the calibrated size: the calibration is scaled to theirs
+///         (calib_profile.hpp), e.g. to match reduced pairs(-decimate) of a full resolution rig.
+///
+/// Ref:
+///     opencv/samples/cpp/stereo_match.cpp
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include "calibration.hpp"
+#include "calib_profile.hpp"
+#include "image_cache.hpp"
+#include "stereo_capture.hpp"
+#include "disparity.hpp"
+#include "pointcloud.hpp"
+#include "voxel_fusion.hpp"
+#include "sparse_stereo.hpp"
+#include "disp_codec.hpp"
+#include "drift_monitor.hpp"
+#include "rectify_refine.hpp"
+#include "trace.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+
+using namespace cv;
+using namespace std;
+
+#define ESC_KEY 27
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+string stereoParamsFn = "stereo_params.xml";    // output of stereo_calib
+string imageListFn;             // image list filename
+string videoSource[2];          // left and right video files or camera IDs, used instead of the image list
+int decimation = 1;             // 1, 2, 4 or 8: match pairs reduced this many times, the calibration follows
+string outputDir;               // directory to save disparity maps, not saved if empty
+string cloudFn;                 // point cloud file, may contain %d for the frame number; "-" for stdout
+string fusedFn;                 // fused point cloud of all pairs, not fused if empty
+string recordFn;                // compressed disparity stream, not recorded if empty
+string driftLogFn;              // per frame drift state, not logged if empty
+bool driftMode = false;         // monitor the vertical disparity
+string intrinsicsFn[2];         // camera_calib results of the left and right cameras, for -refine
+bool refineMode = false;        // re-estimate R when the calibration drifts
+const string refinedParamsFn = "stereo_params_refined.xml";
+bool display = true;
+bool compareFullRange = false;  // also run the full range search and report the differences
+bool temporalMode = false;      // search around the disparity of the previous frame
+bool sparseMode = false;        // match corners only
+StereoMatchParams matchParams;
+TemporalParams temporalParams;
+FusionParams fusionParams;
+SparseStereoParams sparseParams;
+DriftParams driftParams;
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void usage();
+static bool argParsing(int argc, char** argv);
+static int readPair(VideoCapture cap[2], const vector<string>& imageList, int frame, Mat img[2],
+                    Mat& leftColor, string& name);
+static bool saveCloud(const Mat& disp, const Mat& color, const Mat& Q, int frame);
+static bool saveFusedCloud(const VoxelFusion& fusion);
+static void savePoints(const vector<SparsePoint>& points, int frame);
+static void showPoints(const vector<SparsePoint>& points, const Mat& imgL);
+static void showDisparity(const Mat& disp, const Mat& imgL);
+static void checkDrift(DriftMonitor& monitor, const Mat rect[2], const string& name, ofstream& log);
+static bool refineRectification(RectifyRefiner& refiner, DriftMonitor& monitor, Mat map[2][2], Mat P[2], Mat& Q);
+static void compareDisparity(const Mat& disp, const Mat& ref, int64& refValid, int64& agree, int64& lost, double& errorSum);
+//--------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    traceFromEnv();
+    if (!argParsing(argc, argv))
+        return -1;
+
+    vector<string> imageList;
+    VideoCapture cap[2];
+    bool video = !videoSource[0].empty();
+    if (video)
+    {
+        if (!openVideo(videoSource[0], cap[0]) || !openVideo(videoSource[1], cap[1]))
+        {
+            cout << "Failed to open " << videoSource[0] << " or " << videoSource[1] << endl;
+            return -1;
+        }
+    }
+    else if (!readStringList(imageListFn, imageList) || imageList.size() < 2)
+    {
+        cout << "Cannot open " << imageListFn << " or the list contains no image pair. Exiting." << endl;
+        return -1;
+    }
+
+    StereoMatcher matcher(matchParams);
+    TemporalStereoMatcher temporal(matchParams, temporalParams);
+    VoxelFusion fusion(fusionParams);
+    SparseStereo sparse(sparseParams);
+    DispStreamWriter recorder;
+    DriftMonitor monitor(driftParams);
+    RectifyRefiner refiner;
+    ofstream driftLog;
+    if (!driftLogFn.empty())
+    {
+        driftLog.open(driftLogFn.c_str());
+        if (!driftLog.is_open())
+        {
+            cout << "Cannot create " << driftLogFn << endl;
+            return -1;
+        }
+        driftLog << "# frame, matches, cells, residual, offset, average, trend(px/1000 frames), alarm" << endl;
+    }
+    Size imageSize;
+    CalibProfile profile;       // stereo_params.xml, scaled to the size of the pairs
+    Mat map[2][2];
+    Mat P[2], Q;                // projection matrices and reprojection matrix of the rectified pair
+
+    StereoMatchParams fullParams = matchParams;
+    fullParams.levels = 0;
+    StereoMatcher reference(fullParams);
+    double matchTime = 0, refTime = 0;  // ms, summed over all pairs
+    int64 refValid = 0, agree = 0, lost = 0;
+    double errorSum = 0;
+
+    for (int frame = 0; ; frame++)
+    {
+        Mat img[2], leftColor;
+        string name;
+        int ret = readPair(cap, imageList, frame, img, leftColor, name);
+        if (ret == 0)
+            break;
+        if (ret < 0)
+            continue;
+
+        // rectification maps depend on the image size, computed once per size of the pairs
+        if (imageSize != img[0].size())
+        {
+            imageSize = img[0].size();
+            if (profile.empty() && !profile.load(stereoParamsFn))
+            {
+                cout << "Cannot read the rectification result of stereo_calib from " << stereoParamsFn << endl;
+                return -1;
+            }
+            profile.report(imageSize);
+            profile.rectifyMaps(imageSize, map);
+            const StereoParams& rectified = profile.at(imageSize);
+            P[0] = rectified.P1;
+            P[1] = rectified.P2;
+            Q = rectified.Q;
+            sparse.setProjections(P[0], P[1]);
+            if (refineMode && !refiner.load(stereoParamsFn, intrinsicsFn, imageSize))
+            {
+                cout << "Cannot read the calibration from " << stereoParamsFn << ", " << intrinsicsFn[0]
+                     << " and " << intrinsicsFn[1] << endl;
+                return -1;
+            }
+            if ((!cloudFn.empty() || !fusedFn.empty()) && Q.empty())
+            {
+                cout << stereoParamsFn << " does not contain Q, cannot reproject." << endl;
+                return -1;
+            }
+        }
+
+        Mat rect[2], rectColor;
+        {
+            TRACE_SCOPE("remap");
+            for (int k = 0; k < 2; k++)
+                remap(img[k], rect[k], map[k][0], map[k][1], INTER_LINEAR);
+            if (!leftColor.empty())
+                remap(leftColor, rectColor, map[0][0], map[0][1], INTER_LINEAR);
+        }
+
+        if (driftMode)
+            checkDrift(monitor, rect, name, driftLog);
+        // the new maps are used from the next pair on
+        if (refineMode && refineRectification(refiner, monitor, map, P, Q))
+            sparse.setProjections(P[0], P[1]);
+
+        if (sparseMode)
+        {
+            vector<SparsePoint> points;
+            int64 t = getTickCount();
+            sparse.compute(rect[0], rect[1], points);
+            t = getTickCount() - t;
+            cout << name << ": " << t*1000/getTickFrequency() << " ms, " << points.size() << " points of "
+                 << sparse.keypoints.size() << " corners" << endl;
+            if (!outputDir.empty())
+                savePoints(points, frame);
+            if (display)
+            {
+                showPoints(points, rect[0]);
+                char key = (char)waitKey(video ? 1 : 0);
+                if (key == ESC_KEY || key == 'q' || key == 'Q')
+                    break;
+            }
+            continue;
+        }
+
+        Mat disp;
+        int64 t = getTickCount();
+        if (temporalMode)
+            temporal.compute(rect[0], rect[1], disp);
+        else
+            matcher.compute(rect[0], rect[1], disp);
+        t = getTickCount() - t;
+        cout << name << ": " << t*1000/getTickFrequency() << " ms, buffers "
+             << (temporalMode ? temporal.bufferSize() : matcher.bufferSize())/(1024*1024.) << " MB";
+        if (temporalMode && temporal.keyframe)
+            cout << ", keyframe";
+        else if (temporalMode)
+            cout << ", " << 100.*temporal.refreshedTiles/temporal.tiles << "% of the tiles searched again";
+        cout << endl;
+
+        if (compareFullRange)
+        {
+            Mat ref;
+            int64 tr = getTickCount();
+            reference.compute(rect[0], rect[1], ref);
+            tr = getTickCount() - tr;
+
+            int64 v = 0, a = 0, l = 0;
+            double e = 0;
+            compareDisparity(disp, ref, v, a, l, e);
+            cout << "\tfull range: " << tr*1000/getTickFrequency() << " ms, speedup " << (double)tr/t
+                 << ", agree " << 100.*a/max(v, (int64)1) << "%, lost " << 100.*l/max(v, (int64)1)
+                 << "%, mean error " << e/max(v - l, (int64)1) << " px" << endl;
+            matchTime += t*1000/getTickFrequency();
+            refTime += tr*1000/getTickFrequency();
+            refValid += v;
+            agree += a;
+            lost += l;
+            errorSum += e;
+        }
+
+        if (!outputDir.empty())
+        {
+            TRACE_SCOPE("imwrite");
+            char fn[256];
+            sprintf(fn, "%s/disp%02d.png", outputDir.c_str(), frame + 1);
+            imwrite(fn, disp);  // raw 16-bit values, divide by DISP_SCALE for pixels
+            sprintf(fn, "%s/conf%02d.png", outputDir.c_str(), frame + 1);
+            imwrite(fn, temporalMode ? temporal.matcher.confidence : matcher.confidence);
+        }
+
+        if (!cloudFn.empty() && !saveCloud(disp, rectColor, Q, frame))
+            return -1;
+
+        if (!recordFn.empty())
+        {
+            if (!recorder.isOpened() && !recorder.open(recordFn, disp.size()))
+            {
+                cout << "Cannot create " << recordFn << endl;
+                return -1;
+            }
+            // the frame number as timestamp keeps the maps aligned with the frames of the input videos
+            if (!recorder.write(disp, frame))
+            {
+                cout << "Cannot write to " << recordFn << endl;
+                return -1;
+            }
+        }
+
+        if (!fusedFn.empty())
+        {
+            int64 tf = getTickCount();
+            fusion.integrate(disp, rectColor, Q);
+            tf = getTickCount() - tf;
+            cout << "\tfused in " << tf*1000/getTickFrequency() << " ms, " << fusion.size() << " voxels, "
+                 << fusion.bufferSize()/(1024*1024.) << " MB" << endl;
+        }
+
+        if (display)
+        {
+            showDisparity(disp, rect[0]);
+            char key = (char)waitKey(video ? 1 : 0);     // videos play on, images wait for a key
+            if (key == ESC_KEY || key == 'q' || key == 'Q')
+                break;
+            if ((key == 'f' || key == 'F') && !fusedFn.empty())
+                saveFusedCloud(fusion);
+        }
+    }
+
+    if (!fusedFn.empty() && !saveFusedCloud(fusion))
+        return -1;
+
+    if (recorder.isOpened())
+    {
+        const int frames = recorder.frames();
+        const int64 raw = (int64)frames*imageSize.area()*sizeof(short);
+        if (!recorder.close())
+        {
+            cout << "Cannot write the index of " << recordFn << endl;
+            return -1;
+        }
+        cout << frames << " disparity maps recorded to " << recordFn << ": " << recorder.bytesWritten()/(1024*1024.)
+             << " MB, ratio " << (double)raw/max(recorder.bytesWritten(), (int64)1) << endl;
+    }
+
+    if (compareFullRange && refTime > 0)
+    {
+        cout << "Against the full range search: " << matchTime << " ms vs " << refTime << " ms(speedup "
+             << refTime/max(matchTime, 1e-3) << "), " << 100.*agree/max(refValid, (int64)1)
+             << "% of the valid disparities agree within 1 px, " << 100.*lost/max(refValid, (int64)1)
+             << "% are lost, mean error " << errorSum/max(refValid - lost, (int64)1) << " px" << endl;
+    }
+
+    return 0;
+}
+
+void usage()
+{
+    cout << "Usage:" << endl
+         << "\t./stereo_match [options] <image list XML/YML file>" << endl
+         << "\t./stereo_match [options] -video <left video|camera ID> <right video|camera ID>" << endl
+         << "\t-p <stereo_params.xml>: output of stereo_calib, default is 'stereo_params.xml';" << endl
+         << "\t    calibrated at another size than the pairs, it is scaled to theirs;" << endl
+         << "\t-decimate <1|2|4|8>: match the pairs reduced this many times, default is 1;" << endl
+         << "\t-m <bm|sgm>: matching mode, default is sgm;" << endl
+         << "\t-n <numDisparities>: search range, multiple of 16, default is 64;" << endl
+         << "\t-census <5x5|7x9>: match census codes instead of intensities(robust to exposure differences);" << endl
+         << "\t-b <blockSize>: odd matching window size, default is 9 for bm and 5 for sgm," << endl
+         << "\t                with census 5 for bm and 1 for sgm;" << endl
+         << "\t-paths <4|8>: number of SGM aggregation paths, default is 8;" << endl
+         << "\t-cost <8|16>: bits per stored matching cost, default is 8;" << endl
+         << "\t-lr <maxDiff>: left-right check tolerance in pixels, -1 disables, default is 1;" << endl
+         << "\t-speckle <size> <range>: remove regions smaller than size pixels whose disparities" << endl
+         << "\t                         differ by at most range pixels, size 0 disables, default is 100 2;" << endl
+         << "\t-levels <n>: coarse-to-fine on n half resolution levels, default is 0(full range search);" << endl
+         << "\t-temporal: search around the disparity of the previous frame, for videos;" << endl
+         << "\t-key <n>: with -temporal, frames between full searches, default is 30;" << endl
+         << "\t-compare: report time and accuracy against the full range search;" << endl
+         << "\t-o <dir>: save disparity maps to dir;" << endl
+         << "\t-cloud <file>: save colored point clouds, binary PLY or PCD(.pcd), %d in the name" << endl
+         << "\t               is replaced by the frame number, - streams PLY to stdout;" << endl
+         << "\t-fuse <file> <voxel size>: average the clouds of all pairs(static rig) in voxels of the" << endl
+         << "\t                           given size(unit of the calibration), saved as PLY or PCD;" << endl
+         << "\t-voxels <n>: with -fuse, most voxels kept, beyond it the least recently updated ones" << endl
+         << "\t             are dropped, default is 2000000;" << endl
+         << "\t-record <file>: record the disparity maps to a compressed stream with a frame index;" << endl
+         << "\t-drift <threshold>: warn when the vertical disparity of matched features exceeds threshold" << endl
+         << "\t                    pixels on average(e.g. 0.5), i.e. the calibration drifted;" << endl
+         << "\t-driftlog <file>: with -drift, log the drift state of every frame;" << endl
+         << "\t-refine <calib_result_l.xml> <calib_result_r.xml>: with -drift, re-estimate the rotation" << endl
+         << "\t          between the cameras when the calibration drifts, keeping these intrinsics;" << endl
+         << "\t-sparse: match and triangulate FAST corners only, for tracking;" << endl
+         << "\t-nd: do not display." << endl;
+}
+
+bool argParsing(int argc, char** argv)
+{
+    int blockSize = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-p" && hasValue)
+            stereoParamsFn = argv[++i];
+        else if (arg == "-decimate" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &decimation) != 1 ||
+                (decimation != 1 && decimation != 2 && decimation != 4 && decimation != 8))
+            {
+                cout << "The decimation must be 1, 2, 4 or 8!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-m" && hasValue)
+        {
+            string mode = argv[++i];
+            if (mode == "bm")
+                matchParams.mode = MATCH_BM;
+            else if (mode == "sgm")
+                matchParams.mode = MATCH_SGM;
+            else
+            {
+                cout << "Invalid matching mode " << mode << endl;
+                usage();
+                return false;
+            }
+        }
+        else if (arg == "-census" && hasValue)
+        {
+            string size = argv[++i];
+            if (size == "5x5")
+                matchParams.cost = COST_CENSUS_5X5;
+            else if (size == "7x9")
+                matchParams.cost = COST_CENSUS_7X9;
+            else
+            {
+                cout << "Invalid census window " << size << endl;
+                usage();
+                return false;
+            }
+        }
+        else if (arg == "-n" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &matchParams.numDisparities) != 1 ||
+                matchParams.numDisparities <= 0 || matchParams.numDisparities % 16 != 0)
+            {
+                cout << "The number of disparities must be a positive multiple of 16!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-b" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &blockSize) != 1 || blockSize < 1 || blockSize > 15 || blockSize % 2 == 0)
+            {
+                cout << "The block size must be odd and between 1 and 15!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-paths" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &matchParams.paths) != 1 ||
+                (matchParams.paths != 4 && matchParams.paths != 8))
+            {
+                cout << "The number of paths must be 4 or 8!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-cost" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &matchParams.costBits) != 1 ||
+                (matchParams.costBits != 8 && matchParams.costBits != 16))
+            {
+                cout << "The cost size must be 8 or 16 bits!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-lr" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &matchParams.disp12MaxDiff) != 1)
+            {
+                cout << "Invalid left-right check tolerance!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-speckle" && i + 2 < argc)
+        {
+            if (sscanf(argv[++i], "%d", &matchParams.speckleWindowSize) != 1 ||
+                sscanf(argv[++i], "%d", &matchParams.speckleRange) != 1 ||
+                matchParams.speckleWindowSize < 0 || matchParams.speckleRange < 0)
+            {
+                cout << "The speckle size and range must not be negative!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-levels" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &matchParams.levels) != 1 || matchParams.levels < 0 || matchParams.levels > 4)
+            {
+                cout << "The number of levels must be between 0 and 4!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-compare")
+            compareFullRange = true;
+        else if (arg == "-temporal")
+            temporalMode = true;
+        else if (arg == "-key" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &temporalParams.keyframeInterval) != 1 || temporalParams.keyframeInterval < 1)
+            {
+                cout << "The keyframe interval must be positive!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-video" && i + 2 < argc)
+        {
+            videoSource[0] = argv[++i];
+            videoSource[1] = argv[++i];
+        }
+        else if (arg == "-o" && hasValue)
+            outputDir = argv[++i];
+        else if (arg == "-cloud" && hasValue)
+            cloudFn = argv[++i];
+        else if (arg == "-fuse" && i + 2 < argc)
+        {
+            fusedFn = argv[++i];
+            if (sscanf(argv[++i], "%f", &fusionParams.voxelSize) != 1 || fusionParams.voxelSize <= 0)
+            {
+                cout << "The voxel size must be positive!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-voxels" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &fusionParams.maxVoxels) != 1 || fusionParams.maxVoxels < 1)
+            {
+                cout << "The number of voxels must be positive!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-record" && hasValue)
+            recordFn = argv[++i];
+        else if (arg == "-drift" && hasValue)
+        {
+            driftMode = true;
+            if (sscanf(argv[++i], "%f", &driftParams.threshold) != 1 || driftParams.threshold <= 0)
+            {
+                cout << "The drift threshold must be positive!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-driftlog" && hasValue)
+            driftLogFn = argv[++i];
+        else if (arg == "-refine" && i + 2 < argc)
+        {
+            refineMode = true;
+            intrinsicsFn[0] = argv[++i];
+            intrinsicsFn[1] = argv[++i];
+        }
+        else if (arg == "-sparse")
+            sparseMode = true;
+        else if (arg == "-nd")
+            display = false;
+        else if (arg[0] == '-')
+        {
+            cout << "Invalid option " << arg << endl;
+            usage();
+            return false;
+        }
+        else
+            imageListFn = arg;
+    }
+
+    if (sparseMode && (temporalMode || compareFullRange || !cloudFn.empty() || !fusedFn.empty() || !recordFn.empty()))
+    {
+        cout << "-sparse cannot be combined with -temporal, -compare, -cloud, -fuse or -record!" << endl;
+        return false;
+    }
+    sparseParams.numDisparities = matchParams.numDisparities;
+    driftParams.numDisparities = min(matchParams.numDisparities, 256);
+    if ((!driftLogFn.empty() || refineMode) && !driftMode)
+    {
+        cout << "-driftlog and -refine need -drift!" << endl;
+        return false;
+    }
+
+    if (blockSize)
+        matchParams.blockSize = blockSize;
+    else if (matchParams.cost == COST_SAD)
+        matchParams.blockSize = matchParams.mode == MATCH_BM ? 9 : 5;
+    else    // the census window already covers the neighbourhood
+        matchParams.blockSize = matchParams.mode == MATCH_BM ? 5 : 1;
+
+    if (imageListFn.empty())
+        imageListFn = "stereo_calib.xml";
+    // stdout carries the point clouds, messages go to stderr
+    if (cloudFn == "-")
+        cout.rdbuf(cerr.rdbuf());
+    return true;
+}
+
+// grayscale pair number 'frame' of the videos, or of the image list if no video is open.
+// leftColor: the color left image if there is one and point clouds are saved or fused.
+// Returns 1 if read, 0 at the end of the input, -1 if this pair has to be skipped.
+int readPair(VideoCapture cap[2], const vector<string>& imageList, int frame, Mat img[2],
+             Mat& leftColor, string& name)
+{
+    TRACE_SCOPE("readPair");
+    if (cap[0].isOpened())
+    {
+        cap[0] >> img[0];
+        cap[1] >> img[1];
+        if (img[0].empty() || img[1].empty())
+            return 0;
+        for (int k = 0; decimation > 1 && k < 2; k++)
+            resize(img[k], img[k], Size(), 1./decimation, 1./decimation, INTER_AREA);
+        char buf[32];
+        sprintf(buf, "frame %d", frame + 1);
+        name = buf;
+    }
+    else
+    {
+        if (2*frame + 1 >= (int)imageList.size())
+            return 0;
+        name = imageList[2*frame];
+        bool color = !cloudFn.empty() || !fusedFn.empty();
+        img[0] = loadImage(imageList[2*frame], color ? CV_LOAD_IMAGE_COLOR : CV_LOAD_IMAGE_GRAYSCALE, decimation);
+        img[1] = loadImage(imageList[2*frame + 1], CV_LOAD_IMAGE_GRAYSCALE, decimation);
+    }
+
+    if (img[0].empty() || img[1].empty() || img[0].size() != img[1].size())
+    {
+        cout << "Cannot read the pair " << name << ". Skipping." << endl;
+        return -1;
+    }
+
+    for (int k = 0; k < 2; k++)
+    {
+        if (img[k].channels() != 3)
+            continue;
+        if (k == 0 && (!cloudFn.empty() || !fusedFn.empty()))
+            leftColor = img[0];
+        Mat gray;
+        cvtColor(img[k], gray, CV_BGR2GRAY);
+        img[k] = gray;
+    }
+    return 1;
+}
+
+// stream the point cloud of a frame to cloudFn
+bool saveCloud(const Mat& disp, const Mat& color, const Mat& Q, int frame)
+{
+    const bool toStdout = cloudFn == "-";
+    char fn[256];
+    snprintf(fn, sizeof(fn), cloudFn.c_str(), frame + 1);
+    const string name = fn;
+    const bool pcd = name.size() > 4 && name.compare(name.size() - 4, 4, ".pcd") == 0;
+
+    FILE* f = toStdout ? stdout : fopen(fn, "wb");
+    if (!f)
+    {
+        cout << "Cannot open " << fn << " for writing!" << endl;
+        return false;
+    }
+    bool ok = writePointCloud(f, pcd ? CLOUD_PCD : CLOUD_PLY, disp, color, Q);
+    if (!toStdout)
+        ok = fclose(f) == 0 && ok;
+    if (!ok)
+        cout << "Failed to write the point cloud to " << (toStdout ? "stdout" : fn) << endl;
+    return ok;
+}
+
+// write the fused cloud to fusedFn
+bool saveFusedCloud(const VoxelFusion& fusion)
+{
+    const bool pcd = fusedFn.size() > 4 && fusedFn.compare(fusedFn.size() - 4, 4, ".pcd") == 0;
+    FILE* f = fopen(fusedFn.c_str(), "wb");
+    bool ok = f && fusion.writeCloud(f, pcd ? CLOUD_PCD : CLOUD_PLY);
+    if (f)
+        ok = fclose(f) == 0 && ok;
+    if (ok)
+        cout << "Fused cloud of " << fusion.size() << " voxels saved to " << fusedFn << endl;
+    else
+        cout << "Failed to write the fused cloud to " << fusedFn << endl;
+    return ok;
+}
+
+// display the disparity next to the rectified left image
+void showDisparity(const Mat& disp, const Mat& imgL)
+{
+    Mat disp8;
+    disp.convertTo(disp8, CV_8U, 255./(matchParams.numDisparities*DISP_SCALE));
+    imshow("left", imgL);
+    imshow("disparity", disp8);
+}
+
+// check the calibration on a rectified pair, warn when the alarm changes
+void checkDrift(DriftMonitor& monitor, const Mat rect[2], const string& name, ofstream& log)
+{
+    const DriftState& s = monitor.process(rect[0], rect[1]);
+    if (s.changed && s.alarm)
+        cout << name << ": WARNING: calibration drift, vertical disparity " << s.average << " px(threshold "
+             << driftParams.threshold << "), offset " << s.offset << " px, trend " << s.trend
+             << " px per 1000 frames. Run stereo_calib again." << endl;
+    else if (s.changed)
+        cout << name << ": vertical disparity back to " << s.average << " px" << endl;
+    if (log.is_open())
+        log << s.frame << ", " << s.matches << ", " << s.cells << ", " << s.residual << ", " << s.offset << ", "
+            << s.average << ", " << s.trend << ", " << s.alarm << endl;
+}
+
+// Re-estimate R from the matches of the monitor while it raises the alarm, and compute the maps
+// of the new rectification a band per frame. Returns true when map, P and Q were replaced.
+bool refineRectification(RectifyRefiner& refiner, DriftMonitor& monitor, Mat map[2][2], Mat P[2], Mat& Q)
+{
+    if (refiner.updating())
+    {
+        if (!refiner.updateMaps(map, P, Q))
+            return false;
+        monitor.reset();    // residuals of the old maps
+        cout << "Rectification maps of the refined calibration swapped in";
+        if (refiner.save(refinedParamsFn))
+            cout << ", saved to " << refinedParamsFn;
+        cout << endl;
+        return true;
+    }
+
+    // matches of before the drift describe the old rotation
+    if (monitor.state.changed && monitor.state.alarm)
+        refiner.clearMatches();
+    if (!monitor.state.alarm)
+        return false;
+    refiner.addMatches(monitor.matches);
+    if (refiner.matches() < refiner.params.minMatches)
+        return false;
+
+    int64 t = getTickCount();
+    const int n = refiner.matches();
+    bool ok = refiner.solve();
+    t = getTickCount() - t;
+    if (ok)
+        cout << "R re-estimated from " << n << " matches in " << t*1000/getTickFrequency() << " ms: rotated by "
+             << refiner.rotationChange << " deg, Sampson error " << refiner.rmsBefore << " -> "
+             << refiner.rmsAfter << " px. Computing the new maps..." << endl;
+    else
+        cout << "Cannot re-estimate R from " << n << " matches(Sampson error " << refiner.rmsBefore
+             << " px), collecting new ones." << endl;
+    refiner.clearMatches();
+    return false;
+}
+
+// save the points of a frame: 3D points(Nx3), pixel and disparity(Nx3), descriptors(Nx32 bytes)
+void savePoints(const vector<SparsePoint>& points, int frame)
+{
+    const int n = (int)points.size();
+    Mat X(n, 3, CV_32F), pixels(n, 3, CV_32F), descriptors(n, SPARSE_DESCRIPTOR_BYTES, CV_8U);
+    for (int i = 0; i < n; i++)
+    {
+        const SparsePoint& p = points[i];
+        float* x = X.ptr<float>(i);
+        float* px = pixels.ptr<float>(i);
+        x[0] = p.X.x;
+        x[1] = p.X.y;
+        x[2] = p.X.z;
+        px[0] = p.pt.x;
+        px[1] = p.pt.y;
+        px[2] = p.disparity;
+        memcpy(descriptors.ptr<uchar>(i), p.descriptor, SPARSE_DESCRIPTOR_BYTES);
+    }
+
+    char fn[256];
+    sprintf(fn, "%s/points%02d.yml", outputDir.c_str(), frame + 1);
+    FileStorage fs(fn, FileStorage::WRITE);
+    if (!fs.isOpened())
+    {
+        cout << "Cannot open " << fn << " for writing!" << endl;
+        return;
+    }
+    fs << "points" << X << "pixels" << pixels << "descriptors" << descriptors;
+}
+
+// draw the points on the rectified left image, near ones red, far ones blue
+void showPoints(const vector<SparsePoint>& points, const Mat& imgL)
+{
+    Mat canvas;
+    cvtColor(imgL, canvas, CV_GRAY2BGR);
+    const float maxDisp = (float)sparseParams.numDisparities;
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        int v = saturate_cast<int>(255*points[i].disparity/maxDisp);
+        circle(canvas, points[i].pt, 3, Scalar(255 - v, 0, v), -1);
+    }
+    imshow("left", canvas);
+}
+
+// Of the pixels valid in ref: how many are within 1 px in disp(agree), invalid in disp(lost),
+// and the summed absolute difference in pixels of those valid in both.
+void compareDisparity(const Mat& disp, const Mat& ref, int64& refValid, int64& agree, int64& lost, double& errorSum)
+{
+    for (int y = 0; y < ref.rows; y++)
+    {
+        const short* d = disp.ptr<short>(y);
+        const short* r = ref.ptr<short>(y);
+        for (int x = 0; x < ref.cols; x++)
+        {
+            if (r[x] < 0)
+                continue;
+            refValid++;
+            if (d[x] < 0)
+            {
+                lost++;
+                continue;
+            }
+            int diff = abs(d[x] - r[x]);
+            if (diff <= DISP_SCALE)
+                agree++;
+            errorSum += (double)diff/DISP_SCALE;
+        }
+    }
+}
@@ -0,0 +1,587 @@
+/// stereo_pipeline.cpp
+/// Compute disparity maps of stereo video with the stages of stereo_match running
+/// concurrently(pipeline.hpp): capture -> rectify -> match -> post -> sinks.
+///
+/// Input: the left and right videos(e.g. recorded by binocular_capture) or camera IDs, or an
+///        xml/yaml image list(left01, right01, left02, ...) as used by stereo_calib,
+///        and the stereo parameters saved by stereo_calib(stereo_params.xml);
+/// Output: the disparity maps are displayed, saved as 16-bit png(-o), recorded to a compressed
+///         stream(-record) and/or reprojected to point clouds(-cloud), as in stereo_match.
+///         At the end the throughput, latency and the timing of every stage are printed.
+///         Every stage has its own thread, frames move between them through bounded queues.
+///         By default no frame is dropped, except by the display which always shows the newest
+///         map; with cameras, -policy match newest keeps the capture from waiting for the matcher.
+///         -affinity pins the stage threads to cores or NUMA nodes, optionally with SCHED_FIFO.
+///
+/// Ref:
+///     opencv/samples/cpp/stereo_match.cpp
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/calib3d/calib3d.hpp"
+
+#include "pipeline.hpp"
+#include "affinity.hpp"
+#include "calibration.hpp"
+#include "calib_profile.hpp"
+#include "stereo_capture.hpp"
+#include "disparity.hpp"
+#include "pointcloud.hpp"
+#include "disp_codec.hpp"
+#include "trace.hpp"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+
+using namespace cv;
+using namespace std;
+
+#define ESC_KEY 27
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+string stereoParamsFn = "stereo_params.xml";    // output of stereo_calib
+string imageListFn;             // image list filename
+string videoSource[2];          // left and right video files or camera IDs, used instead of the image list
+string outputDir;               // directory to save disparity maps, not saved if empty
+string cloudFn;                 // point cloud file, may contain %d for the frame number; "-" for stdout
+string recordFn;                // compressed disparity stream, not recorded if empty
+bool display = true;
+bool temporalMode = false;      // search around the disparity of the previous frame
+bool threaded = true;           // false: all stages in turn on one thread, for comparison
+int queueCapacity = 2;          // frames each queue holds
+StereoMatchParams matchParams;
+AffinityConfig affinity;        // placement of the stage threads, affinity.hpp
+
+const int STAGES = 7;
+const char* stageNames[STAGES] = {"capture", "rectify", "match", "post", "record", "cloud", "display"};
+int policies[STAGES] = {DROP_NONE, DROP_NONE, DROP_NONE, DROP_NONE, DROP_NONE, DROP_NONE, DROP_OLDEST};
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void usage();
+static bool argParsing(int argc, char** argv);
+//--------------------------------------------------
+// Stages
+//--------------------------------------------------
+// reads the pairs, converts them to grayscale(keeps the left color image for the clouds)
+class CaptureStage : public PipelineStage
+{
+public:
+    VideoCapture cap[2];
+    vector<string> imageList;
+    int next;   // pair of the image list
+
+    CaptureStage() : next(0) {}
+    bool open();
+    bool process(PipelineFrame& f);
+};
+
+// remaps the pair with the maps of the first pair size
+class RectifyStage : public PipelineStage
+{
+public:
+    Pipeline& pipeline;
+    Size imageSize;
+    CalibProfile profile;       // stereo_params.xml, scaled to the size of the pairs
+    Mat map[2][2];
+    Mat Q;
+    bool failed;
+
+    RectifyStage(Pipeline& p) : pipeline(p), failed(false) {}
+    bool process(PipelineFrame& f);
+};
+
+class MatchStage : public PipelineStage
+{
+public:
+    StereoMatcher matcher;
+    TemporalStereoMatcher temporal;
+
+    MatchStage() : matcher(matchParams), temporal(matchParams) {}
+    bool process(PipelineFrame& f);
+};
+
+// 8-bit view of the disparity, invalid pixels black
+class PostStage : public PipelineStage
+{
+public:
+    bool process(PipelineFrame& f);
+};
+
+// disparity png files and/or the compressed stream
+class RecordStage : public PipelineStage
+{
+public:
+    Pipeline& pipeline;
+    DispStreamWriter recorder;
+    bool failed;
+
+    RecordStage(Pipeline& p) : pipeline(p), failed(false) {}
+    bool process(PipelineFrame& f);
+    void finish();
+};
+
+class CloudStage : public PipelineStage
+{
+public:
+    Pipeline& pipeline;
+    const RectifyStage& rectify;    // Q, read once the first frame is rectified
+    bool failed;
+
+    CloudStage(Pipeline& p, const RectifyStage& r) : pipeline(p), rectify(r), failed(false) {}
+    bool process(PipelineFrame& f);
+};
+
+class DisplayStage : public PipelineStage
+{
+public:
+    Pipeline& pipeline;
+
+    DisplayStage(Pipeline& p) : pipeline(p) {}
+    bool process(PipelineFrame& f);
+    void finish();
+};
+//--------------------------------------------------
+
+int main(int argc, char** argv)
+{
+    traceFromEnv();
+    if (!argParsing(argc, argv))
+        return -1;
+
+    Pipeline pipeline;
+    CaptureStage capture;
+    RectifyStage rectify(pipeline);
+    MatchStage match;
+    PostStage post;
+    RecordStage record(pipeline);
+    CloudStage cloud(pipeline, rectify);
+    DisplayStage show(pipeline);
+    if (!capture.open())
+        return -1;
+
+    // the sinks that are off are left out of the chain, the display comes last so that
+    // its drop policy does not take frames from the other sinks
+    PipelineStage* stages[STAGES] = {&capture, &rectify, &match, &post, &record, &cloud, &show};
+    const bool used[STAGES] = {true, true, true, display, !outputDir.empty() || !recordFn.empty(),
+                               !cloudFn.empty(), display};
+    for (int i = 0; i < STAGES; i++)
+        if (used[i])
+            pipeline.add(stageNames[i], stages[i], policies[i], queueCapacity);
+
+    if (!affinity.empty())
+    {
+        CpuTopology topology;
+        readTopology(topology);
+        reportTopology(cout, topology, affinity);
+        pipeline.setAffinity(&affinity);
+    }
+    pipeline.run(threaded);
+    pipeline.report();
+
+    if (record.recorder.isOpened())
+    {
+        const int frames = record.recorder.frames();
+        const int64 bytes = record.recorder.bytesWritten();
+        if (!record.recorder.close())
+        {
+            cout << "Cannot write the index of " << recordFn << endl;
+            return -1;
+        }
+        cout << frames << " disparity maps recorded to " << recordFn << ": " << bytes/(1024*1024.) << " MB" << endl;
+    }
+    return rectify.failed || record.failed || cloud.failed ? -1 : 0;
+}
+
+bool CaptureStage::open()
+{
+    if (!videoSource[0].empty())
+    {
+        if (openVideo(videoSource[0], cap[0]) && openVideo(videoSource[1], cap[1]))
+            return true;
+        cout << "Failed to open " << videoSource[0] << " or " << videoSource[1] << endl;
+        return false;
+    }
+    if (!readStringList(imageListFn, imageList) || imageList.size() < 2)
+    {
+        cout << "Cannot open " << imageListFn << " or the list contains no image pair. Exiting." << endl;
+        return false;
+    }
+    return true;
+}
+
+bool CaptureStage::process(PipelineFrame& f)
+{
+    const bool color = !cloudFn.empty();
+    Mat img[2];
+    for (;;)
+    {
+        if (cap[0].isOpened())
+        {
+            cap[0] >> img[0];
+            cap[1] >> img[1];
+            if (img[0].empty() || img[1].empty())
+                return false;
+            char buf[32];
+            sprintf(buf, "frame %d", f.index + 1);
+            f.name = buf;
+        }
+        else
+        {
+            if (2*next + 1 >= (int)imageList.size())
+                return false;
+            f.name = imageList[2*next];
+            img[0] = imread(imageList[2*next], color ? CV_LOAD_IMAGE_COLOR : CV_LOAD_IMAGE_GRAYSCALE);
+            img[1] = imread(imageList[2*next + 1], CV_LOAD_IMAGE_GRAYSCALE);
+            next++;
+        }
+        if (!img[0].empty() && !img[1].empty() && img[0].size() == img[1].size())
+            break;
+        cout << "Cannot read the pair " << f.name << ". Skipping." << endl;
+    }
+
+    for (int k = 0; k < 2; k++)
+    {
+        if (img[k].channels() != 3)
+        {
+            f.img[k] = img[k];
+            continue;
+        }
+        if (k == 0 && color)
+            f.color = img[0];
+        cvtColor(img[k], f.img[k], CV_BGR2GRAY);
+    }
+    return true;
+}
+
+bool RectifyStage::process(PipelineFrame& f)
+{
+    // rectification maps depend on the image size, compute them with the first pair
+    if (imageSize != f.img[0].size())
+    {
+        if (!imageSize.area())
+        {
+            failed = !profile.load(stereoParamsFn);
+            if (failed)
+                cout << "Cannot read the rectification result of stereo_calib from " << stereoParamsFn << endl;
+            else
+            {
+                profile.report(f.img[0].size());
+                profile.rectifyMaps(f.img[0].size(), map);
+                Q = profile.at(f.img[0].size()).Q;
+            }
+        }
+        else
+        {
+            cout << "The pair " << f.name << " has different size from the first pair. Skipping." << endl;
+            return false;
+        }
+        if (!failed && !cloudFn.empty() && Q.empty())
+        {
+            cout << stereoParamsFn << " does not contain Q, cannot reproject." << endl;
+            failed = true;
+        }
+        if (failed)
+        {
+            pipeline.stop();
+            return false;
+        }
+        imageSize = f.img[0].size();
+    }
+
+    TRACE_SCOPE("remap");
+    for (int k = 0; k < 2; k++)
+    {
+        Mat rect;
+        remap(f.img[k], rect, map[k][0], map[k][1], INTER_LINEAR);
+        f.img[k] = rect;
+    }
+    if (!f.color.empty())
+    {
+        Mat rect;
+        remap(f.color, rect, map[0][0], map[0][1], INTER_LINEAR);
+        f.color = rect;
+    }
+    return true;
+}
+
+bool MatchStage::process(PipelineFrame& f)
+{
+    // the matchers reuse their confidence map, the frame gets its own copy
+    if (temporalMode)
+    {
+        temporal.compute(f.img[0], f.img[1], f.disp);
+        f.confidence = temporal.matcher.confidence.clone();
+    }
+    else
+    {
+        matcher.compute(f.img[0], f.img[1], f.disp);
+        f.confidence = matcher.confidence.clone();
+    }
+    return true;
+}
+
+bool PostStage::process(PipelineFrame& f)
+{
+    // DISP_INVALID is negative and saturates to 0
+    f.disp.convertTo(f.view, CV_8U, 255./(matchParams.numDisparities*DISP_SCALE));
+    return true;
+}
+
+bool RecordStage::process(PipelineFrame& f)
+{
+    if (!outputDir.empty())
+    {
+        TRACE_SCOPE("imwrite");
+        char fn[256];
+        sprintf(fn, "%s/disp%02d.png", outputDir.c_str(), f.index + 1);
+        bool ok = imwrite(fn, f.disp);  // raw 16-bit values, divide by DISP_SCALE for pixels
+        sprintf(fn, "%s/conf%02d.png", outputDir.c_str(), f.index + 1);
+        if (!ok || !imwrite(fn, f.confidence))
+        {
+            cout << "Cannot write the maps of " << f.name << " to " << outputDir << endl;
+            failed = true;
+        }
+    }
+
+    if (!recordFn.empty() && !failed)
+    {
+        if (!recorder.isOpened() && !recorder.open(recordFn, f.disp.size()))
+        {
+            cout << "Cannot create " << recordFn << endl;
+            failed = true;
+        }
+        // the frame number as timestamp keeps the maps aligned with the frames of the input videos
+        else if (!recorder.write(f.disp, f.index))
+        {
+            cout << "Cannot write to " << recordFn << endl;
+            failed = true;
+        }
+    }
+
+    if (failed)
+        pipeline.stop();
+    return !failed;
+}
+
+void RecordStage::finish()
+{
+    if (failed && recorder.isOpened())
+        recorder.close();
+}
+
+// stream the point cloud of a frame to cloudFn
+bool CloudStage::process(PipelineFrame& f)
+{
+    const bool toStdout = cloudFn == "-";
+    char fn[256];
+    snprintf(fn, sizeof(fn), cloudFn.c_str(), f.index + 1);
+    const string name = fn;
+    const bool pcd = name.size() > 4 && name.compare(name.size() - 4, 4, ".pcd") == 0;
+
+    FILE* file = toStdout ? stdout : fopen(fn, "wb");
+    bool ok = file != 0;
+    if (file)
+    {
+        ok = writePointCloud(file, pcd ? CLOUD_PCD : CLOUD_PLY, f.disp, f.color, rectify.Q);
+        if (!toStdout)
+            ok = fclose(file) == 0 && ok;
+    }
+    if (!ok)
+    {
+        cout << "Failed to write the point cloud to " << (toStdout ? "stdout" : fn) << endl;
+        failed = true;
+        pipeline.stop();
+    }
+    return ok;
+}
+
+// display the disparity next to the rectified left image
+bool DisplayStage::process(PipelineFrame& f)
+{
+    imshow("left", f.img[0]);
+    imshow("disparity", f.view);
+    char key = (char)waitKey(1);
+    if (key == ESC_KEY || key == 'q' || key == 'Q')
+        pipeline.stop();
+    return true;
+}
+
+void DisplayStage::finish()
+{
+    destroyAllWindows();    // from the thread that created them
+}
+
+void usage()
+{
+    cout << "Usage:" << endl
+         << "\t./stereo_pipeline [options] -video <left video|camera ID> <right video|camera ID>" << endl
+         << "\t./stereo_pipeline [options] <image list XML/YML file>" << endl
+         << "\t-p <stereo_params.xml>: output of stereo_calib, default is 'stereo_params.xml';" << endl
+         << "\t-m <bm|sgm>: matching mode, default is sgm;" << endl
+         << "\t-n <numDisparities>: search range, multiple of 16, default is 64;" << endl
+         << "\t-b <blockSize>: odd matching window size, default is 9 for bm and 5 for sgm;" << endl
+         << "\t-levels <n>: coarse-to-fine on n half resolution levels, default is 0(full range search);" << endl
+         << "\t-temporal: search around the disparity of the previous frame, for videos;" << endl
+         << "\t-o <dir>: save disparity maps to dir;" << endl
+         << "\t-record <file>: record the disparity maps to a compressed stream with a frame index;" << endl
+         << "\t-cloud <file>: save colored point clouds, binary PLY or PCD(.pcd), %d in the name" << endl
+         << "\t               is replaced by the frame number, - streams PLY to stdout;" << endl
+         << "\t-queue <n>: frames every queue between two stages holds, default is 2;" << endl
+         << "\t-policy <stage> <block|newest|oldest>: when the queue in front of the stage is full," << endl
+         << "\t          block the stage before it, drop the newest frame, or have the stage take the" << endl
+         << "\t          newest frame and drop the older ones. Stages: rectify, match, post, record," << endl
+         << "\t          cloud, display. Default is block, oldest for the display;" << endl
+         << "\t-affinity <spec>: place the stage threads, e.g. 'capture=0:fifo50;match=node1;record=3'," << endl
+         << "\t            <stage>=<CPU list|nodeN>[:fifo<priority 1-99>] separated by ';'. SCHED_FIFO" << endl
+         << "\t            needs CAP_SYS_NICE; the topology is printed at startup;" << endl
+         << "\t-sequential: run the stages in turn on one thread, to compare;" << endl
+         << "\t-nd: do not display." << endl;
+}
+
+bool argParsing(int argc, char** argv)
+{
+    int blockSize = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-p" && hasValue)
+            stereoParamsFn = argv[++i];
+        else if (arg == "-m" && hasValue)
+        {
+            string mode = argv[++i];
+            if (mode == "bm")
+                matchParams.mode = MATCH_BM;
+            else if (mode == "sgm")
+                matchParams.mode = MATCH_SGM;
+            else
+            {
+                cout << "Invalid matching mode " << mode << endl;
+                usage();
+                return false;
+            }
+        }
+        else if (arg == "-n" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &matchParams.numDisparities) != 1 ||
+                matchParams.numDisparities <= 0 || matchParams.numDisparities % 16 != 0)
+            {
+                cout << "The number of disparities must be a positive multiple of 16!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-b" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &blockSize) != 1 || blockSize < 1 || blockSize > 15 || blockSize % 2 == 0)
+            {
+                cout << "The block size must be odd and between 1 and 15!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-levels" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &matchParams.levels) != 1 || matchParams.levels < 0 || matchParams.levels > 4)
+            {
+                cout << "The number of levels must be between 0 and 4!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-temporal")
+            temporalMode = true;
+        else if (arg == "-video" && i + 2 < argc)
+        {
+            videoSource[0] = argv[++i];
+            videoSource[1] = argv[++i];
+        }
+        else if (arg == "-o" && hasValue)
+            outputDir = argv[++i];
+        else if (arg == "-record" && hasValue)
+            recordFn = argv[++i];
+        else if (arg == "-cloud" && hasValue)
+            cloudFn = argv[++i];
+        else if (arg == "-queue" && hasValue)
+        {
+            if (sscanf(argv[++i], "%d", &queueCapacity) != 1 || queueCapacity < 1)
+            {
+                cout << "The queue capacity must be positive!" << endl;
+                return false;
+            }
+        }
+        else if (arg == "-policy" && i + 2 < argc)
+        {
+            string stage = argv[++i], policy = argv[++i];
+            int k = 1;
+            while (k < STAGES && stage != stageNames[k])
+                k++;
+            if (k == STAGES)
+            {
+                cout << "Invalid stage " << stage << endl;
+                usage();
+                return false;
+            }
+            if (policy == "block")
+                policies[k] = DROP_NONE;
+            else if (policy == "newest")
+                policies[k] = DROP_NEWEST;
+            else if (policy == "oldest")
+                policies[k] = DROP_OLDEST;
+            else
+            {
+                cout << "Invalid drop policy " << policy << endl;
+                usage();
+                return false;
+            }
+        }
+        else if (arg == "-affinity" && hasValue)
+        {
+            string error;
+            if (!affinity.parse(argv[++i], error))
+            {
+                cout << "Invalid affinity: " << error << endl;
+                usage();
+                return false;
+            }
+            for (size_t j = 0; j < affinity.placements.size(); j++)
+            {
+                int k = 0;
+                while (k < STAGES && affinity.placements[j].role != stageNames[k])
+                    k++;
+                if (k == STAGES)
+                {
+                    cout << "Invalid stage " << affinity.placements[j].role << endl;
+                    usage();
+                    return false;
+                }
+            }
+        }
+        else if (arg == "-sequential")
+            threaded = false;
+        else if (arg == "-nd")
+            display = false;
+        else if (arg[0] == '-')
+        {
+            cout << "Invalid option " << arg << endl;
+            usage();
+            return false;
+        }
+        else
+            imageListFn = arg;
+    }
+
+    if (blockSize)
+        matchParams.blockSize = blockSize;
+    else
+        matchParams.blockSize = matchParams.mode == MATCH_BM ? 9 : 5;
+
+    if (imageListFn.empty())
+        imageListFn = "stereo_calib.xml";
+    // stdout carries the point clouds, messages go to stderr
+    if (cloudFn == "-")
+        cout.rdbuf(cerr.rdbuf());
+    return true;
+}
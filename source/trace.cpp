@@ -0,0 +1,198 @@
+/// trace.cpp
+/// Per-thread event buffers of the tracer and the Chrome trace writer.
+///
+/// A thread finds its buffer through a thread-local pointer; only that thread appends to it.
+/// Buffers are registered once, under traceMutex, and never freed, so the pointer of a thread of
+/// the OpenMP pool stays valid across parallel regions and traceClear(). traceMutex is a plain
+/// mutex, not an OpenMP critical section: threads outside OpenMP register too, and the library
+/// may be built without OpenMP.
+///
+/// Ref:
+///     Trace Event Format, https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+
+#include "trace.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(_MSC_VER)
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+using namespace cv;
+using namespace std;
+
+const size_t MAX_THREAD_EVENTS = 1 << 20;  // ~24 MB per thread, the later events are dropped
+
+struct TraceEvent
+{
+    const char* name;
+    int64 start, end;   // ticks
+};
+
+struct TraceBuffer
+{
+    int tid;
+    const char* threadName;
+    vector<TraceEvent> events;
+    size_t dropped;
+};
+
+std::atomic<int> traceOn(0);
+static int64 traceStart = 0;                 // ticks of the first traceEnable(), time 0 of the trace
+static std::mutex traceMutex;                // guards traceBuffers and the interned names
+static vector<TraceBuffer*> traceBuffers;    // of all the threads that recorded
+static TRACE_THREAD_LOCAL TraceBuffer* threadBuffer = 0;
+static string traceExitFn;                   // STEREO_TRACE
+
+static TraceBuffer* currentBuffer()
+{
+    if (!threadBuffer)
+    {
+        TraceBuffer* b = new TraceBuffer;
+        b->threadName = 0;
+        b->dropped = 0;
+        b->events.reserve(4096);
+        {
+            std::lock_guard<std::mutex> lock(traceMutex);
+            b->tid = (int)traceBuffers.size() + 1;
+            traceBuffers.push_back(b);
+        }
+        threadBuffer = b;
+    }
+    return threadBuffer;
+}
+
+void traceEnable(bool on)
+{
+    if (on && !traceStart)
+        traceStart = getTickCount();
+    traceOn.store(on);
+}
+
+static void writeAtExit()
+{
+    if (traceWrite(traceExitFn))
+        cerr << "Trace written to " << traceExitFn << endl;
+    else
+        cerr << "Cannot write the trace to " << traceExitFn << endl;
+}
+
+bool traceFromEnv()
+{
+    const char* fn = getenv("STEREO_TRACE");
+    if (!fn || !*fn)
+        return false;
+    if (traceExitFn.empty())
+        atexit(writeAtExit);
+    traceExitFn = fn;
+    traceEnable(true);
+    traceThreadName("main");
+    return true;
+}
+
+void traceThreadName(const char* name)
+{
+    if (traceEnabled())
+        currentBuffer()->threadName = name;
+}
+
+const char* traceIntern(const string& name)
+{
+    static set<string> names;
+    std::lock_guard<std::mutex> lock(traceMutex);
+    return names.insert(name).first->c_str();
+}
+
+void traceRecord(const char* name, int64 start)
+{
+    const int64 end = getTickCount();
+    TraceBuffer* b = currentBuffer();
+    if (b->events.size() >= MAX_THREAD_EVENTS)
+    {
+        b->dropped++;
+        return;
+    }
+    TraceEvent e;
+    e.name = name;
+    e.start = start;
+    e.end = end;
+    b->events.push_back(e);
+}
+
+void traceClear()
+{
+    std::lock_guard<std::mutex> lock(traceMutex);
+    for (size_t i = 0; i < traceBuffers.size(); i++)
+    {
+        traceBuffers[i]->events.clear();
+        traceBuffers[i]->dropped = 0;
+    }
+}
+
+static void writeString(ostream& os, const char* s)
+{
+    os << '"';
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            os << '\\' << *s;
+        else if ((unsigned char)*s < 0x20)
+            os << ' ';
+        else
+            os << *s;
+    }
+    os << '"';
+}
+
+bool traceWrite(const string& filename)
+{
+    ofstream os(filename.c_str());
+    if (!os.is_open())
+        return false;
+
+    // complete events("X") in microseconds, and the names of the threads("M")
+    const double usPerTick = 1e6/getTickFrequency();
+    size_t dropped = 0;
+    os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    std::lock_guard<std::mutex> lock(traceMutex);
+    for (size_t i = 0; i < traceBuffers.size(); i++)
+    {
+        const TraceBuffer& b = *traceBuffers[i];
+        char buf[96];
+        if (b.threadName || !b.events.empty())
+        {
+            sprintf(buf, "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":", b.tid);
+            os << (first ? "" : ",\n") << buf;
+            if (b.threadName)
+                writeString(os, b.threadName);
+            else
+                os << "\"thread " << b.tid << "\"";
+            os << "}}";
+            first = false;
+        }
+        for (size_t j = 0; j < b.events.size(); j++)
+        {
+            const TraceEvent& e = b.events[j];
+            os << (first ? "" : ",\n") << "{\"ph\":\"X\",\"pid\":1,\"name\":";
+            writeString(os, e.name);
+            sprintf(buf, ",\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", b.tid, (e.start - traceStart)*usPerTick,
+                    (e.end - e.start)*usPerTick);
+            os << buf;
+            first = false;
+        }
+        dropped += b.dropped;
+    }
+    os << "\n]}\n";
+    if (dropped)
+        cerr << dropped << " trace events dropped, more than " << MAX_THREAD_EVENTS << " in a thread" << endl;
+    return !os.fail();
+}
@@ -0,0 +1,71 @@
+/// trace.hpp
+/// Scoped timing of the hot paths(chessboard detection, corner refinement, calibration,
+/// rectification maps, remap, matching, image and video writes), saved as Chrome trace JSON
+/// for chrome://tracing or https://ui.perfetto.dev.
+///
+/// Tracing is off until enabled at runtime; a disabled scope only tests a global flag, so the
+/// scopes stay in release builds(define STEREO_NO_TRACE to compile them out). Every thread
+/// appends to its own buffer without locking; a mutex is taken once per thread, to register it,
+/// so the threads of the OpenMP pool and other threads(image_cache.cpp) can trace alike.
+///
+/// All the tools call traceFromEnv(): STEREO_TRACE=trace.json ./stereo_match ... writes the
+/// trace of the run to trace.json at exit.
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include <atomic>
+#include <string>
+
+extern std::atomic<int> traceOn;    // read by every scope, set by traceEnable()
+
+/// Starts/stops recording. Threads keep their events when stopped.
+void traceEnable(bool on = true);
+inline bool traceEnabled() { return traceOn.load(std::memory_order_relaxed) != 0; }
+
+/// Enables tracing if the environment variable STEREO_TRACE holds a filename; the trace is then
+/// written to it at exit. Returns true if enabled.
+bool traceFromEnv();
+
+/// Names the calling thread in the trace(e.g. after its pipeline stage).
+void traceThreadName(const char* name);
+
+/// Copy of name that lives until exit, for names that are not literals. Events keep the pointer.
+const char* traceIntern(const std::string& name);
+
+/// Appends the event [start, now) to the buffer of the calling thread.
+void traceRecord(const char* name, int64 start);
+
+/// Writes the events recorded so far as Chrome trace JSON. Call while no thread records.
+bool traceWrite(const std::string& filename);
+
+/// Drops the events recorded so far.
+void traceClear();
+
+/// Records the time from construction to destruction as an event. name is kept by pointer:
+/// a literal or traceIntern().
+class TraceScope
+{
+public:
+    explicit TraceScope(const char* n) : name(traceEnabled() ? n : 0), start(name ? cv::getTickCount() : 0) {}
+    ~TraceScope() { if (name) traceRecord(name, start); }
+
+private:
+    const char* name;
+    int64 start;
+
+    TraceScope(const TraceScope&);
+    TraceScope& operator=(const TraceScope&);
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#ifndef STEREO_NO_TRACE
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name)
+#endif
+
+#endif
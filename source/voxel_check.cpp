@@ -0,0 +1,369 @@
+/// voxel_check.cpp
+/// Checks the voxel grid of voxel_fusion.hpp on synthetic frames that drift through space while
+/// revisiting a fixed region:
+///     with one shard, the grid after every frame must equal a plain reference that keeps its voxels
+///     in a list and evicts by a stable sort on the stamps(same voxels, order, averages and hits);
+///     with many shards, every voxel of the latest frame must survive, within the budget;
+///     frames inserted from several threads at once must fuse like frames inserted one by one;
+///     the colors must be averages of the points with color only.
+///
+/// Output: one line per check; the exit code is 0 if all pass, 1 if any fails.
+///
+/// Ref:
+///     voxel_fusion.cpp
+
+#include "opencv2/core/core.hpp"
+
+#include "voxel_fusion.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <math.h>
+#include <limits.h>
+
+using namespace cv;
+using namespace std;
+
+//--------------------------------------------------
+// Parameters
+//--------------------------------------------------
+const int numFrames = 40;
+const int frameSize = 300;          // points per frame
+const float voxelSize = 0.5f;       // exact inverse, the voxel of a point is the same everywhere
+const float maxError = 1e-4f;       // averages may be contracted to FMA differently
+const int colorMin = 128;           // of every channel of the points with color
+//--------------------------------------------------
+// Function Declarations
+//--------------------------------------------------
+static void syntheticFrames(vector<vector<CloudPoint> >& frames);
+static bool sameClouds(const vector<CloudPoint>& a, const vector<CloudPoint>& b, bool sameOrder, string& why);
+static int report(const string& name, bool ok, const string& why);
+//--------------------------------------------------
+
+//--------------------------------------------------
+// Reference
+//--------------------------------------------------
+// The voxels in order of creation. A new voxel in a full grid first evicts all but the keep voxels
+// with the newest stamps, older voxels first among equal stamps.
+struct ReferenceGrid
+{
+    struct Cell
+    {
+        int key[3];
+        Voxel v;
+    };
+    vector<Cell> cells;
+    int budget, keep, maxHits;
+    int64 evicted;
+
+    ReferenceGrid(int budget, int maxHits)
+        : budget(budget), keep(std::max(budget - budget/8 - 1, 0)), maxHits(maxHits), evicted(0)
+    {
+    }
+
+    void insert(const vector<CloudPoint>& points, unsigned stamp)
+    {
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            const CloudPoint& p = points[i];
+            const int key[3] = {(int)floorf(p.x/voxelSize), (int)floorf(p.y/voxelSize), (int)floorf(p.z/voxelSize)};
+            size_t j = 0;
+            while (j < cells.size() && !(cells[j].key[0] == key[0] && cells[j].key[1] == key[1] &&
+                                         cells[j].key[2] == key[2]))
+                j++;
+            if (j == cells.size())
+            {
+                if ((int)cells.size() >= budget)
+                    evict();
+                Cell c;
+                std::copy(key, key + 3, c.key);
+                c.v.x = p.x;
+                c.v.y = p.y;
+                c.v.z = p.z;
+                c.v.b = c.v.g = c.v.r = 0;
+                c.v.hits = 0;
+                c.v.colorHits = 0;
+                j = cells.size();
+                cells.push_back(c);
+            }
+
+            Voxel& v = cells[j].v;
+            v.hits = std::min(v.hits + 1, maxHits);
+            v.stamp = stamp;
+            const float w = 1.f/v.hits;
+            v.x += (p.x - v.x)*w;
+            v.y += (p.y - v.y)*w;
+            v.z += (p.z - v.z)*w;
+            if (p.a)
+            {
+                v.colorHits = std::min(v.colorHits + 1, maxHits);
+                const float wc = 1.f/v.colorHits;
+                v.b += (p.b - v.b)*wc;
+                v.g += (p.g - v.g)*wc;
+                v.r += (p.r - v.r)*wc;
+            }
+        }
+    }
+
+    void evict()
+    {
+        vector<pair<unsigned, size_t> > age(cells.size());
+        for (size_t i = 0; i < cells.size(); i++)
+            age[i] = make_pair(cells[i].v.stamp, i);
+        std::sort(age.begin(), age.end());
+        vector<bool> dropped(cells.size(), false);
+        const size_t drop = cells.size() - keep;
+        for (size_t i = 0; i < drop; i++)
+            dropped[age[i].second] = true;
+        vector<Cell> kept;
+        for (size_t i = 0; i < cells.size(); i++)
+            if (!dropped[i])
+                kept.push_back(cells[i]);
+        cells.swap(kept);
+        evicted += drop;
+    }
+
+    void exportCloud(vector<CloudPoint>& points, int minHits) const
+    {
+        points.clear();
+        for (size_t i = 0; i < cells.size(); i++)
+        {
+            const Voxel& v = cells[i].v;
+            if (v.hits < minHits)
+                continue;
+            CloudPoint p;
+            p.x = v.x;
+            p.y = v.y;
+            p.z = v.z;
+            p.b = saturate_cast<uchar>(v.b);
+            p.g = saturate_cast<uchar>(v.g);
+            p.r = saturate_cast<uchar>(v.r);
+            p.a = v.colorHits ? 0xFF : 0;
+            points.push_back(p);
+        }
+    }
+};
+
+int main()
+{
+    vector<vector<CloudPoint> > frames;
+    syntheticFrames(frames);
+    int failures = 0, checks = 0;
+    string why;
+
+    // one shard: the whole grid is one LRU, frames cut through by the evictions
+    {
+        FusionParams params;
+        params.voxelSize = voxelSize;
+        params.maxVoxels = 500;
+        params.maxHits = 4;
+        params.minHits = 1;
+        params.shards = 1;
+        VoxelFusion fusion(params);
+        ReferenceGrid reference(params.maxVoxels, params.maxHits);
+        bool ok = true;
+        for (int k = 0; ok && k < numFrames; k++)
+        {
+            fusion.insert(&frames[k][0], (int)frames[k].size());
+            reference.insert(frames[k], k + 1);
+            for (int minHits = 1; ok && minHits <= 3; minHits += 2)
+            {
+                vector<CloudPoint> fused, expected;
+                fusion.params.minHits = minHits;
+                fusion.exportCloud(fused);
+                reference.exportCloud(expected, minHits);
+                ok = sameClouds(fused, expected, true, why);
+                if (!ok)
+                    why = format("frame %d, at least %d hits: ", k, minHits) + why;
+            }
+            if (ok && fusion.evictedVoxels != reference.evicted)
+            {
+                ok = false;
+                why = format("frame %d: %d voxels evicted instead of %d", k, (int)fusion.evictedVoxels,
+                             (int)reference.evicted);
+            }
+        }
+        failures += report(format("eviction order, one shard, %d evicted", (int)reference.evicted), ok, why);
+        checks++;
+    }
+
+    // many shards: the latest frame is never evicted while it fits a shard
+    {
+        FusionParams params;
+        params.voxelSize = voxelSize;
+        params.maxVoxels = 1024;
+        params.minHits = 1;
+        params.shards = 8;
+        VoxelFusion fusion(params);
+        bool ok = true;
+        why.clear();
+        for (int k = 0; ok && k < numFrames; k++)
+        {
+            fusion.insert(&frames[k][0], (int)frames[k].size());
+            ReferenceGrid latest(INT_MAX, params.maxHits);
+            latest.insert(frames[k], 1);
+            vector<CloudPoint> fused;
+            fusion.exportCloud(fused);
+            vector<bool> found(latest.cells.size(), false);
+            for (size_t i = 0; i < fused.size(); i++)
+                for (size_t j = 0; j < latest.cells.size(); j++)
+                    found[j] = found[j] || (floorf(fused[i].x/voxelSize) == latest.cells[j].key[0] &&
+                                            floorf(fused[i].y/voxelSize) == latest.cells[j].key[1] &&
+                                            floorf(fused[i].z/voxelSize) == latest.cells[j].key[2]);
+            const int missing = (int)std::count(found.begin(), found.end(), false);
+            if (missing || fusion.size() > params.maxVoxels)
+            {
+                ok = false;
+                why = format("frame %d: %d of its %d voxels evicted, %d voxels held", k, missing,
+                             (int)latest.cells.size(), fusion.size());
+            }
+        }
+        failures += report(format("latest frame kept, %d shards, %d evicted", params.shards,
+                                  (int)fusion.evictedVoxels), ok, why);
+        checks++;
+    }
+
+    // concurrent insertions: same voxels and hits, averages up to the order of the frames
+    {
+        FusionParams params;
+        params.voxelSize = voxelSize;
+        params.maxHits = INT_MAX;
+        params.minHits = 1;
+        params.shards = 8;
+        VoxelFusion serial(params), concurrent(params);
+        for (int k = 0; k < numFrames; k++)
+            serial.insert(&frames[k][0], (int)frames[k].size());
+        #pragma omp parallel for schedule(dynamic)
+        for (int k = 0; k < numFrames; k++)
+            concurrent.insert(&frames[k][0], (int)frames[k].size());
+        bool ok = true;
+        why.clear();
+        for (int minHits = 1; ok && minHits <= numFrames; minHits *= 2)
+        {
+            vector<CloudPoint> a, b;
+            serial.params.minHits = concurrent.params.minHits = minHits;
+            serial.exportCloud(a);
+            concurrent.exportCloud(b);
+            ok = sameClouds(b, a, false, why);
+            if (!ok)
+                why = format("at least %d hits: ", minHits) + why;
+        }
+        if (ok && serial.insertedPoints != concurrent.insertedPoints)
+        {
+            ok = false;
+            why = "different numbers of points inserted";
+        }
+        failures += report(format("concurrent insertions, %d voxels", serial.size()), ok, why);
+        checks++;
+    }
+
+    // colors: the points without color are black, they must not darken the voxels
+    {
+        FusionParams params;
+        params.voxelSize = voxelSize;
+        params.minHits = 1;
+        VoxelFusion fusion(params);
+        for (int k = 0; k < numFrames; k++)
+            fusion.insert(&frames[k][0], (int)frames[k].size());
+        vector<CloudPoint> fused;
+        fusion.exportCloud(fused);
+        int colored = 0, darker = 0;
+        why.clear();
+        for (size_t i = 0; i < fused.size(); i++)
+        {
+            const CloudPoint& p = fused[i];
+            const int darkest = std::min(p.b, std::min(p.g, p.r));
+            if (p.a ? darkest < colorMin : darkest > 0)
+            {
+                if (!darker++)
+                    why = format("voxel (%g, %g, %g) is #%02x%02x%02x%02x", p.x, p.y, p.z, p.a, p.r, p.g, p.b);
+            }
+            colored += p.a != 0;
+        }
+        if (darker)
+            why = format("%d voxels wrong, ", darker) + why;
+        failures += report(format("colors, %d of %d voxels colored", colored, (int)fused.size()), !darker, why);
+        checks++;
+    }
+
+    if (failures)
+        cout << failures << " of " << checks << " checks failed" << endl;
+    else
+        cout << "All " << checks << " checks passed" << endl;
+    return failures ? 1 : 0;
+}
+
+// Frame k: 2/3 of the points in a cube that moves by one voxel per frame, the rest in a fixed cube
+// visited by every frame; every other point has a color of at least colorMin, the others are black
+// as the points reprojected without an image.
+void syntheticFrames(vector<vector<CloudPoint> >& frames)
+{
+    RNG rng(2024);
+    frames.resize(numFrames);
+    for (int k = 0; k < numFrames; k++)
+    {
+        frames[k].resize(frameSize);
+        for (int i = 0; i < frameSize; i++)
+        {
+            const bool fixed = i % 3 == 0;
+            const float x0 = fixed ? -20.f : k*voxelSize, side = fixed ? 2.f : 4.f;
+            CloudPoint& p = frames[k][i];
+            p.x = x0 + rng.uniform(0.f, side);
+            p.y = rng.uniform(0.f, side);
+            p.z = 10 + rng.uniform(0.f, side);
+            p.a = i % 2 ? 0xFF : 0;
+            p.b = p.a ? (uchar)rng.uniform(colorMin, 256) : 0;
+            p.g = p.a ? (uchar)rng.uniform(colorMin, 256) : 0;
+            p.r = p.a ? (uchar)rng.uniform(colorMin, 256) : 0;
+        }
+    }
+}
+
+// by voxel: averages of neighbouring voxels may be closer than the errors
+static bool lessVoxel(const CloudPoint& a, const CloudPoint& b)
+{
+    const float ka[3] = {floorf(a.x/voxelSize), floorf(a.y/voxelSize), floorf(a.z/voxelSize)};
+    const float kb[3] = {floorf(b.x/voxelSize), floorf(b.y/voxelSize), floorf(b.z/voxelSize)};
+    return std::lexicographical_compare(ka, ka + 3, kb, kb + 3);
+}
+
+// Same points within maxError and colors within 1; sorted by voxel first unless sameOrder.
+bool sameClouds(const vector<CloudPoint>& a, const vector<CloudPoint>& b, bool sameOrder, string& why)
+{
+    if (a.size() != b.size())
+    {
+        why = format("%d voxels instead of %d", (int)a.size(), (int)b.size());
+        return false;
+    }
+    vector<CloudPoint> sa(a), sb(b);
+    if (!sameOrder)
+    {
+        std::sort(sa.begin(), sa.end(), lessVoxel);
+        std::sort(sb.begin(), sb.end(), lessVoxel);
+    }
+    for (size_t i = 0; i < sa.size(); i++)
+    {
+        const CloudPoint& p = sa[i];
+        const CloudPoint& q = sb[i];
+        if (!(fabsf(p.x - q.x) <= maxError && fabsf(p.y - q.y) <= maxError && fabsf(p.z - q.z) <= maxError) ||
+            abs(p.b - q.b) > 1 || abs(p.g - q.g) > 1 || abs(p.r - q.r) > 1 || p.a != q.a)
+        {
+            why = format("voxel %d is (%g, %g, %g) #%02x%02x%02x%02x instead of (%g, %g, %g) #%02x%02x%02x%02x",
+                         (int)i, p.x, p.y, p.z, p.a, p.r, p.g, p.b, q.x, q.y, q.z, q.a, q.r, q.g, q.b);
+            return false;
+        }
+    }
+    return true;
+}
+
+// prints the result of a check, returns 1 if it failed
+int report(const string& name, bool ok, const string& why)
+{
+    cout << format("%s %-48s", ok ? "PASS" : "FAIL", name.c_str());
+    if (!ok)
+        cout << " " << why;
+    cout << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,424 @@
+/// voxel_fusion.cpp
+/// Sparse voxel grid fusing the point clouds of many frames.
+///
+/// A voxel is addressed by its integer coordinates packed into a 63-bit key. The key's hash picks
+/// a shard, every shard is an open addressing table(linear probing) of indices into a dense array
+/// of voxels, under its own lock. An insertion first sorts its points by shard, then updates the
+/// shards in parallel, so concurrent insertions only wait for each other on shared shards.
+///
+/// Eviction is LRU with insertion granularity: every insertion(a frame for integrate) gets a
+/// stamp, and a full shard drops its voxels with the oldest stamps down to 7/8 of its share of
+/// maxVoxels, then compacts the dense array and rebuilds the table.
+///
+/// Ref:
+///     Niessner et al., Real-time 3D Reconstruction at Scale using Voxel Hashing, 2013;
+///     splitmix64 finalizer(Steele et al., Fast Splittable Pseudorandom Number Generators, 2014)
+
+#include "voxel_fusion.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+#ifdef _OPENMP
+#include "omp.h"
+#endif
+
+using namespace cv;
+using namespace std;
+
+// Voxel coordinates must fit KEY_BITS bits each, in [-KEY_RANGE, KEY_RANGE).
+const int KEY_BITS = 21;
+const int KEY_RANGE = 1 << (KEY_BITS - 1);
+const int MIN_TABLE_SIZE = 1024;
+const int STRIP_ROWS = 64;      // integrate: rows reprojected at a time
+
+struct VoxelShard
+{
+    vector<uint64> keys;        // key of every voxel
+    vector<Voxel> voxels;
+    vector<int> table;          // index into voxels, -1 if free; at least twice the voxels
+#ifdef _OPENMP
+    omp_lock_t lock;
+#endif
+
+    VoxelShard()
+    {
+#ifdef _OPENMP
+        omp_init_lock(&lock);
+#endif
+    }
+    ~VoxelShard()
+    {
+#ifdef _OPENMP
+        omp_destroy_lock(&lock);
+#endif
+    }
+    void acquire()
+    {
+#ifdef _OPENMP
+        omp_set_lock(&lock);
+#endif
+    }
+    void release()
+    {
+#ifdef _OPENMP
+        omp_unset_lock(&lock);
+#endif
+    }
+};
+
+static inline uint64 mixKey(uint64 key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+// slots are picked with the low bits of the hash, shards with the high ones
+static inline int shardOf(uint64 key, int shards)
+{
+    return (int)((mixKey(key) >> 32) % (unsigned)shards);
+}
+
+static void rebuildTable(VoxelShard& s, size_t tableSize)
+{
+    s.table.assign(tableSize, -1);
+    const size_t mask = tableSize - 1;
+    for (size_t i = 0; i < s.keys.size(); i++)
+    {
+        size_t slot = mixKey(s.keys[i]) & mask;
+        while (s.table[slot] >= 0)
+            slot = (slot + 1) & mask;
+        s.table[slot] = (int)i;
+    }
+}
+
+// Keeps the 'keep' most recently updated voxels of s. Returns the number evicted.
+static int evictOldest(VoxelShard& s, int keep)
+{
+    const int n = (int)s.voxels.size();
+    if (n <= keep)
+        return 0;
+
+    // stamps older than 'oldest' go, and as many stamped 'oldest' as needed
+    vector<unsigned> stamps(n);
+    for (int i = 0; i < n; i++)
+        stamps[i] = s.voxels[i].stamp;
+    int drop = n - keep;
+    nth_element(stamps.begin(), stamps.begin() + (drop - 1), stamps.end());
+    const unsigned oldest = stamps[drop - 1];
+    for (int i = 0; i < n; i++)
+        drop -= s.voxels[i].stamp < oldest;
+
+    int m = 0;
+    for (int i = 0; i < n; i++)
+    {
+        const unsigned stamp = s.voxels[i].stamp;
+        if (stamp < oldest || (stamp == oldest && drop-- > 0))
+            continue;
+        s.voxels[m] = s.voxels[i];
+        s.keys[m++] = s.keys[i];
+    }
+    s.voxels.resize(m);
+    s.keys.resize(m);
+    rebuildTable(s, s.table.size());
+    return n - m;
+}
+
+// Averages point p into voxel 'key' of s, creating it if needed. Returns the number of evicted voxels.
+static int updateVoxel(VoxelShard& s, uint64 key, const CloudPoint& p, unsigned stamp,
+                       int budget, int maxHits)
+{
+    int evicted = 0;
+    size_t mask = s.table.size() - 1;
+    size_t slot = mixKey(key) & mask;
+    int idx;
+    while ((idx = s.table[slot]) >= 0 && s.keys[idx] != key)
+        slot = (slot + 1) & mask;
+
+    if (idx < 0)
+    {
+        if ((int)s.voxels.size() >= budget)
+        {
+            evicted = evictOldest(s, std::max(budget - budget/8 - 1, 0));
+            slot = mixKey(key) & mask;
+            while (s.table[slot] >= 0)
+                slot = (slot + 1) & mask;
+        }
+        if (2*(s.voxels.size() + 1) > s.table.size())
+        {
+            rebuildTable(s, 2*s.table.size());
+            mask = s.table.size() - 1;
+            slot = mixKey(key) & mask;
+            while (s.table[slot] >= 0)
+                slot = (slot + 1) & mask;
+        }
+        idx = (int)s.voxels.size();
+        Voxel v;
+        v.x = p.x;
+        v.y = p.y;
+        v.z = p.z;
+        v.b = v.g = v.r = 0;
+        v.hits = 0;
+        v.colorHits = 0;
+        v.stamp = stamp;
+        s.voxels.push_back(v);
+        s.keys.push_back(key);
+        s.table[slot] = idx;
+    }
+
+    // running averages, the weight of new points stops decreasing at maxHits; the color is the
+    // average of the points with color only
+    Voxel& v = s.voxels[idx];
+    v.hits = std::min(v.hits + 1, maxHits);
+    v.stamp = stamp;
+    const float w = 1.f/v.hits;
+    v.x += (p.x - v.x)*w;
+    v.y += (p.y - v.y)*w;
+    v.z += (p.z - v.z)*w;
+    if (p.a)
+    {
+        v.colorHits = std::min(v.colorHits + 1, maxHits);
+        const float wc = 1.f/v.colorHits;
+        v.b += (p.b - v.b)*wc;
+        v.g += (p.g - v.g)*wc;
+        v.r += (p.r - v.r)*wc;
+    }
+    return evicted;
+}
+
+FusionParams::FusionParams()
+    : voxelSize(1.f), maxVoxels(2000000), maxHits(64), minHits(2), shards(64)
+{
+}
+
+VoxelFusion::VoxelFusion(const FusionParams& _params)
+    : params(_params), insertedPoints(0), evictedVoxels(0), clock(0), colored(0)
+{
+    CV_Assert(params.voxelSize > 0 && params.maxVoxels > 0 && params.maxHits > 0 && params.shards > 0);
+    shards.resize(params.shards);
+    for (int i = 0; i < params.shards; i++)
+    {
+        shards[i] = new VoxelShard;
+        shards[i]->table.assign(MIN_TABLE_SIZE, -1);
+    }
+}
+
+VoxelFusion::~VoxelFusion()
+{
+    for (size_t i = 0; i < shards.size(); i++)
+        delete shards[i];
+}
+
+static Matx34f toPose(const Mat& pose)
+{
+    Matx34f P(1, 0, 0, 0,
+              0, 1, 0, 0,
+              0, 0, 1, 0);
+    if (pose.empty())
+        return P;
+    CV_Assert((pose.rows == 3 || pose.rows == 4) && pose.cols == 4);
+    Mat pf;
+    pose.convertTo(pf, CV_32F);
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 4; j++)
+            P(i, j) = pf.at<float>(i, j);
+    return P;
+}
+
+void VoxelFusion::insert(const CloudPoint* points, int n, const Mat& pose)
+{
+    unsigned stamp;
+    #pragma omp atomic capture
+    stamp = ++clock;
+    insert(points, n, toPose(pose), stamp);
+}
+
+void VoxelFusion::integrate(const Mat& disp, const Mat& color, const Mat& Q, const Mat& pose)
+{
+    TRACE_SCOPE("VoxelFusion::integrate");
+    CV_Assert(disp.type() == CV_16S);
+    unsigned stamp;
+    #pragma omp atomic capture
+    stamp = ++clock;
+    const Matx34f P = toPose(pose);
+
+    vector<CloudPoint> buf(STRIP_ROWS*disp.cols);
+    for (int y0 = 0; y0 < disp.rows; y0 += STRIP_ROWS)
+    {
+        int n = reprojectDisparity(disp, color, Q, y0, std::min(y0 + STRIP_ROWS, disp.rows), &buf[0]);
+        insert(&buf[0], n, P, stamp);
+    }
+}
+
+void VoxelFusion::insert(const CloudPoint* points, int n, const Matx34f& P, unsigned stamp)
+{
+    TRACE_SCOPE("VoxelFusion::insert");
+    if (n <= 0)
+        return;
+    const int S = (int)shards.size();
+    const float inv = 1.f/params.voxelSize;
+
+    // transform, find the keys and sort the points by shard(counting sort)
+    vector<CloudPoint> world(n);
+    vector<uint64> keys(n);
+    vector<int> shardIdx(n);
+    vector<int> start(S + 1, 0);
+    int hasColor = 0;
+    #pragma omp parallel for reduction(|:hasColor)
+    for (int i = 0; i < n; i++)
+    {
+        const CloudPoint& p = points[i];
+        CloudPoint& q = world[i];
+        q = p;
+        q.x = P(0, 0)*p.x + P(0, 1)*p.y + P(0, 2)*p.z + P(0, 3);
+        q.y = P(1, 0)*p.x + P(1, 1)*p.y + P(1, 2)*p.z + P(1, 3);
+        q.z = P(2, 0)*p.x + P(2, 1)*p.y + P(2, 2)*p.z + P(2, 3);
+        const float c[3] = { q.x*inv, q.y*inv, q.z*inv };
+        uint64 key = 0;
+        bool inside = true;
+        for (int k = 0; k < 3; k++)
+        {
+            // also false for NaN, e.g. points at infinity
+            inside = inside && fabsf(c[k]) < KEY_RANGE - 1;
+            int v = inside ? (int)floorf(c[k]) : 0;
+            key = (key << KEY_BITS) | (uint64)(v + KEY_RANGE);
+        }
+        keys[i] = key;
+        shardIdx[i] = inside ? shardOf(key, S) : -1;
+        hasColor |= p.a != 0;
+    }
+    for (int i = 0; i < n; i++)
+        start[shardIdx[i] + 1] += shardIdx[i] >= 0;
+    for (int s = 0; s < S; s++)
+        start[s + 1] += start[s];
+    vector<int> order(start[S]);
+    vector<int> next(start.begin(), start.end() - 1);
+    for (int i = 0; i < n; i++)
+    {
+        if (shardIdx[i] >= 0)
+            order[next[shardIdx[i]]++] = i;
+    }
+
+    const int budget = std::max(params.maxVoxels/S, 1);
+    const int maxHits = params.maxHits;
+    int64 evicted = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(+:evicted)
+    for (int s = 0; s < S; s++)
+    {
+        if (start[s] == start[s + 1])
+            continue;
+        VoxelShard& shard = *shards[s];
+        shard.acquire();
+        for (int j = start[s]; j < start[s + 1]; j++)
+            evicted += updateVoxel(shard, keys[order[j]], world[order[j]], stamp, budget, maxHits);
+        shard.release();
+    }
+
+    #pragma omp atomic
+    insertedPoints += start[S];
+    #pragma omp atomic
+    evictedVoxels += evicted;
+    if (hasColor)
+    {
+        #pragma omp atomic write
+        colored = 1;
+    }
+}
+
+void VoxelFusion::exportCloud(vector<CloudPoint>& points) const
+{
+    TRACE_SCOPE("VoxelFusion::exportCloud");
+    const int S = (int)shards.size();
+    const int minHits = params.minHits;
+    vector<int> start(S + 1, 0);
+
+    // shards stay locked between counting and copying, so that the counts hold
+    for (int s = 0; s < S; s++)
+        shards[s]->acquire();
+    #pragma omp parallel for
+    for (int s = 0; s < S; s++)
+    {
+        const vector<Voxel>& v = shards[s]->voxels;
+        int n = 0;
+        for (size_t i = 0; i < v.size(); i++)
+            n += v[i].hits >= minHits;
+        start[s + 1] = n;
+    }
+    for (int s = 0; s < S; s++)
+        start[s + 1] += start[s];
+
+    points.resize(start[S]);
+    #pragma omp parallel for schedule(dynamic)
+    for (int s = 0; s < S; s++)
+    {
+        const vector<Voxel>& v = shards[s]->voxels;
+        CloudPoint* out = points.empty() ? NULL : &points[0] + start[s];
+        for (size_t i = 0; i < v.size(); i++)
+        {
+            if (v[i].hits < minHits)
+                continue;
+            CloudPoint& p = *out++;
+            p.x = v[i].x;
+            p.y = v[i].y;
+            p.z = v[i].z;
+            p.b = saturate_cast<uchar>(v[i].b);
+            p.g = saturate_cast<uchar>(v[i].g);
+            p.r = saturate_cast<uchar>(v[i].r);
+            p.a = v[i].colorHits ? 0xFF : 0;
+        }
+    }
+    for (int s = 0; s < S; s++)
+        shards[s]->release();
+}
+
+bool VoxelFusion::writeCloud(FILE* f, int format) const
+{
+    vector<CloudPoint> points;
+    exportCloud(points);
+    return writeCloudPoints(f, format, points.empty() ? NULL : &points[0], (int)points.size(), colored != 0);
+}
+
+void VoxelFusion::clear()
+{
+    for (size_t s = 0; s < shards.size(); s++)
+    {
+        VoxelShard& shard = *shards[s];
+        shard.acquire();
+        vector<uint64>().swap(shard.keys);
+        vector<Voxel>().swap(shard.voxels);
+        vector<int>(MIN_TABLE_SIZE, -1).swap(shard.table);
+        shard.release();
+    }
+    insertedPoints = evictedVoxels = 0;
+    colored = 0;
+}
+
+int VoxelFusion::size() const
+{
+    int n = 0;
+    for (size_t s = 0; s < shards.size(); s++)
+    {
+        shards[s]->acquire();
+        n += (int)shards[s]->voxels.size();
+        shards[s]->release();
+    }
+    return n;
+}
+
+size_t VoxelFusion::bufferSize() const
+{
+    size_t n = 0;
+    for (size_t s = 0; s < shards.size(); s++)
+    {
+        VoxelShard& shard = *shards[s];
+        shard.acquire();
+        n += shard.keys.capacity()*sizeof(uint64) + shard.voxels.capacity()*sizeof(Voxel)
+           + shard.table.capacity()*sizeof(int);
+        shard.release();
+    }
+    return n;
+}
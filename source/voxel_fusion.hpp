@@ -0,0 +1,84 @@
+/// voxel_fusion.hpp
+/// Fusion of the point clouds of many frames into a sparse voxel grid with bounded memory.
+///
+/// Every voxel keeps the running average of the points that fell into it and a hit count,
+/// so noise averages out over frames and single-frame outliers can be dropped on export.
+/// The grid is a set of hashed shards; once it holds maxVoxels voxels, the voxels updated
+/// least recently are evicted. Frames may be inserted from several threads at once.
+
+#ifndef VOXEL_FUSION_HPP
+#define VOXEL_FUSION_HPP
+
+#include "pointcloud.hpp"
+
+#include "opencv2/core/core.hpp"
+
+#include <vector>
+
+struct FusionParams
+{
+    float voxelSize;        // voxel edge, in the unit of the calibration(squareSize of stereo_calib)
+    int maxVoxels;          // memory budget, least recently updated voxels are evicted beyond it
+    int maxHits;            // hit counts saturate here, so averages keep following slow changes
+    int minHits;            // voxels with fewer hits are not exported
+    int shards;             // hash tables locked independently, more shards allow more parallel inserts
+
+    FusionParams();
+};
+
+struct Voxel
+{
+    float x, y, z;          // mean of the points
+    float b, g, r;          // mean color of the points with color
+    int hits;               // points averaged, at most maxHits
+    int colorHits;          // points with color averaged, at most maxHits; no color while 0
+    unsigned stamp;         // insertion that updated the voxel last
+};
+
+struct VoxelShard;
+
+struct VoxelFusion
+{
+    FusionParams params;
+
+    // statistics
+    int64 insertedPoints;   // points averaged into the grid
+    int64 evictedVoxels;
+
+    VoxelFusion(const FusionParams& params = FusionParams());
+    ~VoxelFusion();
+
+    /// Averages n points into the grid. pose: 3x4 or 4x4 transform of the points to the grid frame
+    /// (camera to world), empty if they are in it already. Points with a = 0 carry no color.
+    void insert(const CloudPoint* points, int n, const cv::Mat& pose = cv::Mat());
+
+    /// Reprojects disp like writePointCloud and inserts the points as one frame, strip by strip.
+    void integrate(const cv::Mat& disp, const cv::Mat& color, const cv::Mat& Q, const cv::Mat& pose = cv::Mat());
+
+    /// The fused cloud: one point per voxel with at least params.minHits hits, with a = 0 if no point
+    /// of the voxel had a color.
+    void exportCloud(std::vector<CloudPoint>& points) const;
+
+    /// exportCloud written as binary PLY or PCD.
+    bool writeCloud(FILE* f, int format) const;
+
+    void clear();
+
+    /// Voxels held.
+    int size() const;
+
+    /// Bytes held by the grid.
+    size_t bufferSize() const;
+
+private:
+    std::vector<VoxelShard*> shards;
+    unsigned clock;         // stamp of the last insertion
+    int colored;            // nonzero once a point with color was inserted
+
+    void insert(const CloudPoint* points, int n, const cv::Matx34f& pose, unsigned stamp);
+
+    VoxelFusion(const VoxelFusion&);
+    VoxelFusion& operator=(const VoxelFusion&);
+};
+
+#endif